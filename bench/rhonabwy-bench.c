@@ -0,0 +1,882 @@
+/**
+ *
+ * Rhonabwy Javascript Object Signing and Encryption (JOSE) library
+ *
+ * Microbenchmark program for sign, verify, encrypt, decrypt,
+ * parse and claims validation
+ *
+ * Every operation is run on its own jws_t, jwe_t or jwt_t like a server
+ * would do for each incoming token, the results are printed in JSON
+ * so they can be compared between releases
+ *
+ * Allocations are counted through the orcania allocator, which is also
+ * used by jansson after r_global_init, allocations made inside
+ * GnuTLS or Nettle are not counted
+ *
+ * Copyright 2022 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <jansson.h>
+#include <orcania.h>
+#include <yder.h>
+#include <rhonabwy.h>
+
+#define BENCH_DEFAULT_ITERATIONS 1000
+#define BENCH_WARMUP_ITERATIONS  10
+#define BENCH_RSA_SIZE           2048
+#define BENCH_PAYLOAD            "The true sign of intelligence is not knowledge but imagination."
+#define BENCH_ISS                "https://rhonabwy.example.com"
+#define BENCH_SUB                "client_1"
+#define BENCH_AUD                "api.example.com"
+#define BENCH_FORGED_MIX         10
+#define BENCH_VERIFY_BATCH       64
+
+const char bench_privkey_es256k_str[] = "{\"kty\":\"EC\",\"crv\":\"secp256k1\",\"x\":\"BmpuaxlZT3-hyC6haetJqA_-Uuvu56j1ZOLOuu6Jucg\","\
+                                        "\"y\":\"RYejBz2lFP-BZz2L4c_ylMsXELcAyTlPwG9ZTVE-W2U\",\"d\":\"uWtNgZatRRFOYvHYV0_4EY11uf5Eik6WRwkVJh3I9Hc\",\"kid\":\"es256k\"}";
+const char bench_pubkey_es256k_str[] = "{\"kty\":\"EC\",\"crv\":\"secp256k1\",\"x\":\"BmpuaxlZT3-hyC6haetJqA_-Uuvu56j1ZOLOuu6Jucg\","\
+                                       "\"y\":\"RYejBz2lFP-BZz2L4c_ylMsXELcAyTlPwG9ZTVE-W2U\",\"kid\":\"es256k\"}";
+
+static const jwa_alg bench_jws_algs[] = {
+  R_JWA_ALG_HS256, R_JWA_ALG_HS384, R_JWA_ALG_HS512,
+  R_JWA_ALG_RS256, R_JWA_ALG_RS384, R_JWA_ALG_RS512,
+  R_JWA_ALG_PS256, R_JWA_ALG_PS384, R_JWA_ALG_PS512,
+  R_JWA_ALG_ES256, R_JWA_ALG_ES384, R_JWA_ALG_ES512,
+  R_JWA_ALG_EDDSA, R_JWA_ALG_ES256K,
+  R_JWA_ALG_UNKNOWN
+};
+
+static const jwa_alg bench_jwe_algs[] = {
+  R_JWA_ALG_RSA1_5, R_JWA_ALG_RSA_OAEP, R_JWA_ALG_RSA_OAEP_256,
+  R_JWA_ALG_A128KW, R_JWA_ALG_A192KW, R_JWA_ALG_A256KW,
+  R_JWA_ALG_DIR,
+  R_JWA_ALG_ECDH_ES, R_JWA_ALG_ECDH_ES_A128KW, R_JWA_ALG_ECDH_ES_A192KW, R_JWA_ALG_ECDH_ES_A256KW,
+  R_JWA_ALG_A128GCMKW, R_JWA_ALG_A192GCMKW, R_JWA_ALG_A256GCMKW,
+  R_JWA_ALG_PBES2_H256, R_JWA_ALG_PBES2_H384, R_JWA_ALG_PBES2_H512,
+  R_JWA_ALG_UNKNOWN
+};
+
+static const jwa_enc bench_jwe_encs[] = {
+  R_JWA_ENC_A128CBC, R_JWA_ENC_A192CBC, R_JWA_ENC_A256CBC,
+  R_JWA_ENC_A128GCM, R_JWA_ENC_A192GCM, R_JWA_ENC_A256GCM,
+  R_JWA_ENC_UNKNOWN
+};
+
+/**
+ * Key pairs are generated once and shared by all the benchmarks
+ */
+struct _bench_keys {
+  jwk_t * rsa_privkey;
+  jwk_t * rsa_pubkey;
+  jwk_t * ec256_privkey;
+  jwk_t * ec256_pubkey;
+  jwk_t * ec384_privkey;
+  jwk_t * ec384_pubkey;
+  jwk_t * ec521_privkey;
+  jwk_t * ec521_pubkey;
+  jwk_t * eddsa_privkey;
+  jwk_t * eddsa_pubkey;
+  jwk_t * es256k_privkey;
+  jwk_t * es256k_pubkey;
+};
+
+/**
+ * State of a single benchmark
+ * privkey and pubkey are borrowed from struct _bench_keys
+ * or point both to symkey for symmetric algorithms
+ */
+struct _bench_ctx {
+  jwa_alg  alg;
+  jwa_enc  enc;
+  jwk_t  * privkey;
+  jwk_t  * pubkey;
+  jwk_t  * symkey;
+  char   * token;
+  char   * forged;
+  jwt_t  * jwt;
+  jwt_t  * jwt_sign;
+  json_t * j_claims;
+  r_jwt_template_t * jwt_template;
+  jwks_t * jwks_pubkey;
+  const char * tokens[BENCH_VERIFY_BATCH];
+  int status[BENCH_VERIFY_BATCH];
+  unsigned int nb_threads;
+};
+
+typedef int (* bench_op)(struct _bench_ctx * ctx);
+
+static size_t bench_nb_alloc = 0;
+
+/**
+ * JWE payload, BENCH_PAYLOAD unless --payload-size is set
+ */
+static const unsigned char * bench_jwe_payload = (const unsigned char *)BENCH_PAYLOAD;
+static size_t bench_jwe_payload_len = sizeof(BENCH_PAYLOAD)-1;
+
+static void * bench_malloc(size_t size) {
+  bench_nb_alloc++;
+  return malloc(size);
+}
+
+static void * bench_realloc(void * ptr, size_t size) {
+  if (ptr == NULL) {
+    bench_nb_alloc++;
+  }
+  return realloc(ptr, size);
+}
+
+static unsigned long long bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static int bench_compare_ns(const void * a, const void * b) {
+  unsigned long long ns_a = *(const unsigned long long *)a, ns_b = *(const unsigned long long *)b;
+
+  return ns_a < ns_b ? -1 : (ns_a > ns_b ? 1 : 0);
+}
+
+static void print_help(FILE * output) {
+  fprintf(output, "\nrhonabwy-bench - Rhonabwy microbenchmarks\n");
+  fprintf(output, "\n");
+  fprintf(output, "Command-line options:\n");
+  fprintf(output, "\n");
+  fprintf(output, "-n --iterations <number>\n");
+  fprintf(output, "\tNumber of iterations per benchmark, default %d\n", BENCH_DEFAULT_ITERATIONS);
+  fprintf(output, "-f --filter <string>\n");
+  fprintf(output, "\tRun only the benchmarks whose name contains the string, e.g. jws_verify/ES256 or /A128GCM\n");
+  fprintf(output, "-p --payload-size <bytes>\n");
+  fprintf(output, "\tSize of the JWE payload, default is a %zu bytes sentence\n", sizeof(BENCH_PAYLOAD)-1);
+  fprintf(output, "-o --output <file>\n");
+  fprintf(output, "\tWrite the JSON results in the file instead of stdout\n");
+  fprintf(output, "-h --help\n");
+  fprintf(output, "\tPrint this help message and exit\n");
+}
+
+/**
+ * Generates a random symmetric key of key_len bytes
+ */
+static jwk_t * bench_symmetric_key(size_t key_len) {
+  unsigned char key[64];
+  jwk_t * jwk = NULL;
+
+  if (key_len <= sizeof(key) && !gnutls_rnd(GNUTLS_RND_KEY, key, key_len) && r_jwk_init(&jwk) == RHN_OK) {
+    if (r_jwk_import_from_symmetric_key(jwk, key, key_len) != RHN_OK) {
+      r_jwk_free(jwk);
+      jwk = NULL;
+    }
+  }
+  return jwk;
+}
+
+static int bench_generate_key_pair(jwk_t ** privkey, jwk_t ** pubkey, int type, unsigned int bits) {
+  int ret;
+
+  if ((ret = r_jwk_init(privkey)) == RHN_OK && (ret = r_jwk_init(pubkey)) == RHN_OK) {
+    ret = r_jwk_generate_key_pair(*privkey, *pubkey, type, bits, NULL);
+  }
+  return ret;
+}
+
+static int bench_keys_init(struct _bench_keys * keys) {
+  int ret;
+
+  memset(keys, 0, sizeof(struct _bench_keys));
+  if ((ret = bench_generate_key_pair(&keys->rsa_privkey, &keys->rsa_pubkey, R_KEY_TYPE_RSA, BENCH_RSA_SIZE)) == RHN_OK &&
+      (ret = bench_generate_key_pair(&keys->ec256_privkey, &keys->ec256_pubkey, R_KEY_TYPE_EC, 256)) == RHN_OK &&
+      (ret = bench_generate_key_pair(&keys->ec384_privkey, &keys->ec384_pubkey, R_KEY_TYPE_EC, 384)) == RHN_OK &&
+      (ret = bench_generate_key_pair(&keys->ec521_privkey, &keys->ec521_pubkey, R_KEY_TYPE_EC, 521)) == RHN_OK) {
+    // EdDSA and secp256k1 depend on the GnuTLS version, their benchmarks are reported as unsupported if unavailable
+    bench_generate_key_pair(&keys->eddsa_privkey, &keys->eddsa_pubkey, R_KEY_TYPE_EDDSA, 256);
+    keys->es256k_privkey = r_jwk_quick_import(R_IMPORT_JSON_STR, bench_privkey_es256k_str);
+    keys->es256k_pubkey = r_jwk_quick_import(R_IMPORT_JSON_STR, bench_pubkey_es256k_str);
+  }
+  return ret;
+}
+
+static void bench_keys_clean(struct _bench_keys * keys) {
+  r_jwk_free(keys->rsa_privkey);
+  r_jwk_free(keys->rsa_pubkey);
+  r_jwk_free(keys->ec256_privkey);
+  r_jwk_free(keys->ec256_pubkey);
+  r_jwk_free(keys->ec384_privkey);
+  r_jwk_free(keys->ec384_pubkey);
+  r_jwk_free(keys->ec521_privkey);
+  r_jwk_free(keys->ec521_pubkey);
+  r_jwk_free(keys->eddsa_privkey);
+  r_jwk_free(keys->eddsa_pubkey);
+  r_jwk_free(keys->es256k_privkey);
+  r_jwk_free(keys->es256k_pubkey);
+}
+
+/**
+ * Sets the keys used by the benchmark depending on alg and enc
+ */
+static int bench_ctx_set_keys(struct _bench_ctx * ctx, struct _bench_keys * keys) {
+  size_t sym_len = 0;
+
+  switch (ctx->alg) {
+    case R_JWA_ALG_RS256:
+    case R_JWA_ALG_RS384:
+    case R_JWA_ALG_RS512:
+    case R_JWA_ALG_PS256:
+    case R_JWA_ALG_PS384:
+    case R_JWA_ALG_PS512:
+    case R_JWA_ALG_RSA1_5:
+    case R_JWA_ALG_RSA_OAEP:
+    case R_JWA_ALG_RSA_OAEP_256:
+      ctx->privkey = keys->rsa_privkey;
+      ctx->pubkey = keys->rsa_pubkey;
+      break;
+    case R_JWA_ALG_ES256:
+    case R_JWA_ALG_ECDH_ES:
+    case R_JWA_ALG_ECDH_ES_A128KW:
+    case R_JWA_ALG_ECDH_ES_A192KW:
+    case R_JWA_ALG_ECDH_ES_A256KW:
+      ctx->privkey = keys->ec256_privkey;
+      ctx->pubkey = keys->ec256_pubkey;
+      break;
+    case R_JWA_ALG_ES384:
+      ctx->privkey = keys->ec384_privkey;
+      ctx->pubkey = keys->ec384_pubkey;
+      break;
+    case R_JWA_ALG_ES512:
+      ctx->privkey = keys->ec521_privkey;
+      ctx->pubkey = keys->ec521_pubkey;
+      break;
+    case R_JWA_ALG_EDDSA:
+      ctx->privkey = keys->eddsa_privkey;
+      ctx->pubkey = keys->eddsa_pubkey;
+      break;
+    case R_JWA_ALG_ES256K:
+      ctx->privkey = keys->es256k_privkey;
+      ctx->pubkey = keys->es256k_pubkey;
+      break;
+    case R_JWA_ALG_HS256:
+    case R_JWA_ALG_HS384:
+    case R_JWA_ALG_HS512:
+      sym_len = 64;
+      break;
+    case R_JWA_ALG_A128KW:
+    case R_JWA_ALG_A128GCMKW:
+      sym_len = 16;
+      break;
+    case R_JWA_ALG_A192KW:
+    case R_JWA_ALG_A192GCMKW:
+      sym_len = 24;
+      break;
+    case R_JWA_ALG_A256KW:
+    case R_JWA_ALG_A256GCMKW:
+      sym_len = 32;
+      break;
+    case R_JWA_ALG_PBES2_H256:
+    case R_JWA_ALG_PBES2_H384:
+    case R_JWA_ALG_PBES2_H512:
+      sym_len = 16;
+      break;
+    case R_JWA_ALG_DIR:
+      // The key is the content encryption key, CBC-HMAC uses the encryption and the MAC keys
+      switch (ctx->enc) {
+        case R_JWA_ENC_A128CBC:
+          sym_len = 32;
+          break;
+        case R_JWA_ENC_A192CBC:
+          sym_len = 48;
+          break;
+        case R_JWA_ENC_A256CBC:
+          sym_len = 64;
+          break;
+        case R_JWA_ENC_A128GCM:
+          sym_len = 16;
+          break;
+        case R_JWA_ENC_A192GCM:
+          sym_len = 24;
+          break;
+        case R_JWA_ENC_A256GCM:
+          sym_len = 32;
+          break;
+        default:
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+  if (sym_len) {
+    ctx->symkey = bench_symmetric_key(sym_len);
+    ctx->privkey = ctx->pubkey = ctx->symkey;
+  }
+  return (ctx->privkey != NULL && ctx->pubkey != NULL) ? RHN_OK : RHN_ERROR_UNSUPPORTED;
+}
+
+static void bench_ctx_clean(struct _bench_ctx * ctx) {
+  r_jwk_free(ctx->symkey);
+  r_jwt_free(ctx->jwt);
+  o_free(ctx->token);
+  o_free(ctx->forged);
+  r_jwt_free(ctx->jwt_sign);
+  json_decref(ctx->j_claims);
+  r_jwt_template_free(ctx->jwt_template);
+  r_jwks_free(ctx->jwks_pubkey);
+  memset(ctx, 0, sizeof(struct _bench_ctx));
+}
+
+static int bench_jws_sign(struct _bench_ctx * ctx) {
+  jws_t * jws = NULL;
+  char * token = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jws_init(&jws) == RHN_OK &&
+      r_jws_set_alg(jws, ctx->alg) == RHN_OK &&
+      r_jws_set_payload(jws, (const unsigned char *)BENCH_PAYLOAD, o_strlen(BENCH_PAYLOAD)) == RHN_OK &&
+      (token = r_jws_serialize(jws, ctx->privkey, 0)) != NULL) {
+    ret = RHN_OK;
+  }
+  o_free(token);
+  r_jws_free(jws);
+  return ret;
+}
+
+static int bench_jws_verify(struct _bench_ctx * ctx) {
+  jws_t * jws = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jws_init(&jws) == RHN_OK && r_jws_parse(jws, ctx->token, 0) == RHN_OK) {
+    ret = r_jws_verify_signature(jws, ctx->pubkey, 0);
+  }
+  r_jws_free(jws);
+  return ret;
+}
+
+static int bench_jwe_encrypt(struct _bench_ctx * ctx) {
+  jwe_t * jwe = NULL;
+  char * token = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwe_init(&jwe) == RHN_OK &&
+      r_jwe_set_alg(jwe, ctx->alg) == RHN_OK &&
+      r_jwe_set_enc(jwe, ctx->enc) == RHN_OK &&
+      r_jwe_set_payload(jwe, bench_jwe_payload, bench_jwe_payload_len) == RHN_OK &&
+      (token = r_jwe_serialize(jwe, ctx->pubkey, 0)) != NULL) {
+    ret = RHN_OK;
+  }
+  o_free(token);
+  r_jwe_free(jwe);
+  return ret;
+}
+
+static int bench_jwe_decrypt(struct _bench_ctx * ctx) {
+  jwe_t * jwe = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwe_init(&jwe) == RHN_OK && r_jwe_parse(jwe, ctx->token, 0) == RHN_OK) {
+    ret = r_jwe_decrypt(jwe, ctx->privkey, 0);
+  }
+  r_jwe_free(jwe);
+  return ret;
+}
+
+/**
+ * Decrypts with empty key caches, so the private key is decoded and imported again
+ * Compared with jwe_decrypt, shows the per-token key setup cost saved by the caches
+ */
+static int bench_jwe_decrypt_cold(struct _bench_ctx * ctx) {
+  r_jwk_cache_flush();
+  return bench_jwe_decrypt(ctx);
+}
+
+static int bench_jwt_parse(struct _bench_ctx * ctx) {
+  jwt_t * jwt = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_init(&jwt) == RHN_OK) {
+    ret = r_jwt_parse(jwt, ctx->token, 0);
+  }
+  r_jwt_free(jwt);
+  return ret;
+}
+
+/**
+ * Parses and verifies BENCH_FORGED_MIX tokens, all forged but the first one
+ * bench_jwt_parse_then_verify decodes the payload and the claims of every token,
+ * bench_jwt_parse_verify only the ones with a valid signature
+ */
+static int bench_jwt_parse_then_verify(struct _bench_ctx * ctx) {
+  jwt_t * jwt = NULL;
+  int ret = RHN_OK, res;
+  unsigned int i;
+
+  for (i=0; i<BENCH_FORGED_MIX; i++) {
+    res = RHN_ERROR;
+    if (r_jwt_init(&jwt) == RHN_OK && r_jwt_parse(jwt, i?ctx->forged:ctx->token, R_PARSE_NONE) == RHN_OK) {
+      res = r_jwt_verify_signature(jwt, ctx->pubkey, 0);
+    }
+    if ((res == RHN_OK) != !i) {
+      ret = RHN_ERROR;
+    }
+    r_jwt_free(jwt);
+    jwt = NULL;
+  }
+  return ret;
+}
+
+static int bench_jwt_parse_verify(struct _bench_ctx * ctx) {
+  jwt_t * jwt = NULL;
+  int ret = RHN_OK, res;
+  unsigned int i;
+
+  for (i=0; i<BENCH_FORGED_MIX; i++) {
+    res = RHN_ERROR;
+    if (r_jwt_init(&jwt) == RHN_OK) {
+      res = r_jwt_parse_verify(jwt, i?ctx->forged:ctx->token, R_PARSE_NONE, ctx->pubkey, 0);
+    }
+    if ((res == RHN_OK) != !i) {
+      ret = RHN_ERROR;
+    }
+    r_jwt_free(jwt);
+    jwt = NULL;
+  }
+  return ret;
+}
+
+/**
+ * Verifies BENCH_VERIFY_BATCH tokens with r_jwt_verify_batch on ctx->nb_threads threads
+ */
+static int bench_jwt_verify_batch(struct _bench_ctx * ctx) {
+  int ret;
+  size_t i;
+
+  ret = r_jwt_verify_batch(ctx->tokens, BENCH_VERIFY_BATCH, ctx->jwks_pubkey, 0, ctx->nb_threads, ctx->status, NULL);
+  for (i=0; ret == RHN_OK && i<BENCH_VERIFY_BATCH; i++) {
+    ret = ctx->status[i];
+  }
+  return ret;
+}
+
+/**
+ * Copies token with a modified signature
+ */
+static char * bench_forge_token(const char * token) {
+  char * forged = o_strdup(token), * signature;
+
+  if (forged != NULL && (signature = strrchr(forged, '.')) != NULL && o_strlen(signature) > 3) {
+    signature[2] = (signature[2]=='A')?'B':'A';
+  }
+  return forged;
+}
+
+static int bench_jwt_validate_claims(struct _bench_ctx * ctx) {
+  return r_jwt_validate_claims(ctx->jwt, R_JWT_CLAIM_ISS, BENCH_ISS,
+                                         R_JWT_CLAIM_SUB, BENCH_SUB,
+                                         R_JWT_CLAIM_AUD, BENCH_AUD,
+                                         R_JWT_CLAIM_EXP, R_JWT_CLAIM_NOW,
+                                         R_JWT_CLAIM_NBF, R_JWT_CLAIM_NOW,
+                                         R_JWT_CLAIM_IAT, R_JWT_CLAIM_PRESENT,
+                                         R_JWT_CLAIM_JTI, NULL,
+                                         R_JWT_CLAIM_STR, "scope", "openid",
+                                         R_JWT_CLAIM_NOP);
+}
+
+static int bench_jwt_serialize_signed(struct _bench_ctx * ctx) {
+  char * token = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_set_claim_str_value(ctx->jwt_sign, "sub", BENCH_SUB) == RHN_OK &&
+      (token = r_jwt_serialize_signed(ctx->jwt_sign, ctx->privkey, 0)) != NULL) {
+    ret = RHN_OK;
+  }
+  o_free(token);
+  return ret;
+}
+
+static int bench_jwt_template_mint(struct _bench_ctx * ctx) {
+  char * token = r_jwt_template_mint(ctx->jwt_template, ctx->j_claims);
+  int ret = token!=NULL?RHN_OK:RHN_ERROR;
+
+  o_free(token);
+  return ret;
+}
+
+/**
+ * Builds the jwt_t with the fixed claims used by the jwt_serialize_signed and jwt_template_mint benchmarks,
+ * the claim "sub" is set for each token
+ */
+static jwt_t * bench_jwt_skeleton(struct _bench_ctx * ctx) {
+  jwt_t * jwt = NULL;
+
+  if (r_jwt_init(&jwt) != RHN_OK ||
+      r_jwt_set_sign_alg(jwt, ctx->alg) != RHN_OK ||
+      r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, BENCH_ISS,
+                            R_JWT_CLAIM_AUD, BENCH_AUD,
+                            R_JWT_CLAIM_STR, "scope", "openid",
+                            R_JWT_CLAIM_NOP) != RHN_OK) {
+    r_jwt_free(jwt);
+    jwt = NULL;
+  }
+  return jwt;
+}
+
+/**
+ * Builds the signed JWT used by the jwt_parse and jwt_validate_claims benchmarks
+ */
+static char * bench_jwt_token(struct _bench_ctx * ctx) {
+  jwt_t * jwt = NULL;
+  char * token = NULL;
+  time_t now = time(NULL);
+
+  if (r_jwt_init(&jwt) == RHN_OK &&
+      r_jwt_set_sign_alg(jwt, ctx->alg) == RHN_OK &&
+      r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, BENCH_ISS,
+                            R_JWT_CLAIM_SUB, BENCH_SUB,
+                            R_JWT_CLAIM_AUD, BENCH_AUD,
+                            R_JWT_CLAIM_EXP, (rhn_int_t)now+3600,
+                            R_JWT_CLAIM_NBF, (rhn_int_t)now-60,
+                            R_JWT_CLAIM_IAT, (rhn_int_t)now,
+                            R_JWT_CLAIM_JTI, "bench-jti",
+                            R_JWT_CLAIM_STR, "scope", "openid",
+                            R_JWT_CLAIM_NOP) == RHN_OK) {
+    token = r_jwt_serialize_signed(jwt, ctx->privkey, 0);
+  }
+  r_jwt_free(jwt);
+  return token;
+}
+
+static int bench_filter_match(const char * filter, const char * name) {
+  return o_strnullempty(filter) || o_strstr(name, filter) != NULL;
+}
+
+/**
+ * Runs op iterations times and appends the result to j_results
+ */
+static void bench_run(const char * operation, bench_op op, struct _bench_ctx * ctx, int setup_ok, unsigned int iterations, json_t * j_results) {
+  unsigned long long * samples = NULL, start, total_ns = 0;
+  size_t nb_alloc;
+  unsigned int i;
+  json_t * j_result = json_pack("{sssoso}",
+                                "operation", operation,
+                                "alg", ctx->alg!=R_JWA_ALG_UNKNOWN?json_string(r_jwa_alg_to_str(ctx->alg)):json_null(),
+                                "enc", ctx->enc!=R_JWA_ENC_UNKNOWN?json_string(r_jwa_enc_to_str(ctx->enc)):json_null());
+
+  if (ctx->nb_threads) {
+    json_object_set_new(j_result, "threads", json_integer(ctx->nb_threads));
+  }
+
+  for (i=0; setup_ok && i<BENCH_WARMUP_ITERATIONS; i++) {
+    if (op(ctx) != RHN_OK) {
+      setup_ok = 0;
+    }
+  }
+  if (setup_ok && (samples = o_malloc(iterations*sizeof(unsigned long long))) != NULL) {
+    nb_alloc = bench_nb_alloc;
+    for (i=0; i<iterations; i++) {
+      start = bench_now_ns();
+      op(ctx);
+      samples[i] = bench_now_ns() - start;
+      total_ns += samples[i];
+    }
+    nb_alloc = bench_nb_alloc - nb_alloc;
+    qsort(samples, iterations, sizeof(unsigned long long), bench_compare_ns);
+    json_object_set_new(j_result, "status", json_string("ok"));
+    json_object_set_new(j_result, "iterations", json_integer(iterations));
+    json_object_set_new(j_result, "ops_per_sec", json_real(total_ns?(double)iterations*1e9/(double)total_ns:0.0));
+    json_object_set_new(j_result, "p50_ns", json_integer((json_int_t)samples[iterations/2]));
+    json_object_set_new(j_result, "p99_ns", json_integer((json_int_t)samples[(iterations*99)/100]));
+    json_object_set_new(j_result, "allocs_per_op", json_real((double)nb_alloc/(double)iterations));
+    o_free(samples);
+  } else {
+    json_object_set_new(j_result, "status", json_string("unsupported"));
+  }
+  fprintf(stderr, "%s/%s%s%s%s%.0u: %s\n", operation,
+                  ctx->alg!=R_JWA_ALG_UNKNOWN?r_jwa_alg_to_str(ctx->alg):"",
+                  ctx->enc!=R_JWA_ENC_UNKNOWN?"/":"",
+                  ctx->enc!=R_JWA_ENC_UNKNOWN?r_jwa_enc_to_str(ctx->enc):"",
+                  ctx->nb_threads?"/":"",
+                  ctx->nb_threads,
+                  json_string_value(json_object_get(j_result, "status")));
+  json_array_append_new(j_results, j_result);
+}
+
+static void bench_jws(struct _bench_keys * keys, const char * filter, unsigned int iterations, json_t * j_results) {
+  struct _bench_ctx ctx;
+  jws_t * jws = NULL;
+  char * name;
+  size_t i;
+  int setup_ok;
+
+  for (i=0; bench_jws_algs[i]!=R_JWA_ALG_UNKNOWN; i++) {
+    memset(&ctx, 0, sizeof(struct _bench_ctx));
+    ctx.alg = bench_jws_algs[i];
+    setup_ok = (bench_ctx_set_keys(&ctx, keys) == RHN_OK);
+    name = msprintf("jws_sign/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      bench_run("jws_sign", bench_jws_sign, &ctx, setup_ok, iterations, j_results);
+    }
+    o_free(name);
+    name = msprintf("jws_verify/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      if (setup_ok && r_jws_init(&jws) == RHN_OK &&
+          r_jws_set_alg(jws, ctx.alg) == RHN_OK &&
+          r_jws_set_payload(jws, (const unsigned char *)BENCH_PAYLOAD, o_strlen(BENCH_PAYLOAD)) == RHN_OK) {
+        ctx.token = r_jws_serialize(jws, ctx.privkey, 0);
+      }
+      r_jws_free(jws);
+      jws = NULL;
+      bench_run("jws_verify", bench_jws_verify, &ctx, ctx.token != NULL, iterations, j_results);
+    }
+    o_free(name);
+    bench_ctx_clean(&ctx);
+  }
+}
+
+static int bench_jwe_is_ecdh(jwa_alg alg) {
+  return (alg == R_JWA_ALG_ECDH_ES || alg == R_JWA_ALG_ECDH_ES_A128KW || alg == R_JWA_ALG_ECDH_ES_A192KW || alg == R_JWA_ALG_ECDH_ES_A256KW);
+}
+
+static void bench_jwe(struct _bench_keys * keys, const char * filter, unsigned int iterations, json_t * j_results) {
+  struct _bench_ctx ctx;
+  jwe_t * jwe = NULL;
+  char * name, * name_cold;
+  size_t i, j;
+  int setup_ok;
+
+  for (i=0; bench_jwe_algs[i]!=R_JWA_ALG_UNKNOWN; i++) {
+    for (j=0; bench_jwe_encs[j]!=R_JWA_ENC_UNKNOWN; j++) {
+      memset(&ctx, 0, sizeof(struct _bench_ctx));
+      ctx.alg = bench_jwe_algs[i];
+      ctx.enc = bench_jwe_encs[j];
+      setup_ok = (bench_ctx_set_keys(&ctx, keys) == RHN_OK);
+      name = msprintf("jwe_encrypt/%s/%s", r_jwa_alg_to_str(ctx.alg), r_jwa_enc_to_str(ctx.enc));
+      if (bench_filter_match(filter, name)) {
+        bench_run("jwe_encrypt", bench_jwe_encrypt, &ctx, setup_ok, iterations, j_results);
+      }
+      o_free(name);
+      name = msprintf("jwe_decrypt/%s/%s", r_jwa_alg_to_str(ctx.alg), r_jwa_enc_to_str(ctx.enc));
+      // The cold decryption is measured only for ECDH-ES, where the static private key setup is significant
+      name_cold = bench_jwe_is_ecdh(ctx.alg)?msprintf("jwe_decrypt_cold/%s/%s", r_jwa_alg_to_str(ctx.alg), r_jwa_enc_to_str(ctx.enc)):NULL;
+      if (bench_filter_match(filter, name) || (name_cold != NULL && bench_filter_match(filter, name_cold))) {
+        if (setup_ok && r_jwe_init(&jwe) == RHN_OK &&
+            r_jwe_set_alg(jwe, ctx.alg) == RHN_OK &&
+            r_jwe_set_enc(jwe, ctx.enc) == RHN_OK &&
+            r_jwe_set_payload(jwe, bench_jwe_payload, bench_jwe_payload_len) == RHN_OK) {
+          ctx.token = r_jwe_serialize(jwe, ctx.pubkey, 0);
+        }
+        r_jwe_free(jwe);
+        jwe = NULL;
+      }
+      if (bench_filter_match(filter, name)) {
+        bench_run("jwe_decrypt", bench_jwe_decrypt, &ctx, ctx.token != NULL, iterations, j_results);
+      }
+      if (name_cold != NULL && bench_filter_match(filter, name_cold)) {
+        bench_run("jwe_decrypt_cold", bench_jwe_decrypt_cold, &ctx, ctx.token != NULL, iterations, j_results);
+      }
+      o_free(name);
+      o_free(name_cold);
+      bench_ctx_clean(&ctx);
+    }
+  }
+}
+
+static void bench_jwt(struct _bench_keys * keys, const char * filter, unsigned int iterations, json_t * j_results) {
+  static const jwa_alg algs[] = {R_JWA_ALG_HS256, R_JWA_ALG_RS256, R_JWA_ALG_ES256, R_JWA_ALG_UNKNOWN};
+  struct _bench_ctx ctx;
+  char * name;
+  size_t i, j, k;
+  long nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+  // 1, 2, 4 and the number of online processors, if it's not already in the list
+  unsigned int threads[] = {1, 2, 4, nb_cpu>0?(unsigned int)nb_cpu:1};
+  size_t nb_threads = (threads[3]==1||threads[3]==2||threads[3]==4)?3:4;
+
+  for (i=0; algs[i]!=R_JWA_ALG_UNKNOWN; i++) {
+    memset(&ctx, 0, sizeof(struct _bench_ctx));
+    ctx.alg = algs[i];
+    if (bench_ctx_set_keys(&ctx, keys) == RHN_OK) {
+      ctx.token = bench_jwt_token(&ctx);
+    }
+    name = msprintf("jwt_parse/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      bench_run("jwt_parse", bench_jwt_parse, &ctx, ctx.token != NULL, iterations, j_results);
+    }
+    o_free(name);
+    name = msprintf("jwt_parse_then_verify_forged/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      if (ctx.token != NULL && ctx.forged == NULL) {
+        ctx.forged = bench_forge_token(ctx.token);
+      }
+      bench_run("jwt_parse_then_verify_forged", bench_jwt_parse_then_verify, &ctx, ctx.forged != NULL, iterations, j_results);
+    }
+    o_free(name);
+    name = msprintf("jwt_parse_verify_forged/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      if (ctx.token != NULL && ctx.forged == NULL) {
+        ctx.forged = bench_forge_token(ctx.token);
+      }
+      bench_run("jwt_parse_verify_forged", bench_jwt_parse_verify, &ctx, ctx.forged != NULL, iterations, j_results);
+    }
+    o_free(name);
+    name = msprintf("jwt_validate_claims/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      if (ctx.token != NULL && r_jwt_init(&ctx.jwt) == RHN_OK) {
+        r_jwt_parse(ctx.jwt, ctx.token, 0);
+      }
+      bench_run("jwt_validate_claims", bench_jwt_validate_claims, &ctx, ctx.jwt != NULL, iterations, j_results);
+    }
+    o_free(name);
+    name = msprintf("jwt_serialize_signed/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      if (ctx.token != NULL) {
+        ctx.jwt_sign = bench_jwt_skeleton(&ctx);
+      }
+      bench_run("jwt_serialize_signed", bench_jwt_serialize_signed, &ctx, ctx.jwt_sign != NULL, iterations, j_results);
+    }
+    o_free(name);
+    name = msprintf("jwt_template_mint/%s", r_jwa_alg_to_str(ctx.alg));
+    if (bench_filter_match(filter, name)) {
+      if (ctx.token != NULL && (ctx.j_claims = json_pack("{ss}", "sub", BENCH_SUB)) != NULL) {
+        r_jwt_free(ctx.jwt_sign);
+        if ((ctx.jwt_sign = bench_jwt_skeleton(&ctx)) != NULL) {
+          r_jwt_template_init(&ctx.jwt_template, ctx.jwt_sign, ctx.privkey, 0);
+        }
+      }
+      bench_run("jwt_template_mint", bench_jwt_template_mint, &ctx, ctx.jwt_template != NULL, iterations, j_results);
+    }
+    o_free(name);
+    // The same tokens are verified with each number of threads
+    for (j=0; j<nb_threads; j++) {
+      name = msprintf("jwt_verify_batch/%s/%u", r_jwa_alg_to_str(ctx.alg), threads[j]);
+      if (bench_filter_match(filter, name)) {
+        if (ctx.token != NULL && ctx.jwks_pubkey == NULL && r_jwks_init(&ctx.jwks_pubkey) == RHN_OK) {
+          r_jwks_append_jwk(ctx.jwks_pubkey, ctx.pubkey);
+          for (k=0; k<BENCH_VERIFY_BATCH; k++) {
+            ctx.tokens[k] = ctx.token;
+          }
+        }
+        ctx.nb_threads = threads[j];
+        bench_run("jwt_verify_batch", bench_jwt_verify_batch, &ctx, ctx.jwks_pubkey != NULL, iterations, j_results);
+        ctx.nb_threads = 0;
+      }
+      o_free(name);
+    }
+    bench_ctx_clean(&ctx);
+  }
+}
+
+int main(int argc, char ** argv) {
+  const char * short_options = "n:f:p:o:h";
+  static const struct option long_options[]= {
+    {"iterations", required_argument, NULL, 'n'},
+    {"filter", required_argument, NULL, 'f'},
+    {"payload-size", required_argument, NULL, 'p'},
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  struct _bench_keys keys;
+  unsigned int iterations = BENCH_DEFAULT_ITERATIONS;
+  const char * filter = NULL, * output = NULL;
+  json_t * j_output, * j_results;
+  char * str_output;
+  unsigned char * payload = NULL;
+  FILE * f_output;
+  int next_option, ret = 0;
+  long l_iterations, l_payload_size = 0, i;
+
+  do {
+    next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+    switch (next_option) {
+      case 'n':
+        l_iterations = strtol(optarg, NULL, 10);
+        if (l_iterations > 0 && l_iterations <= 100000000) {
+          iterations = (unsigned int)l_iterations;
+        } else {
+          fprintf(stderr, "Invalid iterations value\n");
+          return 1;
+        }
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'p':
+        l_payload_size = strtol(optarg, NULL, 10);
+        if (l_payload_size <= 0 || l_payload_size > 1073741824) {
+          fprintf(stderr, "Invalid payload size value\n");
+          return 1;
+        }
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'h':
+        print_help(stdout);
+        return 0;
+      case -1:
+        break;
+      default:
+        print_help(stderr);
+        return 1;
+    }
+  } while (next_option != -1);
+
+  // The allocator must be set before any allocation
+  o_set_alloc_funcs(bench_malloc, bench_realloc, free);
+  if (r_global_init() != RHN_OK) {
+    fprintf(stderr, "Error r_global_init\n");
+    return 1;
+  }
+  if (l_payload_size) {
+    if ((payload = o_malloc((size_t)l_payload_size)) == NULL) {
+      fprintf(stderr, "Error allocating payload\n");
+      return 1;
+    }
+    for (i=0; i<l_payload_size; i++) {
+      payload[i] = (unsigned char)('a'+(i%26));
+    }
+    bench_jwe_payload = payload;
+    bench_jwe_payload_len = (size_t)l_payload_size;
+  }
+
+  if (bench_keys_init(&keys) == RHN_OK) {
+    j_results = json_array();
+    bench_jws(&keys, filter, iterations, j_results);
+    bench_jwe(&keys, filter, iterations, j_results);
+    bench_jwt(&keys, filter, iterations, j_results);
+    j_output = json_pack("{sssssIso}",
+                         "rhonabwy_version", RHONABWY_VERSION_STR,
+                         "gnutls_version", gnutls_check_version(NULL),
+                         "jwe_payload_size", (json_int_t)bench_jwe_payload_len,
+                         "results", j_results);
+    str_output = json_dumps(j_output, JSON_INDENT(2));
+    if (output != NULL) {
+      if ((f_output = fopen(output, "w")) != NULL) {
+        fprintf(f_output, "%s\n", str_output);
+        fclose(f_output);
+      } else {
+        fprintf(stderr, "Error opening output file %s\n", output);
+        ret = 1;
+      }
+    } else {
+      printf("%s\n", str_output);
+    }
+    o_free(str_output);
+    json_decref(j_output);
+  } else {
+    fprintf(stderr, "Error generating keys\n");
+    ret = 1;
+  }
+  bench_keys_clean(&keys);
+  o_free(payload);
+
+  r_global_close();
+  return ret;
+}
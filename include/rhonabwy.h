@@ -35,6 +35,7 @@ extern "C"
 #include <stdint.h>
 #include <jansson.h>
 #include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
 #include <nettle/version.h>
 
 /**
@@ -97,6 +98,9 @@ extern "C"
 #define R_PARSE_HEADER_ALL    (R_PARSE_HEADER_JWK|R_PARSE_HEADER_JKU|R_PARSE_HEADER_X5C|R_PARSE_HEADER_X5U)
 #define R_PARSE_UNSIGNED       16
 #define R_PARSE_ALL           (R_PARSE_HEADER_ALL|R_PARSE_UNSIGNED)
+#define R_PARSE_ZERO_COPY      32
+#define R_PARSE_LAZY_CLAIMS    64
+#define R_PARSE_STREAM_VERIFIED 128
 
 /**
  * @}
@@ -240,6 +244,62 @@ typedef enum {
   R_IMPORT_JKU       = 11  ///< Import from an URL pointing to a jku, available for r_jwks_quick_import only, following parameters must be x5u_flags (R_FLAG_IGNORE_SERVER_CERTIFICATE, R_FLAG_FOLLOW_REDIRECT, R_FLAG_IGNORE_REMOTE), const char * value
 } rhn_import;
 
+/**
+ * Memory block of a r_arena_t
+ * The block data follows the structure
+ */
+struct _r_arena_block {
+  struct _r_arena_block * next;
+  size_t                  size;
+  size_t                  used;
+};
+
+typedef struct {
+  struct _r_arena_block * first;
+  struct _r_arena_block * current;
+  size_t                  block_size;
+  unsigned int            depth;
+} r_arena_t;
+
+/**
+ * Limits on the tokens parsed, verified or decrypted
+ * The limits are checked before any expensive operation
+ * so a crafted token can't waste CPU time
+ * A 0 value means no limit
+ */
+typedef struct {
+  size_t       max_token_len;  ///< Maximum length of a serialized token
+  size_t       max_header_len; ///< Maximum length of a base64url encoded protected header
+  unsigned int max_p2c;        ///< Maximum PBES2 iteration count (p2c)
+  unsigned int min_rsa_bits;   ///< Minimum modulus size of a RSA key used to verify a signature
+  unsigned int max_rsa_bits;   ///< Maximum modulus size of a RSA key used to verify a signature
+  size_t       max_keys;       ///< Maximum number of keys tried to verify or decrypt a token
+} r_policy_t;
+
+/**
+ * Hashed set of strings used by a r_claims_policy_t
+ */
+struct _r_str_set {
+  char     ** values;
+  uint32_t  * hashes;
+  size_t      size;
+  size_t      count;
+};
+
+/**
+ * Claims validation policy, built once and applied to any number of jwt_t
+ * A r_claims_policy_t isn't modified when a jwt_t is validated,
+ * so it may be shared by multiple threads once it's built
+ */
+typedef struct {
+  struct _r_str_set iss;      ///< Allowed "iss" values, any value if empty
+  struct _r_str_set sub;      ///< Allowed "sub" values, any value if empty
+  struct _r_str_set aud;      ///< Allowed "aud" values, any value if empty
+  unsigned int      leeway;   ///< Clock skew allowed in seconds for the claims "exp", "nbf" and "iat"
+  unsigned int      required; ///< Bit mask of the required claims, indexed by rhn_claim_opt
+  char            * typ;      ///< Expected header "typ" value, any value if NULL
+} r_claims_policy_t;
+
 typedef struct {
   unsigned char * header_b64url;
   unsigned char * payload_b64url;
@@ -252,6 +312,13 @@ typedef struct {
   size_t          payload_len;
   json_t        * j_json_serialization;
   int             token_mode;
+  const unsigned char * token_signing_input;
+  size_t                token_signing_input_len;
+  const unsigned char * token_signature;
+  size_t                token_signature_len;
+  size_t                jwks_pubkey_parse_size;
+  r_arena_t           * arena;
+  const r_policy_t    * policy;
 } jws_t;
 
 typedef struct {
@@ -277,8 +344,21 @@ typedef struct {
   size_t          payload_len;
   json_t        * j_json_serialization;
   int             token_mode;
+  size_t          jwks_pubkey_parse_size;
+  r_arena_t     * arena;
+  const r_policy_t * policy;
 } jwe_t;
 
+/**
+ * Position of a claim in the payload of a jwt_t parsed with R_PARSE_LAZY_CLAIMS
+ */
+struct _r_claim_index {
+  size_t key_offset;
+  size_t key_len;
+  size_t value_offset;
+  size_t value_len;
+};
+
 typedef struct {
   int             type;
   uint32_t        parse_flags;
@@ -297,8 +377,87 @@ typedef struct {
   jwks_t        * jwks_pubkey_sign;
   jwks_t        * jwks_privkey_enc;
   jwks_t        * jwks_pubkey_enc;
+  size_t          jwks_pubkey_sign_parse_size;
+  size_t          jwks_pubkey_enc_parse_size;
+  r_arena_t     * arena;
+  const r_policy_t * policy;
+  char          * claims_lazy;
+  size_t          claims_lazy_len;
+  struct _r_claim_index * claims_index;
+  size_t          claims_index_size;
 } jwt_t;
 
+/**
+ * Signing template used to mint signed JWTs with the same header and key
+ * The header is serialized and encoded once when the template is built
+ * A r_jwt_template_t isn't modified when a token is minted,
+ * so it may be shared by multiple threads once it's built
+ */
+typedef struct {
+  jwa_alg         alg;                  ///< Signature algorithm
+  jwk_t         * jwk;                  ///< Signing key
+  int             x5u_flags;            ///< Flags to retrieve x5u certificates
+  int             zip;                  ///< Set if the payload is compressed
+  unsigned char * header_b64url;        ///< Encoded header
+  size_t          header_b64url_len;    ///< Length of the encoded header
+  size_t          signature_b64url_len; ///< Length of the encoded signature
+  json_t        * j_claims;             ///< Claims skeleton, NULL if empty
+  char          * claims_str;           ///< Serialized claims skeleton, NULL if empty
+  size_t          claims_str_len;       ///< Length of claims_str
+} r_jwt_template_t;
+
+/**
+ * Completion callback of a token submitted to a r_jwt_verifier_t
+ * The callback is called by r_jwt_verifier_dispatch in the calling thread
+ * @param user_data: the user data given to r_jwt_verifier_submit
+ * @param status: the result of the verification: RHN_OK if the signature is valid,
+ * or the error value returned by r_jwt_parsen_verify
+ * @param jwt: the parsed token if status is RHN_OK, NULL otherwise,
+ * the jwt is freed after the callback returns
+ */
+typedef void (* r_jwt_verify_callback)(void * user_data, int status, jwt_t * jwt);
+
+/**
+ * Asynchronous verifier of signed JWTs
+ * The structure is private, a r_jwt_verifier_t is used with
+ * the r_jwt_verifier_* functions
+ */
+typedef struct _r_jwt_verifier r_jwt_verifier_t;
+
+/**
+ * Size of the payload chunks processed by a jwe_stream_t,
+ * a multiple of the cipher block size and of 3 so the base64url
+ * encoded chunks can be concatenated
+ */
+#define R_JWE_STREAM_CHUNK_SIZE 3072
+
+/**
+ * Output callback of a stream
+ * @param user_data: the user data given to the stream
+ * @param data: the output data
+ * @param data_len: the size of data
+ * @return RHN_OK on success, an error value to abort the stream
+ */
+typedef int (* r_stream_write_callback)(void * user_data, const unsigned char * data, size_t data_len);
+
+/**
+ * Input callback of a stream
+ * @param user_data: the user data given to the stream
+ * @param buffer: the buffer to fill
+ * @param buffer_size: the size of buffer
+ * @param data_len: set to the number of bytes read, 0 at the end of the input
+ * @return RHN_OK on success, an error value to abort the stream
+ */
+typedef int (* r_stream_read_callback)(void * user_data, unsigned char * buffer, size_t buffer_size, size_t * data_len);
+
+/**
+ * Stream to encrypt or decrypt a JWE in compact serialization
+ * The structure is private, a jwe_stream_t is allocated by
+ * r_jwe_encrypt_stream_init or r_jwe_decrypt_stream_init
+ * and used with the r_jwe_stream_* functions
+ */
+typedef struct _r_jwe_stream jwe_stream_t;
+
 /**
  * @}
  */
@@ -348,6 +507,213 @@ char * r_library_info_json_str(void);
  */
 void r_free(void * data);
 
+/**
+ * Set the maximum number of keys kept in the imported keys cache
+ * Rhonabwy keeps the gnutls_pubkey_t and gnutls_privkey_t imported
+ * from a jwk_t in a process-wide cache, indexed by the key material,
+ * so signing, verifying, encrypting or decrypting tokens with the same keys
+ * doesn't rebuild the gnutls keys every time
+ * The private keys used to decrypt ECDH-ES tokens are also kept decoded
+ * in a cache of the same size
+ * Changing the key material of a jwk_t, e.g. with r_jwk_set_property_str,
+ * makes its cache entry unreachable, the entry will be recycled later
+ * Setting size to 0 disables the cache
+ * The cache is flushed by this function
+ * Default size is 64 keys
+ * @param size: the maximum number of keys in the cache
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwk_cache_set_size(size_t size);
+
+/**
+ * Get the maximum number of keys kept in the imported keys cache
+ * @return the maximum number of keys in the cache, 0 if the cache is disabled
+ */
+size_t r_jwk_cache_get_size(void);
+
+/**
+ * Remove all the keys in the imported keys cache
+ * Must be called to wipe the imported private keys from memory
+ * before the program ends, r_global_close calls this function
+ */
+void r_jwk_cache_flush(void);
+
+/**
+ * Set the maximum number of remote contents kept in the remote content cache
+ * Rhonabwy keeps the contents downloaded from a jku or x5u url in a process-wide
+ * cache, indexed by the url, so parsing tokens pointing to the same url
+ * doesn't download its content every time
+ * The content lifetime is given by the Cache-Control max-age directive
+ * or the Expires header of the response, the content is refreshed in the background
+ * when its lifetime is nearly over, and revalidated with If-None-Match
+ * when the response had an ETag header
+ * Responses with the Cache-Control directive no-store aren't stored
+ * Concurrent downloads of the same url are merged into one
+ * Setting size to 0 disables the cache
+ * The cache is flushed by this function
+ * Default size is 16 urls
+ * @param size: the maximum number of urls in the cache
+ * @return RHN_OK on success, an error value on error
+ */
+int r_remote_cache_set_size(size_t size);
+
+/**
+ * Get the maximum number of remote contents kept in the remote content cache
+ * @return the maximum number of urls in the cache, 0 if the cache is disabled
+ */
+size_t r_remote_cache_get_size(void);
+
+/**
+ * Set the lifetimes of the remote contents in the remote content cache
+ * @param default_ttl: lifetime in seconds of a content when the response has
+ * no Cache-Control max-age directive and no Expires header, default is 0,
+ * so those contents are downloaded every time
+ * @param max_ttl: maximum lifetime in seconds of a content, default is 86400
+ * @return RHN_OK on success, an error value on error
+ */
+int r_remote_cache_set_ttl(unsigned int default_ttl, unsigned int max_ttl);
+
+/**
+ * Remove all the contents in the remote content cache
+ * Waits for the pending downloads, r_global_close calls this function
+ */
+void r_remote_cache_flush(void);
+
+/**
+ * Set the timeout of the remote content downloads
+ * The connections and the TLS sessions to the servers are kept between
+ * the downloads, so repeated fetches from the same server reuse them
+ * @param timeout: maximum duration of a download in milliseconds,
+ * 0 for no timeout, default is 0
+ * @return RHN_OK on success, an error value on error
+ */
+int r_remote_set_timeout(unsigned long timeout);
+
+/**
+ * Set the maximum size of the remote contents
+ * A larger response is discarded and the download fails
+ * @param max_size: maximum size of a response body in bytes,
+ * 0 for no limit, default is 0
+ * @return RHN_OK on success, an error value on error
+ */
+int r_remote_set_max_response_size(size_t max_size);
+
+/**
+ * Default maximum size of an inflated payload
+ */
+#define R_ZIP_DEFAULT_MAX_INFLATE_SIZE 16777216
+
+/**
+ * Set the compression level used to deflate the payloads with "zip":"DEF"
+ * @param level: the zlib compression level, from 0 (no compression)
+ * to 9 (best compression), or -1 for the zlib default level, default is -1
+ * @return RHN_OK on success, an error value on error
+ */
+int r_zip_set_level(int level);
+
+/**
+ * Set the maximum size of the payloads inflated from "zip":"DEF"
+ * The inflate stops as soon as the output exceeds this size
+ * and the token is rejected, so a small token can't expand
+ * into a huge payload
+ * @param max_size: maximum size of an inflated payload in bytes,
+ * 0 for no limit, default is R_ZIP_DEFAULT_MAX_INFLATE_SIZE
+ * @return RHN_OK on success, an error value on error
+ */
+int r_zip_set_max_inflate_size(size_t max_size);
+
+/**
+ * Set the number of ephemeral keys kept in the ECDH-ES ephemeral key pools
+ * An encryption with ECDH-ES, ECDH-ES+A128KW, ECDH-ES+A192KW or ECDH-ES+A256KW
+ * generates an ephemeral key pair on the recipient key curve, a background thread
+ * can pre-generate these key pairs so the encryption doesn't wait for them
+ * There is one pool per curve (P-256, P-384, P-521, X25519 and X448), a pool
+ * is filled once an encryption has used its curve
+ * Each key pair is used only once
+ * The pools are emptied by this function, r_global_close stops the background thread
+ * Default size is 0, which disables the pools
+ * @param size: the maximum number of key pairs in each pool
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_ecdh_pool_set_size(size_t size);
+
+/**
+ * Get the number of ephemeral keys kept in the ECDH-ES ephemeral key pools
+ * @return the maximum number of key pairs in each pool, 0 if the pools are disabled
+ */
+size_t r_jwe_ecdh_pool_get_size(void);
+
+/**
+ * Set the number of threads used to process the recipients
+ * of a JWE in general JSON serialization
+ * r_jwe_serialize_json_t and r_jwe_serialize_json_str encrypt the key
+ * for each recipient in parallel, r_jwe_decrypt tries the candidate keys in parallel
+ * The recipients order in the token and the decryption result
+ * are the same as with a single thread
+ * The threads are started for each token, the calling thread is one of them
+ * Default is 1, the recipients are processed one after another
+ * @param nb_threads: the maximum number of threads, must be at least 1
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_set_recipients_threads(unsigned int nb_threads);
+
+/**
+ * Get the number of threads used to process the recipients
+ * of a JWE in general JSON serialization
+ * @return the maximum number of threads
+ */
+unsigned int r_jwe_get_recipients_threads(void);
+
+/**
+ * Default size of the memory blocks allocated by a r_arena_t
+ */
+#define R_ARENA_DEFAULT_BLOCK_SIZE 8192
+
+/**
+ * Initialize a r_arena_t
+ * An arena is a bump allocator used for the temporary buffers
+ * of a parse, verify or decrypt operation on the jws_t, jwe_t or jwt_t
+ * it's attached to, e.g. the decoded segments, the signing input or the aad
+ * The temporary buffers are released all at once at the end of the operation
+ * and the arena memory blocks are kept for the next operation
+ * A r_arena_t isn't thread-safe, it may be attached to multiple objects
+ * as long as they are used by the same thread
+ * @param arena: a reference to a r_arena_t * to initialize
+ * @param block_size: the size of the memory blocks to allocate,
+ * 0 to use R_ARENA_DEFAULT_BLOCK_SIZE
+ * @return RHN_OK on success, an error value on error
+ */
+int r_arena_init(r_arena_t ** arena, size_t block_size);
+
+/**
+ * Free a r_arena_t and its memory blocks
+ * The arena must be detached from all objects before
+ * @param arena: the r_arena_t * to free
+ */
+void r_arena_free(r_arena_t * arena);
+
+/**
+ * Release the memory blocks of a r_arena_t
+ * The arena can't be reset during an operation
+ * @param arena: the r_arena_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_arena_reset(r_arena_t * arena);
+
+/**
+ * Get the size of the memory blocks allocated by a r_arena_t
+ * @param arena: the r_arena_t * to check
+ * @return the total size of the memory blocks
+ */
+size_t r_arena_get_size(r_arena_t * arena);
+
+/**
+ * Initialize a r_policy_t with no limit
+ * @param policy: the r_policy_t * to initialize
+ * @return RHN_OK on success, an error value on error
+ */
+int r_policy_init(r_policy_t * policy);
+
 /**
  * Initialize a jwk_t
  * @param jwk: a reference to a jwk_t * to initialize
@@ -387,6 +753,38 @@ int r_jws_init(jws_t ** jws);
  */
 void r_jws_free(jws_t * jws);
 
+/**
+ * Reset a jws_t so it can be reused for another token
+ * The header, payload, algorithm and serialized values are cleared
+ * The public key set is restored to its content before the first parse since
+ * the last init or reset, so the keys imported from token headers are removed
+ * @param jws: the jws_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_reset(jws_t * jws);
+
+/**
+ * Attach a r_arena_t to a jws_t
+ * The temporary buffers of the parse and verify operations
+ * will be allocated in the arena
+ * The arena isn't owned by the jws_t and must outlive it
+ * @param jws: the jws_t * to update
+ * @param arena: the r_arena_t * to attach, NULL to detach the current arena
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_set_arena(jws_t * jws, r_arena_t * arena);
+
+/**
+ * Attach a r_policy_t to a jws_t
+ * The parse and verify operations fail if the token exceeds the policy limits
+ * The policy isn't owned by the jws_t and must outlive it,
+ * it may be attached to multiple objects used by different threads
+ * @param jws: the jws_t * to update
+ * @param policy: the r_policy_t * to attach, NULL to detach the current policy
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_set_policy(jws_t * jws, const r_policy_t * policy);
+
 /**
  * Initialize a jwe_t
  * @param jwe: a reference to a jwe_t * to initialize
@@ -400,6 +798,38 @@ int r_jwe_init(jwe_t ** jwe);
  */
 void r_jwe_free(jwe_t * jwe);
 
+/**
+ * Reset a jwe_t so it can be reused for another token
+ * The header, payload, algorithms, key, iv, aad and serialized values are cleared
+ * The public key set is restored to its content before the first parse since
+ * the last init or reset, so the keys imported from token headers are removed
+ * @param jwe: the jwe_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_reset(jwe_t * jwe);
+
+/**
+ * Attach a r_arena_t to a jwe_t
+ * The temporary buffers of the parse and decrypt operations
+ * will be allocated in the arena
+ * The arena isn't owned by the jwe_t and must outlive it
+ * @param jwe: the jwe_t * to update
+ * @param arena: the r_arena_t * to attach, NULL to detach the current arena
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_set_arena(jwe_t * jwe, r_arena_t * arena);
+
+/**
+ * Attach a r_policy_t to a jwe_t
+ * The parse and decrypt operations fail if the token exceeds the policy limits
+ * The policy isn't owned by the jwe_t and must outlive it,
+ * it may be attached to multiple objects used by different threads
+ * @param jwe: the jwe_t * to update
+ * @param policy: the r_policy_t * to attach, NULL to detach the current policy
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_set_policy(jwe_t * jwe, const r_policy_t * policy);
+
 /**
  * Initialize a jwt_t
  * @param jwt: a reference to a jwt_t * to initialize
@@ -413,6 +843,41 @@ int r_jwt_init(jwt_t ** jwt);
  */
 void r_jwt_free(jwt_t * jwt);
 
+/**
+ * Reset a jwt_t so it can be reused for another token
+ * The header, claims, algorithms, key and iv are cleared,
+ * the inner jws_t and jwe_t are kept and reused by the next parse or serialize
+ * The public key sets are restored to their content before the first parse since
+ * the last init or reset, so the keys attached with r_jwt_add_sign_keys or r_jwt_add_enc_keys
+ * before parsing are kept and the keys imported from token headers are removed
+ * @param jwt: the jwt_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_reset(jwt_t * jwt);
+
+/**
+ * Attach a r_arena_t to a jwt_t
+ * The arena is attached to the inner jws_t and jwe_t, so the temporary buffers
+ * of the parse, verify and decrypt operations will be allocated in the arena
+ * The arena isn't owned by the jwt_t and must outlive it
+ * @param jwt: the jwt_t * to update
+ * @param arena: the r_arena_t * to attach, NULL to detach the current arena
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_set_arena(jwt_t * jwt, r_arena_t * arena);
+
+/**
+ * Attach a r_policy_t to a jwt_t
+ * The policy is attached to the inner jws_t and jwe_t, so the parse, verify
+ * and decrypt operations fail if the token exceeds the policy limits
+ * The policy isn't owned by the jwt_t and must outlive it,
+ * it may be attached to multiple objects used by different threads
+ * @param jwt: the jwt_t * to update
+ * @param policy: the r_policy_t * to attach, NULL to detach the current policy
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_set_policy(jwt_t * jwt, const r_policy_t * policy);
+
 /**
  * Get the jwa_alg corresponding to the string algorithm specified
  * @param alg: the algorithm to convert
@@ -999,6 +1464,16 @@ size_t r_jwks_size(jwks_t * jwks);
  */
 jwk_t * r_jwks_get_at(jwks_t * jwks, size_t index);
 
+/**
+ * Get a borrowed reference to the jwk_t at the specified index of the jwks_t *
+ * @param jwks: the jwks_t * to evaluate
+ * @param index: the index of the array to retrieve
+ * @return a jwk_t * on success, NULL on error
+ * The returned jwk belongs to the jwks, it must not be modified nor freed,
+ * and it is valid until the jwks is modified or freed
+ */
+jwk_t * r_jwks_get_at_borrowed(jwks_t * jwks, size_t index);
+
 /**
  * Get the jwk_t at the specified index of the jwks_t *
  * @param jwks: the jwks_t * to evaluate
@@ -1008,6 +1483,21 @@ jwk_t * r_jwks_get_at(jwks_t * jwks, size_t index);
  */
 jwk_t * r_jwks_get_by_kid(jwks_t * jwks, const char * kid);
 
+/**
+ * Get a borrowed reference to the jwk_t with the specified kid in the jwks_t *
+ * The lookup uses the kid index maintained by r_jwks_append_jwk,
+ * r_jwks_set_at, r_jwks_remove_at and r_jwks_empty
+ * Changing the keys of the jwks outside of the r_jwks_* functions is unsupported,
+ * the lookup may then miss a key
+ * If several jwk have the same kid, the first one is returned
+ * @param jwks: the jwks_t * to evaluate
+ * @param kid: the key id of the jwk to retreive
+ * @return a jwk_t * on success, NULL on error
+ * The returned jwk belongs to the jwks, it must not be modified nor freed,
+ * and it is valid until the jwks is modified or freed
+ */
+jwk_t * r_jwks_get_by_kid_borrowed(jwks_t * jwks, const char * kid);
+
 /**
  * Append a jwk_t at the end of the array of jwk_t in the jwks_t
  * @param jwks: the jwks_t * to append the jwk_t
@@ -1404,6 +1894,9 @@ int r_jws_parsen(jws_t * jws, const char * jws_str, size_t jws_str_len, int x5u_
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_ZERO_COPY: compact serialization only, the jws keeps references to
+ * the header, payload and signature in jws_str instead of copying them,
+ * jws_str must remain valid and unchanged as long as the jws is used
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -1429,6 +1922,9 @@ int r_jws_advanced_parse(jws_t * jws, const char * jws_str, uint32_t parse_flags
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_ZERO_COPY: compact serialization only, the jws keeps references to
+ * the header, payload and signature in jws_str instead of copying them,
+ * jws_str must remain valid and unchanged as long as the jws is used
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -1499,6 +1995,9 @@ int r_jws_compact_parse(jws_t * jws, const char * jws_str, int x5u_flags);
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_ZERO_COPY: compact serialization only, the jws keeps references to
+ * the header, payload and signature in jws_str instead of copying them,
+ * jws_str must remain valid and unchanged as long as the jws is used
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -1523,6 +2022,9 @@ int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_ZERO_COPY: compact serialization only, the jws keeps references to
+ * the header, payload and signature in jws_str instead of copying them,
+ * jws_str must remain valid and unchanged as long as the jws is used
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -1761,6 +2263,71 @@ jws_t * r_jws_quick_parsen(const char * jws_str, size_t jws_str_len, uint32_t pa
  */
 int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags);
 
+/**
+ * Parses a JWS in compact mode and verifies its signature
+ * The header is decoded and the signature is verified over the token
+ * before the payload is decoded, so a token with an invalid signature
+ * is rejected without decoding its payload
+ * The payload is available only if the signature is valid
+ * @param jws: the jws_t to update
+ * @param jws_str: the jws serialized to parse
+ * @param jws_str_len: the length of jws_str
+ * @param parse_flags: Flags to set or unset options
+ * Flags available are
+ * - R_PARSE_NONE
+ * - R_PARSE_HEADER_JWK
+ * - R_PARSE_HEADER_JKU
+ * - R_PARSE_HEADER_X5C
+ * - R_PARSE_HEADER_X5U
+ * - R_PARSE_HEADER_ALL
+ * - R_PARSE_ZERO_COPY: the jws keeps references to the header and signature
+ * in jws_str instead of copying them,
+ * jws_str must remain valid and unchanged as long as the jws is used
+ * @param jwk_pubkey: the public key to check the signature,
+ * can be NULL if jws already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return RHN_OK if the signature is valid, RHN_ERROR_INVALID if the signature is invalid,
+ * an error value on error
+ */
+int r_jws_compact_parsen_verify(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, jwk_t * jwk_pubkey, int x5u_flags);
+
+/**
+ * Parses a JWS in compact mode and verifies its signature
+ * The header is decoded and the signature is verified over the token
+ * before the payload is decoded, so a token with an invalid signature
+ * is rejected without decoding its payload
+ * The payload is available only if the signature is valid
+ * @param jws: the jws_t to update
+ * @param jws_str: the jws serialized to parse, must end with a NULL string terminator
+ * @param parse_flags: Flags to set or unset options
+ * Flags available are
+ * - R_PARSE_NONE
+ * - R_PARSE_HEADER_JWK
+ * - R_PARSE_HEADER_JKU
+ * - R_PARSE_HEADER_X5C
+ * - R_PARSE_HEADER_X5U
+ * - R_PARSE_HEADER_ALL
+ * - R_PARSE_ZERO_COPY: the jws keeps references to the header and signature
+ * in jws_str instead of copying them,
+ * jws_str must remain valid and unchanged as long as the jws is used
+ * @param jwk_pubkey: the public key to check the signature,
+ * can be NULL if jws already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return RHN_OK if the signature is valid, RHN_ERROR_INVALID if the signature is invalid,
+ * an error value on error
+ */
+int r_jws_compact_parse_verify(jws_t * jws, const char * jws_str, uint32_t parse_flags, jwk_t * jwk_pubkey, int x5u_flags);
+
 /**
  * Serialize a JWS in compact mode (xxx.yyy.zzz)
  * @param jws: the JWS to serialize
@@ -2620,6 +3187,132 @@ char * r_jwe_serialize_json_str(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags
  */
 json_t * r_jwe_serialize_json_t(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags, int mode);
 
+/**
+ * Initialize a stream to encrypt a payload in compact serialization
+ * The payload is given in chunks to r_jwe_stream_update, encrypted and
+ * base64url encoded R_JWE_STREAM_CHUNK_SIZE bytes at a time, so the memory
+ * used doesn't depend on the payload size, jwe->payload isn't used
+ * The token is written to write_cb: the header, encrypted key and iv
+ * in this function, the ciphertext in r_jwe_stream_update,
+ * the tag in r_jwe_stream_final
+ * The header 'zip' isn't supported in a stream
+ * @param stream: a reference to a jwe_stream_t * to initialize,
+ * must be r_jwe_stream_free'd after use
+ * @param jwe: the jwe_t containing the header, alg, enc and keys,
+ * must not be used by another function until the stream is free'd
+ * @param jwk_pubkey: the key to encrypt the cypher key, may be NULL
+ * if jwe already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param write_cb: the callback to write the token
+ * @param write_user_data: the user data given to write_cb
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_encrypt_stream_init(jwe_stream_t ** stream, jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags, r_stream_write_callback write_cb, void * write_user_data);
+
+/**
+ * Initialize a stream to decrypt a token in compact serialization
+ * The token is given in chunks to r_jwe_stream_update, the payload is written
+ * to write_cb as soon as it's decrypted, so the memory used doesn't depend
+ * on the payload size, and the tag is verified in r_jwe_stream_final
+ * Warning: write_cb receives unauthenticated data, a modified token
+ * is detected only at the end of the stream, the payload written
+ * must be discarded unless r_jwe_stream_final returns RHN_OK
+ * With R_PARSE_STREAM_VERIFIED in parse_flags, the payload is kept in memory
+ * and written to write_cb only once the tag is verified, the memory used
+ * is then proportional to the payload size
+ * The header 'zip' isn't supported in a stream
+ * @param stream: a reference to a jwe_stream_t * to initialize,
+ * must be r_jwe_stream_free'd after use
+ * @param jwe: the jwe_t containing the private keys if any, its header,
+ * cypher key and iv are set when the token head is parsed,
+ * must not be used by another function until the stream is free'd
+ * @param jwk_privkey: the private key to decrypt the cypher key,
+ * may be NULL if jwe already contains a private key
+ * @param parse_flags: Flags to set or unset options, see r_jwe_advanced_parse,
+ * and R_PARSE_STREAM_VERIFIED: write the payload only once the tag is verified
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param write_cb: the callback to write the payload
+ * @param write_user_data: the user data given to write_cb
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_decrypt_stream_init(jwe_stream_t ** stream, jwe_t * jwe, jwk_t * jwk_privkey, uint32_t parse_flags, int x5u_flags, r_stream_write_callback write_cb, void * write_user_data);
+
+/**
+ * Gives the next chunk of input to a stream,
+ * the payload to encrypt or the token to decrypt
+ * @param stream: the stream to update
+ * @param data: the input chunk
+ * @param data_len: the size of data
+ * @return RHN_OK on success, an error value on error,
+ * the stream can't be used after an error
+ */
+int r_jwe_stream_update(jwe_stream_t * stream, const unsigned char * data, size_t data_len);
+
+/**
+ * Ends a stream
+ * An encryption stream writes the last ciphertext chunk and the tag,
+ * a decryption stream writes the last payload chunk and verifies the tag,
+ * or verifies the tag then writes the payload with R_PARSE_STREAM_VERIFIED
+ * @param stream: the stream to end
+ * @return RHN_OK on success, RHN_ERROR_INVALID if the tag is invalid,
+ * an error value on error, the payload written by a decryption stream
+ * must be discarded unless the return value is RHN_OK
+ */
+int r_jwe_stream_final(jwe_stream_t * stream);
+
+/**
+ * Free a stream
+ * @param stream: the stream to free
+ */
+void r_jwe_stream_free(jwe_stream_t * stream);
+
+/**
+ * Encrypts a payload read from read_cb and writes the token to write_cb
+ * using a jwe_stream_t, see r_jwe_encrypt_stream_init
+ * @param jwe: the jwe_t containing the header, alg, enc and keys
+ * @param jwk_pubkey: the key to encrypt the cypher key, may be NULL
+ * if jwe already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * @param read_cb: the callback to read the payload
+ * @param read_user_data: the user data given to read_cb
+ * @param write_cb: the callback to write the token
+ * @param write_user_data: the user data given to write_cb
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_encrypt_stream(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags, r_stream_read_callback read_cb, void * read_user_data, r_stream_write_callback write_cb, void * write_user_data);
+
+/**
+ * Decrypts a token read from read_cb and writes the payload to write_cb
+ * using a jwe_stream_t, see r_jwe_decrypt_stream_init
+ * The payload is written as soon as it's decrypted, unless parse_flags
+ * contains R_PARSE_STREAM_VERIFIED, the payload written must
+ * be discarded unless the function returns RHN_OK
+ * @param jwe: the jwe_t containing the private keys if any
+ * @param jwk_privkey: the private key to decrypt the cypher key,
+ * may be NULL if jwe already contains a private key
+ * @param parse_flags: Flags to set or unset options, see r_jwe_decrypt_stream_init
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * @param read_cb: the callback to read the token
+ * @param read_user_data: the user data given to read_cb
+ * @param write_cb: the callback to write the payload
+ * @param write_user_data: the user data given to write_cb
+ * @return RHN_OK on success, RHN_ERROR_INVALID if the token is invalid,
+ * an error value on error
+ */
+int r_jwe_decrypt_stream(jwe_t * jwe, jwk_t * jwk_privkey, uint32_t parse_flags, int x5u_flags, r_stream_read_callback read_cb, void * read_user_data, r_stream_write_callback write_cb, void * write_user_data);
+
 /**
  * @}
  */
@@ -3123,6 +3816,88 @@ char * r_jwt_serialize_signed(jwt_t * jwt, jwk_t * privkey, int x5u_flags);
  */
 char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_flags);
 
+/**
+ * Builds a signing template from a jwt_t
+ * The template keeps the header, the signing key and the claims of jwt
+ * as a claims skeleton, then each token minted with the template
+ * only serializes its own claims and computes its signature
+ * The header, the signature algorithm and the keys must be set in jwt
+ * as for r_jwt_serialize_signed, jwt is no longer needed afterwards
+ * A test token is signed to check the key and the algorithm
+ * The template must be freed with r_jwt_template_free after use
+ * @param jwt_template: a reference to a r_jwt_template_t * to initialize
+ * @param jwt: the jwt_t to build the template from
+ * @param privkey: the private key to sign the tokens, may be NULL
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return NULL
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_template_init(r_jwt_template_t ** jwt_template, jwt_t * jwt, jwk_t * privkey, int x5u_flags);
+
+/**
+ * Free all the data allocated by a r_jwt_template_t
+ * @param jwt_template: the r_jwt_template_t * to free
+ */
+void r_jwt_template_free(r_jwt_template_t * jwt_template);
+
+/**
+ * Mints a signed JWT in serialized format (xxx.yyy.zzz) with a template
+ * The payload is the claims skeleton of the template with the claims j_claims,
+ * the values in j_claims replace the skeleton values with the same name
+ * This function may be called by multiple threads with the same template
+ * @param jwt_template: the r_jwt_template_t * to use
+ * @param j_claims: the variable claims of the token, must be a JSON object, may be NULL
+ * @return the serialized token on success, NULL on error, must be r_free'd after use
+ */
+char * r_jwt_template_mint(const r_jwt_template_t * jwt_template, json_t * j_claims);
+
+/**
+ * Mints a signed JWT in serialized format (xxx.yyy.zzz) with a template
+ * from claims already serialized
+ * The members of claims are appended to the claims skeleton of the template
+ * without parsing, so claims must be a valid JSON object and must not
+ * contain a claim of the skeleton
+ * This function may be called by multiple threads with the same template
+ * @param jwt_template: the r_jwt_template_t * to use
+ * @param claims: the variable claims of the token, a serialized JSON object
+ * @param claims_len: the length of claims
+ * @return the serialized token on success, NULL on error, must be r_free'd after use
+ */
+char * r_jwt_template_mint_str(const r_jwt_template_t * jwt_template, const char * claims, size_t claims_len);
+
+/**
+ * Serializes a batch of signed JWTs with the same header and signing key
+ * The claims of jwt are the common claims of all the tokens, the claims
+ * of each token are added to them like in r_jwt_template_mint
+ * or r_jwt_template_mint_str
+ * The tokens are minted by nb_threads worker threads sharing
+ * the private key read-only
+ * @param jwt: the jwt_t * with the header values, the common claims,
+ * the signing algorithm and the private keys
+ * @param privkey: the private key to sign the tokens, optional
+ * If privkey is NULL, the private key is selected in jwt like in r_jwt_serialize_signed
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param claims: an array of nb_tokens json_t * JSON objects, the claims of each token
+ * @param claims_str: an array of nb_tokens serialized JSON objects, the claims of each token
+ * Exactly one of claims or claims_str must be set, the other must be NULL
+ * @param nb_tokens: the number of tokens to serialize
+ * @param nb_threads: the number of worker threads, 0 to use the number of online processors
+ * @param tokens: an array of nb_tokens char *, will be filled with
+ * the serialized tokens, NULL for the claims that couldn't be signed
+ * The tokens returned must be r_free'd after use
+ * @return RHN_OK if all the claims were processed, an error value on error
+ */
+int r_jwt_serialize_signed_batch(jwt_t * jwt, jwk_t * privkey, int x5u_flags, json_t ** claims, const char ** claims_str, size_t nb_tokens, unsigned int nb_threads, char ** tokens);
+
 /**
  * Return an encrypted JWT in serialized format (xxx.yyy.zzz.aaa.bbb)
  * @param jwt: the jwt_t to encrypt
@@ -3252,6 +4027,17 @@ int r_jwt_parsen_unsecure(jwt_t * jwt, const char * token, size_t token_len, int
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_ZERO_COPY: signed JWT only, the jwt keeps references to
+ * the header, payload and signature in token instead of copying them,
+ * token must remain valid and unchanged as long as the jwt is used
+ * - R_PARSE_LAZY_CLAIMS: the claims are indexed but not decoded,
+ * each claim is decoded when it's accessed, the full claims are decoded
+ * only if needed, e.g. by r_jwt_get_full_claims_json_t,
+ * the claim values are checked when they are indexed, so a malformed
+ * payload is rejected as without the flag
+ * Warning: the claim getters and r_jwt_validate_claims* decode the claims
+ * in the jwt, a jwt parsed with this flag must not be read by several threads
+ * at the same time
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -3280,6 +4066,17 @@ int r_jwt_advanced_parse(jwt_t * jwt, const char * token, uint32_t parse_flags,
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_ZERO_COPY: signed JWT only, the jwt keeps references to
+ * the header, payload and signature in token instead of copying them,
+ * token must remain valid and unchanged as long as the jwt is used
+ * - R_PARSE_LAZY_CLAIMS: the claims are indexed but not decoded,
+ * each claim is decoded when it's accessed, the full claims are decoded
+ * only if needed, e.g. by r_jwt_get_full_claims_json_t,
+ * the claim values are checked when they are indexed, so a malformed
+ * payload is rejected as without the flag
+ * Warning: the claim getters and r_jwt_validate_claims* decode the claims
+ * in the jwt, a jwt parsed with this flag must not be read by several threads
+ * at the same time
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -3290,6 +4087,79 @@ int r_jwt_advanced_parse(jwt_t * jwt, const char * token, uint32_t parse_flags,
  */
 int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, int x5u_flags);
 
+/**
+ * Parses a signed JWT and verifies its signature
+ * The signature is verified before the payload is decoded
+ * and the claims are parsed, so a token with an invalid signature
+ * is rejected without decoding its payload
+ * If the JWT is a nested JWT encrypted then signed, the
+ * encrypted JWT is parsed after the signature is verified
+ * An encrypted JWT is rejected with RHN_ERROR_PARAM
+ * @param jwt: the jwt that will contain the parsed token
+ * @param token: the token to parse into a JWT
+ * @param token_len: token length
+ * @param parse_flags: Flags to set or unset options
+ * Flags available are
+ * - R_PARSE_NONE
+ * - R_PARSE_HEADER_JWK
+ * - R_PARSE_HEADER_JKU
+ * - R_PARSE_HEADER_X5C
+ * - R_PARSE_HEADER_X5U
+ * - R_PARSE_HEADER_ALL
+ * - R_PARSE_ZERO_COPY: the jwt keeps references to the header and signature
+ * in token instead of copying them,
+ * token must remain valid and unchanged as long as the jwt is used
+ * - R_PARSE_LAZY_CLAIMS: the claims are decoded when they are accessed,
+ * see r_jwt_advanced_parse
+ * @param verify_key: the public key to check the signature,
+ * can be NULL if jwt already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return RHN_OK if the signature is valid, RHN_ERROR_INVALID if the signature is invalid,
+ * an error value on error
+ */
+int r_jwt_parsen_verify(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, jwk_t * verify_key, int x5u_flags);
+
+/**
+ * Parses a signed JWT and verifies its signature
+ * The signature is verified before the payload is decoded
+ * and the claims are parsed, so a token with an invalid signature
+ * is rejected without decoding its payload
+ * If the JWT is a nested JWT encrypted then signed, the
+ * encrypted JWT is parsed after the signature is verified
+ * An encrypted JWT is rejected with RHN_ERROR_PARAM
+ * @param jwt: the jwt that will contain the parsed token
+ * @param token: the token to parse into a JWT, must end with a NULL string terminator
+ * @param parse_flags: Flags to set or unset options
+ * Flags available are
+ * - R_PARSE_NONE
+ * - R_PARSE_HEADER_JWK
+ * - R_PARSE_HEADER_JKU
+ * - R_PARSE_HEADER_X5C
+ * - R_PARSE_HEADER_X5U
+ * - R_PARSE_HEADER_ALL
+ * - R_PARSE_ZERO_COPY: the jwt keeps references to the header and signature
+ * in token instead of copying them,
+ * token must remain valid and unchanged as long as the jwt is used
+ * - R_PARSE_LAZY_CLAIMS: the claims are decoded when they are accessed,
+ * see r_jwt_advanced_parse
+ * @param verify_key: the public key to check the signature,
+ * can be NULL if jwt already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return RHN_OK if the signature is valid, RHN_ERROR_INVALID if the signature is invalid,
+ * an error value on error
+ */
+int r_jwt_parse_verify(jwt_t * jwt, const char * token, uint32_t parse_flags, jwk_t * verify_key, int x5u_flags);
+
 /**
  * Parses a serialized JWT
  * If the JWT is signed only, the claims will be available
@@ -3395,6 +4265,104 @@ int r_jwt_token_typen(const char * token, size_t token_len);
  */
 int r_jwt_verify_signature(jwt_t * jwt, jwk_t * pubkey, int x5u_flags);
 
+/**
+ * Parses and verifies the signature of a batch of signed JWTs
+ * The tokens are spread among nb_threads worker threads,
+ * each worker uses its own copy of jwks_pubkey
+ * The tokens are parsed with R_PARSE_NONE, so only the keys in
+ * jwks_pubkey are used to verify the signatures
+ * @param tokens: the array of tokens to verify
+ * @param nb_tokens: the number of tokens in the array
+ * @param jwks_pubkey: the public keys to verify the signatures
+ * @param x5u_flags: Flags to retrieve x5u certificates in jwks_pubkey
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param nb_threads: the number of worker threads, 0 to use the number of online processors
+ * @param status: an array of nb_tokens int, will be filled with the
+ * result of the verification of each token: RHN_OK if the signature is valid,
+ * or the error value returned by r_jwt_parse or r_jwt_verify_signature
+ * @param claims: an array of nb_tokens json_t *, optional,
+ * will be filled with the claims of each valid token, NULL for the others
+ * The claims returned must be json_decref after use
+ * @return RHN_OK if all the tokens were processed, an error value on error
+ */
+int r_jwt_verify_batch(const char ** tokens, size_t nb_tokens, jwks_t * jwks_pubkey, int x5u_flags, unsigned int nb_threads, int * status, json_t ** claims);
+
+/**
+ * Initializes an asynchronous verifier of signed JWTs for an event loop
+ * The tokens submitted are parsed and verified by nb_threads worker threads,
+ * including the remote keys download if parse_flags allow it,
+ * so the calling thread is never blocked by the verification
+ * The completions are signalled on a file descriptor returned by
+ * r_jwt_verifier_get_fd, then the callbacks are called by r_jwt_verifier_dispatch
+ * @param verifier: the verifier to initialize, must be freed with r_jwt_verifier_free
+ * @param jwks_pubkey: the public keys to verify the signatures, copied in the verifier,
+ * may be NULL if the keys are given in the token headers
+ * @param parse_flags: Flags to set or unset options
+ * Flags available are
+ * - R_PARSE_NONE
+ * - R_PARSE_HEADER_JWK
+ * - R_PARSE_HEADER_JKU
+ * - R_PARSE_HEADER_X5C
+ * - R_PARSE_HEADER_X5U
+ * - R_PARSE_HEADER_ALL
+ * - R_PARSE_LAZY_CLAIMS: the claims are decoded when they are accessed,
+ * see r_jwt_advanced_parse
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param nb_threads: the number of worker threads, 0 to use the number of online processors
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_init(r_jwt_verifier_t ** verifier, jwks_t * jwks_pubkey, uint32_t parse_flags, int x5u_flags, unsigned int nb_threads);
+
+/**
+ * Returns the file descriptor of the completion events of a verifier
+ * The file descriptor is readable when tokens are verified,
+ * r_jwt_verifier_dispatch must be called then
+ * It's an eventfd on Linux and the read end of a pipe elsewhere,
+ * it must not be read nor closed by the caller
+ * @param verifier: the verifier
+ * @return the file descriptor, -1 on error
+ */
+int r_jwt_verifier_get_fd(r_jwt_verifier_t * verifier);
+
+/**
+ * Submits a token to a verifier
+ * The token is copied, the function returns without waiting for the verification
+ * @param verifier: the verifier
+ * @param token: the token to verify
+ * @param token_len: the length of token
+ * @param callback: the function called by r_jwt_verifier_dispatch
+ * when the token is verified
+ * @param user_data: the user data given to callback
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_submit(r_jwt_verifier_t * verifier, const char * token, size_t token_len, r_jwt_verify_callback callback, void * user_data);
+
+/**
+ * Calls the callbacks of the tokens verified since the last call
+ * in the calling thread, and clears the completion events
+ * This function never blocks
+ * @param verifier: the verifier
+ * @return the number of callbacks called
+ */
+size_t r_jwt_verifier_dispatch(r_jwt_verifier_t * verifier);
+
+/**
+ * Stops the workers and frees a verifier
+ * The callbacks of the tokens already verified are called,
+ * the callbacks of the tokens not verified yet are called with the status RHN_ERROR
+ * @param verifier: the verifier to free
+ */
+void r_jwt_verifier_free(r_jwt_verifier_t * verifier);
+
 /**
  * Decrypts the payload of the JWT
  * @param jwt: the jwt_t to decrypt
@@ -3493,6 +4461,73 @@ int r_jwt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_ke
  */
 int r_jwt_validate_claims(jwt_t * jwt, ...);
 
+/**
+ * Initialize a r_claims_policy_t
+ * A r_claims_policy_t is built once with the r_claims_policy_* functions
+ * then used to validate any number of jwt_t with r_jwt_validate_claims_policy,
+ * e.g. one policy per tenant
+ * The r_claims_policy_* functions aren't thread-safe, but
+ * r_jwt_validate_claims_policy may be called by multiple threads
+ * with the same policy once it's built
+ * @param policy: a reference to a r_claims_policy_t * to initialize
+ * @return RHN_OK on success, an error value on error
+ */
+int r_claims_policy_init(r_claims_policy_t ** policy);
+
+/**
+ * Free all the data allocated by a r_claims_policy_t
+ * @param policy: the r_claims_policy_t * to free
+ */
+void r_claims_policy_free(r_claims_policy_t * policy);
+
+/**
+ * Adds an allowed value for a claim to a r_claims_policy_t
+ * If at least one value is added for a claim, the claim is required
+ * and its value must be one of the allowed values
+ * If the claim "aud" is an array, at least one of its values must be allowed
+ * @param policy: the r_claims_policy_t * to update
+ * @param claim: the claim, values available are R_JWT_CLAIM_ISS, R_JWT_CLAIM_SUB or R_JWT_CLAIM_AUD
+ * @param value: the allowed value
+ * @return RHN_OK on success, an error value on error
+ */
+int r_claims_policy_add_value(r_claims_policy_t * policy, rhn_claim_opt claim, const char * value);
+
+/**
+ * Sets a claim as required in a r_claims_policy_t
+ * @param policy: the r_claims_policy_t * to update
+ * @param claim: the claim, values available are R_JWT_CLAIM_ISS, R_JWT_CLAIM_SUB,
+ * R_JWT_CLAIM_AUD, R_JWT_CLAIM_EXP, R_JWT_CLAIM_NBF, R_JWT_CLAIM_IAT or R_JWT_CLAIM_JTI
+ * @return RHN_OK on success, an error value on error
+ */
+int r_claims_policy_set_required(r_claims_policy_t * policy, rhn_claim_opt claim);
+
+/**
+ * Sets the clock skew allowed when the claims "exp", "nbf" and "iat" are checked
+ * @param policy: the r_claims_policy_t * to update
+ * @param leeway: the clock skew allowed in seconds, default 0
+ * @return RHN_OK on success, an error value on error
+ */
+int r_claims_policy_set_leeway(r_claims_policy_t * policy, unsigned int leeway);
+
+/**
+ * Sets the expected header value "typ" in a r_claims_policy_t
+ * @param policy: the r_claims_policy_t * to update
+ * @param typ: the expected value, NULL to accept any value
+ * @return RHN_OK on success, an error value on error
+ */
+int r_claims_policy_set_typ(r_claims_policy_t * policy, const char * typ);
+
+/**
+ * Validates the jwt claims with a r_claims_policy_t
+ * The claims "exp", "nbf" and "iat" are checked against the current time
+ * with the policy leeway if they are present
+ * @param jwt: the jwt_t to validate
+ * @param policy: the r_claims_policy_t to apply
+ * @return RHN_OK if the claims are valid, RHN_ERROR_PARAM if they aren't,
+ * an error value on error
+ */
+int r_jwt_validate_claims_policy(jwt_t * jwt, const r_claims_policy_t * policy);
+
 /**
  * Set the jwt claims with the list of claims given in parameters
  * The list must end with the claim type R_JWT_CLAIM_NOP
@@ -3541,6 +4576,78 @@ int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_l
 
 int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len, unsigned char ** uncompressed, size_t * uncompressed_len);
 
+int _r_policy_check_token(const r_policy_t * policy, size_t token_len, size_t header_len);
+
+int _r_policy_check_p2c(const r_policy_t * policy, json_int_t p2c);
+
+int _r_policy_check_rsa_bits(const r_policy_t * policy, unsigned int bits);
+
+int _r_policy_check_keys(const r_policy_t * policy, size_t nb_keys_tried);
+
+#define _R_KEY_FINGERPRINT_SIZE 32
+
+// Value of the jwks_*_parse_size members when no token was parsed since the last init or reset
+#define _R_JWKS_PARSE_SIZE_NONE ((size_t)-1)
+
+int _r_jwks_truncate(jwks_t * jwks, size_t size);
+
+int _r_jwk_fingerprint(jwk_t * jwk, int type, unsigned char * fingerprint);
+
+gnutls_pubkey_t _r_jwk_acquire_gnutls_pubkey(jwk_t * jwk, int x5u_flags, unsigned char * fingerprint);
+
+void _r_jwk_release_gnutls_pubkey(gnutls_pubkey_t pubkey, const unsigned char * fingerprint);
+
+gnutls_privkey_t _r_jwk_acquire_gnutls_privkey(jwk_t * jwk, unsigned char * fingerprint);
+
+void _r_jwk_release_gnutls_privkey(gnutls_privkey_t privkey, const unsigned char * fingerprint);
+
+gnutls_hmac_hd_t _r_jwk_acquire_gnutls_hmac(jwk_t * jwk, gnutls_mac_algorithm_t mac, unsigned char * fingerprint);
+
+void _r_jwk_release_gnutls_hmac(gnutls_hmac_hd_t hmac, gnutls_mac_algorithm_t mac, const unsigned char * fingerprint);
+
+void _r_jwe_ecdh_key_cache_flush(void);
+
+void _r_jwks_index_flush(void);
+
+int _r_memcmp_const_time(const unsigned char * a, const unsigned char * b, size_t len);
+
+void _r_arena_enter(r_arena_t * arena);
+
+void _r_arena_leave(r_arena_t * arena);
+
+void * _r_arena_malloc(r_arena_t * arena, size_t size);
+
+void _r_arena_free(r_arena_t * arena, void * ptr);
+
+unsigned char * _r_arena_base64url_decode(r_arena_t * arena, const unsigned char * src, size_t len, size_t * dat_len);
+
+/**
+ * base64url codec with the same semantics as o_base64url_*
+ * The decoded or encoded size is exactly known before the data is processed
+ */
+struct _o_datum;
+
+int _r_base64url_encode(const unsigned char * src, size_t len, unsigned char * dst, size_t * dst_len);
+
+int _r_base64url_decode(const unsigned char * src, size_t len, unsigned char * dst, size_t * dst_len);
+
+int _r_base64url_encode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat);
+
+int _r_base64url_decode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat);
+
+/**
+ * Signs the signing input 'header.payload' with jwk
+ * Returns the base64url encoded signature
+ */
+unsigned char * _r_jws_sign_input(jwk_t * jwk, jwa_alg alg, const unsigned char * signing_input, size_t signing_input_len, int x5u_flags);
+
+/**
+ * Runs task(data, index) for each index in [0, nb_tasks[
+ * on up to nb_threads threads, including the calling thread
+ * Returns when all the tasks are done
+ */
+int _r_parallel_run(unsigned int nb_threads, size_t nb_tasks, void (* task)(void * data, size_t index), void * data);
+
 #endif
 
 #ifdef __cplusplus
@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -39,6 +40,14 @@
 #define _R_PBES_DEFAULT_SALT_LENGTH 8
 #define _R_CURVE_MAX_SIZE 66
 
+#define _R_JWE_STREAM_HEAD          0
+#define _R_JWE_STREAM_CIPHERTEXT    1
+#define _R_JWE_STREAM_TAG           2
+#define _R_JWE_STREAM_DONE          3
+#define _R_JWE_STREAM_ERROR         4
+#define _R_JWE_STREAM_B64_SIZE      ((R_JWE_STREAM_CHUNK_SIZE/3)*4)
+#define _R_JWE_STREAM_HEAD_MAX_SIZE 65536
+
 // AES KeyWrap (includes)
 #if NETTLE_VERSION_NUMBER >= 0x030400
 #include <nettle/hmac.h>
@@ -607,8 +616,8 @@ static json_t * r_jwe_aes_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         break;
       }
       _r_aes_key_wrap(kek, kek_len, jwe->key, jwe->key_len, wrapped_key);
-      if (!o_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error o_base64url_encode wrapped_key");
+      if (!_r_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error _r_base64url_encode wrapped_key");
         *ret = RHN_ERROR;
         break;
       }
@@ -653,8 +662,8 @@ static int r_jwe_aes_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_f
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), NULL, &cipherkey_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), NULL, &cipherkey_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -663,8 +672,8 @@ static int r_jwe_aes_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_f
         ret = RHN_ERROR_INVALID;
         break;
       }
-      if (!o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -721,8 +730,8 @@ static int _r_concat_kdf(jwe_t * jwe, jwa_alg alg, const gnutls_datum_t * Z, gnu
     kdf->size += 4+(unsigned int)alg_id_len;
 
     if (!o_strnullempty(apu)) {
-      if (!o_base64url_decode_alloc((const unsigned char *)apu, o_strlen(apu), &dat_apu)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error o_base64url_decode_alloc apu");
+      if (!_r_base64url_decode_alloc((const unsigned char *)apu, o_strlen(apu), &dat_apu)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error _r_base64url_decode_alloc apu");
         ret = RHN_ERROR;
         break;
       }
@@ -744,8 +753,8 @@ static int _r_concat_kdf(jwe_t * jwe, jwa_alg alg, const gnutls_datum_t * Z, gnu
     kdf->size += (unsigned int)dat_apu.size+4;
 
     if (!o_strnullempty(apv)) {
-      if (!o_base64url_decode_alloc((const unsigned char *)apv, o_strlen(apv), &dat_apv)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error o_base64url_decode apv");
+      if (!_r_base64url_decode_alloc((const unsigned char *)apv, o_strlen(apv), &dat_apv)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error _r_base64url_decode apv");
         ret = RHN_ERROR;
         break;
       }
@@ -808,30 +817,20 @@ static int _r_concat_kdf(jwe_t * jwe, jwa_alg alg, const gnutls_datum_t * Z, gnu
   return ret;
 }
 
-static int _r_ecdh_compute(uint8_t * priv_d, size_t priv_d_size, uint8_t * pub_x, size_t pub_x_size, uint8_t * pub_y, size_t pub_y_size, const struct ecc_curve * curve, gnutls_datum_t * Z) {
+static int _r_ecdh_compute_scalar(const struct ecc_scalar * priv, uint8_t * pub_x, size_t pub_x_size, uint8_t * pub_y, size_t pub_y_size, const struct ecc_curve * curve, gnutls_datum_t * Z) {
   int ret = RHN_OK;
-  struct ecc_scalar priv;
   struct ecc_point pub, r;
-  mpz_t z_priv_d, z_pub_x, z_pub_y, r_x, r_y;
-  uint8_t r_x_u[64] = {0};
-  size_t r_x_u_len = 64;
+  mpz_t z_pub_x, z_pub_y, r_x, r_y;
+  uint8_t r_x_u[66] = {0};
+  size_t r_x_u_len = 66;
 
-  mpz_init(z_priv_d);
   mpz_init(z_pub_x);
   mpz_init(z_pub_y);
   mpz_init(r_x);
   mpz_init(r_y);
-  ecc_scalar_init(&priv, curve);
   ecc_point_init(&pub, curve);
   ecc_point_init(&r, curve);
   do {
-    mpz_import(z_priv_d, priv_d_size, 1, 1, 0, 0, priv_d);
-    if (!ecc_scalar_set(&priv, z_priv_d)) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_compute - Error ecc_scalar_set");
-      ret = RHN_ERROR_INVALID;
-      break;
-    }
-
     mpz_import(z_pub_x, pub_x_size, 1, 1, 0, 0, pub_x);
     mpz_import(z_pub_y, pub_y_size, 1, 1, 0, 0, pub_y);
     if (!ecc_point_set(&pub, z_pub_x, z_pub_y)) {
@@ -840,7 +839,7 @@ static int _r_ecdh_compute(uint8_t * priv_d, size_t priv_d_size, uint8_t * pub_x
       break;
     }
 
-    ecc_point_mul(&r, &priv, &pub);
+    ecc_point_mul(&r, priv, &pub);
     ecc_point_get(&r, r_x, r_y);
 
     mpz_export(r_x_u, &r_x_u_len, 1, 1, 0, 0, r_x);
@@ -854,19 +853,37 @@ static int _r_ecdh_compute(uint8_t * priv_d, size_t priv_d_size, uint8_t * pub_x
     Z->size = (unsigned int)r_x_u_len;
     ret = RHN_OK;
   } while (0);
-  mpz_clear(z_priv_d);
   mpz_clear(z_pub_x);
   mpz_clear(z_pub_y);
   mpz_clear(r_x);
   mpz_clear(r_y);
-  ecc_scalar_clear(&priv);
   ecc_point_clear(&pub);
   ecc_point_clear(&r);
 
   return ret;
 }
 
-static int _r_dh_compute(uint8_t * priv_k, uint8_t * pub_x, size_t crv_size, gnutls_datum_t * Z) {
+static int _r_ecdh_compute(uint8_t * priv_d, size_t priv_d_size, uint8_t * pub_x, size_t pub_x_size, uint8_t * pub_y, size_t pub_y_size, const struct ecc_curve * curve, gnutls_datum_t * Z) {
+  int ret;
+  struct ecc_scalar priv;
+  mpz_t z_priv_d;
+
+  mpz_init(z_priv_d);
+  ecc_scalar_init(&priv, curve);
+  mpz_import(z_priv_d, priv_d_size, 1, 1, 0, 0, priv_d);
+  if (ecc_scalar_set(&priv, z_priv_d)) {
+    ret = _r_ecdh_compute_scalar(&priv, pub_x, pub_x_size, pub_y, pub_y_size, curve, Z);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_compute - Error ecc_scalar_set");
+    ret = RHN_ERROR_INVALID;
+  }
+  mpz_clear(z_priv_d);
+  ecc_scalar_clear(&priv);
+
+  return ret;
+}
+
+static int _r_dh_compute(const uint8_t * priv_k, uint8_t * pub_x, size_t crv_size, gnutls_datum_t * Z) {
   int ret;
   uint8_t q[CURVE448_SIZE] = {0};
 
@@ -888,10 +905,315 @@ static int _r_dh_compute(uint8_t * priv_k, uint8_t * pub_x, size_t crv_size, gnu
   return ret;
 }
 
+/**
+ * Static private keys used to decrypt ECDH-ES tokens, decoded once
+ * An entry holds the nettle scalar for NIST curves or the raw key for X25519 and X448
+ * Entries are indexed by the key fingerprint, so a modified jwk gets a new entry,
+ * they are read-only once built and shared by all threads
+ * An entry evicted or flushed while in use is freed by its last user
+ */
+struct _r_ecdh_key_entry {
+  unsigned char     fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  unsigned int      bits;
+  unsigned long     last_used;
+  unsigned int      refcount;
+  int               detached;
+  int               has_scalar;
+  struct ecc_scalar scalar;
+  uint8_t           d[_R_CURVE_MAX_SIZE];
+  size_t            d_size;
+};
+
+static pthread_mutex_t _r_ecdh_key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct _r_ecdh_key_entry ** _r_ecdh_key_cache = NULL;
+static size_t _r_ecdh_key_cache_size = 0;
+static unsigned long _r_ecdh_key_cache_tick = 0;
+
+static void _r_ecdh_key_entry_free(struct _r_ecdh_key_entry * entry) {
+  if (entry != NULL) {
+    if (entry->has_scalar) {
+      ecc_scalar_clear(&entry->scalar);
+    }
+    gnutls_memset(entry->d, 0, sizeof(entry->d));
+    o_free(entry);
+  }
+}
+
+/**
+ * Decodes the private key d of the jwk
+ * For NIST curves, curve is set and the scalar is built, otherwise the raw key is kept
+ */
+static struct _r_ecdh_key_entry * _r_ecdh_key_entry_build(jwk_t * jwk, unsigned int bits, const struct ecc_curve * curve) {
+  struct _r_ecdh_key_entry * entry;
+  const char * key = r_jwk_get_property_str(jwk, "d");
+  mpz_t z_priv_d;
+  int ret = RHN_OK;
+
+  if ((entry = o_malloc(sizeof(struct _r_ecdh_key_entry))) != NULL) {
+    memset(entry, 0, sizeof(struct _r_ecdh_key_entry));
+    entry->bits = bits;
+    if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &entry->d_size)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_key_entry_build - Error _r_base64url_decode d");
+      ret = RHN_ERROR_PARAM;
+    } else if (!entry->d_size || entry->d_size > _R_CURVE_MAX_SIZE) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_key_entry_build - Invalid d size");
+      ret = RHN_ERROR_PARAM;
+    } else if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), entry->d, &entry->d_size)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_key_entry_build - Error _r_base64url_decode d");
+      ret = RHN_ERROR_PARAM;
+    } else if (curve != NULL) {
+      mpz_init(z_priv_d);
+      ecc_scalar_init(&entry->scalar, curve);
+      entry->has_scalar = 1;
+      mpz_import(z_priv_d, entry->d_size, 1, 1, 0, 0, entry->d);
+      if (!ecc_scalar_set(&entry->scalar, z_priv_d)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_key_entry_build - Error ecc_scalar_set");
+        ret = RHN_ERROR_INVALID;
+      }
+      mpz_clear(z_priv_d);
+    }
+    if (ret != RHN_OK) {
+      _r_ecdh_key_entry_free(entry);
+      entry = NULL;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_key_entry_build - Error allocating resources for entry");
+  }
+  return entry;
+}
+
+/**
+ * Returns the decoded private key of the jwk, from the cache if possible
+ * The entry must be released with _r_ecdh_key_release
+ */
+static struct _r_ecdh_key_entry * _r_ecdh_key_acquire(jwk_t * jwk, unsigned int bits, const struct ecc_curve * curve) {
+  struct _r_ecdh_key_entry * entry = NULL, * new_entry, ** oldest = NULL;
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  int cacheable = (_r_jwk_fingerprint(jwk, R_KEY_TYPE_PRIVATE, fingerprint) == RHN_OK);
+  size_t i;
+
+  if (cacheable) {
+    pthread_mutex_lock(&_r_ecdh_key_cache_lock);
+    for (i=0; _r_ecdh_key_cache!=NULL && i<_r_ecdh_key_cache_size; i++) {
+      if (_r_ecdh_key_cache[i] != NULL && _r_ecdh_key_cache[i]->bits == bits && 0 == memcmp(_r_ecdh_key_cache[i]->fingerprint, fingerprint, _R_KEY_FINGERPRINT_SIZE)) {
+        entry = _r_ecdh_key_cache[i];
+        entry->refcount++;
+        entry->last_used = ++_r_ecdh_key_cache_tick;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&_r_ecdh_key_cache_lock);
+  }
+  if (entry == NULL && (new_entry = _r_ecdh_key_entry_build(jwk, bits, curve)) != NULL) {
+    memcpy(new_entry->fingerprint, fingerprint, _R_KEY_FINGERPRINT_SIZE);
+    new_entry->refcount = 1;
+    new_entry->detached = 1;
+    if (cacheable) {
+      pthread_mutex_lock(&_r_ecdh_key_cache_lock);
+      if (_r_ecdh_key_cache == NULL && (_r_ecdh_key_cache_size = r_jwk_cache_get_size())) {
+        if ((_r_ecdh_key_cache = o_malloc(_r_ecdh_key_cache_size*sizeof(struct _r_ecdh_key_entry *))) != NULL) {
+          memset(_r_ecdh_key_cache, 0, _r_ecdh_key_cache_size*sizeof(struct _r_ecdh_key_entry *));
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_key_acquire - Error allocating resources for _r_ecdh_key_cache");
+        }
+      }
+      for (i=0; _r_ecdh_key_cache!=NULL && i<_r_ecdh_key_cache_size; i++) {
+        if (oldest == NULL || _r_ecdh_key_cache[i] == NULL || (*oldest != NULL && _r_ecdh_key_cache[i]->last_used < (*oldest)->last_used)) {
+          oldest = &_r_ecdh_key_cache[i];
+        }
+      }
+      if (oldest != NULL) {
+        if (*oldest != NULL) {
+          if ((*oldest)->refcount) {
+            (*oldest)->detached = 1;
+          } else {
+            _r_ecdh_key_entry_free(*oldest);
+          }
+        }
+        new_entry->detached = 0;
+        new_entry->last_used = ++_r_ecdh_key_cache_tick;
+        *oldest = new_entry;
+      }
+      pthread_mutex_unlock(&_r_ecdh_key_cache_lock);
+    }
+    entry = new_entry;
+  }
+  return entry;
+}
+
+static void _r_ecdh_key_release(struct _r_ecdh_key_entry * entry) {
+  if (entry != NULL) {
+    pthread_mutex_lock(&_r_ecdh_key_cache_lock);
+    entry->refcount--;
+    if (entry->detached && !entry->refcount) {
+      _r_ecdh_key_entry_free(entry);
+    }
+    pthread_mutex_unlock(&_r_ecdh_key_cache_lock);
+  }
+}
+
 static int _r_compare_likely(size_t src, size_t around) {
   return ((around && src == around-1) || src == around || src == around+1);
 }
 
+/**
+ * Pools of pre-generated ephemeral key pairs, one per curve
+ * A pool is filled by the background thread once an encryption used its curve,
+ * a key pair is removed from the pool when it's handed out so it's used only once
+ */
+struct _r_ecdh_pool_key {
+  jwk_t * jwk_priv;
+  jwk_t * jwk_pub;
+};
+
+struct _r_ecdh_pool {
+  int                       type;
+  unsigned int              bits;
+  int                       active;
+  size_t                    nb_keys;
+  struct _r_ecdh_pool_key * keys;
+};
+
+static struct _r_ecdh_pool _r_ecdh_pools[] = {
+  {R_KEY_TYPE_EC, 256, 0, 0, NULL},
+  {R_KEY_TYPE_EC, 384, 0, 0, NULL},
+  {R_KEY_TYPE_EC, 521, 0, 0, NULL},
+  {R_KEY_TYPE_ECDH, 256, 0, 0, NULL},
+  {R_KEY_TYPE_ECDH, 448, 0, 0, NULL}
+};
+
+#define _R_ECDH_POOL_NB_CURVES (sizeof(_r_ecdh_pools)/sizeof(struct _r_ecdh_pool))
+
+// _r_ecdh_pool_config_lock serializes r_jwe_ecdh_pool_set_size calls, so the thread is started and joined once
+static pthread_mutex_t _r_ecdh_pool_config_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t _r_ecdh_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _r_ecdh_pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t _r_ecdh_pool_thread;
+static size_t _r_ecdh_pool_size = 0;
+static int _r_ecdh_pool_running = 0;
+static int _r_ecdh_pool_stop = 0;
+
+static struct _r_ecdh_pool * _r_ecdh_pool_get(int type, unsigned int bits) {
+  size_t i;
+
+  for (i=0; i<_R_ECDH_POOL_NB_CURVES; i++) {
+    if ((type & _r_ecdh_pools[i].type) && bits == _r_ecdh_pools[i].bits) {
+      return &_r_ecdh_pools[i];
+    }
+  }
+  return NULL;
+}
+
+static void * _r_ecdh_pool_run(void * args) {
+  struct _r_ecdh_pool * pool;
+  jwk_t * jwk_priv, * jwk_pub;
+  size_t i;
+  int type;
+  unsigned int bits;
+  (void)args;
+
+  pthread_mutex_lock(&_r_ecdh_pool_lock);
+  while (!_r_ecdh_pool_stop) {
+    pool = NULL;
+    for (i=0; i<_R_ECDH_POOL_NB_CURVES && pool == NULL; i++) {
+      if (_r_ecdh_pools[i].active && _r_ecdh_pools[i].nb_keys < _r_ecdh_pool_size) {
+        pool = &_r_ecdh_pools[i];
+      }
+    }
+    if (pool == NULL) {
+      pthread_cond_wait(&_r_ecdh_pool_cond, &_r_ecdh_pool_lock);
+    } else {
+      type = pool->type;
+      bits = pool->bits;
+      // The key pair is generated without the lock, so encryptions can take keys meanwhile
+      pthread_mutex_unlock(&_r_ecdh_pool_lock);
+      jwk_priv = NULL;
+      jwk_pub = NULL;
+      if (r_jwk_init(&jwk_priv) != RHN_OK || r_jwk_init(&jwk_pub) != RHN_OK || r_jwk_generate_key_pair(jwk_priv, jwk_pub, type, bits, NULL) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_pool_run - Error generating key pair");
+        r_jwk_free(jwk_priv);
+        r_jwk_free(jwk_pub);
+        jwk_priv = NULL;
+        jwk_pub = NULL;
+      } else {
+        r_jwk_delete_property_str(jwk_pub, "kid");
+      }
+      pthread_mutex_lock(&_r_ecdh_pool_lock);
+      if (jwk_priv == NULL) {
+        // Don't spin on a failing generation
+        pool->active = 0;
+      } else if (!_r_ecdh_pool_stop && pool->nb_keys < _r_ecdh_pool_size) {
+        pool->keys[pool->nb_keys].jwk_priv = jwk_priv;
+        pool->keys[pool->nb_keys].jwk_pub = jwk_pub;
+        pool->nb_keys++;
+      } else {
+        r_jwk_free(jwk_priv);
+        r_jwk_free(jwk_pub);
+      }
+    }
+  }
+  pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  return NULL;
+}
+
+/**
+ * Takes an ephemeral key pair from the pool of the curve
+ * Returns 0 if the pool is empty or disabled, the caller must generate a key pair then
+ */
+static int _r_ecdh_pool_take(int type, unsigned int bits, jwk_t ** jwk_priv, jwk_t ** jwk_pub) {
+  struct _r_ecdh_pool * pool;
+  int ret = 0;
+
+  pthread_mutex_lock(&_r_ecdh_pool_lock);
+  if (_r_ecdh_pool_size && (pool = _r_ecdh_pool_get(type, bits)) != NULL) {
+    if (pool->nb_keys) {
+      pool->nb_keys--;
+      r_jwk_free(*jwk_priv);
+      r_jwk_free(*jwk_pub);
+      *jwk_priv = pool->keys[pool->nb_keys].jwk_priv;
+      *jwk_pub = pool->keys[pool->nb_keys].jwk_pub;
+      pool->keys[pool->nb_keys].jwk_priv = NULL;
+      pool->keys[pool->nb_keys].jwk_pub = NULL;
+      ret = 1;
+    }
+    pool->active = 1;
+    pthread_cond_signal(&_r_ecdh_pool_cond);
+  }
+  pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  return ret;
+}
+
+/**
+ * Stops the background thread and frees the pools
+ * Must be called with _r_ecdh_pool_config_lock
+ */
+static void _r_ecdh_pool_close(void) {
+  size_t i, j;
+
+  pthread_mutex_lock(&_r_ecdh_pool_lock);
+  _r_ecdh_pool_stop = 1;
+  pthread_cond_broadcast(&_r_ecdh_pool_cond);
+  pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  if (_r_ecdh_pool_running) {
+    pthread_join(_r_ecdh_pool_thread, NULL);
+    _r_ecdh_pool_running = 0;
+  }
+  pthread_mutex_lock(&_r_ecdh_pool_lock);
+  for (i=0; i<_R_ECDH_POOL_NB_CURVES; i++) {
+    for (j=0; j<_r_ecdh_pools[i].nb_keys; j++) {
+      r_jwk_free(_r_ecdh_pools[i].keys[j].jwk_priv);
+      r_jwk_free(_r_ecdh_pools[i].keys[j].jwk_pub);
+    }
+    o_free(_r_ecdh_pools[i].keys);
+    _r_ecdh_pools[i].keys = NULL;
+    _r_ecdh_pools[i].nb_keys = 0;
+    _r_ecdh_pools[i].active = 0;
+  }
+  _r_ecdh_pool_size = 0;
+  _r_ecdh_pool_stop = 0;
+  pthread_mutex_unlock(&_r_ecdh_pool_lock);
+}
+
 static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, jwk_t * jwk_priv, int type, unsigned int bits, int x5u_flags, int * ret) {
   int type_priv = 0;
   unsigned int bits_priv = 0;
@@ -933,19 +1255,21 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
     } else {
-      if (r_jwk_init(&jwk_ephemeral) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral");
-        *ret = RHN_ERROR;
-        break;
-      }
+      if (!_r_ecdh_pool_take(type, bits, &jwk_ephemeral, &jwk_ephemeral_pub)) {
+        if (r_jwk_init(&jwk_ephemeral) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral");
+          *ret = RHN_ERROR;
+          break;
+        }
 
-      if (r_jwk_generate_key_pair(jwk_ephemeral, jwk_ephemeral_pub, type&R_KEY_TYPE_EC?R_KEY_TYPE_EC:R_KEY_TYPE_ECDH, bits, NULL) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_generate_key_pair");
-        *ret = RHN_ERROR;
-        break;
-      }
+        if (r_jwk_generate_key_pair(jwk_ephemeral, jwk_ephemeral_pub, type&R_KEY_TYPE_EC?R_KEY_TYPE_EC:R_KEY_TYPE_ECDH, bits, NULL) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_generate_key_pair");
+          *ret = RHN_ERROR;
+          break;
+        }
 
-      r_jwk_delete_property_str(jwk_ephemeral_pub, "kid");
+        r_jwk_delete_property_str(jwk_ephemeral_pub, "kid");
+      }
     }
 
     if (type & R_KEY_TYPE_EC) {
@@ -965,8 +1289,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
       } else {
         key = r_jwk_get_property_str(jwk_ephemeral, "d");
       }
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -977,15 +1301,15 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -996,15 +1320,15 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_pub, "y");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode y (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1015,8 +1339,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode y (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1040,8 +1364,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
       } else {
         key = r_jwk_get_property_str(jwk_ephemeral, "d");
       }
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (eddsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1052,8 +1376,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (eddsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1066,8 +1390,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
 
       pub_x_size = CURVE448_SIZE;
       key = r_jwk_get_property_str(jwk_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (eddsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1078,8 +1402,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (eddsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1129,8 +1453,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
                                            "epk", r_jwk_export_to_json_t(jwk_ephemeral_pub));
     } else {
       _r_aes_key_wrap(derived_key, derived_key_len, jwe->key, jwe->key_len, wrapped_key);
-      if (!o_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_encode wrapped_key");
+      if (!_r_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_encode wrapped_key");
         *ret = RHN_ERROR;
       }
       o_free(jwe->encrypted_key_b64url);
@@ -1156,10 +1480,11 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
   json_t * j_epk = NULL;
   unsigned int epk_bits = 0;
   gnutls_datum_t Z = {NULL, 0}, kdf = {NULL, 0};
-  uint8_t derived_key[64] = {0}, key_data[72] = {0}, cipherkey[128] = {0}, priv_k[_R_CURVE_MAX_SIZE] = {0}, pub_x[_R_CURVE_MAX_SIZE] = {0}, pub_y[_R_CURVE_MAX_SIZE] = {0};
-  size_t derived_key_len = 0, cipherkey_len = 0, priv_k_size = 0, pub_x_size = 0, pub_y_size = 0, crv_size = 0;
+  uint8_t derived_key[64] = {0}, key_data[72] = {0}, cipherkey[128] = {0}, pub_x[_R_CURVE_MAX_SIZE] = {0}, pub_y[_R_CURVE_MAX_SIZE] = {0};
+  size_t derived_key_len = 0, cipherkey_len = 0, pub_x_size = 0, pub_y_size = 0, crv_size = 0;
   const char * key = NULL;
   const struct ecc_curve * nettle_curve;
+  struct _r_ecdh_key_entry * priv_key = NULL;
 
   do {
     if ((j_epk = r_jwe_get_header_json_t_value(jwe, "epk")) == NULL) {
@@ -1199,28 +1524,15 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         crv_size = 64;
       }
 
-      key = r_jwk_get_property_str(jwk, "d");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (ecdsa)");
-        ret = RHN_ERROR_PARAM;
-        break;
-      }
-
-      if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Invalid priv_k_size (ecdsa)");
-        ret = RHN_ERROR_PARAM;
-        break;
-      }
-
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (ecdsa)");
+      if ((priv_key = _r_ecdh_key_acquire(jwk, bits, nettle_curve)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_ecdh_key_acquire (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_ephemeral_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1231,15 +1543,15 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_ephemeral_pub, "y");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode y (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1250,14 +1562,14 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode y (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
-      if (_r_ecdh_compute(priv_k, priv_k_size, pub_x, pub_x_size, pub_y, pub_y_size, nettle_curve, &Z) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_ecdh_compute (ecdsa)");
+      if (_r_ecdh_compute_scalar(&priv_key->scalar, pub_x, pub_x_size, pub_y, pub_y_size, nettle_curve, &Z) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_ecdh_compute_scalar (ecdsa)");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -1275,28 +1587,15 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         crv_size = CURVE448_SIZE;
       }
 
-      key = r_jwk_get_property_str(jwk, "d");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (eddsa)");
-        ret = RHN_ERROR_PARAM;
-        break;
-      }
-
-      if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Invalid priv_k_size (eddsa)");
-        ret = RHN_ERROR_PARAM;
-        break;
-      }
-
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (eddsa)");
+      if ((priv_key = _r_ecdh_key_acquire(jwk, bits, NULL)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_ecdh_key_acquire (eddsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_ephemeral_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (eddsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1307,13 +1606,13 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (eddsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
-      if (_r_dh_compute(priv_k, pub_x, crv_size, &Z) != GNUTLS_E_SUCCESS) {
+      if (_r_dh_compute(priv_key->d, pub_x, crv_size, &Z) != GNUTLS_E_SUCCESS) {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_dh_compute (eddsa)");
         ret = RHN_ERROR;
         break;
@@ -1345,7 +1644,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
     if (alg == R_JWA_ALG_ECDH_ES) {
       r_jwe_set_cypher_key(jwe, derived_key, derived_key_len);
     } else {
-      if (o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
+      if (_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
         if (_r_aes_key_unwrap(derived_key, derived_key_len, key_data, cipherkey_len-8, cipherkey)) {
           r_jwe_set_cypher_key(jwe, key_data, cipherkey_len-8);
         } else {
@@ -1353,7 +1652,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
           break;
         }
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode cipherkey");
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR;
         break;
       }
@@ -1362,6 +1661,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
 
   o_free(kdf.data);
   gnutls_free(Z.data);
+  _r_ecdh_key_release(priv_key);
   r_jwk_free(jwk_ephemeral_pub);
   json_decref(j_epk);
 
@@ -1369,6 +1669,80 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
 }
 #endif
 
+int r_jwe_ecdh_pool_set_size(size_t size) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  int ret = RHN_OK;
+  size_t i;
+
+  pthread_mutex_lock(&_r_ecdh_pool_config_lock);
+  _r_ecdh_pool_close();
+  if (size) {
+    pthread_mutex_lock(&_r_ecdh_pool_lock);
+    for (i=0; i<_R_ECDH_POOL_NB_CURVES && ret == RHN_OK; i++) {
+      if ((_r_ecdh_pools[i].keys = o_malloc(size*sizeof(struct _r_ecdh_pool_key))) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_ecdh_pool_set_size - Error allocating resources for keys");
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+    if (ret == RHN_OK) {
+      _r_ecdh_pool_size = size;
+    }
+    pthread_mutex_unlock(&_r_ecdh_pool_lock);
+    if (ret == RHN_OK) {
+      if (!pthread_create(&_r_ecdh_pool_thread, NULL, _r_ecdh_pool_run, NULL)) {
+        _r_ecdh_pool_running = 1;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_ecdh_pool_set_size - Error pthread_create");
+        ret = RHN_ERROR;
+      }
+    }
+    if (ret != RHN_OK) {
+      _r_ecdh_pool_close();
+    }
+  }
+  pthread_mutex_unlock(&_r_ecdh_pool_config_lock);
+  return ret;
+#else
+  return size?RHN_ERROR_UNSUPPORTED:RHN_OK;
+#endif
+}
+
+size_t r_jwe_ecdh_pool_get_size(void) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  size_t size;
+
+  pthread_mutex_lock(&_r_ecdh_pool_lock);
+  size = _r_ecdh_pool_size;
+  pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  return size;
+#else
+  return 0;
+#endif
+}
+
+void _r_jwe_ecdh_key_cache_flush(void) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  size_t i;
+
+  pthread_mutex_lock(&_r_ecdh_key_cache_lock);
+  if (_r_ecdh_key_cache != NULL) {
+    for (i=0; i<_r_ecdh_key_cache_size; i++) {
+      if (_r_ecdh_key_cache[i] != NULL) {
+        if (_r_ecdh_key_cache[i]->refcount) {
+          _r_ecdh_key_cache[i]->detached = 1;
+        } else {
+          _r_ecdh_key_entry_free(_r_ecdh_key_cache[i]);
+        }
+      }
+    }
+    o_free(_r_ecdh_key_cache);
+    _r_ecdh_key_cache = NULL;
+    _r_ecdh_key_cache_size = 0;
+  }
+  pthread_mutex_unlock(&_r_ecdh_key_cache_lock);
+#endif
+}
+
 // PBES2
 #if GNUTLS_VERSION_NUMBER >= 0x03060d
 static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_flags, int * ret) {
@@ -1394,8 +1768,8 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         }
       }
       if ((p2s = r_jwe_get_header_str_value(jwe, "p2s")) != NULL) {
-        if (!o_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error o_base64url_decode_alloc p2s");
+        if (!_r_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error _r_base64url_decode_alloc p2s");
           *ret = RHN_ERROR_PARAM;
           break;
         }
@@ -1425,8 +1799,8 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
           *ret = RHN_ERROR_MEMORY;
           break;
         }
-        if (!o_base64url_encode(salt_seed, _R_PBES_DEFAULT_SALT_LENGTH, salt_seed_b64, &salt_seed_b64_len)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error o_base64url_encode salt_seed");
+        if (!_r_base64url_encode(salt_seed, _R_PBES_DEFAULT_SALT_LENGTH, salt_seed_b64, &salt_seed_b64_len)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error _r_base64url_encode salt_seed");
           *ret = RHN_ERROR;
           break;
         }
@@ -1481,8 +1855,8 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         break;
       }
       _r_aes_key_wrap(kek, kek_len, jwe->key, jwe->key_len, wrapped_key);
-      if (!o_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error o_base64url_encode wrapped_key");
+      if (!_r_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error _r_base64url_encode wrapped_key");
         *ret = RHN_ERROR;
         break;
       }
@@ -1523,14 +1897,20 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
         ret = RHN_ERROR_PARAM;
         break;
       }
+      // The header may come from a recipient of a general serialization, not checked by r_jwe_extract_header
+      if (_r_policy_check_p2c(jwe->policy, r_jwe_get_header_int_value(jwe, "p2c")) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - p2c rejected by policy");
+        ret = RHN_ERROR_INVALID;
+        break;
+      }
       if (!o_strlen(r_jwe_get_header_str_value(jwe, "p2s"))) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error invalid p2s");
         ret = RHN_ERROR_PARAM;
         break;
       }
       p2s = r_jwe_get_header_str_value(jwe, "p2s");
-      if (!o_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error o_base64url_decode_alloc p2s");
+      if (!_r_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error _r_base64url_decode_alloc p2s");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1579,8 +1959,8 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR;
         break;
       }
@@ -1696,14 +2076,14 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
           *ret = RHN_ERROR;
           break;
         }
-        if (!o_base64url_encode_alloc(iv, iv_size, &dat_iv_enc)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_encode_alloc iv");
+        if (!_r_base64url_encode_alloc(iv, iv_size, &dat_iv_enc)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_encode_alloc iv");
           *ret = RHN_ERROR;
           break;
         }
       } else {
-        if (!o_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv_dec)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_decode iv");
+        if (!_r_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv_dec)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_decode iv");
           *ret = RHN_ERROR_PARAM;
           break;
         }
@@ -1734,8 +2114,8 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         *ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_encode(cipherkey, jwe->key_len, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_encode cipherkey");
+      if (!_r_base64url_encode(cipherkey, jwe->key_len, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_encode cipherkey");
         *ret = RHN_ERROR;
         break;
       }
@@ -1744,8 +2124,8 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         *ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_encode tag");
+      if (!_r_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_encode tag");
         *ret = RHN_ERROR;
         break;
       }
@@ -1890,8 +2270,8 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error o_base64url_decode iv");
+      if (!_r_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error _r_base64url_decode iv");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -1900,8 +2280,8 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         ret = RHN_ERROR_INVALID;
         break;
       }
-      if (!o_base64url_decode_alloc((const unsigned char *)jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat_key)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode_alloc((const unsigned char *)jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat_key)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -1924,8 +2304,8 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error o_base64url_encode tag");
+      if (!_r_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error _r_base64url_encode tag");
         ret = RHN_ERROR;
         break;
       }
@@ -1997,6 +2377,10 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
   size_t apu_size = 0, apv_size = 0, iv_size = 0, tag_size = 0, p2s_size = 0;
   json_int_t p2c = 0;
 
+  // Keys imported from the header are removed by r_jwe_reset
+  if (jwe->jwks_pubkey_parse_size == _R_JWKS_PARSE_SIZE_NONE) {
+    jwe->jwks_pubkey_parse_size = r_jwks_size(jwe->jwks_pubkey);
+  }
   if (json_is_object(j_header)) {
     ret = RHN_OK;
 
@@ -2108,8 +2492,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
         } else {
           apu = json_string_value(json_object_get(j_header, "apu"));
           if (!o_strnullempty(apu)) {
-            if (!o_base64url_decode((const unsigned char *)apu, o_strlen(apu), NULL, &apu_size)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode_alloc apu");
+            if (!_r_base64url_decode((const unsigned char *)apu, o_strlen(apu), NULL, &apu_size)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode_alloc apu");
               ret = RHN_ERROR_PARAM;
             }
           } else {
@@ -2126,8 +2510,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
         } else {
           apv = json_string_value(json_object_get(j_header, "apv"));
           if (!o_strnullempty(apv)) {
-            if (!o_base64url_decode((const unsigned char *)apv, o_strlen(apv), NULL, &apv_size)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode apv");
+            if (!_r_base64url_decode((const unsigned char *)apv, o_strlen(apv), NULL, &apv_size)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode apv");
               ret = RHN_ERROR_PARAM;
             }
           } else {
@@ -2145,8 +2529,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
       } else {
         iv = json_string_value(json_object_get(j_header, "iv"));
         if (!o_strnullempty(iv)) {
-          if (!o_base64url_decode((const unsigned char *)iv, o_strlen(iv), NULL, &iv_size) || iv_size != 12) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode iv");
+          if (!_r_base64url_decode((const unsigned char *)iv, o_strlen(iv), NULL, &iv_size) || iv_size != 12) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode iv");
             ret = RHN_ERROR_PARAM;
           }
         } else {
@@ -2161,8 +2545,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
       } else {
         tag = json_string_value(json_object_get(j_header, "tag"));
         if (!o_strnullempty(tag)) {
-          if (!o_base64url_decode((const unsigned char *)tag, o_strlen(tag), NULL, &tag_size) || tag_size != 16) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode tag %zu", tag_size);
+          if (!_r_base64url_decode((const unsigned char *)tag, o_strlen(tag), NULL, &tag_size) || tag_size != 16) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode tag %zu", tag_size);
             ret = RHN_ERROR_PARAM;
           }
         } else {
@@ -2179,8 +2563,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
       } else {
         p2s = json_string_value(json_object_get(j_header, "p2s"));
         if (!o_strnullempty(p2s)) {
-          if (!o_base64url_decode((const unsigned char *)p2s, o_strlen(p2s), NULL, &p2s_size) || p2s_size < 8) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode p2s");
+          if (!_r_base64url_decode((const unsigned char *)p2s, o_strlen(p2s), NULL, &p2s_size) || p2s_size < 8) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode p2s");
             ret = RHN_ERROR_PARAM;
           }
         } else {
@@ -2197,6 +2581,9 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
         if (p2c <= 0) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error invalid p2c value");
           ret = RHN_ERROR_PARAM;
+        } else if (_r_policy_check_p2c(jwe->policy, p2c) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - p2c rejected by policy");
+          ret = RHN_ERROR_PARAM;
         }
       }
     }
@@ -2207,6 +2594,31 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
   return ret;
 }
 
+/**
+ * Sets header_b64url with the base64url encoded header
+ */
+static int r_jwe_set_header_b64url(jwe_t * jwe) {
+  int ret;
+  char * str_header;
+  struct _o_datum dat = {0, NULL};
+
+  if ((str_header = json_dumps(jwe->j_header, JSON_COMPACT)) != NULL) {
+    if (_r_base64url_encode_alloc((const unsigned char *)str_header, o_strlen(str_header), &dat)) {
+      o_free(jwe->header_b64url);
+      jwe->header_b64url = dat.data;
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_header_b64url - Error _r_base64url_encode str_header");
+      ret = RHN_ERROR;
+    }
+    o_free(str_header);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_header_b64url - Error json_dumps j_header");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
 static void r_jwe_remove_padding(unsigned char * text, size_t * text_len, unsigned int block_size) {
   unsigned char pad = text[(*text_len)-1], i;
   int pad_ok = 1;
@@ -2223,41 +2635,81 @@ static void r_jwe_remove_padding(unsigned char * text, size_t * text_len, unsign
   }
 }
 
+/**
+ * Returns the additional authenticated data 'header' or 'header.aad'
+ * allocated in the jwe arena if any
+ */
+static unsigned char * r_jwe_get_aad_input(jwe_t * jwe) {
+  unsigned char * aad;
+  size_t header_len = o_strlen((const char *)jwe->header_b64url), aad_len = 0;
+
+  if (jwe->aad_b64url != NULL && jwe->token_mode != R_JSON_MODE_COMPACT) {
+    aad_len = o_strlen((const char *)jwe->aad_b64url)+1;
+  }
+  if ((aad = _r_arena_malloc(jwe->arena, header_len+aad_len+1)) != NULL) {
+    memcpy(aad, jwe->header_b64url, header_len);
+    if (aad_len) {
+      aad[header_len] = '.';
+      memcpy(aad+header_len+1, jwe->aad_b64url, aad_len-1);
+    }
+    aad[header_len+aad_len] = '\0';
+  }
+  return aad;
+}
+
 static int r_jwe_compute_hmac_tag(jwe_t * jwe, unsigned char * ciphertext, size_t cyphertext_len, const unsigned char * aad, unsigned char * tag, size_t * tag_len) {
   int ret, res;
-  unsigned char al[8], * compute_hmac = NULL;
+  unsigned char al[8], digest[64];
   uint64_t aad_len;
-  size_t hmac_size = 0, aad_size = o_strlen((const char *)aad), i;
+  size_t aad_size = o_strlen((const char *)aad), i;
   gnutls_mac_algorithm_t mac = r_jwe_get_digest_from_enc(jwe->enc);
+  gnutls_hmac_hd_t hmac;
 
-  aad_len = (uint64_t)(o_strlen((const char *)aad)*8);
+  aad_len = (uint64_t)(aad_size*8);
   memset(al, 0, 8);
   for(i = 0; i < 8; i++) {
     al[i] = (uint8_t)((aad_len >> 8*(7 - i)) & 0xFF);
   }
 
-  if ((compute_hmac = o_malloc(aad_size+jwe->iv_len+cyphertext_len+8)) != NULL) {
-    if (aad_size) {
-      memcpy(compute_hmac, aad, aad_size);
-      hmac_size += aad_size;
-    }
-    memcpy(compute_hmac+hmac_size, jwe->iv, jwe->iv_len);
-    hmac_size += jwe->iv_len;
-    memcpy(compute_hmac+hmac_size, ciphertext, cyphertext_len);
-    hmac_size += cyphertext_len;
-    memcpy(compute_hmac+hmac_size, al, 8);
-    hmac_size += 8;
-
-    if (!(res = gnutls_hmac_fast(mac, jwe->key, jwe->key_len/2, compute_hmac, hmac_size, tag))) {
+  // The mac input is aad || iv || ciphertext || al, each part is given to the hmac handle instead of being copied
+  if (!(res = gnutls_hmac_init(&hmac, mac, jwe->key, jwe->key_len/2))) {
+    if ((!aad_size || !(res = gnutls_hmac(hmac, aad, aad_size))) &&
+        !(res = gnutls_hmac(hmac, jwe->iv, jwe->iv_len)) &&
+        !(res = gnutls_hmac(hmac, ciphertext, cyphertext_len)) &&
+        !(res = gnutls_hmac(hmac, al, 8))) {
+      gnutls_hmac_output(hmac, digest);
       *tag_len = (unsigned)gnutls_hmac_get_len(mac)/2;
+      memcpy(tag, digest, *tag_len);
       ret = RHN_OK;
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error gnutls_hmac_fast: '%s'", gnutls_strerror(res));
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error gnutls_hmac: '%s'", gnutls_strerror(res));
       ret = RHN_ERROR;
     }
-    o_free(compute_hmac);
+    gnutls_hmac_deinit(hmac, NULL);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error gnutls_hmac_init: '%s'", gnutls_strerror(res));
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * Compares the tag with the token tag auth_tag_b64url in constant time
+ */
+static int r_jwe_check_tag(jwe_t * jwe, const unsigned char * tag, size_t tag_len) {
+  unsigned char tag_b64url[2*R_TAG_MAX_SIZE+64];
+  size_t tag_b64url_len = 0;
+  int ret;
+
+  if (tag_len <= 2*R_TAG_MAX_SIZE && _r_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
+    if (tag_b64url_len != o_strlen((const char *)jwe->auth_tag_b64url) || _r_memcmp_const_time(tag_b64url, jwe->auth_tag_b64url, tag_b64url_len)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_check_tag - Invalid tag");
+      ret = RHN_ERROR_INVALID;
+    } else {
+      ret = RHN_OK;
+    }
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error allocating resources for compute_hmac");
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_check_tag - Error _r_base64url_encode tag");
     ret = RHN_ERROR;
   }
   return ret;
@@ -2269,7 +2721,7 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
   unsigned int bits = 0;
   gnutls_pubkey_t g_pub = NULL;
   gnutls_datum_t plainkey, cypherkey = {NULL, 0};
-  unsigned char key[128] = {0};
+  unsigned char key[128] = {0}, fingerprint[_R_KEY_FINGERPRINT_SIZE] = {0};
   size_t key_len = 0, index = 0;
   const char * key_ref = NULL;
   json_t * j_element = NULL, * j_reference, * j_key_ref_array;
@@ -2288,16 +2740,16 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
     case R_JWA_ALG_RSA1_5:
       res = r_jwk_key_type(jwk, &bits, x5u_flags);
       if (res & R_KEY_TYPE_RSA && bits >= 2048) {
-        if (jwk != NULL && (g_pub = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags)) != NULL) {
+        if (jwk != NULL && (g_pub = _r_jwk_acquire_gnutls_pubkey(jwk, x5u_flags, fingerprint)) != NULL) {
           plainkey.data = jwe->key;
           plainkey.size = (unsigned int)jwe->key_len;
           if (!(res = gnutls_pubkey_encrypt_data(g_pub, 0, &plainkey, &cypherkey))) {
-            if (o_base64url_encode_alloc(cypherkey.data, cypherkey.size, &dat)) {
+            if (_r_base64url_encode_alloc(cypherkey.data, cypherkey.size, &dat)) {
               j_return = json_pack("{ss%s{ss}}", "encrypted_key", dat.data, dat.size, "header", "alg", r_jwa_alg_to_str(alg));
               o_free(dat.data);
               dat.data = NULL;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error o_base64url_encode cypherkey_b64");
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error _r_base64url_encode cypherkey_b64");
               *ret = RHN_ERROR;
             }
             gnutls_free(cypherkey.data);
@@ -2309,7 +2761,7 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Unable to export public key");
           *ret = RHN_ERROR;
         }
-        gnutls_pubkey_deinit(g_pub);
+        _r_jwk_release_gnutls_pubkey(g_pub, fingerprint);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error invalid key type (rsa)");
         *ret = RHN_ERROR_PARAM;
@@ -2320,16 +2772,16 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
     case R_JWA_ALG_RSA_OAEP_256:
       res = r_jwk_key_type(jwk, &bits, x5u_flags);
       if (res & R_KEY_TYPE_RSA && bits >= 2048) {
-        if (jwk != NULL && (g_pub = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags)) != NULL) {
+        if (jwk != NULL && (g_pub = _r_jwk_acquire_gnutls_pubkey(jwk, x5u_flags, fingerprint)) != NULL) {
           if ((cyphertext = o_malloc(bits+1)) != NULL) {
             cyphertext_len = bits+1;
             if (_r_rsa_oaep_encrypt(g_pub, alg, jwe->key, jwe->key_len, cyphertext, &cyphertext_len) == RHN_OK) {
-              if (o_base64url_encode_alloc(cyphertext, cyphertext_len, &dat)) {
+              if (_r_base64url_encode_alloc(cyphertext, cyphertext_len, &dat)) {
                 j_return = json_pack("{ss%s{ss}}", "encrypted_key", dat.data, dat.size, "header", "alg", r_jwa_alg_to_str(alg));
                 o_free(dat.data);
                 dat.data = NULL;
               } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error o_base64url_encode cypherkey_b64");
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error _r_base64url_encode cypherkey_b64");
                 *ret = RHN_ERROR;
               }
               gnutls_free(cypherkey.data);
@@ -2346,7 +2798,7 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Unable to export public key");
           *ret = RHN_ERROR;
         }
-        gnutls_pubkey_deinit(g_pub);
+        _r_jwk_release_gnutls_pubkey(g_pub, fingerprint);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error invalid key type (rsa oaep)");
         *ret = RHN_ERROR_PARAM;
@@ -2476,7 +2928,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
   gnutls_datum_t plainkey = {NULL, 0}, cypherkey;
   gnutls_privkey_t g_priv = NULL;
   unsigned int bits = 0;
-  unsigned char * key = NULL;
+  unsigned char * key = NULL, fingerprint[_R_KEY_FINGERPRINT_SIZE] = {0};
   size_t key_len = 0;
   struct _o_datum dat = {0, NULL};
 #if NETTLE_VERSION_NUMBER >= 0x030400
@@ -2488,8 +2940,8 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
     case R_JWA_ALG_RSA1_5:
       res = r_jwk_key_type(jwk, &bits, x5u_flags);
       if (res & R_KEY_TYPE_RSA && res & R_KEY_TYPE_PRIVATE && bits >= 2048) {
-        if (jwk != NULL && !o_strnullempty((const char *)jwe->encrypted_key_b64url) && (g_priv = r_jwk_export_to_gnutls_privkey(jwk)) != NULL) {
-            if (o_base64url_decode_alloc(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat)) {
+        if (jwk != NULL && !o_strnullempty((const char *)jwe->encrypted_key_b64url) && (g_priv = _r_jwk_acquire_gnutls_privkey(jwk, fingerprint)) != NULL) {
+            if ((dat.data = _r_arena_base64url_decode(jwe->arena, jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat.size)) != NULL) {
               cypherkey.size = (unsigned int)dat.size;
               cypherkey.data = dat.data;
               if (!(res = gnutls_privkey_decrypt_data(g_priv, 0, &cypherkey, &plainkey))) {
@@ -2506,17 +2958,17 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
                 y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error gnutls_privkey_decrypt_data: %s", gnutls_strerror(res));
                 ret = RHN_ERROR;
               }
-              o_free(dat.data);
+              _r_arena_free(jwe->arena, dat.data);
               dat.data = NULL;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error o_base64url_decode_alloc encrypted_key_b64url");
+              y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error _r_base64url_decode_alloc encrypted_key_b64url");
               ret = RHN_ERROR_PARAM;
             }
         } else {
           y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error invalid RSA1_5 input parameters");
           ret = RHN_ERROR_PARAM;
         }
-        gnutls_privkey_deinit(g_priv);
+        _r_jwk_release_gnutls_privkey(g_priv, fingerprint);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error invalid key size RSA1_5");
         ret = RHN_ERROR_INVALID;
@@ -2527,9 +2979,9 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
     case R_JWA_ALG_RSA_OAEP_256:
       res = r_jwk_key_type(jwk, &bits, x5u_flags);
       if (res & R_KEY_TYPE_RSA && res & R_KEY_TYPE_PRIVATE && bits >= 2048) {
-        if (jwk != NULL && !o_strnullempty((const char *)jwe->encrypted_key_b64url) && (g_priv = r_jwk_export_to_gnutls_privkey(jwk)) != NULL) {
-          if (o_base64url_decode_alloc(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat)) {
-            if ((clearkey = o_malloc(bits+1)) != NULL) {
+        if (jwk != NULL && !o_strnullempty((const char *)jwe->encrypted_key_b64url) && (g_priv = _r_jwk_acquire_gnutls_privkey(jwk, fingerprint)) != NULL) {
+          if ((dat.data = _r_arena_base64url_decode(jwe->arena, jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat.size)) != NULL) {
+            if ((clearkey = _r_arena_malloc(jwe->arena, bits+1)) != NULL) {
               clearkey_len = bits+1;
               if (_r_rsa_oaep_decrypt(g_priv, alg, dat.data, dat.size, clearkey, &clearkey_len) == RHN_OK) {
                 if (_r_get_key_size(jwe->enc) == clearkey_len) {
@@ -2551,18 +3003,18 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
               y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error o_malloc clearkey");
               ret = RHN_ERROR_MEMORY;
             }
-            o_free(clearkey);
-            o_free(dat.data);
+            _r_arena_free(jwe->arena, clearkey);
+            _r_arena_free(jwe->arena, dat.data);
             dat.data = NULL;
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error o_base64url_decode_alloc encrypted_key_b64url");
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error _r_base64url_decode_alloc encrypted_key_b64url");
             ret = RHN_ERROR_PARAM;
           }
         } else {
           y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error invalid RSA1-OAEP input parameters");
           ret = RHN_ERROR_PARAM;
         }
-        gnutls_privkey_deinit(g_priv);
+        _r_jwk_release_gnutls_privkey(g_priv, fingerprint);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error invalid key size RSA_OAEP");
         ret = RHN_ERROR_INVALID;
@@ -2707,6 +3159,9 @@ int r_jwe_init(jwe_t ** jwe) {
             (*jwe)->payload_len = 0;
             (*jwe)->j_json_serialization = NULL;
             (*jwe)->token_mode = R_JSON_MODE_COMPACT;
+            (*jwe)->jwks_pubkey_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+            (*jwe)->arena = NULL;
+            (*jwe)->policy = NULL;
             ret = RHN_OK;
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_init - Error allocating resources for jwks_privkey");
@@ -2755,31 +3210,104 @@ void r_jwe_free(jwe_t * jwe) {
   }
 }
 
-jwe_t * r_jwe_copy(jwe_t * jwe) {
-  jwe_t * jwe_copy = NULL;
+int r_jwe_reset(jwe_t * jwe) {
+  int ret;
 
   if (jwe != NULL) {
-    if (r_jwe_init(&jwe_copy) == RHN_OK) {
-      jwe_copy->alg = jwe->alg;
-      jwe_copy->enc = jwe->enc;
-      jwe_copy->token_mode = jwe->token_mode;
-      if (r_jwe_set_payload(jwe_copy, jwe->payload, jwe->payload_len) == RHN_OK &&
-          r_jwe_set_iv(jwe_copy, jwe->iv, jwe->iv_len) == RHN_OK &&
-          r_jwe_set_aad(jwe_copy, jwe->aad, jwe->aad_len) == RHN_OK &&
-          r_jwe_set_cypher_key(jwe_copy, jwe->key, jwe->key_len) == RHN_OK &&
-          r_jwe_set_alg(jwe_copy, r_jwe_get_alg(jwe)) == RHN_OK) {
-        jwe_copy->header_b64url = (unsigned char *)o_strdup((const char *)jwe->header_b64url);
-        jwe_copy->encrypted_key_b64url = (unsigned char *)o_strdup((const char *)jwe->encrypted_key_b64url);
-        jwe_copy->ciphertext_b64url = (unsigned char *)o_strdup((const char *)jwe->ciphertext_b64url);
-        jwe_copy->auth_tag_b64url = (unsigned char *)o_strdup((const char *)jwe->auth_tag_b64url);
-        r_jwks_free(jwe_copy->jwks_privkey);
-        jwe_copy->jwks_privkey = r_jwks_copy(jwe->jwks_privkey);
-        r_jwks_free(jwe_copy->jwks_pubkey);
-        jwe_copy->jwks_pubkey = r_jwks_copy(jwe->jwks_pubkey);
-        json_decref(jwe_copy->j_header);
-        jwe_copy->j_header = json_deep_copy(jwe->j_header);
-        jwe_copy->j_unprotected_header = json_deep_copy(jwe->j_unprotected_header);
-        jwe_copy->j_json_serialization = json_deep_copy(jwe->j_json_serialization);
+    o_free(jwe->header_b64url);
+    jwe->header_b64url = NULL;
+    o_free(jwe->encrypted_key_b64url);
+    jwe->encrypted_key_b64url = NULL;
+    o_free(jwe->iv_b64url);
+    jwe->iv_b64url = NULL;
+    o_free(jwe->aad_b64url);
+    jwe->aad_b64url = NULL;
+    o_free(jwe->ciphertext_b64url);
+    jwe->ciphertext_b64url = NULL;
+    o_free(jwe->auth_tag_b64url);
+    jwe->auth_tag_b64url = NULL;
+    json_decref(jwe->j_unprotected_header);
+    jwe->j_unprotected_header = NULL;
+    json_decref(jwe->j_json_serialization);
+    jwe->j_json_serialization = NULL;
+    o_free(jwe->key);
+    jwe->key = NULL;
+    jwe->key_len = 0;
+    o_free(jwe->iv);
+    jwe->iv = NULL;
+    jwe->iv_len = 0;
+    o_free(jwe->aad);
+    jwe->aad = NULL;
+    jwe->aad_len = 0;
+    o_free(jwe->payload);
+    jwe->payload = NULL;
+    jwe->payload_len = 0;
+    jwe->alg = R_JWA_ALG_UNKNOWN;
+    jwe->enc = R_JWA_ENC_UNKNOWN;
+    jwe->token_mode = R_JSON_MODE_COMPACT;
+    if (jwe->jwks_pubkey_parse_size != _R_JWKS_PARSE_SIZE_NONE) {
+      _r_jwks_truncate(jwe->jwks_pubkey, jwe->jwks_pubkey_parse_size);
+      jwe->jwks_pubkey_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+    }
+    if (jwe->j_header != NULL) {
+      json_object_clear(jwe->j_header);
+      ret = RHN_OK;
+    } else if ((jwe->j_header = json_object()) != NULL) {
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_reset - Error allocating resources for j_header");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwe_set_arena(jwe_t * jwe, r_arena_t * arena) {
+  if (jwe != NULL) {
+    jwe->arena = arena;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwe_set_policy(jwe_t * jwe, const r_policy_t * policy) {
+  if (jwe != NULL) {
+    jwe->policy = policy;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+jwe_t * r_jwe_copy(jwe_t * jwe) {
+  jwe_t * jwe_copy = NULL;
+
+  if (jwe != NULL) {
+    if (r_jwe_init(&jwe_copy) == RHN_OK) {
+      jwe_copy->alg = jwe->alg;
+      jwe_copy->enc = jwe->enc;
+      jwe_copy->token_mode = jwe->token_mode;
+      jwe_copy->policy = jwe->policy;
+      if (r_jwe_set_payload(jwe_copy, jwe->payload, jwe->payload_len) == RHN_OK &&
+          r_jwe_set_iv(jwe_copy, jwe->iv, jwe->iv_len) == RHN_OK &&
+          r_jwe_set_aad(jwe_copy, jwe->aad, jwe->aad_len) == RHN_OK &&
+          r_jwe_set_cypher_key(jwe_copy, jwe->key, jwe->key_len) == RHN_OK &&
+          r_jwe_set_alg(jwe_copy, r_jwe_get_alg(jwe)) == RHN_OK) {
+        jwe_copy->header_b64url = (unsigned char *)o_strdup((const char *)jwe->header_b64url);
+        jwe_copy->encrypted_key_b64url = (unsigned char *)o_strdup((const char *)jwe->encrypted_key_b64url);
+        jwe_copy->ciphertext_b64url = (unsigned char *)o_strdup((const char *)jwe->ciphertext_b64url);
+        jwe_copy->auth_tag_b64url = (unsigned char *)o_strdup((const char *)jwe->auth_tag_b64url);
+        r_jwks_free(jwe_copy->jwks_privkey);
+        jwe_copy->jwks_privkey = r_jwks_copy(jwe->jwks_privkey);
+        r_jwks_free(jwe_copy->jwks_pubkey);
+        jwe_copy->jwks_pubkey = r_jwks_copy(jwe->jwks_pubkey);
+        json_decref(jwe_copy->j_header);
+        jwe_copy->j_header = json_deep_copy(jwe->j_header);
+        jwe_copy->j_unprotected_header = json_deep_copy(jwe->j_unprotected_header);
+        jwe_copy->j_json_serialization = json_deep_copy(jwe->j_json_serialization);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_copy - Error setting values");
         r_jwe_free(jwe_copy);
@@ -2898,13 +3426,12 @@ int r_jwe_set_iv(jwe_t * jwe, const unsigned char * iv, size_t iv_len) {
       if ((jwe->iv = o_malloc(iv_len)) != NULL) {
         memcpy(jwe->iv, iv, iv_len);
         jwe->iv_len = iv_len;
-        if (o_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
+        if (_r_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
           o_free(jwe->iv_b64url);
-          jwe->iv_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-          o_free(dat.data);
+          jwe->iv_b64url = dat.data;
           ret = RHN_OK;
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_iv - Error o_base64url_encode_alloc iv");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_iv - Error _r_base64url_encode_alloc iv");
           ret = RHN_ERROR;
         }
         ret = RHN_OK;
@@ -2945,13 +3472,12 @@ int r_jwe_set_aad(jwe_t * jwe, const unsigned char * aad, size_t aad_len) {
       if ((jwe->aad = o_malloc(aad_len)) != NULL) {
         memcpy(jwe->aad, aad, aad_len);
         jwe->aad_len = aad_len;
-        if (o_base64url_encode_alloc(jwe->aad, jwe->aad_len, &dat)) {
+        if (_r_base64url_encode_alloc(jwe->aad, jwe->aad_len, &dat)) {
           o_free(jwe->aad_b64url);
-          jwe->aad_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-          o_free(dat.data);
+          jwe->aad_b64url = dat.data;
           ret = RHN_OK;
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_aad - Error o_base64url_encode_alloc aad");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_aad - Error _r_base64url_encode_alloc aad");
           ret = RHN_ERROR;
         }
         ret = RHN_OK;
@@ -2993,12 +3519,11 @@ int r_jwe_generate_iv(jwe_t * jwe) {
     if (jwe->iv_len) {
       if ((jwe->iv = o_malloc(jwe->iv_len)) != NULL) {
         if (!gnutls_rnd(GNUTLS_RND_NONCE, jwe->iv, jwe->iv_len)) {
-          if (o_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
-            jwe->iv_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-            o_free(dat.data);
+          if (_r_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
+            jwe->iv_b64url = dat.data;
             ret = RHN_OK;
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_generate_iv - Error o_base64url_encode iv_b64");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_generate_iv - Error _r_base64url_encode iv_b64");
             ret = RHN_ERROR;
           }
         } else {
@@ -3415,9 +3940,8 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
   int ret = RHN_OK, res;
   gnutls_cipher_hd_t handle;
   gnutls_datum_t key, iv;
-  unsigned char * ptext = NULL, * text_zip = NULL, * ciphertext_b64url = NULL, tag[128] = {0}, * tag_b64url = NULL, * aad = NULL;
-  size_t ptext_len = 0, ciphertext_b64url_len = 0, tag_len = 0, text_zip_len = 0;
-  char * str_header = NULL;
+  unsigned char * ptext = NULL, * text_zip = NULL, tag[128] = {0}, * aad = NULL;
+  size_t ptext_len = 0, tag_len = 0, text_zip_len = 0;
   int cipher_cbc;
   struct _o_datum dat = {0, NULL};
 
@@ -3432,19 +3956,8 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
       r_jwe_set_enc_header(jwe, jwe->j_header) == RHN_OK) {
     cipher_cbc = (jwe->enc == R_JWA_ENC_A128CBC || jwe->enc == R_JWA_ENC_A192CBC || jwe->enc == R_JWA_ENC_A256CBC);
 
-    if ((str_header = json_dumps(jwe->j_header, JSON_COMPACT)) != NULL) {
-      if (o_base64url_encode_alloc((const unsigned char *)str_header, o_strlen(str_header), &dat)) {
-        o_free(jwe->header_b64url);
-        jwe->header_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-        o_free(dat.data);
-        dat.data = NULL;
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode str_header");
-        ret = RHN_ERROR;
-      }
-      o_free(str_header);
-    } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error json_dumps j_header");
+    if (r_jwe_set_header_b64url(jwe) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error r_jwe_set_header_b64url");
       ret = RHN_ERROR;
     }
 
@@ -3489,19 +4002,15 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
         }
         if (ret == RHN_OK) {
           if (!(res = gnutls_cipher_encrypt(handle, ptext, ptext_len))) {
-            if ((ciphertext_b64url = o_malloc(2*ptext_len)) != NULL) {
-              if (o_base64url_encode(ptext, ptext_len, ciphertext_b64url, &ciphertext_b64url_len)) {
-                o_free(jwe->ciphertext_b64url);
-                jwe->ciphertext_b64url = (unsigned char *)o_strndup((const char *)ciphertext_b64url, ciphertext_b64url_len);
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode ciphertext");
-                ret = RHN_ERROR;
-              }
+            // The encoded ciphertext is allocated once at its exact size
+            if (_r_base64url_encode_alloc(ptext, ptext_len, &dat)) {
+              o_free(jwe->ciphertext_b64url);
+              jwe->ciphertext_b64url = dat.data;
+              dat.data = NULL;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error allocating resources for ciphertext_b64url");
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error _r_base64url_encode_alloc ciphertext");
               ret = RHN_ERROR_MEMORY;
             }
-            o_free(ciphertext_b64url);
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error gnutls_cipher_encrypt: '%s'", gnutls_strerror(res));
             ret = RHN_ERROR;
@@ -3525,20 +4034,13 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
             }
           }
           if (ret == RHN_OK && tag_len) {
-            if ((tag_b64url = o_malloc(tag_len*2)) != NULL) {
-              if (o_base64url_encode_alloc(tag, tag_len, &dat)) {
-                o_free(jwe->auth_tag_b64url);
-                jwe->auth_tag_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-                o_free(dat.data);
-                dat.data = NULL;
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode tag_b64url");
-                ret = RHN_ERROR;
-              }
-              o_free(tag_b64url);
+            if (_r_base64url_encode_alloc(tag, tag_len, &dat)) {
+              o_free(jwe->auth_tag_b64url);
+              jwe->auth_tag_b64url = dat.data;
+              dat.data = NULL;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error allocating resources for tag_b64url");
-              ret = RHN_ERROR_MEMORY;
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error _r_base64url_encode tag_b64url");
+              ret = RHN_ERROR;
             }
           }
         }
@@ -3566,31 +4068,32 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
   unsigned char tag[128];
   size_t tag_len = 0;
   int cipher_cbc;
-  struct _o_datum dat = {0, NULL}, dat_ciph = {0, NULL}, dat_tag = {0, NULL};
+  struct _o_datum dat = {0, NULL}, dat_ciph = {0, NULL};
 
   if (jwe != NULL && jwe->enc != R_JWA_ENC_UNKNOWN && !o_strnullempty((const char *)jwe->ciphertext_b64url) && !o_strnullempty((const char *)jwe->iv_b64url) && jwe->key != NULL && jwe->key_len && jwe->key_len == _r_get_key_size(jwe->enc)) {
+    _r_arena_enter(jwe->arena);
     // Decode iv and payload_b64
     o_free(jwe->iv);
-    if (o_base64url_decode_alloc(jwe->iv_b64url, o_strlen((const char *)jwe->iv_b64url), &dat)) {
+    if ((dat.data = _r_arena_base64url_decode(jwe->arena, jwe->iv_b64url, o_strlen((const char *)jwe->iv_b64url), &dat.size)) != NULL) {
       if ((jwe->iv = o_malloc(dat.size)) != NULL) {
         jwe->iv_len = dat.size;
         memcpy(jwe->iv, dat.data, dat.size);
-        if (o_base64url_decode_alloc(jwe->ciphertext_b64url, o_strlen((const char *)jwe->ciphertext_b64url), &dat_ciph)) {
-          if ((payload_enc = o_malloc(dat_ciph.size)) == NULL) {
+        if ((dat_ciph.data = _r_arena_base64url_decode(jwe->arena, jwe->ciphertext_b64url, o_strlen((const char *)jwe->ciphertext_b64url), &dat_ciph.size)) != NULL) {
+          if ((payload_enc = _r_arena_malloc(jwe->arena, dat_ciph.size)) == NULL) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error allocating resources for payload_enc");
             ret = RHN_ERROR_MEMORY;
           }
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_decode_alloc ciphertext_b64url");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_base64url_decode_alloc ciphertext_b64url");
           ret = RHN_ERROR;
         }
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error reallocating resources for iv");
         ret = RHN_ERROR_MEMORY;
       }
-      o_free(dat.data);
+      _r_arena_free(jwe->arena, dat.data);
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_decode_alloc iv");
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_base64url_decode_alloc iv");
       ret = RHN_ERROR;
     }
 
@@ -3608,83 +4111,79 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
       iv.size = (unsigned int)jwe->iv_len;
       payload_enc_len = dat_ciph.size;
       if (!(res = gnutls_cipher_init(&handle, _r_get_alg_from_enc(jwe->enc), &key, &iv))) {
-        if (jwe->aad_b64url == NULL || jwe->token_mode == R_JSON_MODE_COMPACT) {
-          aad = (unsigned char *)o_strdup((const char *)jwe->header_b64url);
-        } else {
-          aad = (unsigned char *)msprintf("%s.%s", jwe->header_b64url, jwe->aad_b64url);
-        }
-        if (!cipher_cbc && (res = gnutls_cipher_add_auth(handle, aad, o_strlen((const char *)aad)))) {
+        aad = r_jwe_get_aad_input(jwe);
+        if (cipher_cbc) {
+          // Encrypt-then-MAC, the tag is verified before the ciphertext is decrypted
+          if (r_jwe_compute_hmac_tag(jwe, dat_ciph.data, dat_ciph.size, aad, tag, &tag_len) == RHN_OK) {
+            ret = r_jwe_check_tag(jwe, tag, tag_len);
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error r_jwe_compute_hmac_tag");
+            ret = RHN_ERROR;
+          }
+        } else if ((res = gnutls_cipher_add_auth(handle, aad, o_strlen((const char *)aad)))) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error gnutls_cipher_add_auth: '%s'", gnutls_strerror(res));
           ret = RHN_ERROR;
         }
-        if (!(res = gnutls_cipher_decrypt2(handle, dat_ciph.data, dat_ciph.size, payload_enc, payload_enc_len))) {
-          if (cipher_cbc) {
-            r_jwe_remove_padding(payload_enc, &payload_enc_len, (unsigned)gnutls_cipher_get_block_size(_r_get_alg_from_enc(jwe->enc)));
-          }
-          if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
-            if (_r_inflate_payload(payload_enc, payload_enc_len, &unzip, &unzip_len) == RHN_OK) {
-              if (r_jwe_set_payload(jwe, unzip, unzip_len) != RHN_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error r_jwe_set_payload");
+        if (ret == RHN_OK) {
+          if (!(res = gnutls_cipher_decrypt2(handle, dat_ciph.data, dat_ciph.size, payload_enc, payload_enc_len))) {
+            if (!cipher_cbc) {
+              // The payload is set only if the tag is valid
+              tag_len = (unsigned)gnutls_cipher_get_tag_size(_r_get_alg_from_enc(jwe->enc));
+              memset(tag, 0, tag_len);
+              if (!(res = gnutls_cipher_tag(handle, tag, tag_len))) {
+                ret = r_jwe_check_tag(jwe, tag, tag_len);
+              } else {
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error gnutls_cipher_tag: '%s'", gnutls_strerror(res));
                 ret = RHN_ERROR;
               }
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_inflate_payload");
-              ret = RHN_ERROR;
-            }
-            o_free(unzip);
-          } else {
-            if (r_jwe_set_payload(jwe, payload_enc, payload_enc_len) != RHN_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error r_jwe_set_payload");
-              ret = RHN_ERROR;
-            }
-          }
-        } else if (res == GNUTLS_E_DECRYPTION_FAILED) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - decryption failed: '%s'", gnutls_strerror(res));
-          ret = RHN_ERROR_INVALID;
-        } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error gnutls_cipher_decrypt: '%s'", gnutls_strerror(res));
-          ret = RHN_ERROR;
-        }
-        if (ret == RHN_OK) {
-          if (cipher_cbc) {
-            if (r_jwe_compute_hmac_tag(jwe, dat_ciph.data, dat_ciph.size, aad, tag, &tag_len) != RHN_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error r_jwe_compute_hmac_tag");
-              ret = RHN_ERROR;
-            }
-          } else {
-            tag_len = (unsigned)gnutls_cipher_get_tag_size(_r_get_alg_from_enc(jwe->enc));
-            memset(tag, 0, tag_len);
-            if ((res = gnutls_cipher_tag(handle, tag, tag_len))) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error gnutls_cipher_tag: '%s'", gnutls_strerror(res));
-              ret = RHN_ERROR;
+              r_jwe_remove_padding(payload_enc, &payload_enc_len, (unsigned)gnutls_cipher_get_block_size(_r_get_alg_from_enc(jwe->enc)));
             }
-          }
-          if (ret == RHN_OK && tag_len) {
-            if (o_base64url_encode_alloc(tag, tag_len, &dat_tag)) {
-              if (dat_tag.size != o_strlen((const char *)jwe->auth_tag_b64url) || 0 != memcmp(dat_tag.data, jwe->auth_tag_b64url, dat_tag.size)) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Invalid tag");
-                ret = RHN_ERROR_INVALID;
+            if (ret == RHN_OK) {
+              if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
+                if (_r_inflate_payload(payload_enc, payload_enc_len, &unzip, &unzip_len) == RHN_OK) {
+                  if (r_jwe_set_payload(jwe, unzip, unzip_len) != RHN_OK) {
+                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error r_jwe_set_payload");
+                    ret = RHN_ERROR;
+                  }
+                } else {
+                  y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_inflate_payload");
+                  ret = RHN_ERROR;
+                }
+                o_free(unzip);
+              } else {
+                if (r_jwe_set_payload(jwe, payload_enc, payload_enc_len) != RHN_OK) {
+                  y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error r_jwe_set_payload");
+                  ret = RHN_ERROR;
+                }
               }
-              o_free(dat_tag.data);
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_encode_alloc tag");
-              ret = RHN_ERROR;
             }
+          } else if (res == GNUTLS_E_DECRYPTION_FAILED) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - decryption failed: '%s'", gnutls_strerror(res));
+            ret = RHN_ERROR_INVALID;
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error gnutls_cipher_decrypt: '%s'", gnutls_strerror(res));
+            ret = RHN_ERROR;
           }
         }
-        o_free(aad);
+        _r_arena_free(jwe->arena, aad);
         gnutls_cipher_deinit(handle);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error gnutls_cipher_init: '%s'", gnutls_strerror(res));
         ret = RHN_ERROR;
       }
     }
+    if (ret != RHN_OK && payload_enc != NULL) {
+      // The payload may have been decrypted before the tag was found invalid
+      memset(payload_enc, 0, dat_ciph.size);
+    }
+    _r_arena_free(jwe->arena, payload_enc);
+    _r_arena_free(jwe->arena, dat_ciph.data);
+    _r_arena_leave(jwe->arena);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error input parameters");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(payload_enc);
-  o_free(dat_ciph.data);
 
   return ret;
 }
@@ -3829,74 +4328,96 @@ int r_jwe_advanced_compact_parse(jwe_t * jwe, const char * jwe_str, uint32_t par
   return r_jwe_advanced_compact_parsen(jwe, jwe_str, o_strlen(jwe_str), parse_flags, x5u_flags);
 }
 
-int r_jwe_advanced_compact_parsen(jwe_t * jwe, const char * jwe_str, size_t jwe_str_len, uint32_t parse_flags, int x5u_flags) {
+/**
+ * Sets the header, encrypted key and iv of a compact serialization
+ */
+static int r_jwe_set_compact_head(jwe_t * jwe, const char * header_b64url, const char * encrypted_key_b64url, const char * iv_b64url, uint32_t parse_flags, int x5u_flags) {
   int ret;
-  char ** str_array = NULL;
-  char * token = NULL;
-  size_t cypher_key_len = 0, cypher_len = 0, tag_len = 0;
+  size_t cypher_key_len = 0;
   json_t * j_header = NULL;
   struct _o_datum dat_header = {0, NULL}, dat_iv = {0, NULL};
 
-  if (jwe != NULL && jwe_str != NULL && jwe_str_len) {
-    token = o_strndup(jwe_str, jwe_str_len);
-    if (split_string(token, ".", &str_array) == 5 && !o_strnullempty(str_array[0]) && !o_strnullempty(str_array[2]) && !o_strnullempty(str_array[3]) && !o_strnullempty(str_array[4])) {
-      // Check if all elements 0, 2 and 3 are base64url encoded
-      if (o_base64url_decode_alloc((unsigned char *)str_array[0], o_strlen(str_array[0]), &dat_header) &&
-         (o_strnullempty(str_array[1]) || o_base64url_decode((unsigned char *)str_array[1], o_strlen(str_array[1]), NULL, &cypher_key_len)) &&
-          o_base64url_decode_alloc((unsigned char *)str_array[2], o_strlen(str_array[2]), &dat_iv) &&
-          o_base64url_decode((unsigned char *)str_array[3], o_strlen(str_array[3]), NULL, &cypher_len) &&
-          o_base64url_decode((unsigned char *)str_array[4], o_strlen(str_array[4]), NULL, &tag_len)) {
-        ret = RHN_OK;
-        jwe->token_mode = R_JSON_MODE_COMPACT;
-        do {
-          // Decode header
-          if ((j_header = json_loadb((const char *)dat_header.data, dat_header.size, JSON_DECODE_ANY, NULL)) == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - Error json_loadb dat_header");
-            ret = RHN_ERROR_PARAM;
-            break;
-          }
+  // Check if all elements are base64url encoded
+  if ((dat_header.data = _r_arena_base64url_decode(jwe->arena, (const unsigned char *)header_b64url, o_strlen(header_b64url), &dat_header.size)) != NULL &&
+     (o_strnullempty(encrypted_key_b64url) || _r_base64url_decode((const unsigned char *)encrypted_key_b64url, o_strlen(encrypted_key_b64url), NULL, &cypher_key_len)) &&
+      (dat_iv.data = _r_arena_base64url_decode(jwe->arena, (const unsigned char *)iv_b64url, o_strlen(iv_b64url), &dat_iv.size)) != NULL) {
+    ret = RHN_OK;
+    jwe->token_mode = R_JSON_MODE_COMPACT;
+    do {
+      // Decode header
+      if ((j_header = json_loadb((const char *)dat_header.data, dat_header.size, JSON_DECODE_ANY, NULL)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_compact_head - Error json_loadb dat_header");
+        ret = RHN_ERROR_PARAM;
+        break;
+      }
 
-          if (r_jwe_extract_header(jwe, j_header, parse_flags, x5u_flags) != RHN_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - error extracting header params");
-            ret = RHN_ERROR_PARAM;
-            break;
-          }
-          json_decref(jwe->j_header);
+      if (r_jwe_extract_header(jwe, j_header, parse_flags, x5u_flags) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_compact_head - error extracting header params");
+        ret = RHN_ERROR_PARAM;
+        break;
+      }
+      json_decref(jwe->j_header);
 
-          jwe->j_header = json_incref(j_header);
+      jwe->j_header = json_incref(j_header);
 
-          // Decode iv
-          if (r_jwe_set_iv(jwe, dat_iv.data, dat_iv.size) != RHN_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - Error r_jwe_set_iv");
-            ret = RHN_ERROR;
-            break;
-          }
+      // Decode iv
+      if (r_jwe_set_iv(jwe, dat_iv.data, dat_iv.size) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_compact_head - Error r_jwe_set_iv");
+        ret = RHN_ERROR;
+        break;
+      }
 
-          o_free(jwe->header_b64url);
-          jwe->header_b64url = (unsigned char *)o_strdup(str_array[0]);
-          o_free(jwe->aad_b64url);
-          jwe->aad_b64url = (unsigned char *)o_strdup(str_array[0]);
-          o_free(jwe->encrypted_key_b64url);
-          jwe->encrypted_key_b64url = (unsigned char *)o_strdup(str_array[1]);
-          o_free(jwe->iv_b64url);
-          jwe->iv_b64url = (unsigned char *)o_strdup(str_array[2]);
+      o_free(jwe->header_b64url);
+      jwe->header_b64url = (unsigned char *)o_strdup(header_b64url);
+      o_free(jwe->aad_b64url);
+      jwe->aad_b64url = (unsigned char *)o_strdup(header_b64url);
+      o_free(jwe->encrypted_key_b64url);
+      jwe->encrypted_key_b64url = (unsigned char *)o_strdup(encrypted_key_b64url);
+      o_free(jwe->iv_b64url);
+      jwe->iv_b64url = (unsigned char *)o_strdup(iv_b64url);
+    } while (0);
+    json_decref(j_header);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  _r_arena_free(jwe->arena, dat_header.data);
+  _r_arena_free(jwe->arena, dat_iv.data);
+  return ret;
+}
+
+int r_jwe_advanced_compact_parsen(jwe_t * jwe, const char * jwe_str, size_t jwe_str_len, uint32_t parse_flags, int x5u_flags) {
+  int ret;
+  char ** str_array = NULL;
+  char * token = NULL;
+  const char * header_end;
+  size_t cypher_len = 0, tag_len = 0;
+
+  if (jwe != NULL && jwe_str != NULL && jwe_str_len) {
+    _r_arena_enter(jwe->arena);
+    if ((header_end = memchr(jwe_str, '.', jwe_str_len)) != NULL && _r_policy_check_token(jwe->policy, jwe_str_len, (size_t)(header_end - jwe_str)) == RHN_OK &&
+        (token = _r_arena_malloc(jwe->arena, jwe_str_len+1)) != NULL) {
+      memcpy(token, jwe_str, jwe_str_len);
+      token[jwe_str_len] = '\0';
+    }
+    if (token != NULL && split_string(token, ".", &str_array) == 5 && !o_strnullempty(str_array[0]) && !o_strnullempty(str_array[2]) && !o_strnullempty(str_array[3]) && !o_strnullempty(str_array[4])) {
+      // Check if elements 3 and 4 are base64url encoded, elements 0, 1 and 2 are checked by r_jwe_set_compact_head
+      if (_r_base64url_decode((unsigned char *)str_array[3], o_strlen(str_array[3]), NULL, &cypher_len) &&
+          _r_base64url_decode((unsigned char *)str_array[4], o_strlen(str_array[4]), NULL, &tag_len)) {
+        if ((ret = r_jwe_set_compact_head(jwe, str_array[0], str_array[1], str_array[2], parse_flags, x5u_flags)) == RHN_OK) {
           o_free(jwe->ciphertext_b64url);
           jwe->ciphertext_b64url = (unsigned char *)o_strdup(str_array[3]);
           o_free(jwe->auth_tag_b64url);
           jwe->auth_tag_b64url = (unsigned char *)o_strdup(str_array[4]);
-
-        } while (0);
-        json_decref(j_header);
+        }
       } else {
         ret = RHN_ERROR_PARAM;
       }
-      o_free(dat_header.data);
-      o_free(dat_iv.data);
     } else {
       ret = RHN_ERROR_PARAM;
     }
     free_string_array(str_array);
-    o_free(token);
+    _r_arena_free(jwe->arena, token);
+    _r_arena_leave(jwe->arena);
   } else {
     ret = RHN_ERROR_PARAM;
   }
@@ -3908,14 +4429,7 @@ int r_jwe_parse_json_str(jwe_t * jwe, const char * jwe_json_str, int x5u_flags)
 }
 
 int r_jwe_parsen_json_str(jwe_t * jwe, const char * jwe_json_str, size_t jwe_json_str_len, int x5u_flags) {
-  json_t * jwe_json = NULL;
-  int ret;
-
-  jwe_json = json_loadb(jwe_json_str, jwe_json_str_len, JSON_DECODE_ANY, NULL);
-  ret = r_jwe_parse_json_t(jwe, jwe_json, x5u_flags);
-  json_decref(jwe_json);
-
-  return ret;
+  return r_jwe_advanced_parsen_json_str(jwe, jwe_json_str, jwe_json_str_len, R_PARSE_HEADER_ALL, x5u_flags);
 }
 
 int r_jwe_parse_json_t(jwe_t * jwe, json_t * jwe_json, int x5u_flags) {
@@ -3930,9 +4444,14 @@ int r_jwe_advanced_parsen_json_str(jwe_t * jwe, const char * jwe_json_str, size_
   json_t * jwe_json = NULL;
   int ret;
 
-  jwe_json = json_loadb(jwe_json_str, jwe_json_str_len, JSON_DECODE_ANY, NULL);
-  ret = r_jwe_advanced_parse_json_t(jwe, jwe_json, parse_flags, x5u_flags);
-  json_decref(jwe_json);
+  if (jwe != NULL && _r_policy_check_token(jwe->policy, jwe_json_str_len, 0) != RHN_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_advanced_parsen_json_str - Token rejected by policy");
+    ret = RHN_ERROR_PARAM;
+  } else {
+    jwe_json = json_loadb(jwe_json_str, jwe_json_str_len, JSON_DECODE_ANY, NULL);
+    ret = r_jwe_advanced_parse_json_t(jwe, jwe_json, parse_flags, x5u_flags);
+    json_decref(jwe_json);
+  }
 
   return ret;
 }
@@ -3944,6 +4463,7 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
   struct _o_datum dat_header = {0, NULL}, dat_iv = {0, NULL};
 
   if (jwe != NULL && json_is_object(jwe_json)) {
+    _r_arena_enter(jwe->arena);
     if (json_string_length(json_object_get(jwe_json, "protected")) &&
         json_string_length(json_object_get(jwe_json, "iv")) &&
         json_string_length(json_object_get(jwe_json, "ciphertext")) &&
@@ -3983,7 +4503,13 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
           break;
         }
 
-        if (!o_base64url_decode_alloc((unsigned char *)json_string_value(json_object_get(jwe_json, "protected")), json_string_length(json_object_get(jwe_json, "protected")), &dat_header)) {
+        if (_r_policy_check_token(jwe->policy, 0, json_string_length(json_object_get(jwe_json, "protected"))) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Header rejected by policy");
+          ret = RHN_ERROR_PARAM;
+          break;
+        }
+
+        if ((dat_header.data = _r_arena_base64url_decode(jwe->arena, (const unsigned char *)json_string_value(json_object_get(jwe_json, "protected")), json_string_length(json_object_get(jwe_json, "protected")), &dat_header.size)) == NULL) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error invalid protected base64");
           ret = RHN_ERROR_PARAM;
           break;
@@ -4005,8 +4531,8 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
         jwe->j_header = json_incref(j_header);
 
         // Decode iv
-        if (!o_base64url_decode_alloc((unsigned char *)json_string_value(json_object_get(jwe_json, "iv")), json_string_length(json_object_get(jwe_json, "iv")), &dat_iv)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error o_base64url_decode_alloc iv");
+        if ((dat_iv.data = _r_arena_base64url_decode(jwe->arena, (const unsigned char *)json_string_value(json_object_get(jwe_json, "iv")), json_string_length(json_object_get(jwe_json, "iv")), &dat_iv.size)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error _r_base64url_decode_alloc iv");
           ret = RHN_ERROR_PARAM;
           break;
         }
@@ -4023,8 +4549,8 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
 
       } while (0);
       json_decref(j_header);
-      o_free(dat_header.data);
-      o_free(dat_iv.data);
+      _r_arena_free(jwe->arena, dat_header.data);
+      _r_arena_free(jwe->arena, dat_iv.data);
       if (ret == RHN_OK) {
         if (json_array_size(json_object_get(jwe_json, "recipients"))) {
           jwe->token_mode = R_JSON_MODE_GENERAL;
@@ -4034,7 +4560,7 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
               ret = RHN_ERROR_PARAM;
               break;
             } else {
-              if (!o_base64url_decode((const unsigned char*)json_string_value(json_object_get(j_recipient, "encrypted_key")), json_string_length(json_object_get(j_recipient, "encrypted_key")), NULL, &cypher_key_len)) {
+              if (!_r_base64url_decode((const unsigned char*)json_string_value(json_object_get(j_recipient, "encrypted_key")), json_string_length(json_object_get(j_recipient, "encrypted_key")), NULL, &cypher_key_len)) {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error at index %zu, invalid encrypted_key base64 %s", index);
                 ret = RHN_ERROR_PARAM;
                 break;
@@ -4061,6 +4587,7 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error invalid content");
       ret = RHN_ERROR_PARAM;
     }
+    _r_arena_leave(jwe->arena);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error input parameters");
     ret = RHN_ERROR_PARAM;
@@ -4089,27 +4616,256 @@ jwe_t * r_jwe_quick_parsen(const char * jwe_str, size_t jwe_str_len, uint32_t pa
   return jwe;
 }
 
-int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
-  int ret, res;
-  json_t * j_recipient = NULL, * j_header, * j_cur_header;
-  size_t index = 0, i;
-  jwk_t * jwk = NULL, * cur_jwk = NULL;
-  jwa_alg alg;
+static pthread_mutex_t _r_recipients_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int _r_recipients_threads = 1;
 
-  if (jwe != NULL) {
-    if (jwk_privkey != NULL) {
-      jwk = r_jwk_copy(jwk_privkey);
+int r_jwe_set_recipients_threads(unsigned int nb_threads) {
+  if (nb_threads) {
+    pthread_mutex_lock(&_r_recipients_threads_lock);
+    _r_recipients_threads = nb_threads;
+    pthread_mutex_unlock(&_r_recipients_threads_lock);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+unsigned int r_jwe_get_recipients_threads(void) {
+  unsigned int nb_threads;
+
+  pthread_mutex_lock(&_r_recipients_threads_lock);
+  nb_threads = _r_recipients_threads;
+  pthread_mutex_unlock(&_r_recipients_threads_lock);
+  return nb_threads;
+}
+
+/**
+ * Key encryption or decryption of a recipient in general JSON serialization
+ * When the recipients are processed in parallel, jwe is a copy
+ * limited to what the key encryption or decryption uses, so the threads share nothing
+ */
+struct _r_jwe_recipient_task {
+  jwe_t  * jwe;
+  jwk_t  * jwk;
+  jwa_alg  alg;
+  int      x5u_flags;
+  json_t * j_result;
+  int      res;
+};
+
+/**
+ * Decryption candidates, i.e. the (recipient, key) pairs in the order r_jwe_decrypt tries them
+ * winner is the lowest index whose result isn't RHN_ERROR_INVALID,
+ * the candidates after the winner are skipped
+ */
+struct _r_jwe_decrypt_tasks {
+  pthread_mutex_t                lock;
+  size_t                         winner;
+  size_t                         nb_tasks;
+  struct _r_jwe_recipient_task * tasks;
+};
+
+/**
+ * jwk_privkey is the only private key of the copy, the task's key for a decryption,
+ * or the ephemeral key of an ECDH-ES encryption
+ */
+static jwe_t * r_jwe_copy_key_context(jwe_t * jwe, json_t * j_header, const char * encrypted_key_b64url, jwk_t * jwk_privkey) {
+  jwe_t * jwe_copy = NULL;
+
+  if (r_jwe_init(&jwe_copy) == RHN_OK) {
+    jwe_copy->alg = jwe->alg;
+    jwe_copy->enc = jwe->enc;
+    jwe_copy->policy = jwe->policy;
+    if (r_jwe_set_cypher_key(jwe_copy, jwe->key, jwe->key_len) == RHN_OK &&
+        r_jwe_set_full_header_json_t(jwe_copy, j_header!=NULL?j_header:jwe->j_header) == RHN_OK) {
+      jwe_copy->j_unprotected_header = json_deep_copy(jwe->j_unprotected_header);
+      jwe_copy->encrypted_key_b64url = (unsigned char *)o_strdup(encrypted_key_b64url);
+      if (jwk_privkey != NULL && r_jwks_append_jwk(jwe_copy->jwks_privkey, jwk_privkey) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_copy_key_context - Error setting private key");
+        r_jwe_free(jwe_copy);
+        jwe_copy = NULL;
+      }
     } else {
-      if (r_jwe_get_header_str_value(jwe, "kid") != NULL) {
-        jwk = r_jwks_get_by_kid(jwe->jwks_privkey, r_jwe_get_header_str_value(jwe, "kid"));
-      } else if (r_jwks_size(jwe->jwks_privkey) == 1) {
-        jwk = r_jwks_get_at(jwe->jwks_privkey, 0);
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_copy_key_context - Error setting values");
+      r_jwe_free(jwe_copy);
+      jwe_copy = NULL;
+    }
+  }
+  return jwe_copy;
+}
+
+static void r_jwe_key_encryption_task(void * data, size_t index) {
+  struct _r_jwe_recipient_task * task = ((struct _r_jwe_recipient_task *)data)+index;
+
+  if (task->jwe != NULL && task->alg != R_JWA_ALG_UNKNOWN && task->alg != R_JWA_ALG_ECDH_ES) {
+    task->j_result = r_jwe_perform_key_encryption(task->jwe, task->alg, task->jwk, task->x5u_flags, &task->res);
+  }
+}
+
+static void r_jwe_key_decryption_task(void * data, size_t index) {
+  struct _r_jwe_decrypt_tasks * tasks = (struct _r_jwe_decrypt_tasks *)data;
+  struct _r_jwe_recipient_task * task = tasks->tasks+index;
+  int skip;
+
+  pthread_mutex_lock(&tasks->lock);
+  skip = (index > tasks->winner);
+  pthread_mutex_unlock(&tasks->lock);
+  if (!skip && task->jwe != NULL) {
+    task->res = _r_preform_key_decryption(task->jwe, task->alg, task->jwk, task->x5u_flags);
+    if (task->res != RHN_ERROR_INVALID) {
+      pthread_mutex_lock(&tasks->lock);
+      if (index < tasks->winner) {
+        tasks->winner = index;
+      }
+      pthread_mutex_unlock(&tasks->lock);
+    }
+  }
+}
+
+static int r_jwe_decrypt_add_task(struct _r_jwe_decrypt_tasks * tasks, jwe_t * jwe, json_t * j_header, jwa_alg alg, jwk_t * jwk, int x5u_flags) {
+  struct _r_jwe_recipient_task * task;
+
+  if (_r_policy_check_keys(jwe->policy, tasks->nb_tasks) != RHN_OK) {
+    r_jwk_free(jwk);
+    return RHN_OK;
+  }
+  if ((task = o_realloc(tasks->tasks, (tasks->nb_tasks+1)*sizeof(struct _r_jwe_recipient_task))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_add_task - Error allocating resources for tasks");
+    r_jwk_free(jwk);
+    return RHN_ERROR_MEMORY;
+  }
+  tasks->tasks = task;
+  task = tasks->tasks+tasks->nb_tasks;
+  if ((task->jwe = r_jwe_copy_key_context(jwe, j_header, (const char *)jwe->encrypted_key_b64url, jwk)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_add_task - Error copying key context");
+    r_jwk_free(jwk);
+    return RHN_ERROR_MEMORY;
+  }
+  task->jwk = jwk;
+  task->alg = alg;
+  task->x5u_flags = x5u_flags;
+  task->j_result = NULL;
+  task->res = RHN_ERROR;
+  tasks->nb_tasks++;
+  return RHN_OK;
+}
+
+/**
+ * Same as the general JSON serialization case of r_jwe_decrypt,
+ * but all the candidate keys are tried in parallel
+ * The result is the one the sequential loop would return
+ */
+static int r_jwe_decrypt_key_parallel(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags, unsigned int nb_threads) {
+  struct _r_jwe_decrypt_tasks tasks;
+  json_t * j_recipient = NULL, * j_header, * j_cur_header, * j_rec_header;
+  size_t index = 0, i;
+  jwa_alg alg;
+  int ret = RHN_OK, invalid_alg = 0;
+
+  memset(&tasks, 0, sizeof(struct _r_jwe_decrypt_tasks));
+  j_header = r_jwe_get_full_header_json_t(jwe);
+  json_array_foreach(json_object_get(jwe->j_json_serialization, "recipients"), index, j_recipient) {
+    j_rec_header = json_object_get(j_recipient, "header");
+    j_cur_header = json_deep_copy(j_header);
+    json_object_update(j_cur_header, j_rec_header);
+    jwe->encrypted_key_b64url = (unsigned char *)json_string_value(json_object_get(j_recipient, "encrypted_key"));
+    alg = r_jwe_get_alg(jwe);
+    if (json_object_get(jwe->j_unprotected_header, "alg") != NULL) {
+      alg = r_str_to_jwa_alg(json_string_value(json_object_get(jwe->j_unprotected_header, "alg")));
+    }
+    if (json_object_get(j_rec_header, "alg") != NULL) {
+      alg = r_str_to_jwa_alg(json_string_value(json_object_get(j_rec_header, "alg")));
+    }
+    if (alg != R_JWA_ALG_UNKNOWN && alg != R_JWA_ALG_ECDH_ES) {
+      if (jwk_privkey != NULL) {
+        if (r_jwk_get_property_str(jwk_privkey, "kid") == NULL || json_object_get(j_rec_header, "kid") == NULL || 0 == o_strcmp(json_string_value(json_object_get(j_rec_header, "kid")), r_jwk_get_property_str(jwk_privkey, "kid"))) {
+          ret = r_jwe_decrypt_add_task(&tasks, jwe, j_cur_header, alg, r_jwk_copy(jwk_privkey), x5u_flags);
+        }
+      } else if (json_object_get(j_rec_header, "kid") != NULL) {
+        ret = r_jwe_decrypt_add_task(&tasks, jwe, j_cur_header, alg, r_jwks_get_by_kid(jwe->jwks_privkey, json_string_value(json_object_get(j_rec_header, "kid"))), x5u_flags);
+      } else {
+        for (i=0; i<r_jwks_size(jwe->jwks_privkey) && ret == RHN_OK; i++) {
+          ret = r_jwe_decrypt_add_task(&tasks, jwe, j_cur_header, alg, r_jwks_get_at(jwe->jwks_privkey, i), x5u_flags);
+        }
+      }
+    } else if (alg == R_JWA_ALG_ECDH_ES) {
+      y_log_message(Y_LOG_LEVEL_DEBUG, "r_jwe_decrypt_key_parallel - Unsupported algorithm ECDH-ES on general serialization");
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_key_parallel - Invalid alg value at index %zu: %d", index, (alg));
+      invalid_alg = 1;
+    }
+    json_decref(j_cur_header);
+    if (ret != RHN_OK) {
+      break;
+    }
+  }
+  jwe->encrypted_key_b64url = NULL;
+  json_decref(j_header);
+
+  if (ret == RHN_OK) {
+    tasks.winner = tasks.nb_tasks;
+    pthread_mutex_init(&tasks.lock, NULL);
+    _r_parallel_run(nb_threads, tasks.nb_tasks, r_jwe_key_decryption_task, &tasks);
+    pthread_mutex_destroy(&tasks.lock);
+    if (tasks.winner < tasks.nb_tasks) {
+      ret = tasks.tasks[tasks.winner].res;
+      if (ret == RHN_OK) {
+        ret = r_jwe_set_cypher_key(jwe, tasks.tasks[tasks.winner].jwe->key, tasks.tasks[tasks.winner].jwe->key_len);
+      }
+    } else {
+      ret = invalid_alg?RHN_ERROR_PARAM:RHN_ERROR_INVALID;
+    }
+  }
+  for (i=0; i<tasks.nb_tasks; i++) {
+    r_jwe_free(tasks.tasks[i].jwe);
+    r_jwk_free(tasks.tasks[i].jwk);
+  }
+  o_free(tasks.tasks);
+  return ret;
+}
+
+/**
+ * Decrypts the cypher key with a key, unless the policy
+ * maximum number of keys tried is reached
+ */
+static int r_jwe_decrypt_key_policy(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_flags, size_t * nb_keys) {
+  int ret;
+
+  if ((ret = _r_policy_check_keys(jwe->policy, *nb_keys)) == RHN_OK) {
+    (*nb_keys)++;
+    ret = _r_preform_key_decryption(jwe, alg, jwk, x5u_flags);
+  }
+  return ret;
+}
+
+int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
+  int ret, res;
+  json_t * j_recipient = NULL, * j_header, * j_cur_header;
+  size_t index = 0, i, nb_keys = 0;
+  jwk_t * jwk = NULL, * cur_jwk = NULL;
+  jwa_alg alg;
+  unsigned int nb_threads;
+
+  if (jwe != NULL) {
+    if (jwk_privkey != NULL) {
+      jwk = r_jwk_copy(jwk_privkey);
+    } else {
+      if (r_jwe_get_header_str_value(jwe, "kid") != NULL) {
+        jwk = r_jwks_get_by_kid(jwe->jwks_privkey, r_jwe_get_header_str_value(jwe, "kid"));
+      } else if (r_jwks_size(jwe->jwks_privkey) == 1) {
+        jwk = r_jwks_get_at(jwe->jwks_privkey, 0);
       }
     }
   }
 
   if (jwe != NULL) {
-    if (jwe->token_mode == R_JSON_MODE_GENERAL) {
+    _r_arena_enter(jwe->arena);
+    if (jwe->token_mode == R_JSON_MODE_GENERAL && (nb_threads = r_jwe_get_recipients_threads()) > 1) {
+      o_free(jwe->encrypted_key_b64url);
+      if ((ret = r_jwe_decrypt_key_parallel(jwe, jwk_privkey, x5u_flags, nb_threads)) == RHN_OK) {
+        ret = r_jwe_decrypt_payload(jwe);
+      }
+    } else if (jwe->token_mode == R_JSON_MODE_GENERAL) {
       ret = RHN_ERROR_INVALID;
       o_free(jwe->encrypted_key_b64url);
       j_header = r_jwe_get_full_header_json_t(jwe);
@@ -4129,7 +4885,7 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
         if (alg != R_JWA_ALG_UNKNOWN && alg != R_JWA_ALG_ECDH_ES) {
           if (jwk_privkey != NULL) {
             if (r_jwk_get_property_str(jwk_privkey, "kid") == NULL || json_object_get(json_object_get(j_recipient, "header"), "kid") == NULL || 0 == o_strcmp(json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid")), r_jwk_get_property_str(jwk_privkey, "kid"))) {
-              if ((res = _r_preform_key_decryption(jwe, alg, jwk_privkey, x5u_flags)) != RHN_ERROR_INVALID) {
+              if ((res = r_jwe_decrypt_key_policy(jwe, alg, jwk_privkey, x5u_flags, &nb_keys)) != RHN_ERROR_INVALID) {
                 ret = res;
                 break;
               }
@@ -4137,7 +4893,7 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
           } else {
             if (json_object_get(json_object_get(j_recipient, "header"), "kid") != NULL) {
               cur_jwk = r_jwks_get_by_kid(jwe->jwks_privkey, json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid")));
-              if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, x5u_flags)) != RHN_ERROR_INVALID) {
+              if ((res = r_jwe_decrypt_key_policy(jwe, alg, cur_jwk, x5u_flags, &nb_keys)) != RHN_ERROR_INVALID) {
                 ret = res;
                 r_jwk_free(cur_jwk);
                 break;
@@ -4146,7 +4902,7 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
             } else {
               for (i=0; i<r_jwks_size(jwe->jwks_privkey); i++) {
                 cur_jwk = r_jwks_get_at(jwe->jwks_privkey, i);
-                if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, x5u_flags)) != RHN_ERROR_INVALID) {
+                if ((res = r_jwe_decrypt_key_policy(jwe, alg, cur_jwk, x5u_flags, &nb_keys)) != RHN_ERROR_INVALID) {
                   ret = res;
                   r_jwk_free(cur_jwk);
                   break;
@@ -4192,6 +4948,7 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
       r_jwe_set_full_header_json_t(jwe, j_header);
       json_decref(j_header);
     }
+    _r_arena_leave(jwe->arena);
   } else {
     ret = RHN_ERROR_PARAM;
   }
@@ -4199,51 +4956,61 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
   return ret;
 }
 
-char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
-  char * jwe_str = NULL;
+/**
+ * Sets the cypher key and iv, generated if missing, and encrypts the cypher key
+ * before a compact serialization
+ */
+static int r_jwe_prepare_compact(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
   int res = RHN_OK;
   unsigned int bits = 0;
   unsigned char * key = NULL;
   size_t key_len = 0;
 
-  if (jwk_pubkey != NULL && jwe != NULL && jwe->alg == R_JWA_ALG_DIR) {
+  if (jwk_pubkey != NULL && jwe->alg == R_JWA_ALG_DIR) {
     if (r_jwk_key_type(jwk_pubkey, &bits, x5u_flags) & R_KEY_TYPE_SYMMETRIC && bits == _r_get_key_size(jwe->enc)*8) {
       key_len = (size_t)(bits/8);
       if ((key = o_malloc(key_len+4)) != NULL) {
         if (r_jwk_export_to_symmetric_key(jwk_pubkey, key, &key_len) == RHN_OK) {
           res = r_jwe_set_cypher_key(jwe, key, key_len);
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error r_jwk_export_to_symmetric_key");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_prepare_compact - Error r_jwk_export_to_symmetric_key");
           res = RHN_ERROR_MEMORY;
         }
         o_free(key);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error allocating resources for key");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_prepare_compact - Error allocating resources for key");
         res = RHN_ERROR_MEMORY;
       }
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error invalid key type");
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_prepare_compact - Error invalid key type");
       res = RHN_ERROR_PARAM;
     }
-  } else {
-    res = RHN_OK;
   }
 
   if (res == RHN_OK) {
     if (jwe->key == NULL || !jwe->key_len) {
       if (r_jwe_generate_cypher_key(jwe) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error r_jwe_generate_cypher_key");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_prepare_compact - Error r_jwe_generate_cypher_key");
         res = RHN_ERROR;
       }
     }
     if (jwe->iv == NULL || !jwe->iv_len) {
       if (r_jwe_generate_iv(jwe) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error r_jwe_generate_iv");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_prepare_compact - Error r_jwe_generate_iv");
         res = RHN_ERROR;
       }
     }
   }
-  if (res == RHN_OK && r_jwe_set_alg_header(jwe, jwe->j_header) == RHN_OK && r_jwe_encrypt_key(jwe, jwk_pubkey, x5u_flags) == RHN_OK && r_jwe_encrypt_payload(jwe) == RHN_OK) {
+  if (res == RHN_OK && (r_jwe_set_alg_header(jwe, jwe->j_header) != RHN_OK || r_jwe_encrypt_key(jwe, jwk_pubkey, x5u_flags) != RHN_OK)) {
+    res = RHN_ERROR;
+  }
+  return res;
+}
+
+char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
+  char * jwe_str = NULL;
+
+  if (jwe != NULL && r_jwe_prepare_compact(jwe, jwk_pubkey, x5u_flags) == RHN_OK && r_jwe_encrypt_payload(jwe) == RHN_OK) {
     jwe_str = msprintf("%s.%s.%s.%s.%s",
                       jwe->header_b64url,
                       jwe->encrypted_key_b64url!=NULL?(const char *)jwe->encrypted_key_b64url:"",
@@ -4266,11 +5033,13 @@ char * r_jwe_serialize_json_str(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags
 
 json_t * r_jwe_serialize_json_t(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags, int mode) {
   json_t * j_return = NULL, * j_result;
-  jwk_t * jwk = NULL;
+  jwk_t * jwk = NULL, * jwk_priv;
   jwa_alg alg = R_JWA_ALG_NONE;
   const char * kid = NULL;
-  size_t i = 0;
+  size_t i = 0, nb_recipients;
   int res = RHN_OK;
+  unsigned int nb_threads;
+  struct _r_jwe_recipient_task * tasks;
 
   if (jwks_pubkey == NULL) {
     jwks_pubkey = jwe->jwks_pubkey;
@@ -4359,28 +5128,57 @@ json_t * r_jwe_serialize_json_t(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_json_t - Error input parameters");
       }
       //r_jwe_set_header_str_value(jwe, "alg", NULL);
-      for (i=0; i<r_jwks_size(jwks_pubkey); i++) {
-        jwk = r_jwks_get_at(jwks_pubkey, i);
-        kid = r_jwk_get_property_str(jwk, "kid");
-        if ((alg = r_jwe_get_alg(jwe)) == R_JWA_ALG_UNKNOWN || alg == R_JWA_ALG_NONE) {
-          alg = r_str_to_jwa_alg(r_jwk_get_property_str(jwk, "alg"));
+      nb_recipients = r_jwks_size(jwks_pubkey);
+      if ((tasks = o_malloc(nb_recipients*sizeof(struct _r_jwe_recipient_task))) != NULL) {
+        nb_threads = r_jwe_get_recipients_threads();
+        for (i=0; i<nb_recipients; i++) {
+          tasks[i].jwk = r_jwks_get_at(jwks_pubkey, i);
+          if ((tasks[i].alg = r_jwe_get_alg(jwe)) == R_JWA_ALG_UNKNOWN || tasks[i].alg == R_JWA_ALG_NONE) {
+            tasks[i].alg = r_str_to_jwa_alg(r_jwk_get_property_str(tasks[i].jwk, "alg"));
+          }
+          tasks[i].x5u_flags = x5u_flags;
+          tasks[i].j_result = NULL;
+          tasks[i].res = RHN_OK;
+          tasks[i].jwe = jwe;
+          if (tasks[i].alg == R_JWA_ALG_DIR) {
+            // 'dir' sets the content encryption key of jwe
+            nb_threads = 1;
+          }
         }
-        if (alg != R_JWA_ALG_UNKNOWN && alg != R_JWA_ALG_ECDH_ES) {
-          if ((j_result = r_jwe_perform_key_encryption(jwe, alg, jwk, x5u_flags, &res)) != NULL) {
-            if (json_object_get(jwe->j_header, "kid") == NULL && json_object_get(jwe->j_unprotected_header, "kid") == NULL) {
-              json_object_set_new(json_object_get(j_result, "header"), "kid", json_string(r_jwk_get_property_str(jwk, "kid")));
+        // The key encryptions are independent, each thread works on its own copy of the key and the header
+        // ECDH-ES key wrapping uses the private key only if jwks_privkey has a single key
+        for (i=0; nb_threads > 1 && i<nb_recipients; i++) {
+          if (tasks[i].alg != R_JWA_ALG_UNKNOWN && tasks[i].alg != R_JWA_ALG_ECDH_ES) {
+            jwk_priv = r_jwks_size(jwe->jwks_privkey) == 1?r_jwks_get_at(jwe->jwks_privkey, 0):NULL;
+            tasks[i].jwe = r_jwe_copy_key_context(jwe, NULL, NULL, jwk_priv);
+            r_jwk_free(jwk_priv);
+          }
+        }
+        _r_parallel_run(nb_threads, nb_recipients, r_jwe_key_encryption_task, tasks);
+        for (i=0; i<nb_recipients; i++) {
+          if (tasks[i].alg != R_JWA_ALG_UNKNOWN && tasks[i].alg != R_JWA_ALG_ECDH_ES) {
+            if ((j_result = tasks[i].j_result) != NULL) {
+              if (json_object_get(jwe->j_header, "kid") == NULL && json_object_get(jwe->j_unprotected_header, "kid") == NULL) {
+                json_object_set_new(json_object_get(j_result, "header"), "kid", json_string(r_jwk_get_property_str(tasks[i].jwk, "kid")));
+              }
+              json_array_append(json_object_get(j_return, "recipients"), j_result);
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_json_t - Error invalid encryption key at index %zu", i);
             }
-            json_array_append(json_object_get(j_return, "recipients"), j_result);
+            json_decref(j_result);
+          } else if (tasks[i].alg == R_JWA_ALG_ECDH_ES) {
+            y_log_message(Y_LOG_LEVEL_DEBUG, "r_jwe_serialize_json_t - Unsupported algorithm for JWE with multiple recipients");
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_json_t - Error invalid encryption key at index %zu", i);
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_json_t - Error invalid encryption algorithm at index %zu", i);
           }
-          json_decref(j_result);
-        } else if (alg == R_JWA_ALG_ECDH_ES) {
-          y_log_message(Y_LOG_LEVEL_DEBUG, "r_jwe_serialize_json_t - Unsupported algorithm for JWE with multiple recipients");
-        } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_json_t - Error invalid encryption algorithm at index %zu", i);
+          if (tasks[i].jwe != jwe) {
+            r_jwe_free(tasks[i].jwe);
+          }
+          r_jwk_free(tasks[i].jwk);
         }
-        r_jwk_free(jwk);
+        o_free(tasks);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_json_t - Error allocating resources for tasks");
       }
       if (!json_array_size(json_object_get(j_return, "recipients"))) {
         json_decref(j_return);
@@ -4615,3 +5413,608 @@ int r_jwe_set_properties(jwe_t * jwe, ...) {
   }
   return ret;
 }
+
+/**
+ * Stream state, see r_jwe_encrypt_stream_init and r_jwe_decrypt_stream_init
+ * With R_PARSE_STREAM_VERIFIED, the decrypted payload is kept
+ * in plaintext until the tag is verified
+ */
+struct _r_jwe_stream {
+  jwe_t                 * jwe;
+  jwk_t                 * jwk;
+  int                     decrypt;
+  int                     state;
+  int                     cipher_cbc;
+  uint32_t                parse_flags;
+  int                     x5u_flags;
+  gnutls_cipher_hd_t      cipher;
+  gnutls_hmac_hd_t        hmac;
+  uint64_t                aad_len;
+  size_t                  total_len;
+  char                  * head;
+  size_t                  head_len;
+  unsigned int            head_dots;
+  unsigned char           buffer[_R_JWE_STREAM_B64_SIZE+64];
+  size_t                  buffer_len;
+  unsigned char           work[_R_JWE_STREAM_B64_SIZE+64];
+  unsigned char           held[32];
+  size_t                  held_len;
+  unsigned char           tag_b64url[128];
+  size_t                  tag_b64url_len;
+  unsigned char         * plaintext;
+  size_t                  plaintext_len;
+  size_t                  plaintext_size;
+  r_stream_write_callback write_cb;
+  void                  * write_user_data;
+};
+
+/**
+ * Initializes the cipher and the hmac handles of the stream
+ * and authenticates the aad and the iv
+ */
+static int r_jwe_stream_init_cipher(jwe_stream_t * stream) {
+  jwe_t * jwe = stream->jwe;
+  gnutls_datum_t key, iv;
+  gnutls_mac_algorithm_t mac;
+  size_t aad_len = o_strlen((const char *)jwe->header_b64url);
+  int ret = RHN_OK, res;
+
+  stream->cipher_cbc = (jwe->enc == R_JWA_ENC_A128CBC || jwe->enc == R_JWA_ENC_A192CBC || jwe->enc == R_JWA_ENC_A256CBC);
+  if (stream->cipher_cbc) {
+    key.data = jwe->key+(jwe->key_len/2);
+    key.size = (unsigned int)jwe->key_len/2;
+  } else {
+    key.data = jwe->key;
+    key.size = (unsigned int)jwe->key_len;
+  }
+  iv.data = jwe->iv;
+  iv.size = (unsigned int)jwe->iv_len;
+  // A compact serialization has no aad, the additional authenticated data is the header
+  stream->aad_len = (uint64_t)aad_len*8;
+  if ((res = gnutls_cipher_init(&stream->cipher, _r_get_alg_from_enc(jwe->enc), &key, &iv))) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_init_cipher - Error gnutls_cipher_init: '%s'", gnutls_strerror(res));
+    stream->cipher = NULL;
+    ret = RHN_ERROR;
+  } else if (stream->cipher_cbc) {
+    mac = r_jwe_get_digest_from_enc(jwe->enc);
+    if ((res = gnutls_hmac_init(&stream->hmac, mac, jwe->key, jwe->key_len/2))) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_init_cipher - Error gnutls_hmac_init: '%s'", gnutls_strerror(res));
+      stream->hmac = NULL;
+      ret = RHN_ERROR;
+    } else if ((res = gnutls_hmac(stream->hmac, jwe->header_b64url, aad_len)) || (res = gnutls_hmac(stream->hmac, jwe->iv, jwe->iv_len))) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_init_cipher - Error gnutls_hmac: '%s'", gnutls_strerror(res));
+      ret = RHN_ERROR;
+    }
+  } else if ((res = gnutls_cipher_add_auth(stream->cipher, jwe->header_b64url, aad_len))) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_init_cipher - Error gnutls_cipher_add_auth: '%s'", gnutls_strerror(res));
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * Computes the authentication tag once the whole ciphertext is processed
+ */
+static int r_jwe_stream_get_tag(jwe_stream_t * stream, unsigned char * tag, size_t * tag_len) {
+  unsigned char al[8], digest[64];
+  gnutls_mac_algorithm_t mac;
+  int ret = RHN_OK, res;
+  size_t i;
+
+  if (stream->cipher_cbc) {
+    mac = r_jwe_get_digest_from_enc(stream->jwe->enc);
+    for(i = 0; i < 8; i++) {
+      al[i] = (uint8_t)((stream->aad_len >> 8*(7 - i)) & 0xFF);
+    }
+    if (!(res = gnutls_hmac(stream->hmac, al, 8))) {
+      gnutls_hmac_output(stream->hmac, digest);
+      *tag_len = (unsigned)gnutls_hmac_get_len(mac)/2;
+      memcpy(tag, digest, *tag_len);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_get_tag - Error gnutls_hmac: '%s'", gnutls_strerror(res));
+      ret = RHN_ERROR;
+    }
+  } else {
+    *tag_len = (unsigned)gnutls_cipher_get_tag_size(_r_get_alg_from_enc(stream->jwe->enc));
+    memset(tag, 0, *tag_len);
+    if ((res = gnutls_cipher_tag(stream->cipher, tag, *tag_len))) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_get_tag - Error gnutls_cipher_tag: '%s'", gnutls_strerror(res));
+      ret = RHN_ERROR;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Encrypts the pending payload and writes the base64url encoded ciphertext
+ */
+static int r_jwe_stream_encrypt_chunk(jwe_stream_t * stream) {
+  int ret = RHN_OK, res;
+  size_t work_len = 0;
+
+  if (stream->buffer_len) {
+    if ((res = gnutls_cipher_encrypt(stream->cipher, stream->buffer, stream->buffer_len))) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_encrypt_chunk - Error gnutls_cipher_encrypt: '%s'", gnutls_strerror(res));
+      ret = RHN_ERROR;
+    } else if (stream->cipher_cbc && (res = gnutls_hmac(stream->hmac, stream->buffer, stream->buffer_len))) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_encrypt_chunk - Error gnutls_hmac: '%s'", gnutls_strerror(res));
+      ret = RHN_ERROR;
+    } else if (!_r_base64url_encode(stream->buffer, stream->buffer_len, stream->work, &work_len)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_encrypt_chunk - Error _r_base64url_encode");
+      ret = RHN_ERROR;
+    } else {
+      ret = stream->write_cb(stream->write_user_data, stream->work, work_len);
+    }
+    stream->buffer_len = 0;
+  }
+  return ret;
+}
+
+static int r_jwe_stream_encrypt_update(jwe_stream_t * stream, const unsigned char * data, size_t data_len) {
+  int ret = RHN_OK;
+  size_t len;
+
+  while (ret == RHN_OK && data_len) {
+    len = R_JWE_STREAM_CHUNK_SIZE-stream->buffer_len;
+    if (len > data_len) {
+      len = data_len;
+    }
+    memcpy(stream->buffer+stream->buffer_len, data, len);
+    stream->buffer_len += len;
+    stream->total_len += len;
+    data += len;
+    data_len -= len;
+    if (stream->buffer_len == R_JWE_STREAM_CHUNK_SIZE) {
+      ret = r_jwe_stream_encrypt_chunk(stream);
+    }
+  }
+  return ret;
+}
+
+static int r_jwe_stream_encrypt_final(jwe_stream_t * stream) {
+  int ret;
+  unsigned char tag[128] = {0};
+  size_t tag_len = 0, b_size, pad, work_len = 0;
+
+  if (stream->total_len) {
+    if (stream->cipher_cbc) {
+      // Same padding as r_jwe_set_ptext_with_block
+      b_size = (size_t)gnutls_cipher_get_block_size(_r_get_alg_from_enc(stream->jwe->enc));
+      if (stream->buffer_len % b_size) {
+        pad = b_size - (stream->buffer_len % b_size);
+        memset(stream->buffer+stream->buffer_len, (int)pad, pad);
+        stream->buffer_len += pad;
+      }
+    }
+    if ((ret = r_jwe_stream_encrypt_chunk(stream)) == RHN_OK &&
+        (ret = r_jwe_stream_get_tag(stream, tag, &tag_len)) == RHN_OK) {
+      stream->work[0] = '.';
+      if (_r_base64url_encode(tag, tag_len, stream->work+1, &work_len)) {
+        ret = stream->write_cb(stream->write_user_data, stream->work, work_len+1);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_encrypt_final - Error _r_base64url_encode tag");
+        ret = RHN_ERROR;
+      }
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_encrypt_final - Error empty payload");
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+/**
+ * Parses the token head 'header.encrypted_key.iv', decrypts the cypher key
+ * and initializes the cipher
+ */
+static int r_jwe_stream_decrypt_head(jwe_stream_t * stream) {
+  jwe_t * jwe = stream->jwe;
+  jwk_t * jwk = NULL;
+  char ** str_array = NULL;
+  int ret;
+
+  if (split_string(stream->head, ".", &str_array) == 3 && !o_strnullempty(str_array[0]) && !o_strnullempty(str_array[2])) {
+    if (_r_policy_check_token(jwe->policy, 0, o_strlen(str_array[0])) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_head - Header rejected by policy");
+      ret = RHN_ERROR_PARAM;
+    } else if ((ret = r_jwe_set_compact_head(jwe, str_array[0], str_array[1], str_array[2], stream->parse_flags, stream->x5u_flags)) == RHN_OK) {
+      if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_head - zip unsupported in a stream");
+        ret = RHN_ERROR_UNSUPPORTED;
+      } else {
+        if (stream->jwk != NULL) {
+          jwk = r_jwk_copy(stream->jwk);
+        } else if (r_jwe_get_header_str_value(jwe, "kid") != NULL) {
+          jwk = r_jwks_get_by_kid(jwe->jwks_privkey, r_jwe_get_header_str_value(jwe, "kid"));
+        } else if (r_jwks_size(jwe->jwks_privkey) == 1) {
+          jwk = r_jwks_get_at(jwe->jwks_privkey, 0);
+        }
+        if ((ret = r_jwe_decrypt_key(jwe, jwk, stream->x5u_flags)) == RHN_OK) {
+          if (jwe->enc != R_JWA_ENC_UNKNOWN && jwe->key != NULL && jwe->key_len == _r_get_key_size(jwe->enc) && jwe->iv != NULL) {
+            ret = r_jwe_stream_init_cipher(stream);
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_head - Invalid enc or cypher key");
+            ret = RHN_ERROR_PARAM;
+          }
+        } else if (ret != RHN_ERROR_INVALID) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_head - Error r_jwe_decrypt_key");
+        }
+        r_jwk_free(jwk);
+      }
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_head - Invalid token head");
+    ret = RHN_ERROR_PARAM;
+  }
+  free_string_array(str_array);
+  o_free(stream->head);
+  stream->head = NULL;
+  stream->head_len = 0;
+  return ret;
+}
+
+/**
+ * Writes decrypted payload to write_cb, or with R_PARSE_STREAM_VERIFIED
+ * appends it to the plaintext written once the tag is verified
+ */
+static int r_jwe_stream_write_payload(jwe_stream_t * stream, const unsigned char * data, size_t data_len) {
+  int ret = RHN_OK;
+  unsigned char * plaintext;
+  size_t size;
+
+  if (!(stream->parse_flags & R_PARSE_STREAM_VERIFIED)) {
+    ret = stream->write_cb(stream->write_user_data, data, data_len);
+  } else {
+    if (stream->plaintext_len+data_len > stream->plaintext_size) {
+      for (size = stream->plaintext_size?stream->plaintext_size:R_JWE_STREAM_CHUNK_SIZE; size < stream->plaintext_len+data_len; size *= 2);
+      // Not realloc'd, so no copy of the plaintext is left in the released memory
+      if ((plaintext = o_malloc(size)) != NULL) {
+        if (stream->plaintext_len) {
+          memcpy(plaintext, stream->plaintext, stream->plaintext_len);
+          memset(stream->plaintext, 0, stream->plaintext_len);
+        }
+        o_free(stream->plaintext);
+        stream->plaintext = plaintext;
+        stream->plaintext_size = size;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_write_payload - Error allocating resources for plaintext");
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+    if (ret == RHN_OK) {
+      memcpy(stream->plaintext+stream->plaintext_len, data, data_len);
+      stream->plaintext_len += data_len;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Decodes and decrypts the pending ciphertext and writes the payload
+ * With AES-CBC, the last block is held until the end of the ciphertext
+ * because it contains the padding
+ */
+static int r_jwe_stream_decrypt_chunk(jwe_stream_t * stream, int last) {
+  int ret = RHN_OK, res;
+  size_t work_len = 0, b_size = (size_t)gnutls_cipher_get_block_size(_r_get_alg_from_enc(stream->jwe->enc));
+  unsigned char * out;
+
+  if (stream->buffer_len && !_r_base64url_decode(stream->buffer, stream->buffer_len, stream->work, &work_len)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_chunk - Error _r_base64url_decode ciphertext");
+    ret = RHN_ERROR_PARAM;
+  } else if (last && !stream->total_len && !work_len) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_chunk - Error empty ciphertext");
+    ret = RHN_ERROR_PARAM;
+  } else if (stream->cipher_cbc && work_len % b_size) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_chunk - Invalid ciphertext size");
+    ret = RHN_ERROR_INVALID;
+  } else if (stream->cipher_cbc && work_len && (res = gnutls_hmac(stream->hmac, stream->work, work_len))) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_chunk - Error gnutls_hmac: '%s'", gnutls_strerror(res));
+    ret = RHN_ERROR;
+  } else if (work_len && (res = gnutls_cipher_decrypt(stream->cipher, stream->work, work_len))) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_chunk - Error gnutls_cipher_decrypt: '%s'", gnutls_strerror(res));
+    ret = RHN_ERROR;
+  } else {
+    stream->total_len += work_len;
+    if (!stream->cipher_cbc) {
+      if (work_len) {
+        ret = r_jwe_stream_write_payload(stream, stream->work, work_len);
+      }
+    } else {
+      if (stream->held_len && work_len) {
+        ret = r_jwe_stream_write_payload(stream, stream->held, stream->held_len);
+        stream->held_len = 0;
+      }
+      if (ret == RHN_OK) {
+        if (!last) {
+          if ((ret = r_jwe_stream_write_payload(stream, stream->work, work_len-b_size)) == RHN_OK) {
+            memcpy(stream->held, stream->work+work_len-b_size, b_size);
+            stream->held_len = b_size;
+          }
+        } else {
+          if (work_len) {
+            out = stream->work;
+          } else {
+            out = stream->held;
+            work_len = stream->held_len;
+            stream->held_len = 0;
+          }
+          r_jwe_remove_padding(out, &work_len, (unsigned int)b_size);
+          if (work_len) {
+            ret = r_jwe_stream_write_payload(stream, out, work_len);
+          }
+        }
+      }
+    }
+  }
+  stream->buffer_len = 0;
+  return ret;
+}
+
+static int r_jwe_stream_decrypt_update(jwe_stream_t * stream, const unsigned char * data, size_t data_len) {
+  int ret = RHN_OK;
+  const unsigned char * dot;
+  size_t len, n;
+
+  while (ret == RHN_OK && data_len) {
+    if (stream->state == _R_JWE_STREAM_HEAD) {
+      // Accumulates 'header.encrypted_key.iv.'
+      for (len=0; len<data_len && stream->head_dots < 3; len++) {
+        if (data[len] == '.') {
+          stream->head_dots++;
+        }
+      }
+      if (stream->head_len+len > _R_JWE_STREAM_HEAD_MAX_SIZE) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_update - Token head too large");
+        ret = RHN_ERROR_PARAM;
+      } else if ((stream->head = o_realloc(stream->head, stream->head_len+len+1)) != NULL) {
+        memcpy(stream->head+stream->head_len, data, len);
+        stream->head_len += len;
+        stream->head[stream->head_len] = '\0';
+        data += len;
+        data_len -= len;
+        if (stream->head_dots == 3) {
+          stream->head[stream->head_len-1] = '\0';
+          ret = r_jwe_stream_decrypt_head(stream);
+          stream->state = _R_JWE_STREAM_CIPHERTEXT;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_update - Error allocating resources for head");
+        ret = RHN_ERROR_MEMORY;
+      }
+    } else if (stream->state == _R_JWE_STREAM_CIPHERTEXT) {
+      dot = memchr(data, '.', data_len);
+      len = dot!=NULL?(size_t)(dot-data):data_len;
+      while (ret == RHN_OK && len) {
+        n = _R_JWE_STREAM_B64_SIZE-stream->buffer_len;
+        if (n > len) {
+          n = len;
+        }
+        memcpy(stream->buffer+stream->buffer_len, data, n);
+        stream->buffer_len += n;
+        data += n;
+        data_len -= n;
+        len -= n;
+        if (stream->buffer_len == _R_JWE_STREAM_B64_SIZE) {
+          ret = r_jwe_stream_decrypt_chunk(stream, 0);
+        }
+      }
+      if (ret == RHN_OK && dot != NULL) {
+        ret = r_jwe_stream_decrypt_chunk(stream, 1);
+        stream->state = _R_JWE_STREAM_TAG;
+        data++;
+        data_len--;
+      }
+    } else {
+      if (memchr(data, '.', data_len) != NULL || stream->tag_b64url_len+data_len >= sizeof(stream->tag_b64url)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_update - Invalid tag");
+        ret = RHN_ERROR_PARAM;
+      } else {
+        memcpy(stream->tag_b64url+stream->tag_b64url_len, data, data_len);
+        stream->tag_b64url_len += data_len;
+        data_len = 0;
+      }
+    }
+  }
+  return ret;
+}
+
+static int r_jwe_stream_decrypt_final(jwe_stream_t * stream) {
+  int ret;
+  unsigned char tag[128] = {0}, token_tag[128] = {0};
+  size_t tag_len = 0, token_tag_len = 0;
+
+  if (stream->state == _R_JWE_STREAM_TAG && stream->tag_b64url_len && _r_base64url_decode(stream->tag_b64url, stream->tag_b64url_len, NULL, &token_tag_len) && token_tag_len <= sizeof(token_tag)) {
+    if ((ret = r_jwe_stream_get_tag(stream, tag, &tag_len)) == RHN_OK) {
+      _r_base64url_decode(stream->tag_b64url, stream->tag_b64url_len, token_tag, &token_tag_len);
+      if (tag_len != token_tag_len || _r_memcmp_const_time(tag, token_tag, tag_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_final - Invalid tag");
+        ret = RHN_ERROR_INVALID;
+      } else if (stream->plaintext_len) {
+        ret = stream->write_cb(stream->write_user_data, stream->plaintext, stream->plaintext_len);
+      }
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_stream_decrypt_final - Incomplete token");
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwe_encrypt_stream_init(jwe_stream_t ** stream, jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags, r_stream_write_callback write_cb, void * write_user_data) {
+  int ret;
+
+  if (stream != NULL && jwe != NULL && write_cb != NULL) {
+    if ((*stream = o_malloc(sizeof(jwe_stream_t))) != NULL) {
+      memset(*stream, 0, sizeof(jwe_stream_t));
+      (*stream)->jwe = jwe;
+      (*stream)->state = _R_JWE_STREAM_CIPHERTEXT;
+      (*stream)->write_cb = write_cb;
+      (*stream)->write_user_data = write_user_data;
+      if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_stream_init - zip unsupported in a stream");
+        ret = RHN_ERROR_UNSUPPORTED;
+      } else if (r_jwe_prepare_compact(jwe, jwk_pubkey, x5u_flags) != RHN_OK ||
+                 jwe->enc == R_JWA_ENC_UNKNOWN ||
+                 jwe->key_len != _r_get_key_size(jwe->enc) ||
+                 r_jwe_set_enc_header(jwe, jwe->j_header) != RHN_OK ||
+                 r_jwe_set_header_b64url(jwe) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_stream_init - Error preparing jwe");
+        ret = RHN_ERROR_PARAM;
+      } else if ((ret = r_jwe_stream_init_cipher(*stream)) == RHN_OK) {
+        // Writes 'header.encrypted_key.iv.'
+        if ((ret = write_cb(write_user_data, jwe->header_b64url, o_strlen((const char *)jwe->header_b64url))) == RHN_OK &&
+            (ret = write_cb(write_user_data, (const unsigned char *)".", 1)) == RHN_OK &&
+            (jwe->encrypted_key_b64url == NULL || (ret = write_cb(write_user_data, jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url))) == RHN_OK) &&
+            (ret = write_cb(write_user_data, (const unsigned char *)".", 1)) == RHN_OK &&
+            (ret = write_cb(write_user_data, jwe->iv_b64url, o_strlen((const char *)jwe->iv_b64url))) == RHN_OK) {
+          ret = write_cb(write_user_data, (const unsigned char *)".", 1);
+        }
+      }
+      if (ret != RHN_OK) {
+        r_jwe_stream_free(*stream);
+        *stream = NULL;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_stream_init - Error allocating resources for stream");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwe_decrypt_stream_init(jwe_stream_t ** stream, jwe_t * jwe, jwk_t * jwk_privkey, uint32_t parse_flags, int x5u_flags, r_stream_write_callback write_cb, void * write_user_data) {
+  int ret;
+
+  if (stream != NULL && jwe != NULL && write_cb != NULL) {
+    if ((*stream = o_malloc(sizeof(jwe_stream_t))) != NULL) {
+      memset(*stream, 0, sizeof(jwe_stream_t));
+      (*stream)->jwe = jwe;
+      (*stream)->decrypt = 1;
+      (*stream)->state = _R_JWE_STREAM_HEAD;
+      (*stream)->parse_flags = parse_flags;
+      (*stream)->x5u_flags = x5u_flags;
+      (*stream)->write_cb = write_cb;
+      (*stream)->write_user_data = write_user_data;
+      if (jwk_privkey != NULL && ((*stream)->jwk = r_jwk_copy(jwk_privkey)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_stream_init - Error r_jwk_copy");
+        r_jwe_stream_free(*stream);
+        *stream = NULL;
+        ret = RHN_ERROR_MEMORY;
+      } else {
+        ret = RHN_OK;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_stream_init - Error allocating resources for stream");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwe_stream_update(jwe_stream_t * stream, const unsigned char * data, size_t data_len) {
+  int ret;
+
+  if (stream != NULL && (data != NULL || !data_len) && stream->state != _R_JWE_STREAM_DONE && stream->state != _R_JWE_STREAM_ERROR) {
+    if (stream->decrypt) {
+      ret = r_jwe_stream_decrypt_update(stream, data, data_len);
+    } else {
+      ret = r_jwe_stream_encrypt_update(stream, data, data_len);
+    }
+    if (ret != RHN_OK) {
+      stream->state = _R_JWE_STREAM_ERROR;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwe_stream_final(jwe_stream_t * stream) {
+  int ret;
+
+  if (stream != NULL && stream->state != _R_JWE_STREAM_DONE && stream->state != _R_JWE_STREAM_ERROR) {
+    if (stream->decrypt) {
+      ret = r_jwe_stream_decrypt_final(stream);
+    } else {
+      ret = r_jwe_stream_encrypt_final(stream);
+    }
+    stream->state = ret==RHN_OK?_R_JWE_STREAM_DONE:_R_JWE_STREAM_ERROR;
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_jwe_stream_free(jwe_stream_t * stream) {
+  if (stream != NULL) {
+    if (stream->cipher != NULL) {
+      gnutls_cipher_deinit(stream->cipher);
+    }
+    if (stream->hmac != NULL) {
+      gnutls_hmac_deinit(stream->hmac, NULL);
+    }
+    r_jwk_free(stream->jwk);
+    o_free(stream->head);
+    if (stream->plaintext != NULL) {
+      memset(stream->plaintext, 0, stream->plaintext_len);
+      o_free(stream->plaintext);
+    }
+    // The buffers may contain plaintext
+    memset(stream, 0, sizeof(jwe_stream_t));
+    o_free(stream);
+  }
+}
+
+/**
+ * Reads the input from read_cb until its end and ends the stream
+ */
+static int r_jwe_stream_run(jwe_stream_t * stream, r_stream_read_callback read_cb, void * read_user_data) {
+  unsigned char buffer[R_JWE_STREAM_CHUNK_SIZE];
+  size_t data_len = 0;
+  int ret;
+
+  do {
+    if ((ret = read_cb(read_user_data, buffer, R_JWE_STREAM_CHUNK_SIZE, &data_len)) == RHN_OK && data_len) {
+      ret = r_jwe_stream_update(stream, buffer, data_len);
+    }
+  } while (ret == RHN_OK && data_len);
+  if (ret == RHN_OK) {
+    ret = r_jwe_stream_final(stream);
+  }
+  return ret;
+}
+
+int r_jwe_encrypt_stream(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags, r_stream_read_callback read_cb, void * read_user_data, r_stream_write_callback write_cb, void * write_user_data) {
+  jwe_stream_t * stream = NULL;
+  int ret;
+
+  if (read_cb != NULL) {
+    if ((ret = r_jwe_encrypt_stream_init(&stream, jwe, jwk_pubkey, x5u_flags, write_cb, write_user_data)) == RHN_OK) {
+      ret = r_jwe_stream_run(stream, read_cb, read_user_data);
+    }
+    r_jwe_stream_free(stream);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwe_decrypt_stream(jwe_t * jwe, jwk_t * jwk_privkey, uint32_t parse_flags, int x5u_flags, r_stream_read_callback read_cb, void * read_user_data, r_stream_write_callback write_cb, void * write_user_data) {
+  jwe_stream_t * stream = NULL;
+  int ret;
+
+  if (read_cb != NULL) {
+    if ((ret = r_jwe_decrypt_stream_init(&stream, jwe, jwk_privkey, parse_flags, x5u_flags, write_cb, write_user_data)) == RHN_OK) {
+      ret = r_jwe_stream_run(stream, read_cb, read_user_data);
+    }
+    r_jwe_stream_free(stream);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
@@ -21,12 +21,159 @@
  *
  */
 
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 #include <orcania.h>
 #include <yder.h>
 #include <rhonabwy.h>
 
+/**
+ * Smallest jwks indexed by kid, smaller jwks are scanned
+ */
+#define _R_JWKS_INDEX_MIN_SIZE 8
+
 char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type);
 
+/**
+ * The kid indexes are kept in a table outside of the jwks objects,
+ * so the JSON content of a jwks isn't changed by the index
+ * An index is found by the jwks address, its format is {"<kid>": <first position>}
+ * Only jwks of at least _R_JWKS_INDEX_MIN_SIZE keys are indexed,
+ * so freeing or changing a smaller jwks never takes the index lock
+ * The index is trusted only if its size matches the keys array size,
+ * if the key at the indexed position doesn't have the kid, the index is rebuilt
+ * Changing the keys array outside of the r_jwks_* functions is unsupported
+ */
+struct _r_jwks_index {
+  const jwks_t * jwks;
+  size_t         size;
+  json_t       * j_kid;
+};
+
+static pthread_rwlock_t _r_jwks_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct _r_jwks_index * _r_jwks_index_table = NULL;
+static size_t _r_jwks_index_capacity = 0;
+// Read without the lock to skip it when no jwks is indexed, updated with the lock write locked
+static size_t _r_jwks_index_count = 0;
+
+static size_t _r_jwks_index_slot(const jwks_t * jwks, size_t capacity) {
+  return (size_t)(((uintptr_t)jwks >> 4) * (uintptr_t)2654435761u) & (capacity-1);
+}
+
+/**
+ * Returns the index of the jwks, _r_jwks_index_lock must be locked by the caller
+ */
+static struct _r_jwks_index * _r_jwks_index_find(const jwks_t * jwks) {
+  size_t slot;
+
+  if (__atomic_load_n(&_r_jwks_index_count, __ATOMIC_ACQUIRE)) {
+    for (slot = _r_jwks_index_slot(jwks, _r_jwks_index_capacity); _r_jwks_index_table[slot].jwks != NULL; slot = (slot+1) & (_r_jwks_index_capacity-1)) {
+      if (_r_jwks_index_table[slot].jwks == jwks) {
+        return &_r_jwks_index_table[slot];
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Adds an index to the table, _r_jwks_index_lock must be write locked by the caller
+ */
+static int _r_jwks_index_insert(const jwks_t * jwks, size_t size, json_t * j_kid) {
+  struct _r_jwks_index * table, * entry;
+  size_t capacity, slot, i;
+
+  if ((entry = _r_jwks_index_find(jwks)) != NULL) {
+    json_decref(entry->j_kid);
+    entry->size = size;
+    entry->j_kid = j_kid;
+    return RHN_OK;
+  }
+  if ((_r_jwks_index_count+1)*2 > _r_jwks_index_capacity) {
+    capacity = _r_jwks_index_capacity?_r_jwks_index_capacity*2:16;
+    if ((table = o_malloc(capacity*sizeof(struct _r_jwks_index))) == NULL) {
+      json_decref(j_kid);
+      return RHN_ERROR_MEMORY;
+    }
+    memset(table, 0, capacity*sizeof(struct _r_jwks_index));
+    for (i=0; i<_r_jwks_index_capacity; i++) {
+      if (_r_jwks_index_table[i].jwks != NULL) {
+        for (slot = _r_jwks_index_slot(_r_jwks_index_table[i].jwks, capacity); table[slot].jwks != NULL; slot = (slot+1) & (capacity-1));
+        table[slot] = _r_jwks_index_table[i];
+      }
+    }
+    o_free(_r_jwks_index_table);
+    _r_jwks_index_table = table;
+    _r_jwks_index_capacity = capacity;
+  }
+  for (slot = _r_jwks_index_slot(jwks, _r_jwks_index_capacity); _r_jwks_index_table[slot].jwks != NULL; slot = (slot+1) & (_r_jwks_index_capacity-1));
+  _r_jwks_index_table[slot].jwks = jwks;
+  _r_jwks_index_table[slot].size = size;
+  _r_jwks_index_table[slot].j_kid = j_kid;
+  __atomic_add_fetch(&_r_jwks_index_count, 1, __ATOMIC_RELEASE);
+  return RHN_OK;
+}
+
+/**
+ * Removes the index of the jwks if any
+ * size is the keys array size before the change, a smaller jwks can't be indexed
+ * The following entries of the probe sequence are moved back, so no lookup stops early
+ */
+static void _r_jwks_index_drop(const jwks_t * jwks, size_t size) {
+  struct _r_jwks_index * entry;
+  size_t hole, slot, home;
+
+  if (size < _R_JWKS_INDEX_MIN_SIZE || !__atomic_load_n(&_r_jwks_index_count, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  pthread_rwlock_wrlock(&_r_jwks_index_lock);
+  if ((entry = _r_jwks_index_find(jwks)) != NULL) {
+    json_decref(entry->j_kid);
+    hole = (size_t)(entry - _r_jwks_index_table);
+    memset(entry, 0, sizeof(struct _r_jwks_index));
+    __atomic_sub_fetch(&_r_jwks_index_count, 1, __ATOMIC_RELEASE);
+    for (slot = (hole+1) & (_r_jwks_index_capacity-1); _r_jwks_index_table[slot].jwks != NULL; slot = (slot+1) & (_r_jwks_index_capacity-1)) {
+      home = _r_jwks_index_slot(_r_jwks_index_table[slot].jwks, _r_jwks_index_capacity);
+      if (((slot - home) & (_r_jwks_index_capacity-1)) >= ((slot - hole) & (_r_jwks_index_capacity-1))) {
+        _r_jwks_index_table[hole] = _r_jwks_index_table[slot];
+        memset(&_r_jwks_index_table[slot], 0, sizeof(struct _r_jwks_index));
+        hole = slot;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&_r_jwks_index_lock);
+}
+
+static json_t * _r_jwks_build_index(json_t * j_keys) {
+  json_t * j_kid = json_object(), * jwk = NULL;
+  size_t index = 0;
+  const char * kid;
+
+  if (j_kid != NULL) {
+    json_array_foreach(j_keys, index, jwk) {
+      if (!o_strnullempty(kid = r_jwk_get_property_str(jwk, "kid")) && json_object_get(j_kid, kid) == NULL) {
+        json_object_set_new(j_kid, kid, json_integer((json_int_t)index));
+      }
+    }
+  }
+  return j_kid;
+}
+
+void _r_jwks_index_flush(void) {
+  size_t i;
+
+  pthread_rwlock_wrlock(&_r_jwks_index_lock);
+  for (i=0; i<_r_jwks_index_capacity; i++) {
+    json_decref(_r_jwks_index_table[i].j_kid);
+  }
+  o_free(_r_jwks_index_table);
+  _r_jwks_index_table = NULL;
+  _r_jwks_index_capacity = 0;
+  __atomic_store_n(&_r_jwks_index_count, 0, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&_r_jwks_index_lock);
+}
+
 int r_jwks_init(jwks_t ** jwks) {
   int ret;
   if (jwks != NULL) {
@@ -40,6 +187,7 @@ int r_jwks_init(jwks_t ** jwks) {
 
 void r_jwks_free(jwks_t * jwks) {
   if (jwks != NULL) {
+    _r_jwks_index_drop(jwks, r_jwks_size(jwks));
     json_decref(jwks);
   }
 }
@@ -81,13 +229,55 @@ jwk_t * r_jwks_get_at(jwks_t * jwks, size_t index) {
   }
 }
 
+jwk_t * r_jwks_get_at_borrowed(jwks_t * jwks, size_t index) {
+  if (jwks != NULL) {
+    return json_array_get(json_object_get(jwks, "keys"), index);
+  } else {
+    return NULL;
+  }
+}
+
 jwk_t * r_jwks_get_by_kid(jwks_t * jwks, const char * kid) {
-  json_t * jwk = NULL;
-  size_t index = 0;
+  return json_deep_copy(r_jwks_get_by_kid_borrowed(jwks, kid));
+}
+
+jwk_t * r_jwks_get_by_kid_borrowed(jwks_t * jwks, const char * kid) {
+  json_t * jwk = NULL, * j_keys, * j_kid = NULL, * j_position;
+  struct _r_jwks_index * entry;
+  size_t index = 0, size;
+  int indexed = 0;
+
   if (jwks != NULL && !o_strnullempty(kid)) {
-    json_array_foreach(json_object_get(jwks, "keys"), index, jwk) {
+    j_keys = json_object_get(jwks, "keys");
+    if ((size = json_array_size(j_keys)) >= _R_JWKS_INDEX_MIN_SIZE) {
+      pthread_rwlock_rdlock(&_r_jwks_index_lock);
+      if ((entry = _r_jwks_index_find(jwks)) != NULL && entry->size == size) {
+        indexed = 1;
+        if ((j_position = json_object_get(entry->j_kid, kid)) != NULL) {
+          jwk = json_array_get(j_keys, (size_t)json_integer_value(j_position));
+        }
+      }
+      pthread_rwlock_unlock(&_r_jwks_index_lock);
+      // A current index missing the kid is a miss, an unknown kid never costs a scan
+      if (indexed && (jwk == NULL || 0 == o_strcmp(kid, r_jwk_get_property_str(jwk, "kid")))) {
+        return jwk;
+      }
+      // The jwks isn't indexed yet, or the indexed position is stale, the index is rebuilt
+      if ((j_kid = _r_jwks_build_index(j_keys)) != NULL) {
+        jwk = NULL;
+        if ((j_position = json_object_get(j_kid, kid)) != NULL) {
+          jwk = json_array_get(j_keys, (size_t)json_integer_value(j_position));
+        }
+        pthread_rwlock_wrlock(&_r_jwks_index_lock);
+        _r_jwks_index_insert(jwks, size, j_kid);
+        pthread_rwlock_unlock(&_r_jwks_index_lock);
+        return jwk;
+      }
+    }
+    // Small jwks aren't indexed, they are scanned
+    json_array_foreach(j_keys, index, jwk) {
       if (0 == o_strcmp(kid, r_jwk_get_property_str(jwk, "kid"))) {
-        return json_deep_copy(jwk);
+        return jwk;
       }
     }
   }
@@ -103,8 +293,23 @@ jwks_t * r_jwks_copy(jwks_t * jwks) {
 }
 
 int r_jwks_append_jwk(jwks_t * jwks, jwk_t * jwk) {
+  struct _r_jwks_index * entry;
+  const char * kid;
+  size_t size;
+
   if (jwks != NULL) {
     if (!json_array_append(json_object_get(jwks, "keys"), jwk)) {
+      if ((size = r_jwks_size(jwks)) > _R_JWKS_INDEX_MIN_SIZE) {
+        // An existing index is updated, otherwise it's built on the first lookup
+        pthread_rwlock_wrlock(&_r_jwks_index_lock);
+        if ((entry = _r_jwks_index_find(jwks)) != NULL && entry->size+1 == size) {
+          entry->size = size;
+          if (!o_strnullempty(kid = r_jwk_get_property_str(jwk, "kid")) && json_object_get(entry->j_kid, kid) == NULL) {
+            json_object_set_new(entry->j_kid, kid, json_integer((json_int_t)(size-1)));
+          }
+        }
+        pthread_rwlock_unlock(&_r_jwks_index_lock);
+      }
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks append - error json_array_append");
@@ -118,6 +323,7 @@ int r_jwks_append_jwk(jwks_t * jwks, jwk_t * jwk) {
 int r_jwks_set_at(jwks_t * jwks, size_t index, jwk_t * jwk) {
   if (jwks != NULL) {
     if (!json_array_set(json_object_get(jwks, "keys"), index, jwk)) {
+      _r_jwks_index_drop(jwks, r_jwks_size(jwks));
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks append - error json_array_set");
@@ -129,8 +335,11 @@ int r_jwks_set_at(jwks_t * jwks, size_t index, jwk_t * jwk) {
 }
 
 int r_jwks_remove_at(jwks_t * jwks, size_t index) {
+  size_t size = r_jwks_size(jwks);
+
   if (jwks != NULL) {
     if (!json_array_remove(json_object_get(jwks, "keys"), index)) {
+      _r_jwks_index_drop(jwks, size);
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks append - error json_array_remove");
@@ -142,8 +351,11 @@ int r_jwks_remove_at(jwks_t * jwks, size_t index) {
 }
 
 int r_jwks_empty(jwks_t * jwks) {
+  size_t size = r_jwks_size(jwks);
+
   if (jwks != NULL) {
     if (!json_array_clear(json_object_get(jwks, "keys"))) {
+      _r_jwks_index_drop(jwks, size);
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks empty - error json_array_clear");
@@ -154,6 +366,22 @@ int r_jwks_empty(jwks_t * jwks) {
   }
 }
 
+int _r_jwks_truncate(jwks_t * jwks, size_t size) {
+  json_t * j_keys;
+  size_t old_size = r_jwks_size(jwks);
+
+  if (jwks != NULL) {
+    j_keys = json_object_get(jwks, "keys");
+    while (json_array_size(j_keys) > size) {
+      json_array_remove(j_keys, json_array_size(j_keys)-1);
+    }
+    _r_jwks_index_drop(jwks, old_size);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jwks_equal(jwks_t * jwks1, jwks_t * jwks2) {
   return json_equal(jwks1, jwks2);
 }
@@ -31,18 +31,23 @@
 #include <yder.h>
 #include <rhonabwy.h>
 
-static json_t * r_jws_parse_protected(const unsigned char * header_b64url) {
+#define R_JWS_HEADER_STACK_SIZE 768
+#define R_JWS_HMAC_MAX_SIZE     64
+#define R_JWS_HMAC_MAX_B64_SIZE 88
+
+static json_t * r_jws_parse_protected(jws_t * jws, const unsigned char * header_b64url) {
   json_t * j_return = NULL;
-  struct _o_datum dat = {0, NULL};
+  unsigned char * header = NULL;
+  size_t header_len = 0;
 
   do {
-    if (!o_base64url_decode_alloc(header_b64url, o_strlen((const char *)header_b64url), &dat)) {
+    if ((header = _r_arena_base64url_decode(jws->arena, header_b64url, o_strlen((const char *)header_b64url), &header_len)) == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_protected - Invalid base64");
       break;
     }
-    j_return = json_loadb((const char *)dat.data, dat.size, JSON_DECODE_ANY, NULL);
+    j_return = json_loadb((const char *)header, header_len, JSON_DECODE_ANY, NULL);
   } while(0);
-  o_free(dat.data);
+  _r_arena_free(jws->arena, header);
   return j_return;
 }
 
@@ -50,6 +55,10 @@ static int r_jws_extract_header(jws_t * jws, json_t * j_header, uint32_t parse_f
   int ret;
   jwk_t * jwk;
 
+  // Keys imported from the header are removed by r_jws_reset
+  if (jws->jwks_pubkey_parse_size == _R_JWKS_PARSE_SIZE_NONE) {
+    jws->jwks_pubkey_parse_size = r_jwks_size(jws->jwks_pubkey);
+  }
   if (json_is_object(j_header)) {
     ret = RHN_OK;
 
@@ -117,20 +126,89 @@ static int r_jws_extract_header(jws_t * jws, json_t * j_header, uint32_t parse_f
   return ret;
 }
 
+/**
+ * Replaces the references to a token parsed with R_PARSE_ZERO_COPY
+ * by copies of the header and signature, before the jws is modified
+ */
+static void r_jws_release_token(jws_t * jws) {
+  const unsigned char * header_end;
+
+  if (jws != NULL && jws->token_signing_input != NULL) {
+    if ((header_end = memchr(jws->token_signing_input, '.', jws->token_signing_input_len)) != NULL) {
+      o_free(jws->header_b64url);
+      jws->header_b64url = (unsigned char *)o_strndup((const char *)jws->token_signing_input, (size_t)(header_end - jws->token_signing_input));
+    }
+    o_free(jws->signature_b64url);
+    jws->signature_b64url = NULL;
+    if (jws->token_signature != NULL) {
+      jws->signature_b64url = (unsigned char *)o_strndup((const char *)jws->token_signature, jws->token_signature_len);
+    }
+    jws->token_signing_input = NULL;
+    jws->token_signing_input_len = 0;
+    jws->token_signature = NULL;
+    jws->token_signature_len = 0;
+  }
+}
+
+/**
+ * Sets data with the signing input 'header.payload'
+ * If the jws was parsed with R_PARSE_ZERO_COPY, data points to the token,
+ * otherwise data is allocated
+ * data must be released with r_jws_free_signing_input
+ */
+static void r_jws_get_signing_input(jws_t * jws, gnutls_datum_t * data) {
+  size_t header_len, payload_len;
+
+  if (jws->token_signing_input != NULL) {
+    data->data = (unsigned char *)jws->token_signing_input;
+    data->size = (unsigned int)jws->token_signing_input_len;
+  } else {
+    header_len = o_strlen((const char *)jws->header_b64url);
+    payload_len = o_strlen((const char *)jws->payload_b64url);
+    if ((data->data = _r_arena_malloc(jws->arena, header_len+payload_len+2)) != NULL) {
+      memcpy(data->data, jws->header_b64url, header_len);
+      data->data[header_len] = '.';
+      memcpy(data->data+header_len+1, jws->payload_b64url, payload_len);
+      data->data[header_len+payload_len+1] = '\0';
+      data->size = (unsigned int)(header_len+payload_len+1);
+    } else {
+      data->size = 0;
+    }
+  }
+}
+
+static void r_jws_free_signing_input(jws_t * jws, gnutls_datum_t * data) {
+  if (jws->token_signing_input == NULL) {
+    _r_arena_free(jws->arena, data->data);
+  }
+  data->data = NULL;
+  data->size = 0;
+}
+
+static const unsigned char * r_jws_get_signature_b64url(jws_t * jws, size_t * signature_b64url_len) {
+  if (jws->token_signing_input != NULL) {
+    *signature_b64url_len = jws->token_signature_len;
+    return jws->token_signature;
+  } else {
+    *signature_b64url_len = o_strlen((const char *)jws->signature_b64url);
+    return jws->signature_b64url;
+  }
+}
+
 static int r_jws_set_header_value(jws_t * jws, int force) {
   int ret = RHN_OK;
   char * header_str = NULL;
   struct _o_datum dat = {0, NULL};
 
   if (jws != NULL) {
+    r_jws_release_token(jws);
     if (jws->header_b64url == NULL || force) {
       if ((header_str = json_dumps(jws->j_header, JSON_COMPACT)) != NULL) {
-        if (o_base64url_encode_alloc((const unsigned char *)header_str, o_strlen(header_str), &dat)) {
+        if (_r_base64url_encode_alloc((const unsigned char *)header_str, o_strlen(header_str), &dat)) {
           o_free(jws->header_b64url);
-          jws->header_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-          o_free(dat.data);
+          jws->header_b64url = dat.data;
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_header_value - Error o_base64url_encode header_str");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_header_value - Error _r_base64url_encode header_str");
           ret = RHN_ERROR;
         }
         o_free(header_str);
@@ -152,6 +230,7 @@ static int r_jws_set_payload_value(jws_t * jws, int force) {
   struct _o_datum dat = {0, NULL};
 
   if (jws != NULL) {
+    r_jws_release_token(jws);
     if (jws->payload_b64url == NULL || force) {
       if (jws->payload_len) {
         if (0 == o_strcmp("DEF", r_jws_get_header_str_value(jws, "zip"))) {
@@ -164,12 +243,11 @@ static int r_jws_set_payload_value(jws_t * jws, int force) {
           payload_to_set_len = jws->payload_len;
         }
         if (ret == RHN_OK) {
-          if (o_base64url_encode_alloc(payload_to_set, payload_to_set_len, &dat)) {
+          if (_r_base64url_encode_alloc(payload_to_set, payload_to_set_len, &dat)) {
             o_free(jws->payload_b64url);
-            jws->payload_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-            o_free(dat.data);
+            jws->payload_b64url = dat.data;
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_payload_value - Error o_base64url_encode payload");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_payload_value - Error _r_base64url_encode payload");
             ret = RHN_ERROR;
           }
         }
@@ -196,67 +274,81 @@ static int r_jws_set_token_values(jws_t * jws, int force) {
   return ret;
 }
 
-static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_t * jwk) {
-  int alg = GNUTLS_DIG_NULL;
-  unsigned char * data = NULL, * key = NULL, * sig = NULL, * to_return = NULL;
-  size_t key_len = 0, sig_len = 0;
-  struct _o_datum dat_sig = {0, NULL};
+static gnutls_mac_algorithm_t r_jws_get_hmac_alg(jwa_alg alg) {
+  gnutls_mac_algorithm_t mac = GNUTLS_MAC_UNKNOWN;
 
-  if (jws->alg == R_JWA_ALG_HS256) {
-    alg = GNUTLS_DIG_SHA256;
-  } else if (jws->alg == R_JWA_ALG_HS384) {
-    alg = GNUTLS_DIG_SHA384;
-  } else if (jws->alg == R_JWA_ALG_HS512) {
-    alg = GNUTLS_DIG_SHA512;
+  switch (alg) {
+    case R_JWA_ALG_HS256:
+      mac = GNUTLS_MAC_SHA256;
+      break;
+    case R_JWA_ALG_HS384:
+      mac = GNUTLS_MAC_SHA384;
+      break;
+    case R_JWA_ALG_HS512:
+      mac = GNUTLS_MAC_SHA512;
+      break;
+    default:
+      mac = GNUTLS_MAC_UNKNOWN;
+      break;
   }
+  return mac;
+}
 
-  if (alg != GNUTLS_DIG_NULL) {
-    sig_len = (unsigned)gnutls_hmac_get_len(alg);
-    sig = o_malloc(sig_len);
-
-    key_len = o_strlen(r_jwk_get_property_str(jwk, "k"));
-    if (key_len) {
-      key = o_malloc(key_len);
+/**
+ * Computes the raw MAC of the signing input in mac
+ * mac must be at least R_JWS_HMAC_MAX_SIZE bytes long
+ * The key context is taken from the key cache and returned to it afterwards
+ */
+static int r_jws_compute_hmac(jws_t * jws, jwk_t * jwk, gnutls_mac_algorithm_t alg, unsigned char * mac) {
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_hmac_hd_t hmac;
+  gnutls_datum_t data = {NULL, 0};
+  int ret;
 
-      if (key != NULL) {
-        if (r_jwk_export_to_symmetric_key(jwk, key, &key_len) != RHN_OK) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error r_jwk_export_to_symmetric_key");
-          o_free(key);
-          key = NULL;
-        }
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error allocating resources for key");
-      }
+  if ((hmac = _r_jwk_acquire_gnutls_hmac(jwk, alg, fingerprint)) != NULL) {
+    r_jws_get_signing_input(jws, &data);
+    if (data.data != NULL && !gnutls_hmac(hmac, data.data, data.size)) {
+      // gnutls_hmac_output resets the context but keeps the key, so it can be reused
+      gnutls_hmac_output(hmac, mac);
+      _r_jwk_release_gnutls_hmac(hmac, alg, fingerprint);
+      ret = RHN_OK;
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error key invalid, 'k' empty");
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_compute_hmac - Error gnutls_hmac");
+      gnutls_hmac_deinit(hmac, NULL);
+      ret = RHN_ERROR;
     }
+    r_jws_free_signing_input(jws, &data);
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error key invalid, 'alg' invalid");
+    ret = RHN_ERROR_INVALID;
   }
+  return ret;
+}
+
+static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_t * jwk) {
+  gnutls_mac_algorithm_t alg = r_jws_get_hmac_alg(jws->alg);
+  unsigned char mac[R_JWS_HMAC_MAX_SIZE], * to_return = NULL;
+  struct _o_datum dat_sig = {0, NULL};
 
-  if (key != NULL && sig != NULL) {
-    data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    if (!gnutls_hmac_fast(alg, key, key_len, data, o_strlen((const char *)data), sig)) {
-      if (o_base64url_encode_alloc(sig, sig_len, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
+  if (alg != GNUTLS_MAC_UNKNOWN) {
+    if (r_jws_compute_hmac(jws, jwk, alg, mac) == RHN_OK) {
+      if (_r_base64url_encode_alloc(mac, gnutls_hmac_get_len(alg), &dat_sig)) {
+        to_return = dat_sig.data;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error o_base64url_encode sig_b64");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error _r_base64url_encode sig_b64");
       }
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error gnutls_hmac_fast");
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error r_jws_compute_hmac");
     }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error key invalid, 'alg' invalid");
   }
 
-  o_free(data);
-  o_free(sig);
-  o_free(key);
-
   return to_return;
 }
 
 static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_privkey_t privkey = _r_jwk_acquire_gnutls_privkey(jwk, fingerprint);
   gnutls_datum_t body_dat, sig_dat;
   unsigned char * to_return = NULL;
   int alg = GNUTLS_DIG_NULL, res;
@@ -293,8 +385,7 @@ static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
   }
 
   if (privkey != NULL && GNUTLS_PK_RSA == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = (unsigned int)o_strlen((const char *)body_dat.data);
+    r_jws_get_signing_input(jws, &body_dat);
 
     if (!(res =
 #if GNUTLS_VERSION_NUMBER >= 0x030600
@@ -303,11 +394,10 @@ static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
                  gnutls_privkey_sign_data
 #endif
                                            (privkey, alg, flag, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
+      if (_r_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
+        to_return = dat_sig.data;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error o_base64url_encode for to_return");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error _r_base64url_encode for to_return");
         o_free(to_return);
         to_return = NULL;
       }
@@ -315,17 +405,18 @@ static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error gnutls_privkey_sign_data2, res %d", res);
     }
-    o_free(body_dat.data);
+    r_jws_free_signing_input(jws, &body_dat);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
+  _r_jwk_release_gnutls_privkey(privkey, fingerprint);
   return to_return;
 }
 
 static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_privkey_t privkey = _r_jwk_acquire_gnutls_privkey(jwk, fingerprint);
   gnutls_datum_t body_dat, sig_dat, r, s;
   unsigned char * binary_sig = NULL, * to_return = NULL;
   int alg = GNUTLS_DIG_NULL, res;
@@ -346,8 +437,7 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
   }
 
   if (privkey != NULL && GNUTLS_PK_EC == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = (unsigned int)o_strlen((const char *)body_dat.data);
+    r_jws_get_signing_input(jws, &body_dat);
 
     if (!(res = gnutls_privkey_sign_data(privkey, alg, 0, &body_dat, &sig_dat))) {
       if (!gnutls_decode_rs_value(&sig_dat, &r, &s)) {
@@ -369,11 +459,10 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
           memset(binary_sig, 0, sig_size);
           memcpy(binary_sig + r_out_padding, r.data + r_padding, r.size - r_padding);
           memcpy(binary_sig + (r.size - r_padding + r_out_padding) + s_out_padding, s.data + s_padding, (s.size - s_padding));
-          if (o_base64url_encode_alloc(binary_sig, sig_size, &dat_sig)) {
-            to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-            o_free(dat_sig.data);
+          if (_r_base64url_encode_alloc(binary_sig, sig_size, &dat_sig)) {
+            to_return = dat_sig.data;
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error o_base64url_encode_alloc for dat_sig");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error _r_base64url_encode_alloc for dat_sig");
           }
           o_free(binary_sig);
         } else {
@@ -388,11 +477,11 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error gnutls_privkey_sign_data: %d", res);
     }
-    o_free(body_dat.data);
+    r_jws_free_signing_input(jws, &body_dat);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
+  _r_jwk_release_gnutls_privkey(privkey, fingerprint);
   return to_return;
 #else
   (void)(jws);
@@ -403,32 +492,31 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
 
 static unsigned char * r_jws_sign_eddsa(jws_t * jws, jwk_t * jwk) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_privkey_t privkey = _r_jwk_acquire_gnutls_privkey(jwk, fingerprint);
   gnutls_datum_t body_dat, sig_dat;
   unsigned char * to_return = NULL;
   int res;
   struct _o_datum dat_sig = {0, NULL};
 
   if (privkey != NULL && GNUTLS_PK_EDDSA_ED25519 == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = (unsigned int)o_strlen((const char *)body_dat.data);
+    r_jws_get_signing_input(jws, &body_dat);
 
     if (!(res = gnutls_privkey_sign_data(privkey, GNUTLS_DIG_SHA512, 0, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
+      if (_r_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
+        to_return = dat_sig.data;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error o_base64url_encode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error _r_base64url_encode_alloc for dat_sig");
       }
       gnutls_free(sig_dat.data);
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error gnutls_privkey_sign_data: %d", res);
     }
-    o_free(body_dat.data);
+    r_jws_free_signing_input(jws, &body_dat);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
+  _r_jwk_release_gnutls_privkey(privkey, fingerprint);
   return to_return;
 #else
   (void)(jws);
@@ -440,32 +528,31 @@ static unsigned char * r_jws_sign_eddsa(jws_t * jws, jwk_t * jwk) {
 #if 0
 static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_privkey_t privkey = _r_jwk_acquire_gnutls_privkey(jwk, fingerprint);
   gnutls_datum_t body_dat, sig_dat;
   unsigned char * to_return = NULL;
   int res;
   struct _o_datum dat_sig = {0, NULL};
 
   if (privkey != NULL && GNUTLS_PK_EC == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = o_strlen((const char *)body_dat.data);
+    r_jws_get_signing_input(jws, &body_dat);
 
     if (!(res = gnutls_privkey_sign_data(privkey, GNUTLS_DIG_SHA256, 0, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
+      if (_r_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
+        to_return = dat_sig.data;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error o_base64url_encode for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error _r_base64url_encode for dat_sig");
       }
       gnutls_free(sig_dat.data);
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error gnutls_privkey_sign_data: %d", res);
     }
-    o_free(body_dat.data);
+    r_jws_free_signing_input(jws, &body_dat);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
+  _r_jwk_release_gnutls_privkey(privkey, fingerprint);
   return to_return;
 #else
   (void)(jws);
@@ -476,27 +563,42 @@ static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
 #endif
 
 static int r_jws_verify_sig_hmac(jws_t * jws, jwk_t * jwk) {
-  unsigned char * sig = r_jws_sign_hmac(jws, jwk);
+  gnutls_mac_algorithm_t alg = r_jws_get_hmac_alg(jws->alg);
+  unsigned char mac[R_JWS_HMAC_MAX_SIZE], sig[R_JWS_HMAC_MAX_SIZE+2];
+  const unsigned char * signature_b64url;
+  size_t signature_b64url_len = 0, sig_len = 0;
   int ret;
 
-  if (sig != NULL && 0 == o_strcmp((const char *)jws->signature_b64url, (const char *)sig)) {
+  // The presented signature is decoded once on the stack and compared to the raw MAC,
+  // its length is not a secret so oversized or truncated signatures are rejected early
+  signature_b64url = r_jws_get_signature_b64url(jws, &signature_b64url_len);
+  if (alg != GNUTLS_MAC_UNKNOWN &&
+      signature_b64url != NULL &&
+      signature_b64url_len &&
+      signature_b64url_len <= R_JWS_HMAC_MAX_B64_SIZE &&
+      _r_base64url_decode(signature_b64url, signature_b64url_len, sig, &sig_len) &&
+      sig_len == gnutls_hmac_get_len(alg) &&
+      r_jws_compute_hmac(jws, jwk, alg, mac) == RHN_OK &&
+      !_r_memcmp_const_time(mac, sig, sig_len)) {
     ret = RHN_OK;
   } else {
     ret = RHN_ERROR_INVALID;
   }
-  o_free(sig);
   return ret;
 }
 
 static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
   int alg = GNUTLS_DIG_NULL, ret = RHN_OK;
-  unsigned int flag = 0;
+  unsigned int flag = 0, bits = 0;
   gnutls_datum_t sig_dat = {NULL, 0}, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_pubkey_t pubkey = _r_jwk_acquire_gnutls_pubkey(jwk, x5u_flags, fingerprint);
   struct _o_datum dat_sig = {0, NULL};
+  const unsigned char * signature_b64url;
+  size_t signature_b64url_len = 0;
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = (unsigned int)o_strlen((const char *)data.data);
+  r_jws_get_signing_input(jws, &data);
+  signature_b64url = r_jws_get_signature_b64url(jws, &signature_b64url_len);
 
   switch (jws->alg) {
     case R_JWA_ALG_RS256:
@@ -526,18 +628,21 @@ static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
       break;
   }
 
-  if (pubkey != NULL && GNUTLS_PK_RSA == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
-    if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+  if (pubkey != NULL && GNUTLS_PK_RSA == gnutls_pubkey_get_pk_algorithm(pubkey, &bits)) {
+    if (_r_policy_check_rsa_bits(jws->policy, bits) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Key rejected by policy");
+      ret = RHN_ERROR_INVALID;
+    } else if (signature_b64url_len) {
+      if ((dat_sig.data = _r_arena_base64url_decode(jws->arena, signature_b64url, signature_b64url_len, &dat_sig.size)) != NULL) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = (unsigned int)dat_sig.size;
         if (gnutls_pubkey_verify_data2(pubkey, alg, flag, &data, &sig_dat)) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error invalid signature");
           ret = RHN_ERROR_INVALID;
         }
-        o_free(dat_sig.data);
+        _r_arena_free(jws->arena, dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error _r_base64url_decode_alloc for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -548,8 +653,8 @@ static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
+  r_jws_free_signing_input(jws, &data);
+  _r_jwk_release_gnutls_pubkey(pubkey, fingerprint);
   return ret;
 }
 
@@ -557,11 +662,14 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   int alg = 0, ret = RHN_OK;
   gnutls_datum_t sig_dat = {NULL, 0}, r, s, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_pubkey_t pubkey = _r_jwk_acquire_gnutls_pubkey(jwk, x5u_flags, fingerprint);
   struct _o_datum dat_sig = {0, NULL};
+  const unsigned char * signature_b64url;
+  size_t signature_b64url_len = 0;
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = (unsigned int)o_strlen((const char *)data.data);
+  r_jws_get_signing_input(jws, &data);
+  signature_b64url = r_jws_get_signature_b64url(jws, &signature_b64url_len);
 
   switch (jws->alg) {
     case R_JWA_ALG_ES256:
@@ -578,8 +686,8 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
   }
 
   if (pubkey != NULL && GNUTLS_PK_EC == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
-    if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+    if (signature_b64url_len) {
+      if ((dat_sig.data = _r_arena_base64url_decode(jws->arena, signature_b64url, signature_b64url_len, &dat_sig.size)) != NULL) {
         if (dat_sig.size == 64) {
           r.size = 32;
           r.data = dat_sig.data;
@@ -614,9 +722,9 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
             ret = RHN_ERROR;
           }
         }
-        o_free(dat_sig.data);
+        _r_arena_free(jws->arena, dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error _r_base64url_decode_alloc for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -627,8 +735,8 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
+  r_jws_free_signing_input(jws, &data);
+  _r_jwk_release_gnutls_pubkey(pubkey, fingerprint);
   return ret;
 #else
   (void)(jws);
@@ -642,24 +750,27 @@ static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   int ret = RHN_OK;
   gnutls_datum_t sig_dat = {NULL, 0}, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_pubkey_t pubkey = _r_jwk_acquire_gnutls_pubkey(jwk, x5u_flags, fingerprint);
   struct _o_datum dat_sig = {0, NULL};
+  const unsigned char * signature_b64url;
+  size_t signature_b64url_len = 0;
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = (unsigned int)o_strlen((const char *)data.data);
+  r_jws_get_signing_input(jws, &data);
+  signature_b64url = r_jws_get_signature_b64url(jws, &signature_b64url_len);
 
   if (pubkey != NULL && GNUTLS_PK_EDDSA_ED25519 == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
-    if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+    if (signature_b64url_len) {
+      if ((dat_sig.data = _r_arena_base64url_decode(jws->arena, signature_b64url, signature_b64url_len, &dat_sig.size)) != NULL) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = (unsigned int)dat_sig.size;
         if (gnutls_pubkey_verify_data2(pubkey, GNUTLS_SIGN_EDDSA_ED25519, 0, &data, &sig_dat)) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error invalid signature");
           ret = RHN_ERROR_INVALID;
         }
-        o_free(dat_sig.data);
+        _r_arena_free(jws->arena, dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error o_base64url_decode for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error _r_base64url_decode for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -670,8 +781,8 @@ static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
+  r_jws_free_signing_input(jws, &data);
+  _r_jwk_release_gnutls_pubkey(pubkey, fingerprint);
   return ret;
 #else
   (void)(jws);
@@ -686,24 +797,27 @@ static int r_jws_verify_sig_es256k(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   int ret = RHN_OK;
   gnutls_datum_t sig_dat = {NULL, 0}, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+  unsigned char fingerprint[_R_KEY_FINGERPRINT_SIZE];
+  gnutls_pubkey_t pubkey = _r_jwk_acquire_gnutls_pubkey(jwk, x5u_flags, fingerprint);
   struct _o_datum dat_sig = {0, NULL};
+  const unsigned char * signature_b64url;
+  size_t signature_b64url_len = 0;
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = o_strlen((const char *)data.data);
+  r_jws_get_signing_input(jws, &data);
+  signature_b64url = r_jws_get_signature_b64url(jws, &signature_b64url_len);
 
   if (pubkey != NULL && GNUTLS_PK_EC == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
-    if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+    if (signature_b64url_len) {
+      if ((dat_sig.data = _r_arena_base64url_decode(jws->arena, signature_b64url, signature_b64url_len, &dat_sig.size)) != NULL) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = dat_sig.size;
         if (gnutls_pubkey_verify_data2(pubkey, GNUTLS_SIGN_ECDSA_SHA256, 0, &data, &sig_dat)) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_es256k - Error invalid signature");
           ret = RHN_ERROR_INVALID;
         }
-        o_free(dat_sig.data);
+        _r_arena_free(jws->arena, dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_es256k - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_es256k - Error _r_base64url_decode_alloc for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -714,8 +828,8 @@ static int r_jws_verify_sig_es256k(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_es256k - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
+  r_jws_free_signing_input(jws, &data);
+  _r_jwk_release_gnutls_pubkey(pubkey, fingerprint);
   return ret;
 #else
   (void)(jws);
@@ -842,6 +956,17 @@ static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg a
   return str_ret;
 }
 
+unsigned char * _r_jws_sign_input(jwk_t * jwk, jwa_alg alg, const unsigned char * signing_input, size_t signing_input_len, int x5u_flags) {
+  jws_t jws;
+
+  // The signing functions read the signing input like in a token parsed with R_PARSE_ZERO_COPY
+  memset(&jws, 0, sizeof(jws_t));
+  jws.alg = alg;
+  jws.token_signing_input = signing_input;
+  jws.token_signing_input_len = signing_input_len;
+  return _r_generate_signature(&jws, jwk, alg, x5u_flags);
+}
+
 int r_jws_init(jws_t ** jws) {
   int ret;
 
@@ -858,6 +983,13 @@ int r_jws_init(jws_t ** jws) {
             (*jws)->payload_len = 0;
             (*jws)->j_json_serialization = NULL;
             (*jws)->token_mode = R_JSON_MODE_COMPACT;
+            (*jws)->token_signing_input = NULL;
+            (*jws)->token_signing_input_len = 0;
+            (*jws)->token_signature = NULL;
+            (*jws)->token_signature_len = 0;
+            (*jws)->jwks_pubkey_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+            (*jws)->arena = NULL;
+            (*jws)->policy = NULL;
             ret = RHN_OK;
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_init - Error allocating resources for jwks_privkey");
@@ -899,6 +1031,64 @@ void r_jws_free(jws_t * jws) {
   }
 }
 
+int r_jws_reset(jws_t * jws) {
+  int ret;
+
+  if (jws != NULL) {
+    o_free(jws->header_b64url);
+    jws->header_b64url = NULL;
+    o_free(jws->payload_b64url);
+    jws->payload_b64url = NULL;
+    o_free(jws->signature_b64url);
+    jws->signature_b64url = NULL;
+    o_free(jws->payload);
+    jws->payload = NULL;
+    jws->payload_len = 0;
+    json_decref(jws->j_json_serialization);
+    jws->j_json_serialization = NULL;
+    jws->alg = R_JWA_ALG_UNKNOWN;
+    jws->token_mode = R_JSON_MODE_COMPACT;
+    jws->token_signing_input = NULL;
+    jws->token_signing_input_len = 0;
+    jws->token_signature = NULL;
+    jws->token_signature_len = 0;
+    if (jws->jwks_pubkey_parse_size != _R_JWKS_PARSE_SIZE_NONE) {
+      _r_jwks_truncate(jws->jwks_pubkey, jws->jwks_pubkey_parse_size);
+      jws->jwks_pubkey_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+    }
+    if (jws->j_header != NULL) {
+      json_object_clear(jws->j_header);
+      ret = RHN_OK;
+    } else if ((jws->j_header = json_object()) != NULL) {
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_reset - Error allocating resources for j_header");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jws_set_arena(jws_t * jws, r_arena_t * arena) {
+  if (jws != NULL) {
+    jws->arena = arena;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jws_set_policy(jws_t * jws, const r_policy_t * policy) {
+  if (jws != NULL) {
+    jws->policy = policy;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 jws_t * r_jws_copy(jws_t * jws) {
   jws_t * jws_copy = NULL;
   if (jws != NULL) {
@@ -907,7 +1097,13 @@ jws_t * r_jws_copy(jws_t * jws) {
         jws_copy->header_b64url = (unsigned char *)o_strdup((const char *)jws->header_b64url);
         jws_copy->payload_b64url = (unsigned char *)o_strdup((const char *)jws->payload_b64url);
         jws_copy->signature_b64url = (unsigned char *)o_strdup((const char *)jws->signature_b64url);
+        jws_copy->token_signing_input = jws->token_signing_input;
+        jws_copy->token_signing_input_len = jws->token_signing_input_len;
+        jws_copy->token_signature = jws->token_signature;
+        jws_copy->token_signature_len = jws->token_signature_len;
+        r_jws_release_token(jws_copy);
         jws_copy->alg = jws->alg;
+        jws_copy->policy = jws->policy;
         r_jwks_free(jws_copy->jwks_privkey);
         jws_copy->jwks_privkey = r_jwks_copy(jws->jwks_privkey);
         r_jwks_free(jws_copy->jwks_pubkey);
@@ -931,6 +1127,7 @@ int r_jws_set_payload(jws_t * jws, const unsigned char * payload, size_t payload
   int ret;
 
   if (jws != NULL) {
+    r_jws_release_token(jws);
     o_free(jws->payload);
     if (payload != NULL && payload_len) {
       if ((jws->payload = o_malloc(payload_len)) != NULL) {
@@ -1048,6 +1245,7 @@ int r_jws_set_header_str_value(jws_t * jws, const char * key, const char * str_v
 
   if (jws != NULL) {
     if ((ret = _r_json_set_str_value(jws->j_header, key, str_value)) == RHN_OK) {
+      r_jws_release_token(jws);
       o_free(jws->header_b64url);
       jws->header_b64url = NULL;
     }
@@ -1062,6 +1260,7 @@ int r_jws_set_header_int_value(jws_t * jws, const char * key, rhn_int_t i_value)
 
   if (jws != NULL) {
     if ((ret = _r_json_set_int_value(jws->j_header, key, i_value)) == RHN_OK) {
+      r_jws_release_token(jws);
       o_free(jws->header_b64url);
       jws->header_b64url = NULL;
     }
@@ -1076,6 +1275,7 @@ int r_jws_set_header_json_t_value(jws_t * jws, const char * key, json_t * j_valu
 
   if (jws != NULL) {
     if ((ret = _r_json_set_json_t_value(jws->j_header, key, j_value)) == RHN_OK) {
+      r_jws_release_token(jws);
       o_free(jws->header_b64url);
       jws->header_b64url = NULL;
     }
@@ -1450,25 +1650,52 @@ int r_jws_advanced_compact_parse(jws_t * jws, const char * jws_str, uint32_t par
   return r_jws_advanced_compact_parsen(jws, jws_str, o_strlen(jws_str), parse_flags, x5u_flags);
 }
 
-int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, int x5u_flags) {
-  int ret;
-  char ** str_array = NULL;
-  char * token = NULL;
-  size_t split_size = 0, unzip_len = 0;
+/**
+ * Parses a compact JWS
+ * If verify is set, the signature is verified over the token
+ * before the payload is decoded, so a forged token is rejected
+ * without decoding its payload
+ */
+static int r_jws_compact_parsen_verify_internal(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, int x5u_flags, int verify, jwk_t * jwk_pubkey) {
+  int ret, res;
+  const char * header_end = NULL, * payload_end = NULL, * token_end = NULL, * payload = NULL;
+  size_t unzip_len = 0, header_len = 0;
   json_t * j_header = NULL;
-  struct _o_datum dat_header = {0, NULL}, dat_payload = {0, NULL};
-  unsigned char * unzip = NULL;
+  struct _o_datum dat_payload = {0, NULL};
+  unsigned char * unzip = NULL, header_stack[R_JWS_HEADER_STACK_SIZE], * header = NULL;
 
   if (jws != NULL && jws_str != NULL && jws_str_len) {
-    token = o_strndup(jws_str, jws_str_len);
-    if ((split_size = split_string(token, ".", &str_array)) == 2 || split_size == 3) {
+    _r_arena_enter(jws->arena);
+    // Split the token in place, the segments are referenced by their position in jws_str
+    if ((token_end = memchr(jws_str, '\0', jws_str_len)) == NULL) {
+      token_end = jws_str + jws_str_len;
+    }
+    if ((header_end = memchr(jws_str, '.', (size_t)(token_end - jws_str))) != NULL) {
+      payload = header_end + 1;
+      if ((payload_end = memchr(payload, '.', (size_t)(token_end - payload))) == NULL) {
+        payload_end = token_end;
+      }
+    }
+    if (header_end != NULL && _r_policy_check_token(jws->policy, (size_t)(token_end - jws_str), (size_t)(header_end - jws_str)) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - Token rejected by policy");
+      ret = RHN_ERROR_PARAM;
+    } else if (header_end != NULL && (payload_end == token_end || memchr(payload_end + 1, '.', (size_t)(token_end - payload_end - 1)) == NULL)) {
       // Check if all first 2 elements are base64url
-      if (o_base64url_decode_alloc((unsigned char *)str_array[0], o_strlen(str_array[0]), &dat_header) &&
-          o_base64url_decode_alloc((unsigned char *)str_array[1], o_strlen(str_array[1]), &dat_payload)) {
+      // The header is decoded in a stack buffer if it's small enough
+      header_len = (size_t)(header_end - jws_str);
+      if (header_len && header_len <= (R_JWS_HEADER_STACK_SIZE/3)*4) {
+        if (_r_base64url_decode((const unsigned char *)jws_str, header_len, header_stack, &header_len)) {
+          header = header_stack;
+        }
+      } else if (header_len) {
+        header = _r_arena_base64url_decode(jws->arena, (const unsigned char *)jws_str, header_len, &header_len);
+      }
+      if (header != NULL &&
+          (verify || _r_base64url_decode_alloc((const unsigned char *)payload, (size_t)(payload_end - payload), &dat_payload))) {
         ret = RHN_OK;
         do {
           // Decode header
-          j_header = json_loadb((const char*)dat_header.data, dat_header.size, JSON_DECODE_ANY, NULL);
+          j_header = json_loadb((const char*)header, header_len, JSON_DECODE_ANY, NULL);
           if (r_jws_extract_header(jws, j_header, parse_flags, x5u_flags) != RHN_OK) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error extracting header params");
             ret = RHN_ERROR_PARAM;
@@ -1486,6 +1713,48 @@ int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_
             }
           }
 
+          o_free(jws->header_b64url);
+          jws->header_b64url = NULL;
+          o_free(jws->signature_b64url);
+          jws->signature_b64url = NULL;
+          o_free(jws->payload_b64url);
+          jws->payload_b64url = NULL;
+          jws->token_signing_input = NULL;
+          jws->token_signing_input_len = 0;
+          jws->token_signature = NULL;
+          jws->token_signature_len = 0;
+          if ((parse_flags&R_PARSE_ZERO_COPY) || verify) {
+            // Without R_PARSE_ZERO_COPY, the references are replaced by copies once the token is verified
+            jws->token_signing_input = (const unsigned char *)jws_str;
+            jws->token_signing_input_len = (size_t)(payload_end - jws_str);
+            if (payload_end != token_end) {
+              jws->token_signature = (const unsigned char *)payload_end + 1;
+              jws->token_signature_len = (size_t)(token_end - payload_end - 1);
+            }
+          } else {
+            jws->header_b64url = (unsigned char *)o_strndup(jws_str, (size_t)(header_end - jws_str));
+            if (payload_end != token_end) {
+              jws->signature_b64url = (unsigned char *)o_strndup(payload_end + 1, (size_t)(token_end - payload_end - 1));
+            }
+          }
+          if (r_jws_get_alg(jws) != R_JWA_ALG_NONE && (payload_end == token_end || payload_end + 1 == token_end)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error invalid signature length");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+
+          if (verify) {
+            if ((res = r_jws_verify_signature(jws, jwk_pubkey, x5u_flags)) != RHN_OK) {
+              ret = res;
+              break;
+            }
+            if (!_r_base64url_decode_alloc((const unsigned char *)payload, (size_t)(payload_end - payload), &dat_payload)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error decoding payload from base64url format");
+              ret = RHN_ERROR_PARAM;
+              break;
+            }
+          }
+
           // Decode payload
           if (0 == o_strcmp("DEF", r_jws_get_header_str_value(jws, "zip"))) {
             if (_r_inflate_payload(dat_payload.data, dat_payload.size, &unzip, &unzip_len) != RHN_OK) {
@@ -1493,66 +1762,68 @@ int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_
               ret = RHN_ERROR_PARAM;
               break;
             }
-            if (r_jws_set_payload(jws, unzip, unzip_len) != RHN_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error r_jws_set_payload");
-              ret = RHN_ERROR_PARAM;
-              break;
-            }
+            // The inflated payload is moved to the jws, r_jws_set_payload would release the token references
+            o_free(jws->payload);
+            jws->payload = unzip;
+            jws->payload_len = unzip_len;
+            unzip = NULL;
           } else {
-            if (r_jws_set_payload(jws, dat_payload.data, dat_payload.size) != RHN_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - Error r_jws_set_payload");
-              ret = RHN_ERROR;
-              break;
-            }
-          }
-
-          o_free(jws->header_b64url);
-          jws->header_b64url = (unsigned char *)o_strdup(str_array[0]);
-
-          o_free(jws->signature_b64url);
-          jws->signature_b64url = NULL;
-          if (str_array[2] != NULL) {
-            jws->signature_b64url = (unsigned char *)o_strdup(str_array[2]);
-          }
-          if (r_jws_get_alg(jws) != R_JWA_ALG_NONE && o_strnullempty(str_array[2])) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error invalid signature length");
-            ret = RHN_ERROR_PARAM;
-            break;
+            // The decoded payload is moved to the jws
+            o_free(jws->payload);
+            jws->payload = dat_payload.data;
+            jws->payload_len = dat_payload.size;
+            dat_payload.data = NULL;
           }
         } while (0);
+        if (verify && !(parse_flags&R_PARSE_ZERO_COPY)) {
+          if (ret == RHN_OK) {
+            r_jws_release_token(jws);
+          } else {
+            jws->token_signing_input = NULL;
+            jws->token_signing_input_len = 0;
+            jws->token_signature = NULL;
+            jws->token_signature_len = 0;
+          }
+        }
         json_decref(j_header);
         o_free(unzip);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error decoding jws from base64url format");
         ret = RHN_ERROR_PARAM;
       }
-      o_free(dat_header.data);
+      if (header != header_stack) {
+        _r_arena_free(jws->arena, header);
+      }
       o_free(dat_payload.data);
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - jws_str invalid format");
       ret = RHN_ERROR_PARAM;
     }
-    free_string_array(str_array);
-    o_free(token);
+    _r_arena_leave(jws->arena);
   } else {
     ret = RHN_ERROR_PARAM;
   }
   return ret;
 }
 
+int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, int x5u_flags) {
+  return r_jws_compact_parsen_verify_internal(jws, jws_str, jws_str_len, parse_flags, x5u_flags, 0, NULL);
+}
+
+int r_jws_compact_parsen_verify(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, jwk_t * jwk_pubkey, int x5u_flags) {
+  return r_jws_compact_parsen_verify_internal(jws, jws_str, jws_str_len, parse_flags, x5u_flags, 1, jwk_pubkey);
+}
+
+int r_jws_compact_parse_verify(jws_t * jws, const char * jws_str, uint32_t parse_flags, jwk_t * jwk_pubkey, int x5u_flags) {
+  return r_jws_compact_parsen_verify(jws, jws_str, o_strlen(jws_str), parse_flags, jwk_pubkey, x5u_flags);
+}
+
 int r_jws_parse_json_t(jws_t * jws, json_t * jws_json, int x5u_flags) {
   return r_jws_advanced_parse_json_t(jws, jws_json, R_PARSE_HEADER_ALL, x5u_flags);
 }
 
 int r_jws_parsen_json_str(jws_t * jws, const char * jws_json_str, size_t jws_str_len, int x5u_flags) {
-  json_t * jws_json = NULL;
-  int ret;
-
-  jws_json = json_loadb(jws_json_str, jws_str_len, JSON_DECODE_ANY, NULL);
-  ret = r_jws_parse_json_t(jws, jws_json, x5u_flags);
-  json_decref(jws_json);
-
-  return ret;
+  return r_jws_advanced_parsen_json_str(jws, jws_json_str, jws_str_len, R_PARSE_HEADER_ALL, x5u_flags);
 }
 
 int r_jws_parse_json_str(jws_t * jws, const char * jws_json_str, int x5u_flags) {
@@ -1567,9 +1838,14 @@ int r_jws_advanced_parsen_json_str(jws_t * jws, const char * jws_json_str, size_
   json_t * jws_json = NULL;
   int ret;
 
-  jws_json = json_loadb(jws_json_str, jws_json_str_len, JSON_DECODE_ANY, NULL);
-  ret = r_jws_advanced_parse_json_t(jws, jws_json, parse_flags, x5u_flags);
-  json_decref(jws_json);
+  if (jws != NULL && _r_policy_check_token(jws->policy, jws_json_str_len, 0) != RHN_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_parsen_json_str - Token rejected by policy");
+    ret = RHN_ERROR_PARAM;
+  } else {
+    jws_json = json_loadb(jws_json_str, jws_json_str_len, JSON_DECODE_ANY, NULL);
+    ret = r_jws_advanced_parse_json_t(jws, jws_json, parse_flags, x5u_flags);
+    json_decref(jws_json);
+  }
 
   return ret;
 }
@@ -1582,6 +1858,8 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
   struct _o_datum dat_header = {0, NULL}, dat_payload = {0, NULL};
 
   if (jws != NULL && json_is_object(jws_json)) {
+    _r_arena_enter(jws->arena);
+    r_jws_release_token(jws);
     if (json_string_length(json_object_get(jws_json, "payload"))) {
       if (json_string_length(json_object_get(jws_json, "protected"))) {
         // Mode flattened - 1 signature maximum
@@ -1589,6 +1867,12 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
         jws->token_mode = R_JSON_MODE_FLATTENED;
 
         do {
+          if (_r_policy_check_token(jws->policy, 0, json_string_length(json_object_get(jws_json, "protected"))) != RHN_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Header rejected by policy");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+
           json_decref(jws->j_json_serialization);
           if ((jws->j_json_serialization = json_deep_copy(jws_json)) == NULL) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error setting j_json_serialization");
@@ -1617,7 +1901,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
               ret = RHN_ERROR;
               break;
             }
-            if (!o_base64url_decode((unsigned char *)jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), NULL, &signature_len)) {
+            if (!_r_base64url_decode((unsigned char *)jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), NULL, &signature_len)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Invalid JWS, signature not valid base64url format");
               ret = RHN_ERROR_PARAM;
               break;
@@ -1627,7 +1911,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
           }
 
           // Decode header
-          if (!o_base64url_decode_alloc((unsigned char *)jws->header_b64url, o_strlen((const char *)jws->header_b64url), &dat_header)) {
+          if ((dat_header.data = _r_arena_base64url_decode(jws->arena, jws->header_b64url, o_strlen((const char *)jws->header_b64url), &dat_header.size)) == NULL) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error decoding str_header");
             ret = RHN_ERROR_PARAM;
             break;
@@ -1644,7 +1928,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
           jws->j_header = json_incref(j_header);
 
           // Decode payload
-          if (!o_base64url_decode_alloc((unsigned char *)jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload)) {
+          if ((dat_payload.data = _r_arena_base64url_decode(jws->arena, jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload.size)) == NULL) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error decoding payload");
             ret = RHN_ERROR_PARAM;
             break;
@@ -1663,8 +1947,8 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
           }
         } while (0);
         json_decref(j_header);
-        o_free(dat_header.data);
-        o_free(dat_payload.data);
+        _r_arena_free(jws->arena, dat_header.data);
+        _r_arena_free(jws->arena, dat_payload.data);
 
       } else {
         ret = RHN_OK;
@@ -1682,13 +1966,19 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
               break;
             }
 
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "protected")), json_string_length(json_object_get(j_element, "protected")), NULL, &header_len)) {
+            if (_r_policy_check_token(jws->policy, 0, json_string_length(json_object_get(j_element, "protected"))) != RHN_OK) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Header rejected by policy");
+              ret = RHN_ERROR_PARAM;
+              break;
+            }
+
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "protected")), json_string_length(json_object_get(j_element, "protected")), NULL, &header_len)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error header base64url format");
               ret = RHN_ERROR_PARAM;
               break;
             }
 
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "signature")), json_string_length(json_object_get(j_element, "signature")), NULL, &signature_len)) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "signature")), json_string_length(json_object_get(j_element, "signature")), NULL, &signature_len)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error signature base64url format");
               ret = RHN_ERROR_PARAM;
               break;
@@ -1725,7 +2015,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
             }
 
             // Decode payload
-            if (!o_base64url_decode_alloc((unsigned char *)jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload)) {
+            if ((dat_payload.data = _r_arena_base64url_decode(jws->arena, jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload.size)) == NULL) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - error decoding jws->payload");
               ret = RHN_ERROR_PARAM;
               break;
@@ -1739,7 +2029,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
           } while (0);
           json_decref(j_header);
           o_free(str_header);
-          o_free(dat_payload.data);
+          _r_arena_free(jws->arena, dat_payload.data);
         }
 
       }
@@ -1747,6 +2037,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error payload missing");
       ret = RHN_ERROR_PARAM;
     }
+    _r_arena_leave(jws->arena);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error input parameters");
     ret = RHN_ERROR_PARAM;
@@ -1775,26 +2066,41 @@ jws_t * r_jws_quick_parsen(const char * jws_str, size_t jws_str_len, uint32_t pa
   return jws;
 }
 
+/**
+ * Verifies the signature with a key, unless the policy
+ * maximum number of keys tried is reached
+ */
+static int r_jws_verify_key_policy(jws_t * jws, jwk_t * jwk, int x5u_flags, size_t * nb_keys) {
+  int ret;
+
+  if ((ret = _r_policy_check_keys(jws->policy, *nb_keys)) == RHN_OK) {
+    (*nb_keys)++;
+    ret = _r_verify_signature(jws, jwk, jws->alg, x5u_flags);
+  }
+  return ret;
+}
+
 int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
   int ret, res;
   jwk_t * jwk = NULL, * cur_jwk;
   const char * kid;
   json_t * j_signature = NULL, * j_header;
-  size_t index = 0, i;
+  size_t index = 0, i, nb_keys = 0;
 
   if (jws != NULL) {
     if (jwk_pubkey != NULL) {
-      jwk = r_jwk_copy(jwk_pubkey);
+      jwk = jwk_pubkey;
     } else {
       if ((kid = r_jws_get_header_str_value(jws, "kid")) != NULL || (jws->token_mode == R_JSON_MODE_FLATTENED && (kid = json_string_value(json_object_get(json_object_get(jws->j_json_serialization, "header"), "kid"))) != NULL)) {
-        jwk = r_jwks_get_by_kid(jws->jwks_pubkey, kid);
+        jwk = r_jwks_get_by_kid_borrowed(jws->jwks_pubkey, kid);
       } else if (r_jwks_size(jws->jwks_pubkey) == 1) {
-        jwk = r_jwks_get_at(jws->jwks_pubkey, 0);
+        jwk = r_jwks_get_at_borrowed(jws->jwks_pubkey, 0);
       }
     }
   }
 
   if (jws != NULL) {
+    _r_arena_enter(jws->arena);
     if (jws->token_mode == R_JSON_MODE_GENERAL) {
       ret = RHN_ERROR_INVALID;
       o_free(jws->header_b64url);
@@ -1803,17 +2109,16 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
         jws->header_b64url = (unsigned char *)json_string_value(json_object_get(j_signature, "protected"));
         jws->signature_b64url = (unsigned char *)json_string_value(json_object_get(j_signature, "signature"));
         kid = json_string_value(json_object_get(json_object_get(j_signature, "header"), "kid"));
-        if ((j_header = r_jws_parse_protected((const unsigned char *)json_string_value(json_object_get(j_signature, "protected")))) != NULL) {
+        if ((j_header = r_jws_parse_protected(jws, (const unsigned char *)json_string_value(json_object_get(j_signature, "protected")))) != NULL) {
           res = r_jws_extract_header(jws, j_header, R_PARSE_NONE, x5u_flags);
           json_decref(j_header);
           if (res == RHN_OK) {
             if (!o_strnullempty(kid)) {
               if (jwk_pubkey != NULL) {
-                ret = _r_verify_signature(jws, jwk, jws->alg, x5u_flags);
+                ret = r_jws_verify_key_policy(jws, jwk, x5u_flags, &nb_keys);
               } else {
-                if ((cur_jwk = r_jwks_get_by_kid(jws->jwks_pubkey, kid)) != NULL) {
-                  ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
-                  r_jwk_free(cur_jwk);
+                if ((cur_jwk = r_jwks_get_by_kid_borrowed(jws->jwks_pubkey, kid)) != NULL) {
+                  ret = r_jws_verify_key_policy(jws, cur_jwk, x5u_flags, &nb_keys);
                 }
               }
               if (ret != RHN_ERROR_INVALID) {
@@ -1821,14 +2126,13 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
               }
             } else {
               if (jwk_pubkey != NULL) {
-                if ((ret = _r_verify_signature(jws, jwk_pubkey, jws->alg, x5u_flags)) != RHN_ERROR_INVALID) {
+                if ((ret = r_jws_verify_key_policy(jws, jwk_pubkey, x5u_flags, &nb_keys)) != RHN_ERROR_INVALID) {
                   break;
                 }
               } else if (r_jwks_size(jws->jwks_pubkey)) {
                 for (i=0; i<r_jwks_size(jws->jwks_pubkey); i++) {
-                  cur_jwk = r_jwks_get_at(jws->jwks_pubkey, i);
-                  ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
-                  r_jwk_free(cur_jwk);
+                  cur_jwk = r_jwks_get_at_borrowed(jws->jwks_pubkey, i);
+                  ret = r_jws_verify_key_policy(jws, cur_jwk, x5u_flags, &nb_keys);
                   if (ret != RHN_ERROR_INVALID) {
                     break;
                   }
@@ -1850,7 +2154,7 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
       jws->header_b64url = NULL;
       jws->signature_b64url = NULL;
     } else {
-      if (r_jws_set_token_values(jws, 0) == RHN_OK && jws->signature_b64url != NULL) {
+      if ((jws->token_signing_input != NULL && jws->token_signature != NULL) || (r_jws_set_token_values(jws, 0) == RHN_OK && jws->signature_b64url != NULL)) {
         if (jwk != NULL) {
           ret = _r_verify_signature(jws, jwk, jws->alg, x5u_flags);
         } else {
@@ -1860,10 +2164,10 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
         ret = RHN_ERROR_PARAM;
       }
     }
+    _r_arena_leave(jws->arena);
   } else {
     ret = RHN_ERROR_PARAM;
   }
-  r_jwk_free(jwk);
   return ret;
 }
 
@@ -1901,8 +2205,9 @@ char * r_jws_serialize_unsecure(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags)
       r_jws_set_header_str_value(jws, "kid", r_jwk_get_property_str(jwk, "kid"));
     }
 
-    o_free(jws->signature_b64url);
     if (r_jws_set_token_values(jws, 1) == RHN_OK) {
+      // r_jws_set_token_values copies the signature of a token parsed with R_PARSE_ZERO_COPY
+      o_free(jws->signature_b64url);
       jws->signature_b64url = _r_generate_signature(jws, jwk, jws->alg, x5u_flags);
       if (jws->signature_b64url != NULL) {
         jws_str = msprintf("%s.%s.%s", jws->header_b64url, jws->payload_b64url, jws->signature_b64url);
@@ -21,8 +21,16 @@
  *
  */
 
+#include <ctype.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -31,6 +39,13 @@
 #include <yder.h>
 #include <rhonabwy.h>
 
+/**
+ * Limits of the values checked when a payload is indexed with R_PARSE_LAZY_CLAIMS,
+ * beyond them the payload is decoded entirely
+ */
+#define _R_JWT_CLAIMS_MAX_DEPTH  64
+#define _R_JWT_CLAIMS_MAX_DIGITS 18
+
 int r_jwt_init(jwt_t ** jwt) {
   int ret;
 
@@ -53,6 +68,14 @@ int r_jwt_init(jwt_t ** jwt) {
                   (*jwt)->key_len = 0;
                   (*jwt)->iv = NULL;
                   (*jwt)->iv_len = 0;
+                  (*jwt)->jwks_pubkey_sign_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+                  (*jwt)->jwks_pubkey_enc_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+                  (*jwt)->arena = NULL;
+                  (*jwt)->policy = NULL;
+                  (*jwt)->claims_lazy = NULL;
+                  (*jwt)->claims_lazy_len = 0;
+                  (*jwt)->claims_index = NULL;
+                  (*jwt)->claims_index_size = 0;
                   ret = RHN_OK;
                 } else {
                   y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_init - Error allocating resources for jwks_pubkey_enc");
@@ -104,18 +127,504 @@ void r_jwt_free(jwt_t * jwt) {
     o_free(jwt->iv);
     json_decref(jwt->j_header);
     json_decref(jwt->j_claims);
+    o_free(jwt->claims_lazy);
+    o_free(jwt->claims_index);
     o_free(jwt);
   }
 }
 
+/**
+ * Prepares jwt->jws to hold a new token
+ * The jws is reused if it already exists, its key sets only come from
+ * previous tokens so they are emptied
+ */
+static int r_jwt_reset_jws(jwt_t * jwt) {
+  int ret;
+
+  if (jwt->jws == NULL) {
+    ret = r_jws_init(&jwt->jws);
+  } else if ((ret = r_jws_reset(jwt->jws)) == RHN_OK && (ret = r_jwks_empty(jwt->jws->jwks_privkey)) == RHN_OK) {
+    ret = r_jwks_empty(jwt->jws->jwks_pubkey);
+  }
+  if (ret == RHN_OK && (ret = r_jws_set_arena(jwt->jws, jwt->arena)) == RHN_OK) {
+    ret = r_jws_set_policy(jwt->jws, jwt->policy);
+  }
+  return ret;
+}
+
+/**
+ * Prepares jwt->jwe to hold a new token
+ * The jwe is reused if it already exists, its key sets only come from
+ * previous tokens so they are emptied
+ */
+static int r_jwt_reset_jwe(jwt_t * jwt) {
+  int ret;
+
+  if (jwt->jwe == NULL) {
+    ret = r_jwe_init(&jwt->jwe);
+  } else if ((ret = r_jwe_reset(jwt->jwe)) == RHN_OK && (ret = r_jwks_empty(jwt->jwe->jwks_privkey)) == RHN_OK) {
+    ret = r_jwks_empty(jwt->jwe->jwks_pubkey);
+  }
+  if (ret == RHN_OK && (ret = r_jwe_set_arena(jwt->jwe, jwt->arena)) == RHN_OK) {
+    ret = r_jwe_set_policy(jwt->jwe, jwt->policy);
+  }
+  return ret;
+}
+
+static int r_jwt_reset_json(json_t ** j_json) {
+  int ret;
+
+  if (json_is_object(*j_json)) {
+    json_object_clear(*j_json);
+    ret = RHN_OK;
+  } else {
+    json_decref(*j_json);
+    ret = ((*j_json = json_object()) != NULL) ? RHN_OK : RHN_ERROR_MEMORY;
+  }
+  return ret;
+}
+
+static void r_jwt_claims_lazy_clean(jwt_t * jwt) {
+  o_free(jwt->claims_lazy);
+  o_free(jwt->claims_index);
+  jwt->claims_lazy = NULL;
+  jwt->claims_lazy_len = 0;
+  jwt->claims_index = NULL;
+  jwt->claims_index_size = 0;
+}
+
+static size_t r_jwt_claims_skip_ws(const char * str, size_t len, size_t i) {
+  while (i < len && (str[i] == ' ' || str[i] == '\t' || str[i] == '\n' || str[i] == '\r')) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * Returns the number of bytes of the UTF-8 sequence starting at str[i], 0 if it's invalid
+ * Overlong sequences, surrogates and code points above U+10FFFF are invalid, as with json_loadb
+ */
+static size_t r_jwt_claims_check_utf8(const char * str, size_t len, size_t i) {
+  const unsigned char * u = (const unsigned char *)str+i;
+  size_t n, k;
+
+  if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+    n = 2;
+  } else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+    n = 3;
+  } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+    n = 4;
+  } else {
+    return 0;
+  }
+  if (i+n > len) {
+    return 0;
+  }
+  for (k=1; k<n; k++) {
+    if ((u[k] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  if ((u[0] == 0xE0 && u[1] < 0xA0) || (u[0] == 0xED && u[1] > 0x9F) || (u[0] == 0xF0 && u[1] < 0x90) || (u[0] == 0xF4 && u[1] > 0x8F)) {
+    return 0;
+  }
+  return n;
+}
+
+/**
+ * Returns the position after the string starting at str[i], 0 on error
+ * The string is checked, but the escapes that json_loadb would have to decode
+ * to check them, \u0000 and the surrogates, are errors too
+ */
+static size_t r_jwt_claims_skip_string(const char * str, size_t len, size_t i, int * escaped) {
+  size_t n, k;
+
+  for (i++; i < len; i++) {
+    if (str[i] == '"') {
+      return i+1;
+    } else if (str[i] == '\\') {
+      *escaped = 1;
+      if (++i >= len) {
+        return 0;
+      } else if (str[i] == 'u') {
+        if (i+4 >= len) {
+          return 0;
+        }
+        for (k=1; k<=4; k++) {
+          if (!isxdigit((unsigned char)str[i+k])) {
+            return 0;
+          }
+        }
+        if (0 == o_strncmp(str+i+1, "0000", 4) || ((str[i+1] == 'd' || str[i+1] == 'D') && strchr("89abcdefABCDEF", str[i+2]) != NULL)) {
+          return 0;
+        }
+        i += 4;
+      } else if (strchr("\"\\/bfnrt", str[i]) == NULL || str[i] == '\0') {
+        return 0;
+      }
+    } else if ((unsigned char)str[i] < 0x20) {
+      return 0;
+    } else if ((unsigned char)str[i] >= 0x80) {
+      if (!(n = r_jwt_claims_check_utf8(str, len, i))) {
+        return 0;
+      }
+      i += n-1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns the position after the number starting at str[i], 0 on error
+ * The numbers json_loadb could reject as out of range are errors too:
+ * integers of more than _R_JWT_CLAIMS_MAX_DIGITS digits, reals with an exponent
+ * or of more than _R_JWT_CLAIMS_MAX_DIGITS characters
+ */
+static size_t r_jwt_claims_skip_number(const char * str, size_t len, size_t i) {
+  size_t start = i, digits;
+
+  if (i < len && str[i] == '-') {
+    i++;
+  }
+  if (i < len && str[i] == '0') {
+    i++;
+  } else if (i < len && str[i] >= '1' && str[i] <= '9') {
+    for (digits = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++, digits++);
+    if (digits > _R_JWT_CLAIMS_MAX_DIGITS) {
+      return 0;
+    }
+  } else {
+    return 0;
+  }
+  if (i < len && str[i] == '.') {
+    for (digits = 0, i++; i < len && str[i] >= '0' && str[i] <= '9'; i++, digits++);
+    if (!digits || i-start > _R_JWT_CLAIMS_MAX_DIGITS) {
+      return 0;
+    }
+  }
+  if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+    return 0;
+  }
+  return i;
+}
+
+/**
+ * Returns the position of the value of the object member starting at str[i], 0 on error
+ */
+static size_t r_jwt_claims_skip_member_key(const char * str, size_t len, size_t i) {
+  int escaped = 0;
+
+  if (i >= len || str[i] != '"' || !(i = r_jwt_claims_skip_string(str, len, i, &escaped))) {
+    return 0;
+  }
+  i = r_jwt_claims_skip_ws(str, len, i);
+  if (i >= len || str[i] != ':') {
+    return 0;
+  }
+  return r_jwt_claims_skip_ws(str, len, i+1);
+}
+
+/**
+ * Returns the position after the value starting at str[i], 0 on error
+ * The value is checked, so a claim indexed is always decoded,
+ * a value that can't be checked cheaply is an error too,
+ * the payload is then decoded entirely by json_loadb which reports the errors
+ */
+static size_t r_jwt_claims_skip_value(const char * str, size_t len, size_t i) {
+  char stack[_R_JWT_CLAIMS_MAX_DEPTH];
+  size_t depth = 0;
+  int escaped = 0, expect_value = 1;
+
+  while (1) {
+    if (expect_value) {
+      if (i >= len) {
+        return 0;
+      } else if (str[i] == '{' || str[i] == '[') {
+        if (depth == _R_JWT_CLAIMS_MAX_DEPTH) {
+          return 0;
+        }
+        stack[depth++] = str[i]=='{'?'}':']';
+        i = r_jwt_claims_skip_ws(str, len, i+1);
+        if (i < len && str[i] == stack[depth-1]) {
+          depth--;
+          i++;
+          expect_value = 0;
+        } else if (stack[depth-1] == '}' && !(i = r_jwt_claims_skip_member_key(str, len, i))) {
+          return 0;
+        }
+      } else if (str[i] == '"') {
+        if (!(i = r_jwt_claims_skip_string(str, len, i, &escaped))) {
+          return 0;
+        }
+        expect_value = 0;
+      } else if (i+4 <= len && (0 == o_strncmp(str+i, "true", 4) || 0 == o_strncmp(str+i, "null", 4))) {
+        i += 4;
+        expect_value = 0;
+      } else if (i+5 <= len && 0 == o_strncmp(str+i, "false", 5)) {
+        i += 5;
+        expect_value = 0;
+      } else if (!(i = r_jwt_claims_skip_number(str, len, i))) {
+        return 0;
+      } else {
+        expect_value = 0;
+      }
+    } else if (!depth) {
+      return i;
+    } else {
+      i = r_jwt_claims_skip_ws(str, len, i);
+      if (i >= len) {
+        return 0;
+      } else if (str[i] == ',') {
+        i = r_jwt_claims_skip_ws(str, len, i+1);
+        if (stack[depth-1] == '}' && !(i = r_jwt_claims_skip_member_key(str, len, i))) {
+          return 0;
+        }
+        expect_value = 1;
+      } else if (str[i] == stack[depth-1]) {
+        depth--;
+        i++;
+      } else {
+        return 0;
+      }
+    }
+  }
+}
+
+/**
+ * Indexes the top-level claims of jwt->claims_lazy
+ * Returns RHN_ERROR_PARAM if the payload isn't an object,
+ * if a value isn't valid or can't be checked without being decoded,
+ * or if a key can't be compared without being decoded
+ */
+static int r_jwt_claims_lazy_index(jwt_t * jwt) {
+  const char * str = jwt->claims_lazy;
+  size_t len = jwt->claims_lazy_len, i, end, size = 0, alloc = 0;
+  struct _r_claim_index * index = NULL, * new_index;
+  int escaped = 0, closed = 0;
+
+  i = r_jwt_claims_skip_ws(str, len, 0);
+  if (i >= len || str[i] != '{') {
+    return RHN_ERROR_PARAM;
+  }
+  i = r_jwt_claims_skip_ws(str, len, i+1);
+  if (i < len && str[i] == '}') {
+    i++;
+    closed = 1;
+  } else {
+    while (1) {
+      if (i >= len || str[i] != '"' || !(end = r_jwt_claims_skip_string(str, len, i, &escaped)) || escaped) {
+        break;
+      }
+      if (size == alloc) {
+        alloc = alloc ? alloc*2 : 16;
+        if ((new_index = o_realloc(index, alloc*sizeof(struct _r_claim_index))) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_claims_lazy_index - Error allocating resources for index");
+          o_free(index);
+          return RHN_ERROR_MEMORY;
+        }
+        index = new_index;
+      }
+      index[size].key_offset = i+1;
+      index[size].key_len = end-i-2;
+      i = r_jwt_claims_skip_ws(str, len, end);
+      if (i >= len || str[i] != ':') {
+        break;
+      }
+      i = r_jwt_claims_skip_ws(str, len, i+1);
+      if (!(end = r_jwt_claims_skip_value(str, len, i))) {
+        break;
+      }
+      index[size].value_offset = i;
+      index[size].value_len = end-i;
+      i = r_jwt_claims_skip_ws(str, len, end);
+      size++;
+      if (i < len && str[i] == ',') {
+        i = r_jwt_claims_skip_ws(str, len, i+1);
+      } else {
+        if (i < len && str[i] == '}') {
+          i++;
+          closed = 1;
+        }
+        break;
+      }
+    }
+  }
+  if (!closed || r_jwt_claims_skip_ws(str, len, i) != len) {
+    o_free(index);
+    return RHN_ERROR_PARAM;
+  }
+  jwt->claims_index = index;
+  jwt->claims_index_size = size;
+  return RHN_OK;
+}
+
+/**
+ * Sets the claims of jwt from a payload
+ * If the jwt was parsed with R_PARSE_LAZY_CLAIMS,
+ * the payload is only indexed
+ */
+static int r_jwt_load_claims(jwt_t * jwt, const unsigned char * payload, size_t payload_len) {
+  int ret;
+
+  r_jwt_claims_lazy_clean(jwt);
+  json_decref(jwt->j_claims);
+  jwt->j_claims = NULL;
+  if (jwt->parse_flags & R_PARSE_LAZY_CLAIMS) {
+    if ((jwt->claims_lazy = o_malloc(payload_len)) != NULL) {
+      memcpy(jwt->claims_lazy, payload, payload_len);
+      jwt->claims_lazy_len = payload_len;
+      if (r_jwt_claims_lazy_index(jwt) == RHN_OK) {
+        if ((jwt->j_claims = json_object()) != NULL) {
+          return RHN_OK;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_load_claims - Error allocating resources for j_claims");
+          r_jwt_claims_lazy_clean(jwt);
+          return RHN_ERROR_MEMORY;
+        }
+      }
+      // The payload can't be indexed, it's decoded entirely
+      r_jwt_claims_lazy_clean(jwt);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_load_claims - Error allocating resources for claims_lazy");
+      return RHN_ERROR_MEMORY;
+    }
+  }
+  // The payload may be any JSON value, not only an object
+  if ((jwt->j_claims = json_loadb((const char *)payload, payload_len, JSON_DECODE_ANY, NULL)) != NULL) {
+    ret = RHN_OK;
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+/**
+ * Returns the claim value, decoded from the lazy payload if necessary
+ */
+static json_t * r_jwt_claim_get(jwt_t * jwt, const char * key) {
+  json_t * j_value = json_object_get(jwt->j_claims, key);
+  size_t i, key_len;
+
+  if (j_value == NULL && jwt->claims_index_size && key != NULL) {
+    key_len = o_strlen(key);
+    // The last occurence of a key wins, as with json_loads
+    for (i = jwt->claims_index_size; i > 0; i--) {
+      if (jwt->claims_index[i-1].key_len == key_len && 0 == memcmp(jwt->claims_lazy+jwt->claims_index[i-1].key_offset, key, key_len)) {
+        if ((j_value = json_loadb(jwt->claims_lazy+jwt->claims_index[i-1].value_offset, jwt->claims_index[i-1].value_len, JSON_DECODE_ANY, NULL)) != NULL) {
+          if (json_object_set_new(jwt->j_claims, key, j_value)) {
+            j_value = NULL;
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_claim_get - Error decoding claim '%s'", key);
+        }
+        break;
+      }
+    }
+  }
+  return j_value;
+}
+
+/**
+ * Decodes all the claims of the lazy payload in jwt->j_claims
+ * The claims already decoded are kept so the values returned
+ * by the getters remain valid
+ */
+static int r_jwt_claims_materialize(jwt_t * jwt) {
+  json_t * j_claims;
+  int ret = RHN_OK;
+
+  if (jwt->claims_lazy != NULL) {
+    if ((j_claims = json_loadb(jwt->claims_lazy, jwt->claims_lazy_len, JSON_DECODE_ANY, NULL)) != NULL) {
+      json_object_update_missing(jwt->j_claims, j_claims);
+      json_decref(j_claims);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_claims_materialize - Error parsing payload as JSON");
+      ret = RHN_ERROR_PARAM;
+    }
+    r_jwt_claims_lazy_clean(jwt);
+  }
+  return ret;
+}
+
+int r_jwt_reset(jwt_t * jwt) {
+  int ret;
+
+  if (jwt != NULL) {
+    jwt->type = R_JWT_TYPE_NONE;
+    jwt->parse_flags = R_PARSE_HEADER_ALL;
+    jwt->sign_alg = R_JWA_ALG_UNKNOWN;
+    jwt->enc_alg = R_JWA_ALG_UNKNOWN;
+    jwt->enc = R_JWA_ENC_UNKNOWN;
+    o_free(jwt->key);
+    jwt->key = NULL;
+    jwt->key_len = 0;
+    o_free(jwt->iv);
+    jwt->iv = NULL;
+    jwt->iv_len = 0;
+    // Keys added to the jwt from the token headers are removed
+    if (jwt->jwks_pubkey_sign_parse_size != _R_JWKS_PARSE_SIZE_NONE) {
+      _r_jwks_truncate(jwt->jwks_pubkey_sign, jwt->jwks_pubkey_sign_parse_size);
+      jwt->jwks_pubkey_sign_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+    }
+    if (jwt->jwks_pubkey_enc_parse_size != _R_JWKS_PARSE_SIZE_NONE) {
+      _r_jwks_truncate(jwt->jwks_pubkey_enc, jwt->jwks_pubkey_enc_parse_size);
+      jwt->jwks_pubkey_enc_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+    }
+    r_jwt_claims_lazy_clean(jwt);
+    if (r_jwt_reset_json(&jwt->j_header) != RHN_OK || r_jwt_reset_json(&jwt->j_claims) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_reset - Error allocating resources for j_header or j_claims");
+      ret = RHN_ERROR_MEMORY;
+    } else if ((jwt->jws != NULL && r_jwt_reset_jws(jwt) != RHN_OK) || (jwt->jwe != NULL && r_jwt_reset_jwe(jwt) != RHN_OK)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_reset - Error resetting jws or jwe");
+      ret = RHN_ERROR;
+    } else {
+      ret = RHN_OK;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwt_set_arena(jwt_t * jwt, r_arena_t * arena) {
+  if (jwt != NULL) {
+    jwt->arena = arena;
+    if (jwt->jws != NULL) {
+      r_jws_set_arena(jwt->jws, arena);
+    }
+    if (jwt->jwe != NULL) {
+      r_jwe_set_arena(jwt->jwe, arena);
+    }
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_set_policy(jwt_t * jwt, const r_policy_t * policy) {
+  if (jwt != NULL) {
+    jwt->policy = policy;
+    if (jwt->jws != NULL) {
+      r_jws_set_policy(jwt->jws, policy);
+    }
+    if (jwt->jwe != NULL) {
+      r_jwe_set_policy(jwt->jwe, policy);
+    }
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 jwt_t * r_jwt_copy(jwt_t * jwt) {
   jwt_t * jwt_copy = NULL;
 
-  if (jwt != NULL) {
+  if (jwt != NULL && r_jwt_claims_materialize(jwt) == RHN_OK) {
     if (r_jwt_init(&jwt_copy) == RHN_OK) {
       jwt_copy->sign_alg = jwt->sign_alg;
       jwt_copy->enc_alg = jwt->enc_alg;
       jwt_copy->enc = jwt->enc;
+      jwt_copy->policy = jwt->policy;
       json_decref(jwt_copy->j_header);
       if (r_jwt_set_full_claims_json_t(jwt_copy, jwt->j_claims) != RHN_OK ||
         r_jwt_add_enc_jwks(jwt_copy, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) != RHN_OK ||
@@ -194,7 +703,7 @@ char * r_jwt_get_full_header_str(jwt_t * jwt) {
 }
 
 int r_jwt_set_claim_str_value(jwt_t * jwt, const char * key, const char * str_value) {
-  if (jwt != NULL) {
+  if (jwt != NULL && r_jwt_claims_materialize(jwt) == RHN_OK) {
     return _r_json_set_str_value(jwt->j_claims, key, str_value);
   } else {
     return RHN_ERROR_PARAM;
@@ -202,7 +711,7 @@ int r_jwt_set_claim_str_value(jwt_t * jwt, const char * key, const char * str_va
 }
 
 int r_jwt_set_claim_int_value(jwt_t * jwt, const char * key, rhn_int_t i_value) {
-  if (jwt != NULL) {
+  if (jwt != NULL && r_jwt_claims_materialize(jwt) == RHN_OK) {
     return _r_json_set_int_value(jwt->j_claims, key, i_value);
   } else {
     return RHN_ERROR_PARAM;
@@ -210,7 +719,7 @@ int r_jwt_set_claim_int_value(jwt_t * jwt, const char * key, rhn_int_t i_value)
 }
 
 int r_jwt_set_claim_json_t_value(jwt_t * jwt, const char * key, json_t * j_value) {
-  if (jwt != NULL) {
+  if (jwt != NULL && r_jwt_claims_materialize(jwt) == RHN_OK) {
     return _r_json_set_json_t_value(jwt->j_claims, key, j_value);
   } else {
     return RHN_ERROR_PARAM;
@@ -219,6 +728,7 @@ int r_jwt_set_claim_json_t_value(jwt_t * jwt, const char * key, json_t * j_value
 
 const char * r_jwt_get_claim_str_value(jwt_t * jwt, const char * key) {
   if (jwt != NULL) {
+    r_jwt_claim_get(jwt, key);
     return _r_json_get_str_value(jwt->j_claims, key);
   }
   return NULL;
@@ -226,6 +736,7 @@ const char * r_jwt_get_claim_str_value(jwt_t * jwt, const char * key) {
 
 rhn_int_t r_jwt_get_claim_int_value(jwt_t * jwt, const char * key) {
   if (jwt != NULL) {
+    r_jwt_claim_get(jwt, key);
     return _r_json_get_int_value(jwt->j_claims, key);
   }
   return 0;
@@ -233,13 +744,14 @@ rhn_int_t r_jwt_get_claim_int_value(jwt_t * jwt, const char * key) {
 
 json_t * r_jwt_get_claim_json_t_value(jwt_t * jwt, const char * key) {
   if (jwt != NULL) {
+    r_jwt_claim_get(jwt, key);
     return _r_json_get_json_t_value(jwt->j_claims, key);
   }
   return NULL;
 }
 
 json_t * r_jwt_get_full_claims_json_t(jwt_t * jwt) {
-  if (jwt != NULL) {
+  if (jwt != NULL && r_jwt_claims_materialize(jwt) == RHN_OK) {
     return _r_json_get_full_json_t(jwt->j_claims);
   }
   return NULL;
@@ -247,7 +759,7 @@ json_t * r_jwt_get_full_claims_json_t(jwt_t * jwt) {
 
 char * r_jwt_get_full_claims_str(jwt_t * jwt) {
   char * to_return = NULL;
-  if (jwt != NULL) {
+  if (jwt != NULL && r_jwt_claims_materialize(jwt) == RHN_OK) {
     to_return = json_dumps(jwt->j_claims, JSON_COMPACT);
   }
   return to_return;
@@ -255,6 +767,7 @@ char * r_jwt_get_full_claims_str(jwt_t * jwt) {
 
 int r_jwt_set_full_claims_json_t(jwt_t * jwt, json_t * j_claim) {
   if (jwt != NULL && json_is_object(j_claim)) {
+    r_jwt_claims_lazy_clean(jwt);
     json_decref(jwt->j_claims);
     jwt->j_claims = json_deep_copy(j_claim);
     return RHN_OK;
@@ -285,7 +798,7 @@ int r_jwt_append_claims_json_t(jwt_t * jwt, json_t * j_claim) {
   json_t * j_claim_copy = json_deep_copy(j_claim);
   int ret;
 
-  if (jwt != NULL && j_claim_copy != NULL) {
+  if (jwt != NULL && j_claim_copy != NULL && r_jwt_claims_materialize(jwt) == RHN_OK) {
     if (!json_object_update(jwt->j_claims, j_claim_copy)) {
       ret = RHN_OK;
     } else {
@@ -1029,7 +1542,7 @@ char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_fla
       }
       json_decref(j_header);
       if (r_jws_add_jwks(jws, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) == RHN_OK) {
-        if ((payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
+        if (r_jwt_claims_materialize(jwt) == RHN_OK && (payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
           if (r_jws_set_alg(jws, alg) == RHN_OK && r_jws_set_payload(jws, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
             token = r_jws_serialize_unsecure(jws, privkey, x5u_flags);
           } else {
@@ -1052,73 +1565,361 @@ char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_fla
   return token;
 }
 
-char * r_jwt_serialize_encrypted(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
-  jwe_t * jwe = NULL;
-  char * token = NULL, * payload = NULL;
-  jwa_alg alg;
-  jwa_enc enc;
-  json_t * j_header, * j_value = NULL;
-  const char * key = NULL;
-  const unsigned char * key_iv;
-  size_t key_iv_len;
-
-  if (jwt != NULL && ((alg = r_jwt_get_enc_alg(jwt)) != R_JWA_ALG_UNKNOWN || (alg = r_str_to_jwa_alg(r_jwk_get_property_str(pubkey, "alg"))) != R_JWA_ALG_NONE) && (enc = r_jwt_get_enc(jwt)) != R_JWA_ENC_UNKNOWN) {
-    if (r_jwe_init(&jwe) == RHN_OK) {
-      if (r_jwt_get_header_str_value(jwt, "typ") == NULL) {
-        r_jwt_set_header_str_value(jwt, "typ", "JWT");
-      }
-      j_header = r_jwt_get_full_header_json_t(jwt);
-      json_object_foreach(j_header, key, j_value) {
-        r_jwe_set_header_json_t_value(jwe, key, j_value);
+/**
+ * Builds the payload of a token minted with a template:
+ * the claims skeleton followed by the members of the serialized object claims
+ */
+static char * r_jwt_template_build_payload(const r_jwt_template_t * jwt_template, const char * claims, size_t claims_len, size_t * payload_len) {
+  char * payload = NULL;
+  size_t start, end = claims_len;
+
+  start = r_jwt_claims_skip_ws(claims, claims_len, 0);
+  while (end > start && (claims[end-1] == ' ' || claims[end-1] == '\t' || claims[end-1] == '\n' || claims[end-1] == '\r')) {
+    end--;
+  }
+  if (end - start >= 2 && claims[start] == '{' && claims[end-1] == '}') {
+    start = r_jwt_claims_skip_ws(claims, end-1, start+1);
+    end--;
+    if (start == end) {
+      // No variable claim
+      if (jwt_template->claims_str != NULL) {
+        payload = o_strndup(jwt_template->claims_str, jwt_template->claims_str_len);
+        *payload_len = jwt_template->claims_str_len;
+      } else {
+        payload = o_strdup("{}");
+        *payload_len = 2;
       }
-      if ((key_iv = r_jwt_get_enc_cypher_key(jwt, &key_iv_len)) != NULL) {
-        r_jwe_set_cypher_key(jwe, key_iv, key_iv_len);
+    } else if (jwt_template->claims_str == NULL) {
+      if ((payload = o_malloc(end-start+3)) != NULL) {
+        payload[0] = '{';
+        memcpy(payload+1, claims+start, end-start);
+        payload[end-start+1] = '}';
+        payload[end-start+2] = '\0';
+        *payload_len = end-start+2;
       }
-      if ((key_iv = r_jwt_get_enc_iv(jwt, &key_iv_len)) != NULL) {
-        r_jwe_set_iv(jwe, key_iv, key_iv_len);
+    } else {
+      if ((payload = o_malloc(jwt_template->claims_str_len+end-start+2)) != NULL) {
+        memcpy(payload, jwt_template->claims_str, jwt_template->claims_str_len-1);
+        payload[jwt_template->claims_str_len-1] = ',';
+        memcpy(payload+jwt_template->claims_str_len, claims+start, end-start);
+        payload[jwt_template->claims_str_len+end-start] = '}';
+        payload[jwt_template->claims_str_len+end-start+1] = '\0';
+        *payload_len = jwt_template->claims_str_len+end-start+1;
       }
-      json_decref(j_header);
-      if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK) {
-        if ((payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
-          if (r_jwe_set_alg(jwe, alg) == RHN_OK && r_jwe_set_enc(jwe, enc) == RHN_OK && r_jwe_set_payload(jwe, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
-            token = r_jwe_serialize(jwe, pubkey, x5u_flags);
+    }
+    if (payload == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_build_payload - Error allocating resources for payload");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_build_payload - Error claims isn't a JSON object");
+  }
+  return payload;
+}
+
+/**
+ * Writes the token 'header.payload.signature' in a single buffer,
+ * the signing input is signed in place
+ */
+static char * r_jwt_template_sign(const r_jwt_template_t * jwt_template, const unsigned char * payload, size_t payload_len) {
+  unsigned char * token = NULL, * signature = NULL, * zip_payload = NULL, * tmp;
+  size_t zip_payload_len = 0, payload_b64url_len = 0, input_len, signature_len;
+
+  if (jwt_template->zip) {
+    if (_r_deflate_payload(payload, payload_len, &zip_payload, &zip_payload_len) == RHN_OK) {
+      payload = zip_payload;
+      payload_len = zip_payload_len;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_sign - Error _r_deflate_payload");
+      payload = NULL;
+    }
+  }
+  if (payload != NULL && _r_base64url_encode(payload, payload_len, NULL, &payload_b64url_len)) {
+    input_len = jwt_template->header_b64url_len+1+payload_b64url_len;
+    if ((token = o_malloc(input_len+jwt_template->signature_b64url_len+2)) != NULL) {
+      memcpy(token, jwt_template->header_b64url, jwt_template->header_b64url_len);
+      token[jwt_template->header_b64url_len] = '.';
+      _r_base64url_encode(payload, payload_len, token+jwt_template->header_b64url_len+1, &payload_b64url_len);
+      if ((signature = _r_jws_sign_input(jwt_template->jwk, jwt_template->alg, token, input_len, jwt_template->x5u_flags)) != NULL) {
+        signature_len = o_strlen((const char *)signature);
+        // Grow the buffer if the signature is longer than the one of the test token
+        if (signature_len > jwt_template->signature_b64url_len) {
+          if ((tmp = o_realloc(token, input_len+signature_len+2)) != NULL) {
+            token = tmp;
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error setting jwe");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_sign - Error reallocating resources for token");
+            o_free(token);
+            token = NULL;
           }
-          o_free(payload);
-        } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error json_dumps claims");
         }
+        if (token != NULL) {
+          token[input_len] = '.';
+          memcpy(token+input_len+1, signature, signature_len);
+          token[input_len+signature_len+1] = '\0';
+        }
+        o_free(signature);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error r_jwe_add_jwks");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_sign - Error _r_jws_sign_input");
+        o_free(token);
+        token = NULL;
       }
-      r_jwe_free(jwe);
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error r_jwe_init");
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_sign - Error allocating resources for token");
     }
-  } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error invalid input parameters");
+  } else if (payload != NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_sign - Error empty payload");
   }
-  return token;
+  o_free(zip_payload);
+  return (char *)token;
 }
 
-char * r_jwt_serialize_nested(jwt_t * jwt, unsigned int type, jwk_t * sign_key, int sign_key_x5u_flags, jwk_t * encrypt_key, int encrypt_key_x5u_flags) {
-  jwe_t * jwe = NULL;
-  jws_t * jws = NULL;
-  char * token = NULL, * token_intermediate = NULL;
-  jwa_alg sign_alg, enc_alg;
-  jwa_enc enc;
-  json_t * j_header, * j_value = NULL;
-  const char * key = NULL;
-
-  if (jwt != NULL &&
-      ((sign_alg = r_jwt_get_sign_alg(jwt)) != R_JWA_ALG_UNKNOWN ||
-      (sign_alg = r_str_to_jwa_alg(r_jwk_get_property_str(sign_key, "alg"))) != R_JWA_ALG_NONE) &&
-      ((enc_alg = r_jwt_get_enc_alg(jwt)) != R_JWA_ALG_UNKNOWN ||
-      (enc_alg = r_str_to_jwa_alg(r_jwk_get_property_str(encrypt_key, "alg"))) != R_JWA_ALG_NONE) &&
-      (enc = r_jwt_get_enc(jwt)) != R_JWA_ENC_UNKNOWN &&
-      r_jwt_get_sign_alg(jwt) != R_JWA_ALG_NONE) {
-    if (type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT) {
+int r_jwt_template_init(r_jwt_template_t ** jwt_template, jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
+  int ret = RHN_OK;
+  jwk_t * jwk = NULL;
+  jwa_alg alg = R_JWA_ALG_UNKNOWN;
+  char * token = NULL;
+  const char * header_end, * signature;
+
+  if (jwt_template != NULL && jwt != NULL) {
+    *jwt_template = NULL;
+    // Same key selection as r_jws_serialize_unsecure
+    if (privkey != NULL) {
+      jwk = r_jwk_copy(privkey);
+    } else if (r_jwt_get_header_str_value(jwt, "kid") != NULL) {
+      jwk = r_jwks_get_by_kid(jwt->jwks_privkey_sign, r_jwt_get_header_str_value(jwt, "kid"));
+    } else if (r_jwks_size(jwt->jwks_privkey_sign) == 1) {
+      jwk = r_jwks_get_at(jwt->jwks_privkey_sign, 0);
+    }
+    if ((alg = r_jwt_get_sign_alg(jwt)) == R_JWA_ALG_UNKNOWN) {
+      alg = r_str_to_jwa_alg(r_jwk_get_property_str(jwk, "alg"));
+    }
+    if (jwk == NULL || alg == R_JWA_ALG_NONE || alg == R_JWA_ALG_UNKNOWN) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_init - Error no signing key or algorithm");
+      ret = RHN_ERROR_PARAM;
+    } else if (r_jwt_set_sign_alg(jwt, alg) != RHN_OK || (token = r_jwt_serialize_signed(jwt, jwk, x5u_flags)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_init - Error signing test token");
+      ret = RHN_ERROR_PARAM;
+    } else if ((*jwt_template = o_malloc(sizeof(r_jwt_template_t))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_init - Error allocating resources for jwt_template");
+      ret = RHN_ERROR_MEMORY;
+    } else {
+      memset(*jwt_template, 0, sizeof(r_jwt_template_t));
+      (*jwt_template)->alg = alg;
+      (*jwt_template)->jwk = jwk;
+      jwk = NULL;
+      (*jwt_template)->x5u_flags = x5u_flags;
+      (*jwt_template)->zip = (0 == o_strcmp("DEF", r_jwt_get_header_str_value(jwt, "zip")));
+      // The test token gives the encoded header and the signature size
+      header_end = strchr(token, '.');
+      signature = strrchr(token, '.')+1;
+      (*jwt_template)->header_b64url_len = (size_t)(header_end - token);
+      (*jwt_template)->signature_b64url_len = o_strlen(signature);
+      if (((*jwt_template)->header_b64url = (unsigned char *)o_strndup(token, (*jwt_template)->header_b64url_len)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_init - Error allocating resources for header_b64url");
+        ret = RHN_ERROR_MEMORY;
+      } else if (json_object_size(jwt->j_claims)) {
+        if (((*jwt_template)->j_claims = json_deep_copy(jwt->j_claims)) == NULL ||
+            ((*jwt_template)->claims_str = json_dumps(jwt->j_claims, JSON_COMPACT)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_init - Error copying claims skeleton");
+          ret = RHN_ERROR_MEMORY;
+        } else {
+          (*jwt_template)->claims_str_len = o_strlen((*jwt_template)->claims_str);
+        }
+      }
+      if (ret != RHN_OK) {
+        r_jwt_template_free(*jwt_template);
+        *jwt_template = NULL;
+      }
+    }
+    r_jwk_free(jwk);
+    o_free(token);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_jwt_template_free(r_jwt_template_t * jwt_template) {
+  if (jwt_template != NULL) {
+    r_jwk_free(jwt_template->jwk);
+    o_free(jwt_template->header_b64url);
+    json_decref(jwt_template->j_claims);
+    o_free(jwt_template->claims_str);
+    o_free(jwt_template);
+  }
+}
+
+char * r_jwt_template_mint(const r_jwt_template_t * jwt_template, json_t * j_claims) {
+  char * token = NULL, * claims = NULL, * payload = NULL;
+  size_t payload_len = 0;
+  json_t * j_merged = NULL, * j_value = NULL;
+  const char * key = NULL;
+  int overlap = 0;
+
+  if (jwt_template != NULL && (j_claims == NULL || json_is_object(j_claims))) {
+    if (json_object_size(j_claims) && json_object_size(jwt_template->j_claims)) {
+      json_object_foreach(j_claims, key, j_value) {
+        if (json_object_get(jwt_template->j_claims, key) != NULL) {
+          overlap = 1;
+          break;
+        }
+      }
+    }
+    if (overlap) {
+      // The skeleton values are replaced, so the claims are merged before serializing
+      // The skeleton may be shared between threads, a deep copy never touches its members reference counters
+      if ((j_merged = json_deep_copy(jwt_template->j_claims)) != NULL && !json_object_update(j_merged, j_claims)) {
+        payload = json_dumps(j_merged, JSON_COMPACT);
+        payload_len = o_strlen(payload);
+      }
+      json_decref(j_merged);
+    } else if (j_claims != NULL && (claims = json_dumps(j_claims, JSON_COMPACT)) != NULL) {
+      payload = r_jwt_template_build_payload(jwt_template, claims, o_strlen(claims), &payload_len);
+      o_free(claims);
+    } else if (j_claims == NULL) {
+      payload = r_jwt_template_build_payload(jwt_template, "{}", 2, &payload_len);
+    }
+    if (payload != NULL) {
+      token = r_jwt_template_sign(jwt_template, (const unsigned char *)payload, payload_len);
+      o_free(payload);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_mint - Error serializing claims");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_mint - Error invalid input parameters");
+  }
+  return token;
+}
+
+char * r_jwt_template_mint_str(const r_jwt_template_t * jwt_template, const char * claims, size_t claims_len) {
+  char * token = NULL, * payload = NULL;
+  size_t payload_len = 0;
+
+  if (jwt_template != NULL && claims != NULL) {
+    if ((payload = r_jwt_template_build_payload(jwt_template, claims, claims_len, &payload_len)) != NULL) {
+      token = r_jwt_template_sign(jwt_template, (const unsigned char *)payload, payload_len);
+      o_free(payload);
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_template_mint_str - Error invalid input parameters");
+  }
+  return token;
+}
+
+/**
+ * Shared state of a r_jwt_serialize_signed_batch call
+ * Each task mints the token at its index with the shared template
+ */
+struct _r_jwt_sign_batch {
+  const r_jwt_template_t  * jwt_template;
+  json_t                 ** claims;
+  const char             ** claims_str;
+  char                   ** tokens;
+};
+
+static void _r_jwt_sign_batch_task(void * data, size_t index) {
+  struct _r_jwt_sign_batch * batch = (struct _r_jwt_sign_batch *)data;
+
+  if (batch->claims != NULL) {
+    batch->tokens[index] = r_jwt_template_mint(batch->jwt_template, batch->claims[index]);
+  } else {
+    batch->tokens[index] = r_jwt_template_mint_str(batch->jwt_template, batch->claims_str[index], o_strlen(batch->claims_str[index]));
+  }
+}
+
+int r_jwt_serialize_signed_batch(jwt_t * jwt, jwk_t * privkey, int x5u_flags, json_t ** claims, const char ** claims_str, size_t nb_tokens, unsigned int nb_threads, char ** tokens) {
+  struct _r_jwt_sign_batch batch;
+  r_jwt_template_t * jwt_template = NULL;
+  long nb_cpu;
+  int ret;
+
+  if (jwt != NULL && ((claims != NULL) ^ (claims_str != NULL)) && nb_tokens && tokens != NULL) {
+    if ((ret = r_jwt_template_init(&jwt_template, jwt, privkey, x5u_flags)) == RHN_OK) {
+      if (!nb_threads) {
+        nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = nb_cpu>0?(unsigned int)nb_cpu:1;
+      }
+      batch.jwt_template = jwt_template;
+      batch.claims = claims;
+      batch.claims_str = claims_str;
+      batch.tokens = tokens;
+      ret = _r_parallel_run(nb_threads, nb_tokens, _r_jwt_sign_batch_task, &batch);
+      r_jwt_template_free(jwt_template);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed_batch - Error r_jwt_template_init");
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+char * r_jwt_serialize_encrypted(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
+  jwe_t * jwe = NULL;
+  char * token = NULL, * payload = NULL;
+  jwa_alg alg;
+  jwa_enc enc;
+  json_t * j_header, * j_value = NULL;
+  const char * key = NULL;
+  const unsigned char * key_iv;
+  size_t key_iv_len;
+
+  if (jwt != NULL && ((alg = r_jwt_get_enc_alg(jwt)) != R_JWA_ALG_UNKNOWN || (alg = r_str_to_jwa_alg(r_jwk_get_property_str(pubkey, "alg"))) != R_JWA_ALG_NONE) && (enc = r_jwt_get_enc(jwt)) != R_JWA_ENC_UNKNOWN) {
+    if (r_jwe_init(&jwe) == RHN_OK) {
+      if (r_jwt_get_header_str_value(jwt, "typ") == NULL) {
+        r_jwt_set_header_str_value(jwt, "typ", "JWT");
+      }
+      j_header = r_jwt_get_full_header_json_t(jwt);
+      json_object_foreach(j_header, key, j_value) {
+        r_jwe_set_header_json_t_value(jwe, key, j_value);
+      }
+      if ((key_iv = r_jwt_get_enc_cypher_key(jwt, &key_iv_len)) != NULL) {
+        r_jwe_set_cypher_key(jwe, key_iv, key_iv_len);
+      }
+      if ((key_iv = r_jwt_get_enc_iv(jwt, &key_iv_len)) != NULL) {
+        r_jwe_set_iv(jwe, key_iv, key_iv_len);
+      }
+      json_decref(j_header);
+      if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK) {
+        if (r_jwt_claims_materialize(jwt) == RHN_OK && (payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
+          if (r_jwe_set_alg(jwe, alg) == RHN_OK && r_jwe_set_enc(jwe, enc) == RHN_OK && r_jwe_set_payload(jwe, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
+            token = r_jwe_serialize(jwe, pubkey, x5u_flags);
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error setting jwe");
+          }
+          o_free(payload);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error json_dumps claims");
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error r_jwe_add_jwks");
+      }
+      r_jwe_free(jwe);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error r_jwe_init");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_encrypted - Error invalid input parameters");
+  }
+  return token;
+}
+
+char * r_jwt_serialize_nested(jwt_t * jwt, unsigned int type, jwk_t * sign_key, int sign_key_x5u_flags, jwk_t * encrypt_key, int encrypt_key_x5u_flags) {
+  jwe_t * jwe = NULL;
+  jws_t * jws = NULL;
+  char * token = NULL, * token_intermediate = NULL;
+  jwa_alg sign_alg, enc_alg;
+  jwa_enc enc;
+  json_t * j_header, * j_value = NULL;
+  const char * key = NULL;
+
+  if (jwt != NULL &&
+      ((sign_alg = r_jwt_get_sign_alg(jwt)) != R_JWA_ALG_UNKNOWN ||
+      (sign_alg = r_str_to_jwa_alg(r_jwk_get_property_str(sign_key, "alg"))) != R_JWA_ALG_NONE) &&
+      ((enc_alg = r_jwt_get_enc_alg(jwt)) != R_JWA_ALG_UNKNOWN ||
+      (enc_alg = r_str_to_jwa_alg(r_jwk_get_property_str(encrypt_key, "alg"))) != R_JWA_ALG_NONE) &&
+      (enc = r_jwt_get_enc(jwt)) != R_JWA_ENC_UNKNOWN &&
+      r_jwt_get_sign_alg(jwt) != R_JWA_ALG_NONE) {
+    if (type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT) {
       if ((token_intermediate = r_jwt_serialize_signed(jwt, sign_key, sign_key_x5u_flags)) != NULL) {
         if (r_jwe_init(&jwe) == RHN_OK) {
           if (r_jwe_get_header_str_value(jwe, "typ") != NULL) {
@@ -1203,36 +2004,61 @@ int r_jwt_advanced_parse(jwt_t * jwt, const char * token, uint32_t parse_flags,
   return r_jwt_advanced_parsen(jwt, token, o_strlen(token), parse_flags, x5u_flags);
 }
 
-int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, int x5u_flags) {
+/**
+ * Parses a JWT
+ * If verify is set, the token must be signed and its signature
+ * is verified with the jwt keys before the payload is decoded
+ */
+static int r_jwt_parsen_verify_internal(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, int x5u_flags, int verify, jwk_t * verify_key) {
   size_t payload_len = 0;
   int ret, res, token_type = R_JWT_TYPE_NONE;
   const unsigned char * payload = NULL;
-  char * payload_str = NULL;
+  jwks_t * jwks_privkey, * jwks_pubkey;
 
   if (jwt != NULL && token != NULL && token_len) {
     jwt->parse_flags = parse_flags;
+    // Keys added from the token headers are removed by r_jwt_reset
+    if (jwt->jwks_pubkey_sign_parse_size == _R_JWKS_PARSE_SIZE_NONE) {
+      jwt->jwks_pubkey_sign_parse_size = r_jwks_size(jwt->jwks_pubkey_sign);
+    }
+    if (jwt->jwks_pubkey_enc_parse_size == _R_JWKS_PARSE_SIZE_NONE) {
+      jwt->jwks_pubkey_enc_parse_size = r_jwks_size(jwt->jwks_pubkey_enc);
+    }
     token_type = r_jwt_token_typen(token, token_len);
     if (R_JWT_TYPE_SIGN == token_type) { // JWS
-      r_jws_free(jwt->jws);
-      if ((r_jws_init(&jwt->jws)) == RHN_OK) {
-        if ((res = r_jws_advanced_compact_parsen(jwt->jws, token, token_len, parse_flags, x5u_flags)) == RHN_OK) {
+      if (r_jwt_reset_jws(jwt) == RHN_OK) {
+        if (verify) {
+          // Lend the jwt keys to the jws, the keys found in the header are added to the jwt keys
+          jwks_privkey = jwt->jws->jwks_privkey;
+          jwks_pubkey = jwt->jws->jwks_pubkey;
+          jwt->jws->jwks_privkey = jwt->jwks_privkey_sign;
+          jwt->jws->jwks_pubkey = jwt->jwks_pubkey_sign;
+          res = r_jws_compact_parsen_verify(jwt->jws, token, token_len, parse_flags, verify_key, x5u_flags);
+          jwt->jws->jwks_privkey = jwks_privkey;
+          jwt->jws->jwks_pubkey = jwks_pubkey;
+          jwt->jws->jwks_pubkey_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+        } else {
+          res = r_jws_advanced_compact_parsen(jwt->jws, token, token_len, parse_flags, x5u_flags);
+        }
+        if (res == RHN_OK) {
           json_decref(jwt->j_header);
           jwt->j_header = json_deep_copy(jwt->jws->j_header);
+          r_jwt_claims_lazy_clean(jwt);
           json_decref(jwt->j_claims);
           jwt->j_claims = NULL;
           jwt->sign_alg = jwt->jws->alg;
-          r_jwt_add_sign_jwks(jwt, jwt->jws->jwks_privkey, jwt->jws->jwks_pubkey);
+          if (!verify) {
+            r_jwt_add_sign_jwks(jwt, jwt->jws->jwks_privkey, jwt->jws->jwks_pubkey);
+          }
           if (0 != o_strcmp("JWT", r_jwt_get_header_str_value(jwt, "cty"))) {
             jwt->type = R_JWT_TYPE_SIGN;
             if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
-              payload_str = o_strndup((const char *)payload, payload_len);
-              if ((jwt->j_claims = json_loads(payload_str, JSON_DECODE_ANY, NULL)) != NULL) {
+              if (r_jwt_load_claims(jwt, payload, payload_len) == RHN_OK) {
                 ret = RHN_OK;
               } else {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error parsing payload as JSON");
                 ret = RHN_ERROR;
               }
-              o_free(payload_str);
             } else {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error getting payload");
               ret = RHN_ERROR;
@@ -1242,8 +2068,7 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
             jwt->type = R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN;
             if (r_jws_get_alg(jwt->jws) != R_JWA_ALG_NONE) {
               if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
-                r_jwe_free(jwt->jwe);
-                if (r_jwe_init(&jwt->jwe) == RHN_OK) {
+                if (r_jwt_reset_jwe(jwt) == RHN_OK) {
                   if (r_jwe_advanced_compact_parsen(jwt->jwe, (const char *)payload, payload_len, parse_flags, x5u_flags) == RHN_OK) {
                     ret = RHN_OK;
                   } else {
@@ -1262,7 +2087,7 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
               ret = RHN_ERROR_INVALID;
             }
           }
-        } else if (res == RHN_ERROR_PARAM || res == RHN_ERROR_INVALID) {
+        } else if (res == RHN_ERROR_PARAM || res == RHN_ERROR_INVALID || res == RHN_ERROR_UNSUPPORTED) {
           ret = res;
         } else {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error r_jws_advanced_compact_parsen");
@@ -1272,9 +2097,11 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error r_jws_init");
         ret = RHN_ERROR;
       }
+    } else if (R_JWT_TYPE_ENCRYPT == token_type && verify) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen_verify - Error token isn't signed");
+      ret = RHN_ERROR_PARAM;
     } else if (R_JWT_TYPE_ENCRYPT == token_type) { // JWE
-      r_jwe_free(jwt->jwe);
-      if ((r_jwe_init(&jwt->jwe)) == RHN_OK) {
+      if (r_jwt_reset_jwe(jwt) == RHN_OK) {
         if ((res = r_jwe_advanced_compact_parsen(jwt->jwe, token, token_len, parse_flags, x5u_flags)) == RHN_OK) {
           json_decref(jwt->j_header);
           jwt->j_header = json_deep_copy(jwt->jwe->j_header);
@@ -1309,6 +2136,18 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
   return ret;
 }
 
+int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, int x5u_flags) {
+  return r_jwt_parsen_verify_internal(jwt, token, token_len, parse_flags, x5u_flags, 0, NULL);
+}
+
+int r_jwt_parsen_verify(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, jwk_t * verify_key, int x5u_flags) {
+  return r_jwt_parsen_verify_internal(jwt, token, token_len, parse_flags, x5u_flags, 1, verify_key);
+}
+
+int r_jwt_parse_verify(jwt_t * jwt, const char * token, uint32_t parse_flags, jwk_t * verify_key, int x5u_flags) {
+  return r_jwt_parsen_verify(jwt, token, o_strlen(token), parse_flags, verify_key, x5u_flags);
+}
+
 jwt_t * r_jwt_quick_parse(const char * token, uint32_t parse_flags, int x5u_flags) {
   return r_jwt_quick_parsen(token, o_strlen(token), parse_flags, x5u_flags);
 }
@@ -1339,37 +2178,439 @@ int r_jwt_get_type(jwt_t * jwt) {
 }
 
 int r_jwt_verify_signature(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
-  size_t jwks_size, i;
-  jwk_t * jwk;
+  int ret;
+  jwks_t * jwks_privkey, * jwks_pubkey;
 
   if (jwt != NULL && jwt->jws != NULL) {
     r_jwks_empty(jwt->jws->jwks_privkey);
     r_jwks_empty(jwt->jws->jwks_pubkey);
-    jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
-    for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
-      r_jws_add_keys(jwt->jws, jwk, NULL);
-      r_jwk_free(jwk);
+    // Lend the jwt keys to the jws instead of copying them one by one
+    jwks_privkey = jwt->jws->jwks_privkey;
+    jwks_pubkey = jwt->jws->jwks_pubkey;
+    jwt->jws->jwks_privkey = jwt->jwks_privkey_sign;
+    jwt->jws->jwks_pubkey = jwt->jwks_pubkey_sign;
+    ret = r_jws_verify_signature(jwt->jws, pubkey, x5u_flags);
+    jwt->jws->jwks_privkey = jwks_privkey;
+    jwt->jws->jwks_pubkey = jwks_pubkey;
+    return ret;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+/**
+ * Shared state of a r_jwt_verify_batch call
+ * The workers pick the next token to verify under lock
+ */
+struct _r_jwt_batch {
+  const char    ** tokens;
+  size_t           nb_tokens;
+  size_t           next;
+  jwks_t         * jwks_pubkey;
+  int              x5u_flags;
+  int            * status;
+  json_t        ** claims;
+  pthread_mutex_t  lock;
+};
+
+static void * _r_jwt_verify_batch_worker(void * args) {
+  struct _r_jwt_batch * batch = (struct _r_jwt_batch *)args;
+  jwks_t * jwks_pubkey, * jwks_pubkey_sign;
+  jwt_t * jwt;
+  size_t index;
+  int ret;
+
+  // Each worker verifies with its own copy of the keys, so jansson objects are never shared between threads
+  pthread_mutex_lock(&batch->lock);
+  jwks_pubkey = r_jwks_copy(batch->jwks_pubkey);
+  pthread_mutex_unlock(&batch->lock);
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    index = batch->next;
+    if (batch->next < batch->nb_tokens) {
+      batch->next++;
     }
-    jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
-    for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
-      r_jws_add_keys(jwt->jws, NULL, jwk);
-      r_jwk_free(jwk);
+    pthread_mutex_unlock(&batch->lock);
+    if (index >= batch->nb_tokens) {
+      break;
+    }
+    if (batch->claims != NULL) {
+      batch->claims[index] = NULL;
+    }
+    if (jwks_pubkey == NULL) {
+      ret = RHN_ERROR_MEMORY;
+    } else if (r_jwt_init(&jwt) == RHN_OK) {
+      if ((ret = r_jwt_advanced_parse(jwt, batch->tokens[index], R_PARSE_ZERO_COPY, batch->x5u_flags)) == RHN_OK) {
+        jwks_pubkey_sign = jwt->jwks_pubkey_sign;
+        jwt->jwks_pubkey_sign = jwks_pubkey;
+        ret = r_jwt_verify_signature(jwt, NULL, batch->x5u_flags);
+        jwt->jwks_pubkey_sign = jwks_pubkey_sign;
+        if (ret == RHN_OK && batch->claims != NULL) {
+          batch->claims[index] = r_jwt_get_full_claims_json_t(jwt);
+        }
+      }
+      r_jwt_free(jwt);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_batch - Error r_jwt_init");
+      ret = RHN_ERROR_MEMORY;
+    }
+    batch->status[index] = ret;
+  }
+  r_jwks_free(jwks_pubkey);
+  return NULL;
+}
+
+int r_jwt_verify_batch(const char ** tokens, size_t nb_tokens, jwks_t * jwks_pubkey, int x5u_flags, unsigned int nb_threads, int * status, json_t ** claims) {
+  struct _r_jwt_batch batch;
+  pthread_t * threads = NULL;
+  unsigned int i, nb_started = 0;
+  long nb_cpu;
+  int ret = RHN_OK;
+
+  if (tokens != NULL && nb_tokens && r_jwks_size(jwks_pubkey) && status != NULL) {
+    if (!nb_threads) {
+      nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+      nb_threads = nb_cpu>0?(unsigned int)nb_cpu:1;
+    }
+    if (nb_threads > nb_tokens) {
+      nb_threads = (unsigned int)nb_tokens;
+    }
+    batch.tokens = tokens;
+    batch.nb_tokens = nb_tokens;
+    batch.next = 0;
+    batch.jwks_pubkey = jwks_pubkey;
+    batch.x5u_flags = x5u_flags;
+    batch.status = status;
+    batch.claims = claims;
+    if (!pthread_mutex_init(&batch.lock, NULL)) {
+      // The calling thread is a worker too
+      if (nb_threads > 1 && (threads = o_malloc((nb_threads-1)*sizeof(pthread_t))) != NULL) {
+        for (i=0; i<nb_threads-1; i++) {
+          if (pthread_create(&threads[nb_started], NULL, _r_jwt_verify_batch_worker, &batch)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_batch - Error pthread_create, continue with %u threads", nb_started+1);
+            break;
+          }
+          nb_started++;
+        }
+      }
+      _r_jwt_verify_batch_worker(&batch);
+      for (i=0; i<nb_started; i++) {
+        pthread_join(threads[i], NULL);
+      }
+      o_free(threads);
+      pthread_mutex_destroy(&batch.lock);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_batch - Error pthread_mutex_init");
+      ret = RHN_ERROR;
     }
-    return r_jws_verify_signature(jwt->jws, pubkey, x5u_flags);
   } else {
-    return RHN_ERROR_PARAM;
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+/**
+ * A token submitted to a r_jwt_verifier_t
+ */
+struct _r_jwt_verifier_job {
+  char                       * token;
+  size_t                       token_len;
+  r_jwt_verify_callback        callback;
+  void                       * user_data;
+  int                          status;
+  jwt_t                      * jwt;
+  struct _r_jwt_verifier_job * next;
+};
+
+/**
+ * The workers take the jobs in the pending queue and move them
+ * to the done queue, the done queue is emptied by r_jwt_verifier_dispatch
+ */
+struct _r_jwt_verifier {
+  jwks_t                     * jwks_pubkey;
+  uint32_t                     parse_flags;
+  int                          x5u_flags;
+  int                          fd_read;
+  int                          fd_write;
+  pthread_t                  * threads;
+  unsigned int                 nb_threads;
+  int                          stop;
+  pthread_mutex_t              lock;
+  pthread_cond_t               cond;
+  struct _r_jwt_verifier_job * pending_first;
+  struct _r_jwt_verifier_job * pending_last;
+  struct _r_jwt_verifier_job * done_first;
+  struct _r_jwt_verifier_job * done_last;
+};
+
+static void _r_jwt_verifier_job_free(struct _r_jwt_verifier_job * job) {
+  r_jwt_free(job->jwt);
+  o_free(job->token);
+  o_free(job);
+}
+
+static void _r_jwt_verifier_signal(r_jwt_verifier_t * verifier) {
+  uint64_t value = 1;
+
+  if (write(verifier->fd_write, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier - Error writing completion event");
+  }
+}
+
+static void * _r_jwt_verifier_worker(void * args) {
+  r_jwt_verifier_t * verifier = (r_jwt_verifier_t *)args;
+  struct _r_jwt_verifier_job * job;
+  jwks_t * jwks_pubkey, * jwks_pubkey_sign;
+  size_t jwks_size;
+
+  // Each worker verifies with its own copy of the keys, so jansson objects are never shared between threads
+  pthread_mutex_lock(&verifier->lock);
+  jwks_pubkey = r_jwks_copy(verifier->jwks_pubkey);
+  pthread_mutex_unlock(&verifier->lock);
+  jwks_size = r_jwks_size(jwks_pubkey);
+  while (1) {
+    pthread_mutex_lock(&verifier->lock);
+    while (!verifier->stop && verifier->pending_first == NULL) {
+      pthread_cond_wait(&verifier->cond, &verifier->lock);
+    }
+    if ((job = verifier->pending_first) != NULL) {
+      if ((verifier->pending_first = job->next) == NULL) {
+        verifier->pending_last = NULL;
+      }
+      job->next = NULL;
+    }
+    pthread_mutex_unlock(&verifier->lock);
+    if (job == NULL) {
+      break;
+    }
+    if (verifier->jwks_pubkey != NULL && jwks_pubkey == NULL) {
+      job->status = RHN_ERROR_MEMORY;
+    } else if (r_jwt_init(&job->jwt) == RHN_OK) {
+      if (jwks_pubkey != NULL) {
+        jwks_pubkey_sign = job->jwt->jwks_pubkey_sign;
+        job->jwt->jwks_pubkey_sign = jwks_pubkey;
+        job->status = r_jwt_parsen_verify(job->jwt, job->token, job->token_len, verifier->parse_flags, NULL, verifier->x5u_flags);
+        // Remove the keys found in the token header before the next token
+        _r_jwks_truncate(jwks_pubkey, jwks_size);
+        job->jwt->jwks_pubkey_sign = jwks_pubkey_sign;
+        job->jwt->jwks_pubkey_sign_parse_size = _R_JWKS_PARSE_SIZE_NONE;
+      } else {
+        job->status = r_jwt_parsen_verify(job->jwt, job->token, job->token_len, verifier->parse_flags, NULL, verifier->x5u_flags);
+      }
+      if (job->status != RHN_OK) {
+        r_jwt_free(job->jwt);
+        job->jwt = NULL;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier - Error r_jwt_init");
+      job->status = RHN_ERROR_MEMORY;
+    }
+    pthread_mutex_lock(&verifier->lock);
+    if (verifier->done_last != NULL) {
+      verifier->done_last->next = job;
+    } else {
+      verifier->done_first = job;
+    }
+    verifier->done_last = job;
+    _r_jwt_verifier_signal(verifier);
+    pthread_mutex_unlock(&verifier->lock);
+  }
+  r_jwks_free(jwks_pubkey);
+  return NULL;
+}
+
+int r_jwt_verifier_init(r_jwt_verifier_t ** verifier, jwks_t * jwks_pubkey, uint32_t parse_flags, int x5u_flags, unsigned int nb_threads) {
+  int ret = RHN_OK, fds[2] = {-1, -1};
+  unsigned int i;
+  long nb_cpu;
+
+  if (verifier != NULL) {
+    if ((*verifier = o_malloc(sizeof(r_jwt_verifier_t))) != NULL) {
+      memset(*verifier, 0, sizeof(r_jwt_verifier_t));
+      (*verifier)->fd_read = -1;
+      (*verifier)->fd_write = -1;
+      // The token is released after the callback, so the jwt can't reference it
+      (*verifier)->parse_flags = parse_flags & (uint32_t)~R_PARSE_ZERO_COPY;
+      (*verifier)->x5u_flags = x5u_flags;
+      if (!nb_threads) {
+        nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = nb_cpu>0?(unsigned int)nb_cpu:1;
+      }
+#ifdef __linux__
+      if ((fds[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) >= 0) {
+        fds[1] = fds[0];
+      }
+#else
+      if (!pipe(fds)) {
+        if (fcntl(fds[0], F_SETFL, O_NONBLOCK) || fcntl(fds[1], F_SETFL, O_NONBLOCK)) {
+          close(fds[0]);
+          close(fds[1]);
+          fds[0] = fds[1] = -1;
+        }
+      }
+#endif
+      if (fds[0] < 0) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error creating completion event");
+        ret = RHN_ERROR;
+      } else if (jwks_pubkey != NULL && ((*verifier)->jwks_pubkey = r_jwks_copy(jwks_pubkey)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error r_jwks_copy");
+        ret = RHN_ERROR_MEMORY;
+      } else if (((*verifier)->threads = o_malloc(nb_threads*sizeof(pthread_t))) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error allocating resources for threads");
+        ret = RHN_ERROR_MEMORY;
+      } else if (pthread_mutex_init(&(*verifier)->lock, NULL)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error pthread_mutex_init");
+        ret = RHN_ERROR;
+      } else if (pthread_cond_init(&(*verifier)->cond, NULL)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error pthread_cond_init");
+        pthread_mutex_destroy(&(*verifier)->lock);
+        ret = RHN_ERROR;
+      } else {
+        (*verifier)->fd_read = fds[0];
+        (*verifier)->fd_write = fds[1];
+        for (i=0; i<nb_threads; i++) {
+          if (pthread_create(&(*verifier)->threads[(*verifier)->nb_threads], NULL, _r_jwt_verifier_worker, *verifier)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error pthread_create, continue with %u threads", (*verifier)->nb_threads);
+            break;
+          }
+          (*verifier)->nb_threads++;
+        }
+        if (!(*verifier)->nb_threads) {
+          r_jwt_verifier_free(*verifier);
+          *verifier = NULL;
+          ret = RHN_ERROR;
+        }
+      }
+      if (ret != RHN_OK && *verifier != NULL) {
+        if (fds[0] >= 0) {
+          close(fds[0]);
+          if (fds[1] != fds[0]) {
+            close(fds[1]);
+          }
+        }
+        r_jwks_free((*verifier)->jwks_pubkey);
+        o_free((*verifier)->threads);
+        o_free(*verifier);
+        *verifier = NULL;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error allocating resources for verifier");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwt_verifier_get_fd(r_jwt_verifier_t * verifier) {
+  if (verifier != NULL) {
+    return verifier->fd_read;
+  } else {
+    return -1;
+  }
+}
+
+int r_jwt_verifier_submit(r_jwt_verifier_t * verifier, const char * token, size_t token_len, r_jwt_verify_callback callback, void * user_data) {
+  struct _r_jwt_verifier_job * job;
+  int ret;
+
+  if (verifier != NULL && token != NULL && token_len && callback != NULL) {
+    if ((job = o_malloc(sizeof(struct _r_jwt_verifier_job))) != NULL) {
+      if ((job->token = o_strndup(token, token_len)) != NULL) {
+        job->token_len = token_len;
+        job->callback = callback;
+        job->user_data = user_data;
+        job->status = RHN_ERROR;
+        job->jwt = NULL;
+        job->next = NULL;
+        pthread_mutex_lock(&verifier->lock);
+        if (verifier->pending_last != NULL) {
+          verifier->pending_last->next = job;
+        } else {
+          verifier->pending_first = job;
+        }
+        verifier->pending_last = job;
+        pthread_cond_signal(&verifier->cond);
+        pthread_mutex_unlock(&verifier->lock);
+        ret = RHN_OK;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_submit - Error allocating resources for token");
+        o_free(job);
+        ret = RHN_ERROR_MEMORY;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_submit - Error allocating resources for job");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+size_t r_jwt_verifier_dispatch(r_jwt_verifier_t * verifier) {
+  struct _r_jwt_verifier_job * job, * next;
+  unsigned char buffer[64];
+  size_t nb_done = 0;
+
+  if (verifier != NULL) {
+    // Clear the completion event before taking the done queue, so a job completed afterwards signals again
+    while (read(verifier->fd_read, buffer, sizeof(buffer)) > 0);
+    pthread_mutex_lock(&verifier->lock);
+    job = verifier->done_first;
+    verifier->done_first = verifier->done_last = NULL;
+    pthread_mutex_unlock(&verifier->lock);
+    while (job != NULL) {
+      next = job->next;
+      job->callback(job->user_data, job->status, job->jwt);
+      _r_jwt_verifier_job_free(job);
+      nb_done++;
+      job = next;
+    }
+  }
+  return nb_done;
+}
+
+void r_jwt_verifier_free(r_jwt_verifier_t * verifier) {
+  struct _r_jwt_verifier_job * job, * next;
+  unsigned int i;
+
+  if (verifier != NULL) {
+    pthread_mutex_lock(&verifier->lock);
+    verifier->stop = 1;
+    // The tokens not verified yet are cancelled
+    job = verifier->pending_first;
+    verifier->pending_first = verifier->pending_last = NULL;
+    pthread_cond_broadcast(&verifier->cond);
+    pthread_mutex_unlock(&verifier->lock);
+    for (i=0; i<verifier->nb_threads; i++) {
+      pthread_join(verifier->threads[i], NULL);
+    }
+    r_jwt_verifier_dispatch(verifier);
+    while (job != NULL) {
+      next = job->next;
+      job->callback(job->user_data, RHN_ERROR, NULL);
+      _r_jwt_verifier_job_free(job);
+      job = next;
+    }
+    pthread_cond_destroy(&verifier->cond);
+    pthread_mutex_destroy(&verifier->lock);
+    close(verifier->fd_read);
+    if (verifier->fd_write != verifier->fd_read) {
+      close(verifier->fd_write);
+    }
+    r_jwks_free(verifier->jwks_pubkey);
+    o_free(verifier->threads);
+    o_free(verifier);
   }
 }
 
 int r_jwt_decrypt(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
   const unsigned char * payload = NULL;
   size_t payload_len = 0, jwks_size, i;
-  json_t * j_payload = NULL;
   int res, ret;
   jwk_t * jwk;
-  char * str_payload;
 
   if (jwt != NULL && jwt->jwe != NULL) {
     r_jwks_empty(jwt->jwe->jwks_privkey);
@@ -1388,19 +2629,14 @@ int r_jwt_decrypt(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
     }
     if ((res = r_jwe_decrypt(jwt->jwe, privkey, x5u_flags)) == RHN_OK) {
       if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
-        str_payload = o_strndup((const char *)payload, payload_len);
-        if ((j_payload = json_loads(str_payload, JSON_DECODE_ANY, NULL)) != NULL) {
-          if (r_jwt_set_full_claims_json_t(jwt, j_payload) == RHN_OK) {
-            ret = RHN_OK;
-          } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt - Error r_jwt_set_full_claims_json_t");
-            ret = RHN_ERROR;
-          }
-        } else {
+        if ((res = r_jwt_load_claims(jwt, payload, payload_len)) == RHN_OK) {
+          ret = RHN_OK;
+        } else if (res == RHN_ERROR_PARAM) {
           ret = RHN_ERROR_PARAM;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt - Error r_jwt_load_claims");
+          ret = RHN_ERROR;
         }
-        json_decref(j_payload);
-        o_free(str_payload);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt - Error getting jwe payload");
         ret = RHN_ERROR;
@@ -1419,9 +2655,7 @@ int r_jwt_decrypt(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
 
 int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_key_x5u_flags, jwk_t * decrypt_key, int decrypt_key_x5u_flags) {
   const unsigned char * payload = NULL;
-  char * str_payload;
   size_t payload_len = 0, jwks_size, i;
-  json_t * j_payload = NULL;
   int res, ret;
   jwk_t * jwk;
 
@@ -1454,15 +2688,10 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
         }
         if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
           if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
-            str_payload = o_strndup((const char *)payload, payload_len);
-            if ((j_payload = json_loads(str_payload, JSON_DECODE_ANY, NULL)) != NULL) {
-              ret = r_jwt_set_full_claims_json_t(jwt, j_payload);
-            } else {
+            if ((ret = r_jwt_load_claims(jwt, payload, payload_len)) != RHN_OK) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_verify_signature_nested - Error JWE payload format");
               ret = RHN_ERROR;
             }
-            json_decref(j_payload);
-            o_free(str_payload);
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_verify_signature_nested - Error getting JWE payload");
             ret = RHN_ERROR;
@@ -1494,9 +2723,8 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
       }
       if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
         if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
-          r_jws_free(jwt->jws);
-          if ((r_jws_init(&jwt->jws)) == RHN_OK) {
-            if (r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags, verify_key_x5u_flags) == RHN_OK) {
+          if (r_jwt_reset_jws(jwt) == RHN_OK) {
+            if (r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags&(~(uint32_t)R_PARSE_ZERO_COPY), verify_key_x5u_flags) == RHN_OK) {
               jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
               for (i=0; i<jwks_size; i++) {
                 jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
@@ -1509,19 +2737,18 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
                 r_jws_add_keys(jwt->jws, NULL, jwk);
                 r_jwk_free(jwk);
               }
+              r_jwt_claims_lazy_clean(jwt);
               json_decref(jwt->j_claims);
               jwt->j_claims = NULL;
               jwt->sign_alg = jwt->jws->alg;
               if ((res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags)) == RHN_OK) {
                 if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
-                  str_payload = o_strndup((const char *)payload, payload_len);
-                  if ((jwt->j_claims = json_loads(str_payload, JSON_DECODE_ANY, NULL)) != NULL) {
+                  if (r_jwt_load_claims(jwt, payload, payload_len) == RHN_OK) {
                     ret = RHN_OK;
                   } else {
                     y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_verify_signature_nested - Error parsing payload as JSON");
                     ret = RHN_ERROR;
                   }
-                  o_free(str_payload);
                 } else {
                   y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_verify_signature_nested - Error getting payload");
                   ret = RHN_ERROR;
@@ -1563,11 +2790,9 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
 
 int r_jwt_decrypt_nested(jwt_t * jwt, jwk_t * decrypt_key, int decrypt_key_x5u_flags) {
   int ret, res;
-  json_t * j_payload;
   jwk_t * jwk;
   size_t jwks_size, payload_len = 0, i;
   const unsigned char * payload = NULL;
-  char * str_payload;
 
   if (jwt != NULL && jwt->jwe != NULL && (jwt->type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN || jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT)) {
     jwks_size = r_jwks_size(jwt->jwks_privkey_enc);
@@ -1585,26 +2810,20 @@ int r_jwt_decrypt_nested(jwt_t * jwt, jwk_t * decrypt_key, int decrypt_key_x5u_f
     if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
       if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
         if (jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT) {
-          r_jws_free(jwt->jws);
-          if ((r_jws_init(&jwt->jws)) == RHN_OK) {
-            if ((res = r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags, decrypt_key_x5u_flags)) == RHN_OK) {
+          if (r_jwt_reset_jws(jwt) == RHN_OK) {
+            if ((res = r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags&(~(uint32_t)R_PARSE_ZERO_COPY), decrypt_key_x5u_flags)) == RHN_OK) {
               if (r_jwt_add_sign_jwks(jwt, jwt->jws->jwks_privkey, jwt->jws->jwks_pubkey) == RHN_OK) {
                 if (r_jwt_set_sign_alg(jwt, r_jws_get_alg(jwt->jws)) == RHN_OK) {
                   if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
-                    str_payload = o_strndup((const char *)payload, payload_len);
-                    if ((j_payload = json_loads(str_payload, JSON_DECODE_ANY, NULL)) != NULL) {
-                      if (r_jwt_set_full_claims_json_t(jwt, j_payload) == RHN_OK) {
-                        ret = RHN_OK;
-                      } else {
-                        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error r_jwt_set_full_claims_json_t");
-                        ret = RHN_ERROR;
-                      }
-                    } else {
+                    if ((res = r_jwt_load_claims(jwt, payload, payload_len)) == RHN_OK) {
+                      ret = RHN_OK;
+                    } else if (res == RHN_ERROR_PARAM) {
                       y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error loading payload");
                       ret = RHN_ERROR_PARAM;
+                    } else {
+                      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error r_jwt_load_claims");
+                      ret = RHN_ERROR;
                     }
-                    json_decref(j_payload);
-                    o_free(str_payload);
                   } else {
                     y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error getting jws payload");
                     ret = RHN_ERROR;
@@ -1626,20 +2845,15 @@ int r_jwt_decrypt_nested(jwt_t * jwt, jwk_t * decrypt_key, int decrypt_key_x5u_f
             ret = RHN_ERROR;
           }
         } else {
-          str_payload = o_strndup((const char *)payload, payload_len);
-          if ((j_payload = json_loads((const char *)str_payload, JSON_DECODE_ANY, NULL)) != NULL) {
-            if (r_jwt_set_full_claims_json_t(jwt, j_payload) == RHN_OK) {
-              ret = RHN_OK;
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error r_jwt_set_full_claims_json_t");
-              ret = RHN_ERROR;
-            }
-          } else {
+          if ((res = r_jwt_load_claims(jwt, payload, payload_len)) == RHN_OK) {
+            ret = RHN_OK;
+          } else if (res == RHN_ERROR_PARAM) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error loading payload");
             ret = RHN_ERROR_PARAM;
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error r_jwt_load_claims");
+            ret = RHN_ERROR;
           }
-          json_decref(j_payload);
-          o_free(str_payload);
         }
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_decrypt_nested - Error getting jwe payload");
@@ -1754,9 +2968,9 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
           break;
         case R_JWT_CLAIM_EXP:
           i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "exp"))) {
+          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(r_jwt_claim_get(jwt, "exp"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "exp"))) {
+          } else if (json_is_integer(r_jwt_claim_get(jwt, "exp"))) {
             t_value = (time_t)r_jwt_get_claim_int_value(jwt, "exp");
             if (i_value == R_JWT_CLAIM_NOW) {
               if (t_value < now) {
@@ -1773,9 +2987,9 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
           break;
         case R_JWT_CLAIM_NBF:
           i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "nbf"))) {
+          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(r_jwt_claim_get(jwt, "nbf"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "nbf"))) {
+          } else if (json_is_integer(r_jwt_claim_get(jwt, "nbf"))) {
             t_value = (time_t)r_jwt_get_claim_int_value(jwt, "nbf");
             if (i_value == R_JWT_CLAIM_NOW) {
               if (t_value > now) {
@@ -1792,9 +3006,9 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
           break;
         case R_JWT_CLAIM_IAT:
           i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "iat"))) {
+          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(r_jwt_claim_get(jwt, "iat"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "iat"))) {
+          } else if (json_is_integer(r_jwt_claim_get(jwt, "iat"))) {
             t_value = (time_t)r_jwt_get_claim_int_value(jwt, "iat");
             if (i_value == R_JWT_CLAIM_NOW) {
               if (t_value > now) {
@@ -1872,6 +3086,241 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
   return ret;
 }
 
+static uint32_t _r_str_set_hash(const char * value) {
+  uint32_t hash = 2166136261U;
+
+  for (; *value; value++) {
+    hash ^= (uint8_t)*value;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static int _r_str_set_has(const struct _r_str_set * set, const char * value) {
+  uint32_t hash;
+  size_t i;
+
+  if (value != NULL && set->count) {
+    hash = _r_str_set_hash(value);
+    for (i = hash & (set->size - 1); set->values[i] != NULL; i = (i + 1) & (set->size - 1)) {
+      if (set->hashes[i] == hash && 0 == o_strcmp(set->values[i], value)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void _r_str_set_insert(char ** values, uint32_t * hashes, size_t size, char * value, uint32_t hash) {
+  size_t i;
+
+  for (i = hash & (size - 1); values[i] != NULL; i = (i + 1) & (size - 1));
+  values[i] = value;
+  hashes[i] = hash;
+}
+
+static int _r_str_set_add(struct _r_str_set * set, const char * value) {
+  char ** values, * dup;
+  uint32_t * hashes;
+  size_t size, i;
+  int ret = RHN_OK;
+
+  if (!_r_str_set_has(set, value)) {
+    if ((set->count + 1) * 2 > set->size) {
+      size = set->size ? set->size * 2 : 8;
+      values = o_malloc(size * sizeof(char *));
+      hashes = o_malloc(size * sizeof(uint32_t));
+      if (values != NULL && hashes != NULL) {
+        memset(values, 0, size * sizeof(char *));
+        for (i = 0; i < set->size; i++) {
+          if (set->values[i] != NULL) {
+            _r_str_set_insert(values, hashes, size, set->values[i], set->hashes[i]);
+          }
+        }
+        o_free(set->values);
+        o_free(set->hashes);
+        set->values = values;
+        set->hashes = hashes;
+        set->size = size;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_str_set_add - Error allocating resources for set");
+        o_free(values);
+        o_free(hashes);
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+    if (ret == RHN_OK) {
+      if ((dup = o_strdup(value)) != NULL) {
+        _r_str_set_insert(set->values, set->hashes, set->size, dup, _r_str_set_hash(value));
+        set->count++;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_str_set_add - Error allocating resources for value");
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+  }
+  return ret;
+}
+
+static void _r_str_set_clean(struct _r_str_set * set) {
+  size_t i;
+
+  for (i = 0; i < set->size; i++) {
+    o_free(set->values[i]);
+  }
+  o_free(set->values);
+  o_free(set->hashes);
+}
+
+int r_claims_policy_init(r_claims_policy_t ** policy) {
+  int ret;
+
+  if (policy != NULL) {
+    if ((*policy = o_malloc(sizeof(r_claims_policy_t))) != NULL) {
+      memset(*policy, 0, sizeof(r_claims_policy_t));
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_claims_policy_init - Error allocating resources for policy");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_claims_policy_free(r_claims_policy_t * policy) {
+  if (policy != NULL) {
+    _r_str_set_clean(&policy->iss);
+    _r_str_set_clean(&policy->sub);
+    _r_str_set_clean(&policy->aud);
+    o_free(policy->typ);
+    o_free(policy);
+  }
+}
+
+int r_claims_policy_add_value(r_claims_policy_t * policy, rhn_claim_opt claim, const char * value) {
+  int ret;
+
+  if (policy != NULL && !o_strnullempty(value)) {
+    switch (claim) {
+      case R_JWT_CLAIM_ISS:
+        ret = _r_str_set_add(&policy->iss, value);
+        break;
+      case R_JWT_CLAIM_SUB:
+        ret = _r_str_set_add(&policy->sub, value);
+        break;
+      case R_JWT_CLAIM_AUD:
+        ret = _r_str_set_add(&policy->aud, value);
+        break;
+      default:
+        ret = RHN_ERROR_PARAM;
+        break;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_claims_policy_set_required(r_claims_policy_t * policy, rhn_claim_opt claim) {
+  if (policy != NULL && claim >= R_JWT_CLAIM_ISS && claim <= R_JWT_CLAIM_JTI) {
+    policy->required |= (1U << claim);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_claims_policy_set_leeway(r_claims_policy_t * policy, unsigned int leeway) {
+  if (policy != NULL) {
+    policy->leeway = leeway;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_claims_policy_set_typ(r_claims_policy_t * policy, const char * typ) {
+  int ret = RHN_OK;
+
+  if (policy != NULL) {
+    o_free(policy->typ);
+    policy->typ = NULL;
+    if (typ != NULL && (policy->typ = o_strdup(typ)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_claims_policy_set_typ - Error allocating resources for typ");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+static int _r_claims_policy_check_str(const struct _r_str_set * set, json_t * j_value) {
+  if (set->count) {
+    return _r_str_set_has(set, json_string_value(j_value));
+  } else {
+    return 1;
+  }
+}
+
+static int _r_claims_policy_check_aud(const struct _r_str_set * set, json_t * j_value) {
+  json_t * j_element = NULL;
+  size_t index = 0;
+
+  if (!set->count) {
+    return 1;
+  } else if (json_is_array(j_value)) {
+    json_array_foreach(j_value, index, j_element) {
+      if (_r_str_set_has(set, json_string_value(j_element))) {
+        return 1;
+      }
+    }
+    return 0;
+  } else {
+    return _r_str_set_has(set, json_string_value(j_value));
+  }
+}
+
+int r_jwt_validate_claims_policy(jwt_t * jwt, const r_claims_policy_t * policy) {
+  int ret = RHN_OK;
+  json_t * j_iss, * j_sub, * j_aud, * j_exp, * j_nbf, * j_iat;
+  json_int_t now;
+
+  if (jwt != NULL && policy != NULL) {
+    now = (json_int_t)time(NULL);
+    j_iss = r_jwt_claim_get(jwt, "iss");
+    j_sub = r_jwt_claim_get(jwt, "sub");
+    j_aud = r_jwt_claim_get(jwt, "aud");
+    j_exp = r_jwt_claim_get(jwt, "exp");
+    j_nbf = r_jwt_claim_get(jwt, "nbf");
+    j_iat = r_jwt_claim_get(jwt, "iat");
+    if (((policy->required & (1U << R_JWT_CLAIM_ISS)) && j_iss == NULL) ||
+        ((policy->required & (1U << R_JWT_CLAIM_SUB)) && j_sub == NULL) ||
+        ((policy->required & (1U << R_JWT_CLAIM_AUD)) && j_aud == NULL) ||
+        ((policy->required & (1U << R_JWT_CLAIM_EXP)) && j_exp == NULL) ||
+        ((policy->required & (1U << R_JWT_CLAIM_NBF)) && j_nbf == NULL) ||
+        ((policy->required & (1U << R_JWT_CLAIM_IAT)) && j_iat == NULL) ||
+        ((policy->required & (1U << R_JWT_CLAIM_JTI)) && r_jwt_claim_get(jwt, "jti") == NULL)) {
+      ret = RHN_ERROR_PARAM;
+    } else if (!_r_claims_policy_check_str(&policy->iss, j_iss) ||
+               !_r_claims_policy_check_str(&policy->sub, j_sub) ||
+               !_r_claims_policy_check_aud(&policy->aud, j_aud)) {
+      ret = RHN_ERROR_PARAM;
+    } else if ((j_exp != NULL && (!json_is_integer(j_exp) || json_integer_value(j_exp) + policy->leeway < now)) ||
+               (j_nbf != NULL && (!json_is_integer(j_nbf) || json_integer_value(j_nbf) > now + policy->leeway)) ||
+               (j_iat != NULL && (!json_is_integer(j_iat) || json_integer_value(j_iat) > now + policy->leeway))) {
+      ret = RHN_ERROR_PARAM;
+    } else if (policy->typ != NULL && 0 != o_strcmp(policy->typ, r_jwt_get_header_str_value(jwt, "typ"))) {
+      ret = RHN_ERROR_PARAM;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 int r_jwt_set_claims(jwt_t * jwt, ...) {
   rhn_claim_opt option;
   int ret = RHN_OK;
@@ -21,17 +21,45 @@
  *
  */
 
+#include <string.h>
 #include <zlib.h>
+#include <pthread.h>
 #include <orcania.h>
 #include <yder.h>
 #include <rhonabwy.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define _R_B64URL_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define _R_B64URL_NEON
+#include <arm_neon.h>
+#endif
+
 #define _R_BLOCK_SIZE 256
 
+#define _R_REMOTE_CACHE_DEFAULT_SIZE    16
+#define _R_REMOTE_CACHE_DEFAULT_MAX_TTL 86400
+
+#define _R_HTTP_POOL_SIZE 8
+
+#define _R_B64URL_INVALID 0x80
+#define _R_B64URL_SCALAR  0
+#define _R_B64URL_SSSE3   1
+#define _R_B64URL_AVX2    2
+
+#define _R_ARENA_ALIGN 16
+#define _R_ARENA_ALIGN_SIZE(size) (((size)+_R_ARENA_ALIGN-1)&~((size_t)_R_ARENA_ALIGN-1))
+#define _R_ARENA_BLOCK_DATA(block) ((unsigned char *)(block)+_R_ARENA_ALIGN_SIZE(sizeof(struct _r_arena_block)))
+
+static void _r_zip_state_close(void);
+
 #ifdef R_WITH_CURL
 #include <curl/curl.h>
-#include <string.h>
+#include <time.h>
 #define _R_HEADER_CONTENT_TYPE "Content-Type"
+
+static void _r_http_pool_close(void);
 #endif
 
 int r_global_init(void) {
@@ -57,7 +85,13 @@ int r_global_init(void) {
 }
 
 void r_global_close(void) {
+  r_jwe_ecdh_pool_set_size(0);
+  r_jwk_cache_flush();
+  _r_jwks_index_flush();
+  r_remote_cache_flush();
+  _r_zip_state_close();
 #ifdef R_WITH_CURL
+  _r_http_pool_close();
   curl_global_cleanup();
 #endif
 }
@@ -67,17 +101,74 @@ void r_global_close(void) {
 struct _r_response_str {
   char * ptr;
   size_t len;
+  size_t max_len;
 };
 
-struct _r_expected_content_type {
+/**
+ * Response headers used to check the content type
+ * and to compute how long the response can be cached
+ */
+struct _r_response_headers {
   const char * expected;
-  int found;
+  int          found;
+  char       * etag;
+  long         max_age;
+  int          no_store;
+  int          no_cache;
+  int          has_expires;
+  time_t       expires;
+};
+
+/**
+ * Remote content cache entry, indexed by url, expected content type and x5u_flags
+ * An entry can't be recycled while it's fetched or while a thread waits for it
+ */
+struct _r_remote_cache_entry {
+  char          * url;
+  char          * expected_content_type;
+  int             x5u_flags;
+  char          * content;
+  char          * etag;
+  time_t          expires_at;
+  time_t          refresh_at;
+  unsigned long   last_used;
+  unsigned long   generation;
+  int             fetching;
+  int             fetch_ok;
+  unsigned int    nb_waiters;
 };
 
+static pthread_cond_t _r_remote_cache_cond = PTHREAD_COND_INITIALIZER;
+static struct _r_remote_cache_entry * _r_remote_cache = NULL;
+static unsigned long _r_remote_cache_tick = 0;
+#endif
+static pthread_mutex_t _r_remote_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t _r_remote_cache_size = _R_REMOTE_CACHE_DEFAULT_SIZE;
+static unsigned int _r_remote_cache_default_ttl = 0;
+static unsigned int _r_remote_cache_max_ttl = _R_REMOTE_CACHE_DEFAULT_MAX_TTL;
+
+#ifdef R_WITH_CURL
+/**
+ * Easy handles are kept after a fetch so their connections can be reused,
+ * the DNS cache, the TLS sessions and the connections are shared between them
+ */
+static pthread_mutex_t _r_http_share_locks[CURL_LOCK_DATA_LAST];
+static CURLSH * _r_http_share = NULL;
+static CURL * _r_http_pool[_R_HTTP_POOL_SIZE];
+static size_t _r_http_pool_len = 0;
+#endif
+static pthread_mutex_t _r_http_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long _r_http_timeout = 0;
+static size_t _r_http_max_response_size = 0;
+
+#ifdef R_WITH_CURL
 static size_t write_response(char *ptr, size_t size, size_t nmemb, void * userdata) {
   struct _r_response_str * resp = (struct _r_response_str *)userdata;
   size_t len = (size*nmemb);
-  if ((resp->ptr = o_realloc(resp->ptr, (resp->len + len + 1))) != NULL) {
+  if (resp->max_len && resp->len + len > resp->max_len) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "write_response - Response too large");
+    return 0;
+  } else if ((resp->ptr = o_realloc(resp->ptr, (resp->len + len + 1))) != NULL) {
     memcpy(resp->ptr+resp->len, ptr, len);
     resp->len += len;
     resp->ptr[resp->len] = '\0';
@@ -87,33 +178,224 @@ static size_t write_response(char *ptr, size_t size, size_t nmemb, void * userda
   }
 }
 
+/**
+ * Returns a copy of the header value if header is 'name: value\r\n'
+ */
+static char * _r_get_header_value(const char * header, size_t header_len, const char * name) {
+  size_t name_len = o_strlen(name), value_len;
+  const char * value;
+
+  if (header_len > name_len && header[name_len] == ':' && !o_strncasecmp(header, name, name_len)) {
+    value = header + name_len + 1;
+    value_len = header_len - name_len - 1;
+    while (value_len && (*value == ' ' || *value == '\t')) {
+      value++;
+      value_len--;
+    }
+    while (value_len && (value[value_len-1] == '\r' || value[value_len-1] == '\n' || value[value_len-1] == ' ')) {
+      value_len--;
+    }
+    return o_strndup(value, value_len);
+  } else {
+    return NULL;
+  }
+}
+
+static void _r_parse_cache_control(struct _r_response_headers * headers, const char * value) {
+  char ** directives = NULL, * directive;
+  size_t i;
+
+  if (split_string(value, ",", &directives)) {
+    for (i=0; directives[i] != NULL; i++) {
+      directive = trimwhitespace(directives[i]);
+      if (0 == o_strcasecmp(directive, "no-store")) {
+        headers->no_store = 1;
+      } else if (0 == o_strcasecmp(directive, "no-cache")) {
+        headers->no_cache = 1;
+      } else if (0 == o_strncasecmp(directive, "max-age=", o_strlen("max-age="))) {
+        headers->max_age = strtol(directive+o_strlen("max-age="), NULL, 10);
+        if (headers->max_age < 0) {
+          headers->max_age = 0;
+        }
+      }
+    }
+  }
+  free_string_array(directives);
+}
+
+static void _r_reset_response_headers(struct _r_response_headers * headers) {
+  headers->found = 0;
+  o_free(headers->etag);
+  headers->etag = NULL;
+  headers->max_age = -1;
+  headers->no_store = 0;
+  headers->no_cache = 0;
+  headers->has_expires = 0;
+  headers->expires = 0;
+}
+
 static size_t write_header(void * buffer, size_t size, size_t nitems, void * user_data) {
   const char * header = (const char *)buffer;
-  struct _r_expected_content_type * expected_content_type = (struct _r_expected_content_type *)user_data;
+  struct _r_response_headers * headers = (struct _r_response_headers *)user_data;
+  size_t header_len = nitems * size;
+  char * value;
 
-  if (o_strncasecmp(header, _R_HEADER_CONTENT_TYPE, o_strlen(_R_HEADER_CONTENT_TYPE)) == 0 &&
-     o_strstr(header+o_strlen(_R_HEADER_CONTENT_TYPE)+1, expected_content_type->expected)) {
-    expected_content_type->found = 1;
+  if (header_len > 5 && !o_strncmp(header, "HTTP/", 5)) {
+    // New response after a redirection
+    _r_reset_response_headers(headers);
+  } else if ((value = _r_get_header_value(header, header_len, _R_HEADER_CONTENT_TYPE)) != NULL) {
+    if (headers->expected != NULL && o_strstr(value, headers->expected)) {
+      headers->found = 1;
+    }
+    o_free(value);
+  } else if ((value = _r_get_header_value(header, header_len, "ETag")) != NULL) {
+    o_free(headers->etag);
+    headers->etag = value;
+  } else if ((value = _r_get_header_value(header, header_len, "Cache-Control")) != NULL) {
+    _r_parse_cache_control(headers, value);
+    o_free(value);
+  } else if ((value = _r_get_header_value(header, header_len, "Expires")) != NULL) {
+    headers->has_expires = 1;
+    // An invalid date means the response is already expired
+    if ((headers->expires = curl_getdate(value, NULL)) < 0) {
+      headers->expires = 0;
+    }
+    o_free(value);
   }
-  return nitems * size;
+  return header_len;
+}
+
+static void _r_http_share_lock(CURL * handle, curl_lock_data data, curl_lock_access access, void * user_data) {
+  (void)handle;
+  (void)access;
+  (void)user_data;
+  pthread_mutex_lock(&_r_http_share_locks[data]);
 }
+
+static void _r_http_share_unlock(CURL * handle, curl_lock_data data, void * user_data) {
+  (void)handle;
+  (void)user_data;
+  pthread_mutex_unlock(&_r_http_share_locks[data]);
+}
+
+/**
+ * Creates the share handle, the lock must be held
+ */
+static CURLSH * _r_http_share_init(void) {
+  CURLSH * share;
+  int i;
+
+  if ((share = curl_share_init()) != NULL) {
+    for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+      pthread_mutex_init(&_r_http_share_locks[i], NULL);
+    }
+    if (curl_share_setopt(share, CURLSHOPT_LOCKFUNC, _r_http_share_lock) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, _r_http_share_unlock) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK
+#if LIBCURL_VERSION_NUM >= 0x073900
+        || curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK
 #endif
+        ) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_share_init - Error setting share options");
+      curl_share_cleanup(share);
+      for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&_r_http_share_locks[i]);
+      }
+      share = NULL;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_share_init - Error curl_share_init");
+  }
+  return share;
+}
 
-char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type) {
-  char * to_return = NULL;
-#ifdef R_WITH_CURL
+/**
+ * Returns an easy handle from the pool or a new one
+ */
+static CURL * _r_http_handle_get(void) {
+  CURL * curl = NULL;
+  CURLSH * share;
+
+  pthread_mutex_lock(&_r_http_lock);
+  if (_r_http_share == NULL) {
+    _r_http_share = _r_http_share_init();
+  }
+  share = _r_http_share;
+  if (_r_http_pool_len) {
+    curl = _r_http_pool[--_r_http_pool_len];
+  }
+  pthread_mutex_unlock(&_r_http_lock);
+
+  if (curl != NULL) {
+    // The options are reset, the connections, the sessions and the share are kept
+    curl_easy_reset(curl);
+  } else if ((curl = curl_easy_init()) != NULL && share != NULL) {
+    if (curl_easy_setopt(curl, CURLOPT_SHARE, share) != CURLE_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_handle_get - Error setting share");
+    }
+  }
+  return curl;
+}
+
+/**
+ * Puts the easy handle back in the pool or cleans it if the pool is full
+ */
+static void _r_http_handle_release(CURL * curl) {
+  pthread_mutex_lock(&_r_http_lock);
+  if (_r_http_share != NULL && _r_http_pool_len < _R_HTTP_POOL_SIZE) {
+    _r_http_pool[_r_http_pool_len++] = curl;
+    curl = NULL;
+  }
+  pthread_mutex_unlock(&_r_http_lock);
+  if (curl != NULL) {
+    curl_easy_cleanup(curl);
+  }
+}
+
+/**
+ * Closes the pooled easy handles and the share handle
+ */
+static void _r_http_pool_close(void) {
+  int i;
+
+  pthread_mutex_lock(&_r_http_lock);
+  while (_r_http_pool_len) {
+    curl_easy_cleanup(_r_http_pool[--_r_http_pool_len]);
+  }
+  if (_r_http_share != NULL) {
+    if (curl_share_cleanup(_r_http_share) == CURLSHE_OK) {
+      for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&_r_http_share_locks[i]);
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_pool_close - Error curl_share_cleanup, share still in use");
+    }
+    _r_http_share = NULL;
+  }
+  pthread_mutex_unlock(&_r_http_lock);
+}
+
+/**
+ * Fetches url, sends etag in If-None-Match if set
+ * Returns the response body if the status is 2xx and the content type is the expected one
+ */
+static char * _r_http_fetch(const char * url, int x5u_flags, const char * etag, struct _r_response_headers * headers, long * status) {
+  char * to_return = NULL, * if_none_match = NULL;
   CURL *curl;
   struct curl_slist *list = NULL;
   struct _r_response_str resp;
-  struct _r_expected_content_type ct;
-  long status = 0;
+  unsigned long timeout;
 
-  curl = curl_easy_init();
+  *status = 0;
+  pthread_mutex_lock(&_r_http_lock);
+  timeout = _r_http_timeout;
+  resp.max_len = _r_http_max_response_size;
+  pthread_mutex_unlock(&_r_http_lock);
+  curl = _r_http_handle_get();
   if(curl != NULL) {
     resp.ptr = NULL;
     resp.len = 0;
-    ct.expected = expected_content_type;
-    ct.found = 0;
 
     do {
       if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK) {
@@ -128,6 +410,12 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
       if ((list = curl_slist_append(list, "User-Agent: Rhonabwy/" RHONABWY_VERSION_STR)) == NULL) {
         break;
       }
+      if (!o_strnullempty(etag)) {
+        if_none_match = msprintf("If-None-Match: %s", etag);
+        if ((list = curl_slist_append(list, if_none_match)) == NULL) {
+          break;
+        }
+      }
       if (curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list) != CURLE_OK) {
         break;
       }
@@ -147,40 +435,334 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
           break;
         }
       }
-      if (!o_strnullempty(expected_content_type)) {
-        if (curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_header) != CURLE_OK) {
+      if (timeout) {
+        // Signals can't be used to time out in a multi-threaded program
+        if (curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) != CURLE_OK) {
+          break;
+        }
+        if (curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout) != CURLE_OK) {
           break;
         }
-        if (curl_easy_setopt(curl, CURLOPT_WRITEHEADER, &ct) != CURLE_OK) {
+      }
+      if (resp.max_len) {
+        if (curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)resp.max_len) != CURLE_OK) {
           break;
         }
       }
+      if (curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_header) != CURLE_OK) {
+        break;
+      }
+      if (curl_easy_setopt(curl, CURLOPT_WRITEHEADER, headers) != CURLE_OK) {
+        break;
+      }
       if (curl_easy_perform(curl) != CURLE_OK) {
         break;
       }
 
-      if (curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK) {
+      if (curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, status) != CURLE_OK) {
         break;
       }
     } while (0);
 
-    curl_easy_cleanup(curl);
+    _r_http_handle_release(curl);
     curl_slist_free_all(list);
+    o_free(if_none_match);
 
-    if (status >= 200 && status < 300) {
-      if (o_strnullempty(expected_content_type)) {
-        to_return = resp.ptr;
-      } else {
-        if (ct.found) {
-          to_return = resp.ptr;
-        } else {
-          o_free(resp.ptr);
+    if (*status >= 200 && *status < 300 && (o_strnullempty(headers->expected) || headers->found)) {
+      to_return = resp.ptr;
+    } else {
+      o_free(resp.ptr);
+    }
+  }
+  return to_return;
+}
+
+static time_t _r_remote_cache_get_ttl(struct _r_response_headers * headers, time_t now) {
+  time_t ttl;
+
+  if (headers->no_store || headers->no_cache) {
+    ttl = 0;
+  } else if (headers->max_age >= 0) {
+    ttl = (time_t)headers->max_age;
+  } else if (headers->has_expires) {
+    ttl = headers->expires > now ? headers->expires - now : 0;
+  } else {
+    ttl = (time_t)_r_remote_cache_default_ttl;
+  }
+  if (ttl > (time_t)_r_remote_cache_max_ttl) {
+    ttl = (time_t)_r_remote_cache_max_ttl;
+  }
+  return ttl;
+}
+
+static void _r_remote_cache_entry_clean(struct _r_remote_cache_entry * entry) {
+  o_free(entry->url);
+  o_free(entry->expected_content_type);
+  o_free(entry->content);
+  o_free(entry->etag);
+  memset(entry, 0, sizeof(struct _r_remote_cache_entry));
+}
+
+/**
+ * Fetches or revalidates the content of the entry
+ * entry->fetching must be set by the caller, the lock must not be held
+ * Returns a copy of the content if with_result is set, even if the response can't be stored
+ */
+static char * _r_remote_cache_update(struct _r_remote_cache_entry * entry, int with_result) {
+  struct _r_response_headers headers;
+  char * etag, * content, * to_return = NULL;
+  long status = 0;
+  time_t now, ttl;
+
+  pthread_mutex_lock(&_r_remote_cache_lock);
+  etag = entry->content != NULL ? o_strdup(entry->etag) : NULL;
+  pthread_mutex_unlock(&_r_remote_cache_lock);
+
+  memset(&headers, 0, sizeof(struct _r_response_headers));
+  headers.expected = entry->expected_content_type;
+  _r_reset_response_headers(&headers);
+  content = _r_http_fetch(entry->url, entry->x5u_flags, etag, &headers, &status);
+  time(&now);
+
+  pthread_mutex_lock(&_r_remote_cache_lock);
+  ttl = _r_remote_cache_get_ttl(&headers, now);
+  if (content != NULL || (status == 304 && etag != NULL && entry->content != NULL)) {
+    if (content != NULL) {
+      o_free(entry->content);
+      entry->content = content;
+      content = NULL;
+      o_free(entry->etag);
+      entry->etag = headers.etag;
+      headers.etag = NULL;
+    } else if (headers.etag != NULL) {
+      o_free(entry->etag);
+      entry->etag = headers.etag;
+      headers.etag = NULL;
+    }
+    entry->expires_at = now + ttl;
+    // Refresh the content in the background during the last quarter of its lifetime
+    entry->refresh_at = ttl >= 4 ? now + ttl - ttl/4 : entry->expires_at;
+    entry->fetch_ok = 1;
+    if (with_result) {
+      to_return = o_strdup(entry->content);
+    }
+    if (headers.no_store) {
+      o_free(entry->content);
+      entry->content = NULL;
+      o_free(entry->etag);
+      entry->etag = NULL;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_remote_cache_update - Error fetching %s, status %ld", entry->url, status);
+    entry->fetch_ok = 0;
+  }
+  entry->fetching = 0;
+  entry->generation++;
+  pthread_cond_broadcast(&_r_remote_cache_cond);
+  pthread_mutex_unlock(&_r_remote_cache_lock);
+
+  o_free(content);
+  o_free(headers.etag);
+  o_free(etag);
+  return to_return;
+}
+
+static void * _r_remote_cache_refresh(void * args) {
+  _r_remote_cache_update((struct _r_remote_cache_entry *)args, 0);
+  return NULL;
+}
+
+/**
+ * Returns the cache entry for the url, a new or recycled one if none exists
+ * The lock must be held
+ */
+static struct _r_remote_cache_entry * _r_remote_cache_get_entry(const char * url, int x5u_flags, const char * expected_content_type) {
+  struct _r_remote_cache_entry * entry = NULL;
+  size_t i;
+
+  if (_r_remote_cache == NULL && _r_remote_cache_size) {
+    if ((_r_remote_cache = o_malloc(_r_remote_cache_size*sizeof(struct _r_remote_cache_entry))) != NULL) {
+      memset(_r_remote_cache, 0, _r_remote_cache_size*sizeof(struct _r_remote_cache_entry));
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_remote_cache_get_entry - Error allocating resources for _r_remote_cache");
+    }
+  }
+  if (_r_remote_cache != NULL) {
+    for (i=0; i<_r_remote_cache_size; i++) {
+      if (_r_remote_cache[i].url != NULL && _r_remote_cache[i].x5u_flags == x5u_flags && 0 == o_strcmp(_r_remote_cache[i].url, url) && 0 == o_strcmp(_r_remote_cache[i].expected_content_type, expected_content_type)) {
+        entry = &_r_remote_cache[i];
+        break;
+      }
+    }
+    if (entry == NULL) {
+      // Use an empty entry or recycle the least recently used one
+      for (i=0; i<_r_remote_cache_size; i++) {
+        if (!_r_remote_cache[i].fetching && !_r_remote_cache[i].nb_waiters && (entry == NULL || _r_remote_cache[i].last_used < entry->last_used)) {
+          entry = &_r_remote_cache[i];
+        }
+      }
+      if (entry != NULL) {
+        _r_remote_cache_entry_clean(entry);
+        entry->url = o_strdup(url);
+        entry->expected_content_type = o_strdup(expected_content_type);
+        entry->x5u_flags = x5u_flags;
+        if (entry->url == NULL) {
+          _r_remote_cache_entry_clean(entry);
+          entry = NULL;
         }
       }
+    }
+    if (entry != NULL) {
+      entry->last_used = ++_r_remote_cache_tick;
+    }
+  }
+  return entry;
+}
+#endif
+
+/**
+ * Removes all the entries, the lock must be held
+ */
+static void _r_remote_cache_flush(void) {
+#ifdef R_WITH_CURL
+  size_t i;
+  int busy;
+
+  if (_r_remote_cache != NULL) {
+    // Wait for the pending fetches, including the background refreshes
+    do {
+      busy = 0;
+      for (i=0; i<_r_remote_cache_size && !busy; i++) {
+        busy = _r_remote_cache[i].fetching || _r_remote_cache[i].nb_waiters;
+      }
+      if (busy) {
+        pthread_cond_wait(&_r_remote_cache_cond, &_r_remote_cache_lock);
+      }
+    } while (busy);
+    for (i=0; i<_r_remote_cache_size; i++) {
+      _r_remote_cache_entry_clean(&_r_remote_cache[i]);
+    }
+    o_free(_r_remote_cache);
+    _r_remote_cache = NULL;
+  }
+#endif
+}
+
+int r_remote_cache_set_size(size_t size) {
+  pthread_mutex_lock(&_r_remote_cache_lock);
+  _r_remote_cache_flush();
+  _r_remote_cache_size = size;
+  pthread_mutex_unlock(&_r_remote_cache_lock);
+  return RHN_OK;
+}
+
+size_t r_remote_cache_get_size(void) {
+  size_t size;
+
+  pthread_mutex_lock(&_r_remote_cache_lock);
+  size = _r_remote_cache_size;
+  pthread_mutex_unlock(&_r_remote_cache_lock);
+  return size;
+}
+
+int r_remote_cache_set_ttl(unsigned int default_ttl, unsigned int max_ttl) {
+  if (default_ttl <= max_ttl) {
+    pthread_mutex_lock(&_r_remote_cache_lock);
+    _r_remote_cache_default_ttl = default_ttl;
+    _r_remote_cache_max_ttl = max_ttl;
+    pthread_mutex_unlock(&_r_remote_cache_lock);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+void r_remote_cache_flush(void) {
+  pthread_mutex_lock(&_r_remote_cache_lock);
+  _r_remote_cache_flush();
+  pthread_mutex_unlock(&_r_remote_cache_lock);
+}
+
+int r_remote_set_timeout(unsigned long timeout) {
+  pthread_mutex_lock(&_r_http_lock);
+  _r_http_timeout = timeout;
+  pthread_mutex_unlock(&_r_http_lock);
+  return RHN_OK;
+}
+
+int r_remote_set_max_response_size(size_t max_size) {
+  pthread_mutex_lock(&_r_http_lock);
+  _r_http_max_response_size = max_size;
+  pthread_mutex_unlock(&_r_http_lock);
+  return RHN_OK;
+}
+
+char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type) {
+  char * to_return = NULL;
+#ifdef R_WITH_CURL
+  struct _r_response_headers headers;
+  struct _r_remote_cache_entry * entry;
+  unsigned long generation;
+  pthread_t thread;
+  pthread_attr_t attr;
+  long status = 0;
+  int done = 0;
+  time_t now;
+
+  pthread_mutex_lock(&_r_remote_cache_lock);
+  entry = _r_remote_cache_get_entry(url, x5u_flags, expected_content_type);
+  while (entry != NULL && !done) {
+    time(&now);
+    if (entry->content != NULL && now < entry->expires_at) {
+      to_return = o_strdup(entry->content);
+      done = 1;
+      if (now >= entry->refresh_at && !entry->fetching) {
+        entry->fetching = 1;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, _r_remote_cache_refresh, entry)) {
+          entry->fetching = 0;
+        }
+        pthread_attr_destroy(&attr);
+      }
     } else {
-      o_free(resp.ptr);
+      // Only one thread fetches the url, the others wait for its result
+      generation = entry->generation;
+      entry->nb_waiters++;
+      if (!entry->fetching) {
+        entry->fetching = 1;
+        pthread_mutex_unlock(&_r_remote_cache_lock);
+        to_return = _r_remote_cache_update(entry, 1);
+        pthread_mutex_lock(&_r_remote_cache_lock);
+        done = 1;
+      } else {
+        while (entry->generation == generation) {
+          pthread_cond_wait(&_r_remote_cache_cond, &_r_remote_cache_lock);
+        }
+        if (!entry->fetch_ok) {
+          done = 1;
+        } else if (entry->content != NULL) {
+          to_return = o_strdup(entry->content);
+          done = 1;
+        }
+        // Otherwise the content wasn't stored (no-store), it must be fetched again
+      }
+      entry->nb_waiters--;
+      if (!entry->nb_waiters) {
+        pthread_cond_broadcast(&_r_remote_cache_cond);
+      }
     }
   }
+  pthread_mutex_unlock(&_r_remote_cache_lock);
+
+  if (entry == NULL) {
+    // Cache disabled or full of pending fetches
+    memset(&headers, 0, sizeof(struct _r_response_headers));
+    headers.expected = expected_content_type;
+    _r_reset_response_headers(&headers);
+    to_return = _r_http_fetch(url, x5u_flags, NULL, &headers, &status);
+    o_free(headers.etag);
+  }
 #else
   (void)url;
   (void)x5u_flags;
@@ -336,89 +918,945 @@ gnutls_cipher_algorithm_t _r_get_alg_from_enc(jwa_enc enc) {
   return alg;
 }
 
-int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_len, unsigned char ** compressed, size_t * compressed_len) {
-  int ret = RHN_OK, res;
+int _r_memcmp_const_time(const unsigned char * a, const unsigned char * b, size_t len) {
+  volatile unsigned char diff = 0;
+  size_t i;
+
+  // Always walk the whole buffers so the time spent doesn't leak the first differing byte
+  for (i=0; i<len; i++) {
+    diff |= (unsigned char)(a[i] ^ b[i]);
+  }
+  return diff;
+}
+
+int r_arena_init(r_arena_t ** arena, size_t block_size) {
+  int ret;
+
+  if (arena != NULL) {
+    if ((*arena = o_malloc(sizeof(r_arena_t))) != NULL) {
+      (*arena)->first = NULL;
+      (*arena)->current = NULL;
+      (*arena)->block_size = block_size?_R_ARENA_ALIGN_SIZE(block_size):R_ARENA_DEFAULT_BLOCK_SIZE;
+      (*arena)->depth = 0;
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_arena_init - Error allocating resources for arena");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_arena_free(r_arena_t * arena) {
+  if (arena != NULL) {
+    arena->depth = 0;
+    r_arena_reset(arena);
+    o_free(arena);
+  }
+}
+
+int r_arena_reset(r_arena_t * arena) {
+  struct _r_arena_block * block;
+  int ret;
+
+  if (arena != NULL && !arena->depth) {
+    while (arena->first != NULL) {
+      block = arena->first;
+      arena->first = block->next;
+      o_free(block);
+    }
+    arena->current = NULL;
+    ret = RHN_OK;
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+size_t r_arena_get_size(r_arena_t * arena) {
+  struct _r_arena_block * block;
+  size_t size = 0;
+
+  if (arena != NULL) {
+    for (block = arena->first; block != NULL; block = block->next) {
+      size += block->size;
+    }
+  }
+  return size;
+}
+
+int r_policy_init(r_policy_t * policy) {
+  if (policy != NULL) {
+    memset(policy, 0, sizeof(r_policy_t));
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int _r_policy_check_token(const r_policy_t * policy, size_t token_len, size_t header_len) {
+  int ret = RHN_OK;
+
+  if (policy != NULL) {
+    if (policy->max_token_len && token_len > policy->max_token_len) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_policy_check_token - Token too large: %zu", token_len);
+      ret = RHN_ERROR_INVALID;
+    } else if (policy->max_header_len && header_len > policy->max_header_len) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_policy_check_token - Header too large: %zu", header_len);
+      ret = RHN_ERROR_INVALID;
+    }
+  }
+  return ret;
+}
+
+int _r_policy_check_p2c(const r_policy_t * policy, json_int_t p2c) {
+  if (policy != NULL && policy->max_p2c && p2c > (json_int_t)policy->max_p2c) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_policy_check_p2c - p2c too large: %" JSON_INTEGER_FORMAT, p2c);
+    return RHN_ERROR_INVALID;
+  } else {
+    return RHN_OK;
+  }
+}
+
+int _r_policy_check_rsa_bits(const r_policy_t * policy, unsigned int bits) {
+  int ret = RHN_OK;
+
+  if (policy != NULL) {
+    if ((policy->min_rsa_bits && bits < policy->min_rsa_bits) || (policy->max_rsa_bits && bits > policy->max_rsa_bits)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_policy_check_rsa_bits - Invalid RSA key size: %u", bits);
+      ret = RHN_ERROR_INVALID;
+    }
+  }
+  return ret;
+}
+
+int _r_policy_check_keys(const r_policy_t * policy, size_t nb_keys_tried) {
+  if (policy != NULL && policy->max_keys && nb_keys_tried >= policy->max_keys) {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "_r_policy_check_keys - Maximum number of keys tried reached");
+    return RHN_ERROR_INVALID;
+  } else {
+    return RHN_OK;
+  }
+}
+
+void _r_arena_enter(r_arena_t * arena) {
+  if (arena != NULL) {
+    arena->depth++;
+  }
+}
+
+void _r_arena_leave(r_arena_t * arena) {
+  struct _r_arena_block * block;
+
+  if (arena != NULL && arena->depth) {
+    arena->depth--;
+    if (!arena->depth) {
+      // End of the outermost operation, all the temporary buffers are released at once
+      for (block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+      }
+      arena->current = arena->first;
+    }
+  }
+}
+
+void * _r_arena_malloc(r_arena_t * arena, size_t size) {
+  struct _r_arena_block * block, * last = NULL;
+  void * ptr = NULL;
+
+  if (arena == NULL || !arena->depth) {
+    // Outside of an operation, the buffer wouldn't be released until the next one
+    ptr = o_malloc(size);
+  } else if (size <= ((size_t)-1) - arena->block_size) {
+    size = _R_ARENA_ALIGN_SIZE(size?size:1);
+    for (block = arena->current; block != NULL && block->size - block->used < size; block = block->next) {
+      last = block;
+    }
+    if (block == NULL) {
+      if ((block = o_malloc(_R_ARENA_ALIGN_SIZE(sizeof(struct _r_arena_block)) + (size>arena->block_size?size:arena->block_size))) != NULL) {
+        block->next = NULL;
+        block->size = size>arena->block_size?size:arena->block_size;
+        block->used = 0;
+        if (last != NULL) {
+          last->next = block;
+        } else {
+          arena->first = block;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_arena_malloc - Error allocating resources for block");
+      }
+    }
+    if (block != NULL) {
+      arena->current = block;
+      ptr = _R_ARENA_BLOCK_DATA(block) + block->used;
+      block->used += size;
+    }
+  }
+  return ptr;
+}
+
+void _r_arena_free(r_arena_t * arena, void * ptr) {
+  struct _r_arena_block * block;
+  int in_arena = 0;
+
+  if (arena != NULL && ptr != NULL) {
+    for (block = arena->first; block != NULL && !in_arena; block = block->next) {
+      in_arena = ((unsigned char *)ptr >= _R_ARENA_BLOCK_DATA(block) && (unsigned char *)ptr < _R_ARENA_BLOCK_DATA(block) + block->size);
+    }
+  }
+  // Arena buffers are released at the end of the operation
+  if (!in_arena) {
+    o_free(ptr);
+  }
+}
+
+/**
+ * base64url codec used for all token segments
+ * SIMD kernels process the bulk of the data, the scalar code handles the tail
+ * and the platforms without a supported instruction set
+ * Semantics are the same as orcania's o_base64url_*: no padding on output,
+ * optional padding on input, 0 on error, 1 on success
+ */
+
+static const unsigned char _r_b64url_enc_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static unsigned char _r_b64url_dec_table[256];
+static int _r_b64url_level = _R_B64URL_SCALAR;
+static pthread_once_t _r_b64url_once = PTHREAD_ONCE_INIT;
+
+static void _r_base64url_init(void) {
+  unsigned int i;
+
+  memset(_r_b64url_dec_table, _R_B64URL_INVALID, sizeof(_r_b64url_dec_table));
+  for (i=0; i<64; i++) {
+    _r_b64url_dec_table[_r_b64url_enc_table[i]] = (unsigned char)i;
+  }
+#ifdef _R_B64URL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    _r_b64url_level = _R_B64URL_AVX2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    _r_b64url_level = _R_B64URL_SSSE3;
+  }
+#endif
+}
+
+#ifdef _R_B64URL_X86
+/**
+ * Muła's pshufb encoding: 12 bytes -> 16 characters per 128 bits lane
+ */
+__attribute__((target("ssse3")))
+static __m128i _r_b64url_enc_ssse3_block(__m128i in) {
+  __m128i t0, t1, t2, t3, indices, result, less;
+
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  indices = _mm_or_si128(t1, t3);
+  // 0 for [26, 51], 1..10 for digits, 11 for '-', 12 for '_', 13 for [0, 25]
+  result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+  result = _mm_shuffle_epi8(_mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '-'-62, '_'-63, 'A', 0, 0), result);
+  return _mm_add_epi8(result, indices);
+}
+
+/**
+ * Returns a mask of the valid characters in chars and their 6 bits values in values
+ */
+__attribute__((target("ssse3")))
+static __m128i _r_b64url_dec_ssse3_values(__m128i chars, __m128i * values) {
+  __m128i m_upper, m_lower, m_digit, m_dash, m_under;
+
+  m_upper = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('A'-1)), _mm_cmpgt_epi8(_mm_set1_epi8('Z'+1), chars));
+  m_lower = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('a'-1)), _mm_cmpgt_epi8(_mm_set1_epi8('z'+1), chars));
+  m_digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0'-1)), _mm_cmpgt_epi8(_mm_set1_epi8('9'+1), chars));
+  m_dash = _mm_cmpeq_epi8(chars, _mm_set1_epi8('-'));
+  m_under = _mm_cmpeq_epi8(chars, _mm_set1_epi8('_'));
+  *values = _mm_or_si128(_mm_or_si128(_mm_and_si128(m_upper, _mm_sub_epi8(chars, _mm_set1_epi8('A'))),
+                                      _mm_and_si128(m_lower, _mm_sub_epi8(chars, _mm_set1_epi8('a'-26)))),
+                         _mm_or_si128(_mm_or_si128(_mm_and_si128(m_digit, _mm_add_epi8(chars, _mm_set1_epi8(52-'0'))),
+                                                   _mm_and_si128(m_dash, _mm_set1_epi8(62))),
+                                      _mm_and_si128(m_under, _mm_set1_epi8(63))));
+  return _mm_or_si128(_mm_or_si128(m_upper, m_lower), _mm_or_si128(m_digit, _mm_or_si128(m_dash, m_under)));
+}
+
+/**
+ * Packs 16 values of 6 bits into 12 bytes at the beginning of the lane
+ */
+__attribute__((target("ssse3")))
+static __m128i _r_b64url_dec_ssse3_pack(__m128i values) {
+  values = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  values = _mm_madd_epi16(values, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(values, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t _r_base64url_encode_ssse3(const unsigned char * src, size_t len, unsigned char * dst) {
+  size_t i = 0;
+
+  // Each load reads 16 bytes but only uses 12
+  while (i + 16 <= len) {
+    _mm_storeu_si128((__m128i *)dst, _r_b64url_enc_ssse3_block(_mm_loadu_si128((const __m128i *)(src+i))));
+    dst += 16;
+    i += 12;
+  }
+  return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t _r_base64url_decode_ssse3(const unsigned char * src, size_t len, unsigned char * dst) {
+  size_t i = 0;
+  __m128i values;
+  unsigned char out[16];
+
+  while (i + 16 <= len) {
+    if (_mm_movemask_epi8(_r_b64url_dec_ssse3_values(_mm_loadu_si128((const __m128i *)(src+i)), &values)) != 0xFFFF) {
+      // Let the scalar code report the error
+      break;
+    }
+    _mm_storeu_si128((__m128i *)out, _r_b64url_dec_ssse3_pack(values));
+    memcpy(dst, out, 12);
+    dst += 12;
+    i += 16;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t _r_base64url_encode_avx2(const unsigned char * src, size_t len, unsigned char * dst) {
+  size_t i = 0;
+  __m256i in, t0, t1, t2, t3, indices, result, less;
+
+  // The high lane is loaded from src+12, each load reads 16 bytes but only uses 12
+  while (i + 28 <= len) {
+    in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src+i))), _mm_loadu_si128((const __m128i *)(src+i+12)), 1);
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    indices = _mm256_or_si256(t1, t3);
+    result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    result = _mm256_shuffle_epi8(_mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '-'-62, '_'-63, 'A', 0, 0,
+                                                  'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '-'-62, '_'-63, 'A', 0, 0), result);
+    _mm256_storeu_si256((__m256i *)dst, _mm256_add_epi8(result, indices));
+    dst += 32;
+    i += 24;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t _r_base64url_decode_avx2(const unsigned char * src, size_t len, unsigned char * dst) {
+  size_t i = 0;
+  __m256i chars, values, m_upper, m_lower, m_digit, m_dash, m_under;
+  unsigned char out[32];
+
+  while (i + 32 <= len) {
+    chars = _mm256_loadu_si256((const __m256i *)(src+i));
+    m_upper = _mm256_and_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('A'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z'+1), chars));
+    m_lower = _mm256_and_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('a'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z'+1), chars));
+    m_digit = _mm256_and_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('0'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), chars));
+    m_dash = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('-'));
+    m_under = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('_'));
+    if ((unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(m_upper, m_lower), _mm256_or_si256(m_digit, _mm256_or_si256(m_dash, m_under)))) != 0xFFFFFFFFU) {
+      break;
+    }
+    values = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(m_upper, _mm256_sub_epi8(chars, _mm256_set1_epi8('A'))),
+                                             _mm256_and_si256(m_lower, _mm256_sub_epi8(chars, _mm256_set1_epi8('a'-26)))),
+                             _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(m_digit, _mm256_add_epi8(chars, _mm256_set1_epi8(52-'0'))),
+                                                             _mm256_and_si256(m_dash, _mm256_set1_epi8(62))),
+                                             _mm256_and_si256(m_under, _mm256_set1_epi8(63))));
+    values = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    values = _mm256_madd_epi16(values, _mm256_set1_epi32(0x00011000));
+    values = _mm256_shuffle_epi8(values, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    // Gather the 2 lanes 12 bytes results in the first 24 bytes
+    values = _mm256_permutevar8x32_epi32(values, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *)out, values);
+    memcpy(dst, out, 24);
+    dst += 24;
+    i += 32;
+  }
+  return i;
+}
+#endif
+
+#ifdef _R_B64URL_NEON
+static size_t _r_base64url_encode_neon(const unsigned char * src, size_t len, unsigned char * dst) {
+  size_t i = 0;
+  uint8x16x4_t table = vld1q_u8_x4(_r_b64url_enc_table), out;
+  uint8x16x3_t in;
+
+  while (i + 48 <= len) {
+    in = vld3q_u8(src+i);
+    out.val[0] = vshrq_n_u8(in.val[0], 2);
+    out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), vdupq_n_u8(0x3F));
+    out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), vdupq_n_u8(0x3F));
+    out.val[3] = vandq_u8(in.val[2], vdupq_n_u8(0x3F));
+    out.val[0] = vqtbl4q_u8(table, out.val[0]);
+    out.val[1] = vqtbl4q_u8(table, out.val[1]);
+    out.val[2] = vqtbl4q_u8(table, out.val[2]);
+    out.val[3] = vqtbl4q_u8(table, out.val[3]);
+    vst4q_u8(dst, out);
+    dst += 64;
+    i += 48;
+  }
+  return i;
+}
+
+/**
+ * Returns a mask of the valid characters in chars and their 6 bits values in values
+ */
+static uint8x16_t _r_b64url_dec_neon_values(uint8x16_t chars, uint8x16_t * values) {
+  uint8x16_t m_upper, m_lower, m_digit, m_dash, m_under;
+
+  m_upper = vcleq_u8(vsubq_u8(chars, vdupq_n_u8('A')), vdupq_n_u8(25));
+  m_lower = vcleq_u8(vsubq_u8(chars, vdupq_n_u8('a')), vdupq_n_u8(25));
+  m_digit = vcleq_u8(vsubq_u8(chars, vdupq_n_u8('0')), vdupq_n_u8(9));
+  m_dash = vceqq_u8(chars, vdupq_n_u8('-'));
+  m_under = vceqq_u8(chars, vdupq_n_u8('_'));
+  *values = vorrq_u8(vorrq_u8(vandq_u8(m_upper, vsubq_u8(chars, vdupq_n_u8('A'))),
+                              vandq_u8(m_lower, vsubq_u8(chars, vdupq_n_u8('a'-26)))),
+                     vorrq_u8(vorrq_u8(vandq_u8(m_digit, vaddq_u8(chars, vdupq_n_u8(52-'0'))),
+                                       vandq_u8(m_dash, vdupq_n_u8(62))),
+                              vandq_u8(m_under, vdupq_n_u8(63))));
+  return vorrq_u8(vorrq_u8(m_upper, m_lower), vorrq_u8(m_digit, vorrq_u8(m_dash, m_under)));
+}
+
+static size_t _r_base64url_decode_neon(const unsigned char * src, size_t len, unsigned char * dst) {
+  size_t i = 0;
+  uint8x16x4_t in;
+  uint8x16x3_t out;
+  uint8x16_t valid;
+
+  while (i + 64 <= len) {
+    in = vld4q_u8(src+i);
+    valid = vandq_u8(vandq_u8(_r_b64url_dec_neon_values(in.val[0], &in.val[0]), _r_b64url_dec_neon_values(in.val[1], &in.val[1])),
+                     vandq_u8(_r_b64url_dec_neon_values(in.val[2], &in.val[2]), _r_b64url_dec_neon_values(in.val[3], &in.val[3])));
+    if (vminvq_u8(valid) != 0xFF) {
+      break;
+    }
+    out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+    out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+    out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+    vst3q_u8(dst, out);
+    dst += 48;
+    i += 64;
+  }
+  return i;
+}
+#endif
+
+static size_t _r_base64url_encode_simd(const unsigned char * src, size_t len, unsigned char * dst) {
+#if defined(_R_B64URL_X86)
+  if (_r_b64url_level == _R_B64URL_AVX2) {
+    return _r_base64url_encode_avx2(src, len, dst);
+  } else if (_r_b64url_level == _R_B64URL_SSSE3) {
+    return _r_base64url_encode_ssse3(src, len, dst);
+  }
+  return 0;
+#elif defined(_R_B64URL_NEON)
+  return _r_base64url_encode_neon(src, len, dst);
+#else
+  (void)src;
+  (void)len;
+  (void)dst;
+  return 0;
+#endif
+}
+
+static size_t _r_base64url_decode_simd(const unsigned char * src, size_t len, unsigned char * dst) {
+#if defined(_R_B64URL_X86)
+  if (_r_b64url_level == _R_B64URL_AVX2) {
+    return _r_base64url_decode_avx2(src, len, dst);
+  } else if (_r_b64url_level == _R_B64URL_SSSE3) {
+    return _r_base64url_decode_ssse3(src, len, dst);
+  }
+  return 0;
+#elif defined(_R_B64URL_NEON)
+  return _r_base64url_decode_neon(src, len, dst);
+#else
+  (void)src;
+  (void)len;
+  (void)dst;
+  return 0;
+#endif
+}
+
+/**
+ * Removes the optional padding and returns the decoded size, or 0 if len is invalid
+ */
+static size_t _r_base64url_decoded_len(const unsigned char * src, size_t * len) {
+  if (!(*len % 4) && src[*len-1] == '=') {
+    (*len)--;
+    if (src[*len-1] == '=') {
+      (*len)--;
+    }
+  }
+  if (*len % 4 == 1) {
+    return 0;
+  }
+  return (*len/4)*3 + (*len%4?(*len%4)-1:0);
+}
+
+int _r_base64url_decode(const unsigned char * src, size_t len, unsigned char * dst, size_t * dst_len) {
+  size_t i = 0, o = 0, out_len;
+  unsigned char a, b, c, d;
+
+  if (src == NULL || !len || dst_len == NULL) {
+    return 0;
+  }
+  pthread_once(&_r_b64url_once, _r_base64url_init);
+  if (!(out_len = _r_base64url_decoded_len(src, &len))) {
+    return 0;
+  }
+  if (dst == NULL) {
+    // Size request, validate the characters only
+    for (i=0; i<len; i++) {
+      if (_r_b64url_dec_table[src[i]] & _R_B64URL_INVALID) {
+        return 0;
+      }
+    }
+  } else {
+    i = _r_base64url_decode_simd(src, len, dst);
+    o = (i/4)*3;
+    for (; i+4 <= len; i += 4) {
+      a = _r_b64url_dec_table[src[i]];
+      b = _r_b64url_dec_table[src[i+1]];
+      c = _r_b64url_dec_table[src[i+2]];
+      d = _r_b64url_dec_table[src[i+3]];
+      if ((a|b|c|d) & _R_B64URL_INVALID) {
+        return 0;
+      }
+      dst[o++] = (unsigned char)((a << 2) | (b >> 4));
+      dst[o++] = (unsigned char)((b << 4) | (c >> 2));
+      dst[o++] = (unsigned char)((c << 6) | d);
+    }
+    if (i < len) {
+      a = _r_b64url_dec_table[src[i]];
+      b = _r_b64url_dec_table[src[i+1]];
+      c = (len-i == 3)?_r_b64url_dec_table[src[i+2]]:0;
+      if ((a|b|c) & _R_B64URL_INVALID) {
+        return 0;
+      }
+      dst[o++] = (unsigned char)((a << 2) | (b >> 4));
+      if (len-i == 3) {
+        dst[o++] = (unsigned char)((b << 4) | (c >> 2));
+      }
+    }
+  }
+  *dst_len = out_len;
+  return 1;
+}
+
+int _r_base64url_decode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat) {
+  size_t out_len = 0, check_len;
+  int ret = 0;
+
+  if (src != NULL && len && dat != NULL) {
+    pthread_once(&_r_b64url_once, _r_base64url_init);
+    check_len = len;
+    if ((out_len = _r_base64url_decoded_len(src, &check_len))) {
+      // One extra byte so the result can be used as a string
+      if ((dat->data = o_malloc(out_len+1)) != NULL) {
+        if (_r_base64url_decode(src, len, dat->data, &dat->size)) {
+          dat->data[dat->size] = '\0';
+          ret = 1;
+        } else {
+          o_free(dat->data);
+          dat->data = NULL;
+          dat->size = 0;
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+int _r_base64url_encode(const unsigned char * src, size_t len, unsigned char * dst, size_t * dst_len) {
+  size_t i, o;
+
+  if (src == NULL || !len || dst_len == NULL) {
+    return 0;
+  }
+  if (dst != NULL) {
+    pthread_once(&_r_b64url_once, _r_base64url_init);
+    i = _r_base64url_encode_simd(src, len, dst);
+    o = (i/3)*4;
+    for (; i+3 <= len; i += 3) {
+      dst[o++] = _r_b64url_enc_table[src[i] >> 2];
+      dst[o++] = _r_b64url_enc_table[((src[i] & 0x03) << 4) | (src[i+1] >> 4)];
+      dst[o++] = _r_b64url_enc_table[((src[i+1] & 0x0F) << 2) | (src[i+2] >> 6)];
+      dst[o++] = _r_b64url_enc_table[src[i+2] & 0x3F];
+    }
+    if (len-i == 1) {
+      dst[o++] = _r_b64url_enc_table[src[i] >> 2];
+      dst[o++] = _r_b64url_enc_table[(src[i] & 0x03) << 4];
+    } else if (len-i == 2) {
+      dst[o++] = _r_b64url_enc_table[src[i] >> 2];
+      dst[o++] = _r_b64url_enc_table[((src[i] & 0x03) << 4) | (src[i+1] >> 4)];
+      dst[o++] = _r_b64url_enc_table[(src[i+1] & 0x0F) << 2];
+    }
+  }
+  *dst_len = (len/3)*4 + (len%3?(len%3)+1:0);
+  return 1;
+}
+
+int _r_base64url_encode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat) {
+  size_t out_len = 0;
+  int ret = 0;
+
+  if (src != NULL && len && dat != NULL) {
+    _r_base64url_encode(src, len, NULL, &out_len);
+    // One extra byte so the result can be used as a string
+    if ((dat->data = o_malloc(out_len+1)) != NULL) {
+      _r_base64url_encode(src, len, dat->data, &dat->size);
+      dat->data[dat->size] = '\0';
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+unsigned char * _r_arena_base64url_decode(r_arena_t * arena, const unsigned char * src, size_t len, size_t * dat_len) {
+  unsigned char * dat = NULL;
+  size_t size, check_len = len;
+
+  if (src != NULL && len && (size = _r_base64url_decoded_len(src, &check_len)) && (dat = _r_arena_malloc(arena, size)) != NULL) {
+    if (!_r_base64url_decode(src, len, dat, dat_len)) {
+      _r_arena_free(arena, dat);
+      dat = NULL;
+    }
+  }
+  return dat;
+}
+
+/**
+ * zlib states reused by the deflate and inflate calls of a thread
+ */
+struct _r_zip_state {
   z_stream defstream;
+  int      def_init;
+  int      def_level;
+  z_stream infstream;
+  int      inf_init;
+};
+
+static pthread_mutex_t _r_zip_lock = PTHREAD_MUTEX_INITIALIZER;
+static int _r_zip_level = Z_DEFAULT_COMPRESSION;
+static size_t _r_zip_max_inflate_size = R_ZIP_DEFAULT_MAX_INFLATE_SIZE;
+static pthread_once_t _r_zip_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _r_zip_key;
+static int _r_zip_key_ok = 0;
+
+static void _r_zip_state_free(void * data) {
+  struct _r_zip_state * state = (struct _r_zip_state *)data;
+
+  if (state != NULL) {
+    if (state->def_init) {
+      deflateEnd(&state->defstream);
+    }
+    if (state->inf_init) {
+      inflateEnd(&state->infstream);
+    }
+    o_free(state);
+  }
+}
+
+static void _r_zip_key_create(void) {
+  _r_zip_key_ok = !pthread_key_create(&_r_zip_key, _r_zip_state_free);
+}
+
+static struct _r_zip_state * _r_zip_state_get(void) {
+  struct _r_zip_state * state = NULL;
+
+  pthread_once(&_r_zip_key_once, _r_zip_key_create);
+  if (_r_zip_key_ok) {
+    if ((state = pthread_getspecific(_r_zip_key)) == NULL) {
+      if ((state = o_malloc(sizeof(struct _r_zip_state))) != NULL) {
+        memset(state, 0, sizeof(struct _r_zip_state));
+        if (pthread_setspecific(_r_zip_key, state)) {
+          o_free(state);
+          state = NULL;
+        }
+      }
+    }
+  }
+  return state;
+}
+
+/**
+ * Free the zlib states of the calling thread,
+ * the states of the other threads are freed when they exit
+ */
+static void _r_zip_state_close(void) {
+  if (_r_zip_key_ok) {
+    _r_zip_state_free(pthread_getspecific(_r_zip_key));
+    pthread_setspecific(_r_zip_key, NULL);
+  }
+}
+
+int r_zip_set_level(int level) {
+  if (level >= Z_DEFAULT_COMPRESSION && level <= Z_BEST_COMPRESSION) {
+    pthread_mutex_lock(&_r_zip_lock);
+    _r_zip_level = level;
+    pthread_mutex_unlock(&_r_zip_lock);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_zip_set_max_inflate_size(size_t max_size) {
+  pthread_mutex_lock(&_r_zip_lock);
+  _r_zip_max_inflate_size = max_size;
+  pthread_mutex_unlock(&_r_zip_lock);
+  return RHN_OK;
+}
+
+int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_len, unsigned char ** compressed, size_t * compressed_len) {
+  int ret = RHN_OK, res = Z_OK, level;
+  struct _r_zip_state * state;
+  z_stream * defstream;
+  unsigned char * out;
+  uLong bound;
 
   *compressed_len = 0;
   *compressed = NULL;
 
-  defstream.zalloc = Z_NULL;
-  defstream.zfree = Z_NULL;
-  defstream.opaque = Z_NULL;
-  defstream.avail_in = (uInt)uncompressed_len;
-  defstream.next_in = (Bytef *)uncompressed;
+  pthread_mutex_lock(&_r_zip_lock);
+  level = _r_zip_level;
+  pthread_mutex_unlock(&_r_zip_lock);
 
-  if (deflateInit2(&defstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -9, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
-    do {
-      if ((*compressed = o_realloc(*compressed, (*compressed_len)+_R_BLOCK_SIZE)) != NULL) {
-        defstream.avail_out = _R_BLOCK_SIZE;
-        defstream.next_out = ((Bytef *)*compressed)+(*compressed_len);
-        switch ((res = deflate(&defstream, Z_FINISH))) {
-          case Z_OK:
-          case Z_STREAM_END:
-          case Z_BUF_ERROR:
-            break;
-          default:
-            y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error deflate %d", res);
-            ret = RHN_ERROR;
-            break;
-        }
-        (*compressed_len) += _R_BLOCK_SIZE - defstream.avail_out;
+  if ((state = _r_zip_state_get()) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error allocating resources for state");
+    ret = RHN_ERROR_MEMORY;
+  } else {
+    defstream = &state->defstream;
+    if (!state->def_init) {
+      defstream->zalloc = Z_NULL;
+      defstream->zfree = Z_NULL;
+      defstream->opaque = Z_NULL;
+      if (deflateInit2(defstream, level, Z_DEFLATED, -9, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+        state->def_init = 1;
+        state->def_level = level;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error allocating resources for *compressed");
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error deflateInit");
         ret = RHN_ERROR;
       }
-    } while (RHN_OK == ret && defstream.avail_out == 0);
-
-    deflateEnd(&defstream);
-  } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error deflateInit");
-    ret = RHN_ERROR;
+    } else if (deflateReset(defstream) != Z_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error deflateReset");
+      ret = RHN_ERROR;
+    }
+    // No data was given to the stream since the reset, so the level can be changed safely
+    if (RHN_OK == ret && state->def_level != level) {
+      if (deflateParams(defstream, level, Z_DEFAULT_STRATEGY) == Z_OK) {
+        state->def_level = level;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error deflateParams");
+        ret = RHN_ERROR;
+      }
+    }
+    if (RHN_OK == ret) {
+      // deflateBound gives the largest possible output, so the stream usually ends in a single deflate call,
+      // older zlib versions may underestimate it for some levels though
+      bound = deflateBound(defstream, (uLong)uncompressed_len);
+      defstream->avail_in = (uInt)uncompressed_len;
+      defstream->next_in = (Bytef *)uncompressed;
+      do {
+        if ((out = o_realloc(*compressed, bound)) != NULL) {
+          *compressed = out;
+          defstream->avail_out = (uInt)(bound - defstream->total_out);
+          defstream->next_out = (Bytef *)out+defstream->total_out;
+          switch ((res = deflate(defstream, Z_FINISH))) {
+            case Z_STREAM_END:
+              *compressed_len = (size_t)defstream->total_out;
+              break;
+            case Z_OK:
+            case Z_BUF_ERROR:
+              bound += _R_BLOCK_SIZE;
+              break;
+            default:
+              y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error deflate %d", res);
+              ret = RHN_ERROR;
+              break;
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error allocating resources for *compressed");
+          ret = RHN_ERROR_MEMORY;
+        }
+      } while (RHN_OK == ret && res != Z_STREAM_END);
+      if (RHN_OK != ret) {
+        o_free(*compressed);
+        *compressed = NULL;
+      }
+    }
+    if (RHN_OK != ret && state->def_init) {
+      // Don't keep a stream in an unknown state
+      deflateEnd(defstream);
+      state->def_init = 0;
+    }
   }
   return ret;
 }
 
 int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len, unsigned char ** uncompressed, size_t * uncompressed_len) {
-  int ret = RHN_OK, res;
-  z_stream infstream;
+  int ret = RHN_OK, res = Z_OK;
+  struct _r_zip_state * state;
+  z_stream * infstream;
+  size_t max_size, out_size;
+  unsigned char * out;
 
   *uncompressed = NULL;
   *uncompressed_len = 0;
-  infstream.zalloc = Z_NULL;
-  infstream.zfree = Z_NULL;
-  infstream.opaque = Z_NULL;
-  infstream.avail_in = (uInt)compressed_len;
-  infstream.next_in = (Bytef *)compressed;
 
-  if (inflateInit2(&infstream, -8) == Z_OK) {
-    do {
-      if (((*uncompressed) = o_realloc((*uncompressed), (*uncompressed_len)+_R_BLOCK_SIZE)) != NULL) {
-        infstream.avail_out = _R_BLOCK_SIZE;
-        infstream.next_out = ((Bytef *)(*uncompressed))+(*uncompressed_len);
-        switch ((res = inflate(&infstream, Z_FINISH))) {
-          case Z_OK:
-          case Z_STREAM_END:
-          case Z_BUF_ERROR:
-            break;
-          default:
-            y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error inflate %d", res);
-            ret = RHN_ERROR;
-            break;
-        }
-        (*uncompressed_len) += _R_BLOCK_SIZE - infstream.avail_out;
+  pthread_mutex_lock(&_r_zip_lock);
+  max_size = _r_zip_max_inflate_size;
+  pthread_mutex_unlock(&_r_zip_lock);
+
+  if ((state = _r_zip_state_get()) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error allocating resources for state");
+    ret = RHN_ERROR_MEMORY;
+  } else {
+    infstream = &state->infstream;
+    if (!state->inf_init) {
+      infstream->zalloc = Z_NULL;
+      infstream->zfree = Z_NULL;
+      infstream->opaque = Z_NULL;
+      infstream->avail_in = 0;
+      infstream->next_in = Z_NULL;
+      if (inflateInit2(infstream, -8) == Z_OK) {
+        state->inf_init = 1;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error allocating resources for data_in_suffix");
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error inflateInit");
         ret = RHN_ERROR;
       }
-    } while (RHN_OK == ret && infstream.avail_out == 0);
+    } else if (inflateReset(infstream) != Z_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error inflateReset");
+      ret = RHN_ERROR;
+    }
+    if (RHN_OK == ret) {
+      infstream->avail_in = (uInt)compressed_len;
+      infstream->next_in = (Bytef *)compressed;
+      // Start with a guess of the output size, then double it when it's full,
+      // one more byte than the ceiling is allowed so an oversized output is detected
+      out_size = compressed_len*4 > _R_BLOCK_SIZE ? compressed_len*4 : _R_BLOCK_SIZE;
+      do {
+        if (max_size && out_size > max_size+1) {
+          out_size = max_size+1;
+        }
+        if ((out = o_realloc(*uncompressed, out_size)) != NULL) {
+          *uncompressed = out;
+          infstream->avail_out = (uInt)(out_size - *uncompressed_len);
+          infstream->next_out = (Bytef *)out+(*uncompressed_len);
+          switch ((res = inflate(infstream, Z_FINISH))) {
+            case Z_OK:
+            case Z_STREAM_END:
+            case Z_BUF_ERROR:
+              break;
+            default:
+              y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error inflate %d", res);
+              ret = RHN_ERROR;
+              break;
+          }
+          *uncompressed_len = (size_t)infstream->total_out;
+          if (max_size && *uncompressed_len > max_size) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Inflated payload too large");
+            ret = RHN_ERROR_INVALID;
+          }
+          out_size *= 2;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error allocating resources for *uncompressed");
+          ret = RHN_ERROR_MEMORY;
+        }
+      } while (RHN_OK == ret && res != Z_STREAM_END && infstream->avail_out == 0);
+      if (RHN_OK != ret) {
+        o_free(*uncompressed);
+        *uncompressed = NULL;
+        *uncompressed_len = 0;
+        inflateEnd(infstream);
+        state->inf_init = 0;
+      }
+    }
+  }
+  return ret;
+}
+
+/**
+ * Tasks shared by the threads of a _r_parallel_run call
+ * Each thread takes the next task index until all the tasks are done
+ */
+struct _r_parallel {
+  pthread_mutex_t lock;
+  size_t          nb_tasks;
+  size_t          next_task;
+  void         (* task)(void * data, size_t index);
+  void          * data;
+};
+
+static void * _r_parallel_worker(void * args) {
+  struct _r_parallel * parallel = (struct _r_parallel *)args;
+  size_t index;
 
-    inflateEnd(&infstream);
+  while (1) {
+    pthread_mutex_lock(&parallel->lock);
+    index = parallel->next_task++;
+    pthread_mutex_unlock(&parallel->lock);
+    if (index >= parallel->nb_tasks) {
+      break;
+    }
+    parallel->task(parallel->data, index);
+  }
+  return NULL;
+}
+
+int _r_parallel_run(unsigned int nb_threads, size_t nb_tasks, void (* task)(void * data, size_t index), void * data) {
+  struct _r_parallel parallel;
+  pthread_t * threads = NULL;
+  size_t i, nb_started = 0;
+
+  if (task == NULL) {
+    return RHN_ERROR_PARAM;
+  }
+  if (nb_threads > nb_tasks) {
+    nb_threads = (unsigned int)nb_tasks;
+  }
+  if (nb_threads > 1) {
+    parallel.nb_tasks = nb_tasks;
+    parallel.next_task = 0;
+    parallel.task = task;
+    parallel.data = data;
+    pthread_mutex_init(&parallel.lock, NULL);
+    // The calling thread is one of the workers
+    if ((threads = o_malloc((nb_threads-1)*sizeof(pthread_t))) != NULL) {
+      for (i=0; i<nb_threads-1; i++) {
+        if (pthread_create(&threads[nb_started], NULL, _r_parallel_worker, &parallel)) {
+          y_log_message(Y_LOG_LEVEL_DEBUG, "_r_parallel_run - Error pthread_create, continue with %zu threads", nb_started+1);
+          break;
+        }
+        nb_started++;
+      }
+    }
+    _r_parallel_worker(&parallel);
+    for (i=0; i<nb_started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    o_free(threads);
+    pthread_mutex_destroy(&parallel.lock);
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error inflateInit");
-    ret = RHN_ERROR;
+    for (i=0; i<nb_tasks; i++) {
+      task(data, i);
+    }
   }
-  return ret;
+  return RHN_OK;
 }
 
 jwa_alg r_str_to_jwa_alg(const char * alg) {
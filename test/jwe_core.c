@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <string.h>
 #include <gnutls/abstract.h>
 #include <gnutls/x509.h>
 
@@ -804,6 +805,50 @@ START_TEST(test_rhonabwy_copy)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_reset)
+{
+  jwe_t * jwe;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  char * token = NULL;
+  const unsigned char * payload;
+  size_t payload_len = 0;
+  
+  ck_assert_int_eq(r_jwe_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys(jwe, jwk_privkey, jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_RSA1_5), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwe_serialize(jwe, NULL, 0)), NULL);
+  
+  ck_assert_int_eq(r_jwe_reset(jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_get_alg(jwe), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_jwe_get_enc(jwe), R_JWA_ENC_UNKNOWN);
+  ck_assert_ptr_eq(r_jwe_get_payload(jwe, &payload_len), NULL);
+  ck_assert_ptr_eq(jwe->key, NULL);
+  ck_assert_ptr_eq(jwe->iv, NULL);
+  ck_assert_int_eq(r_jwks_size(jwe->jwks_privkey), 1);
+  ck_assert_int_eq(r_jwks_size(jwe->jwks_pubkey), 1);
+  
+  ck_assert_int_eq(r_jwe_parse(jwe, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe, NULL, 0), RHN_OK);
+  ck_assert_ptr_ne((payload = r_jwe_get_payload(jwe, &payload_len)), NULL);
+  ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+  ck_assert_int_eq(0, memcmp(payload, PAYLOAD, payload_len));
+  ck_assert_int_eq(r_jwe_reset(jwe), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwe->jwks_pubkey), 1);
+  
+  o_free(token);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  r_jwe_free(jwe);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_generate_cypher_key)
 {
   jwe_t * jwe;
@@ -994,6 +1039,29 @@ START_TEST(test_rhonabwy_decrypt_payload_invalid_key_no_tag)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_decrypt_payload_invalid_tag)
+{
+  jwe_t * jwe;
+  jwa_enc enc[2] = {R_JWA_ENC_A128CBC, R_JWA_ENC_A128GCM};
+  size_t i;
+  
+  for (i=0; i<2; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, enc[i]), RHN_OK);
+    ck_assert_int_eq(r_jwe_generate_cypher_key(jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_generate_iv(jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+    ck_assert_int_eq(r_jwe_encrypt_payload(jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, NULL, 0), RHN_OK);
+    jwe->auth_tag_b64url[0] = jwe->auth_tag_b64url[0]=='A'?'B':'A';
+    ck_assert_int_eq(r_jwe_decrypt_payload(jwe), RHN_ERROR_INVALID);
+    ck_assert_ptr_eq(jwe->payload, NULL);
+    ck_assert_int_eq(jwe->payload_len, 0);
+    r_jwe_free(jwe);
+  }
+}
+END_TEST
+
 START_TEST(test_rhonabwy_encrypt_payload_zip)
 {
   jwe_t * jwe;
@@ -1029,6 +1097,192 @@ START_TEST(test_rhonabwy_encrypt_payload_zip)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_encrypt_payload_zip_settings)
+{
+  jwe_t * jwe;
+  int level[3] = {0, 9, -1};
+  size_t i;
+  
+  ck_assert_int_eq(r_zip_set_level(10), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_zip_set_level(-2), RHN_ERROR_PARAM);
+  for (i=0; i<3; i++) {
+    ck_assert_int_eq(r_zip_set_level(level[i]), RHN_OK);
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+    ck_assert_int_eq(r_jwe_generate_cypher_key(jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_generate_iv(jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)HUGE_PAYLOAD, o_strlen(HUGE_PAYLOAD)), RHN_OK);
+    r_jwe_set_header_str_value(jwe, "zip", "DEF");
+    ck_assert_int_eq(r_jwe_encrypt_payload(jwe), RHN_OK);
+    
+    ck_assert_int_eq(r_zip_set_max_inflate_size(o_strlen(HUGE_PAYLOAD)-1), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt_payload(jwe), RHN_ERROR);
+    ck_assert_int_eq(r_zip_set_max_inflate_size(o_strlen(HUGE_PAYLOAD)), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt_payload(jwe), RHN_OK);
+    ck_assert_int_eq(0, o_strncmp(HUGE_PAYLOAD, (const char *)r_jwe_get_payload(jwe, NULL), o_strlen(HUGE_PAYLOAD)));
+    ck_assert_int_eq(r_zip_set_max_inflate_size(0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt_payload(jwe), RHN_OK);
+    ck_assert_int_eq(0, o_strncmp(HUGE_PAYLOAD, (const char *)r_jwe_get_payload(jwe, NULL), o_strlen(HUGE_PAYLOAD)));
+    
+    r_jwe_free(jwe);
+  }
+  ck_assert_int_eq(r_zip_set_max_inflate_size(R_ZIP_DEFAULT_MAX_INFLATE_SIZE), RHN_OK);
+}
+END_TEST
+
+struct _stream_buffer {
+  unsigned char * data;
+  size_t          len;
+  size_t          pos;
+  size_t          chunk;
+};
+
+static int stream_write(void * user_data, const unsigned char * data, size_t data_len) {
+  struct _stream_buffer * buffer = (struct _stream_buffer *)user_data;
+  
+  if ((buffer->data = o_realloc(buffer->data, buffer->len+data_len+1)) != NULL) {
+    memcpy(buffer->data+buffer->len, data, data_len);
+    buffer->len += data_len;
+    buffer->data[buffer->len] = '\0';
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_MEMORY;
+  }
+}
+
+static int stream_read(void * user_data, unsigned char * data, size_t data_size, size_t * data_len) {
+  struct _stream_buffer * buffer = (struct _stream_buffer *)user_data;
+  
+  *data_len = buffer->len-buffer->pos;
+  if (*data_len > data_size) {
+    *data_len = data_size;
+  }
+  if (buffer->chunk && *data_len > buffer->chunk) {
+    *data_len = buffer->chunk;
+  }
+  memcpy(data, buffer->data+buffer->pos, *data_len);
+  buffer->pos += *data_len;
+  return RHN_OK;
+}
+
+START_TEST(test_rhonabwy_stream)
+{
+  jwe_t * jwe, * jwe_decrypt;
+  jwe_stream_t * stream = NULL;
+  jwk_t * jwk_pubkey, * jwk_privkey;
+  struct _stream_buffer payload, token, output;
+  jwa_enc encs[] = {R_JWA_ENC_A128CBC, R_JWA_ENC_A256GCM};
+  size_t sizes[] = {3*R_JWE_STREAM_CHUNK_SIZE+5, 2*R_JWE_STREAM_CHUNK_SIZE, 1}, i, j, k;
+  char * token_str, * tag;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_rsa_str), RHN_OK);
+  
+  for (i=0; i<sizeof(encs)/sizeof(jwa_enc); i++) {
+    for (j=0; j<sizeof(sizes)/sizeof(size_t); j++) {
+      memset(&payload, 0, sizeof(struct _stream_buffer));
+      memset(&token, 0, sizeof(struct _stream_buffer));
+      memset(&output, 0, sizeof(struct _stream_buffer));
+      payload.data = o_malloc(sizes[j]);
+      payload.len = sizes[j];
+      for (k=0; k<sizes[j]; k++) {
+        payload.data[k] = (unsigned char)(k%251);
+      }
+      
+      // Streaming encryption, regular decryption
+      ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+      ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_RSA1_5), RHN_OK);
+      ck_assert_int_eq(r_jwe_set_enc(jwe, encs[i]), RHN_OK);
+      ck_assert_int_eq(r_jwe_encrypt_stream(jwe, jwk_pubkey, 0, &stream_read, &payload, &stream_write, &token), RHN_OK);
+      r_jwe_free(jwe);
+      ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+      ck_assert_int_eq(r_jwe_parse(jwe_decrypt, (const char *)token.data, 0), RHN_OK);
+      ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk_privkey, 0), RHN_OK);
+      ck_assert_int_eq(jwe_decrypt->payload_len, payload.len);
+      ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, payload.data, payload.len));
+      r_jwe_free(jwe_decrypt);
+      
+      // Streaming decryption, token given in small chunks
+      token.chunk = 7;
+      ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+      ck_assert_int_eq(r_jwe_decrypt_stream(jwe_decrypt, jwk_privkey, R_PARSE_NONE, 0, &stream_read, &token, &stream_write, &output), RHN_OK);
+      ck_assert_int_eq(output.len, payload.len);
+      ck_assert_int_eq(0, memcmp(output.data, payload.data, payload.len));
+      r_jwe_free(jwe_decrypt);
+      o_free(output.data);
+      memset(&output, 0, sizeof(struct _stream_buffer));
+      
+      // Payload written once the tag is verified
+      token.pos = 0;
+      ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+      ck_assert_int_eq(r_jwe_decrypt_stream(jwe_decrypt, jwk_privkey, R_PARSE_STREAM_VERIFIED, 0, &stream_read, &token, &stream_write, &output), RHN_OK);
+      ck_assert_int_eq(output.len, payload.len);
+      ck_assert_int_eq(0, memcmp(output.data, payload.data, payload.len));
+      r_jwe_free(jwe_decrypt);
+      o_free(output.data);
+      memset(&output, 0, sizeof(struct _stream_buffer));
+      
+      // Invalid tag, no payload is written if the tag must be verified first
+      tag = o_strrchr((const char *)token.data, '.')+1;
+      *tag = *tag=='A'?'B':'A';
+      token.pos = 0;
+      ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+      ck_assert_int_eq(r_jwe_decrypt_stream(jwe_decrypt, jwk_privkey, R_PARSE_STREAM_VERIFIED, 0, &stream_read, &token, &stream_write, &output), RHN_ERROR_INVALID);
+      ck_assert_int_eq(output.len, 0);
+      r_jwe_free(jwe_decrypt);
+      o_free(output.data);
+      memset(&output, 0, sizeof(struct _stream_buffer));
+      
+      // Invalid tag, the unverified payload is written before the error is returned
+      token.pos = 0;
+      ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+      ck_assert_int_eq(r_jwe_decrypt_stream(jwe_decrypt, jwk_privkey, R_PARSE_NONE, 0, &stream_read, &token, &stream_write, &output), RHN_ERROR_INVALID);
+      ck_assert_int_eq(output.len, payload.len);
+      r_jwe_free(jwe_decrypt);
+      o_free(output.data);
+      memset(&output, 0, sizeof(struct _stream_buffer));
+      o_free(token.data);
+      memset(&token, 0, sizeof(struct _stream_buffer));
+      
+      // Regular encryption, streaming decryption
+      ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+      ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_RSA1_5), RHN_OK);
+      ck_assert_int_eq(r_jwe_set_enc(jwe, encs[i]), RHN_OK);
+      ck_assert_int_eq(r_jwe_set_payload(jwe, payload.data, payload.len), RHN_OK);
+      ck_assert_ptr_ne((token_str = r_jwe_serialize(jwe, jwk_pubkey, 0)), NULL);
+      r_jwe_free(jwe);
+      ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+      ck_assert_int_eq(r_jwe_decrypt_stream_init(&stream, jwe_decrypt, jwk_privkey, R_PARSE_NONE, 0, &stream_write, &output), RHN_OK);
+      ck_assert_int_eq(r_jwe_stream_update(stream, (const unsigned char *)token_str, o_strlen(token_str)), RHN_OK);
+      ck_assert_int_eq(r_jwe_stream_final(stream), RHN_OK);
+      ck_assert_int_eq(r_jwe_stream_final(stream), RHN_ERROR_PARAM);
+      r_jwe_stream_free(stream);
+      ck_assert_int_eq(output.len, payload.len);
+      ck_assert_int_eq(0, memcmp(output.data, payload.data, payload.len));
+      r_jwe_free(jwe_decrypt);
+      r_free(token_str);
+      o_free(output.data);
+      o_free(payload.data);
+    }
+  }
+  
+  // zip isn't supported in a stream
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_RSA1_5), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_header_str_value(jwe, "zip", "DEF"), RHN_OK);
+  ck_assert_int_eq(r_jwe_encrypt_stream_init(&stream, jwe, jwk_pubkey, 0, &stream_write, &token), RHN_ERROR_UNSUPPORTED);
+  ck_assert_ptr_eq(stream, NULL);
+  ck_assert_int_eq(r_jwe_encrypt_stream_init(&stream, jwe, jwk_pubkey, 0, NULL, &token), RHN_ERROR_PARAM);
+  r_jwe_free(jwe);
+  
+  r_jwk_free(jwk_pubkey);
+  r_jwk_free(jwk_privkey);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_encrypt_key_invalid)
 {
   jwe_t * jwe;
@@ -1454,6 +1708,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_set_properties_error);
   tcase_add_test(tc_core, test_rhonabwy_set_properties);
   tcase_add_test(tc_core, test_rhonabwy_copy);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
   tcase_add_test(tc_core, test_rhonabwy_generate_cypher_key);
   tcase_add_test(tc_core, test_rhonabwy_generate_iv);
   tcase_add_test(tc_core, test_rhonabwy_get_set_key_iv_aad);
@@ -1461,7 +1716,10 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_encrypt_payload);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_payload_all_format);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_payload_invalid_key_no_tag);
+  tcase_add_test(tc_core, test_rhonabwy_decrypt_payload_invalid_tag);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_payload_zip);
+  tcase_add_test(tc_core, test_rhonabwy_encrypt_payload_zip_settings);
+  tcase_add_test(tc_core, test_rhonabwy_stream);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_key_invalid);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_key_valid);
 #if GNUTLS_VERSION_NUMBER >= 0x030600
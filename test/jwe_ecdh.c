@@ -222,6 +222,132 @@ START_TEST(test_rhonabwy_encrypt_decrypt_x25519_ok)
 }
 END_TEST
 
+static void check_ecdh_pool(const char * privkey_str, const char * pubkey_str) {
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  json_t * j_epk, * j_x = json_array();
+  char * token = NULL;
+  size_t i, j;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, privkey_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, pubkey_str), RHN_OK);
+  for (i=0; i<12; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+    ck_assert_int_eq(r_jwe_add_keys(jwe, NULL, jwk_pubkey), RHN_OK);
+    ck_assert_int_eq(r_jwe_add_keys(jwe_decrypt, jwk_privkey, NULL), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_ECDH_ES_A256KW), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+    ck_assert_ptr_ne((token = r_jwe_serialize(jwe, NULL, 0)), NULL);
+    ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, NULL, 0), RHN_OK);
+    ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+    ck_assert_ptr_ne((j_epk = r_jwe_get_header_json_t_value(jwe_decrypt, "epk")), NULL);
+    // Each ephemeral key must be used only once
+    for (j=0; j<json_array_size(j_x); j++) {
+      ck_assert_str_ne(json_string_value(json_array_get(j_x, j)), json_string_value(json_object_get(j_epk, "x")));
+    }
+    json_array_append(j_x, json_object_get(j_epk, "x"));
+    json_decref(j_epk);
+    o_free(token);
+    r_jwe_free(jwe);
+    r_jwe_free(jwe_decrypt);
+  }
+  json_decref(j_x);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+}
+
+START_TEST(test_rhonabwy_encrypt_decrypt_ephemeral_pool)
+{
+  ck_assert_int_eq(r_jwe_ecdh_pool_get_size(), 0);
+  ck_assert_int_eq(r_jwe_ecdh_pool_set_size(4), RHN_OK);
+  ck_assert_int_eq(r_jwe_ecdh_pool_get_size(), 4);
+  check_ecdh_pool(jwk_privkey_ecdsa_str, jwk_pubkey_ecdsa_str);
+  check_ecdh_pool(jwk_privkey_x25519_str, jwk_pubkey_x25519_str);
+  ck_assert_int_eq(r_jwe_ecdh_pool_set_size(0), RHN_OK);
+  ck_assert_int_eq(r_jwe_ecdh_pool_get_size(), 0);
+  check_ecdh_pool(jwk_privkey_ecdsa_str, jwk_pubkey_ecdsa_str);
+}
+END_TEST
+
+static void check_ecdh_key_cache(const char * privkey_str, const char * pubkey_str, const char * privkey_2_str) {
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk_privkey, * jwk_pubkey, * jwk_privkey_2, * jwk_pubkey_2;
+  char * token = NULL, * token_2 = NULL;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey_2), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey_2), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, privkey_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, pubkey_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey_2, privkey_2_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_extract_pubkey(jwk_privkey_2, jwk_pubkey_2, 0), RHN_OK);
+
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_ECDH_ES_A128KW), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwe_serialize(jwe, jwk_pubkey, 0)), NULL);
+  ck_assert_ptr_ne((token_2 = r_jwe_serialize(jwe, jwk_pubkey_2, 0)), NULL);
+  r_jwe_free(jwe);
+
+  // The decoded key is cached after the first decryption
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk_privkey, 0), RHN_OK);
+  r_jwe_free(jwe_decrypt);
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk_privkey, 0), RHN_OK);
+  ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+  r_jwe_free(jwe_decrypt);
+
+  // Changing the key material must not use the cached key
+  ck_assert_int_eq(r_jwk_set_property_str(jwk_privkey, "d", r_jwk_get_property_str(jwk_privkey_2, "d")), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk_privkey, "x", r_jwk_get_property_str(jwk_privkey_2, "x")), RHN_OK);
+  if (r_jwk_get_property_str(jwk_privkey_2, "y") != NULL) {
+    ck_assert_int_eq(r_jwk_set_property_str(jwk_privkey, "y", r_jwk_get_property_str(jwk_privkey_2, "y")), RHN_OK);
+  }
+  if (r_jwk_get_property_str(jwk_privkey_2, "kid") != NULL) {
+    ck_assert_int_eq(r_jwk_set_property_str(jwk_privkey, "kid", r_jwk_get_property_str(jwk_privkey_2, "kid")), RHN_OK);
+  }
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_ne(r_jwe_decrypt(jwe_decrypt, jwk_privkey, 0), RHN_OK);
+  r_jwe_free(jwe_decrypt);
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token_2, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk_privkey, 0), RHN_OK);
+  ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+  r_jwe_free(jwe_decrypt);
+
+  // The cached key is still valid after a flush
+  r_jwk_cache_flush();
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token_2, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk_privkey, 0), RHN_OK);
+  r_jwe_free(jwe_decrypt);
+
+  o_free(token);
+  o_free(token_2);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  r_jwk_free(jwk_privkey_2);
+  r_jwk_free(jwk_pubkey_2);
+}
+
+START_TEST(test_rhonabwy_decrypt_key_cache)
+{
+  check_ecdh_key_cache(jwk_privkey_ecdsa_str, jwk_pubkey_ecdsa_str, jwk_privkey_ecdsa_str_2);
+  check_ecdh_key_cache(jwk_privkey_x25519_str, jwk_pubkey_x25519_str, jwk_privkey_x25519_str_2);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_encrypt_decrypt_x448_ok)
 {
   jwe_t * jwe, * jwe_decrypt;
@@ -1122,6 +1248,8 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_ok);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_x25519_ok);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_x448_ok);
+  tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_ephemeral_pool);
+  tcase_add_test(tc_core, test_rhonabwy_decrypt_key_cache);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_invalid_parameters);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_invalid_key);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_invalid_x25519_key);
@@ -663,6 +663,64 @@ START_TEST(test_rhonabwy_json_general_flood)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_json_general_threads)
+{
+  jwe_t * jwe, * jwe_decrypt;
+  char * str_result;
+  json_t * j_result;
+  const unsigned char * payload;
+  size_t payload_len;
+  
+  ck_assert_int_eq(r_jwe_get_recipients_threads(), 1);
+  ck_assert_int_eq(r_jwe_set_recipients_threads(0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwe_set_recipients_threads(4), RHN_OK);
+  ck_assert_int_eq(r_jwe_get_recipients_threads(), 4);
+  
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys_json_str(jwe, jwk_key_symmetric_str, jwk_key_symmetric_str), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys_json_str(jwe, jwk_privkey_rsa_str, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys_json_str(jwe, jwk_key_aesgcm, jwk_key_aesgcm), RHN_OK);
+  
+  // The recipients are in the same order as the keys
+  ck_assert_ptr_ne(NULL, j_result = r_jwe_serialize_json_t(jwe, NULL, 0, R_JSON_MODE_GENERAL));
+  ck_assert_int_eq(3, json_array_size(json_object_get(j_result, "recipients")));
+  ck_assert_str_eq("A128KW", json_string_value(json_object_get(json_object_get(json_array_get(json_object_get(j_result, "recipients"), 0), "header"), "alg")));
+  ck_assert_str_eq("RSA1_5", json_string_value(json_object_get(json_object_get(json_array_get(json_object_get(j_result, "recipients"), 1), "header"), "alg")));
+  ck_assert_str_eq("A128GCMKW", json_string_value(json_object_get(json_object_get(json_array_get(json_object_get(j_result, "recipients"), 2), "header"), "alg")));
+  json_decref(j_result);
+  
+  ck_assert_ptr_ne(NULL, str_result = r_jwe_serialize_json_str(jwe, NULL, 0, R_JSON_MODE_GENERAL));
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys_json_str(jwe_decrypt, jwk_key_aesgcm, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse_json_str(jwe_decrypt, str_result, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, NULL, 0), RHN_OK);
+  ck_assert_ptr_ne(NULL, payload = r_jwe_get_payload(jwe_decrypt, &payload_len));
+  ck_assert_int_eq(o_strlen(PAYLOAD), payload_len);
+  ck_assert_int_eq(0, memcmp(PAYLOAD, payload, payload_len));
+  r_jwe_free(jwe_decrypt);
+  o_free(str_result);
+  
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys_json_str(jwe_decrypt, jwk_key_symmetric_str, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse_json_str(jwe_decrypt, JWE_GENERAL, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse_json_str(jwe_decrypt, JWE_GENERAL_INVALID_TAG, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, NULL, 0), RHN_ERROR_INVALID);
+  r_jwe_free(jwe_decrypt);
+  
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys_json_str(jwe_decrypt, jwk_privkey_rsa_str_2, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse_json_str(jwe_decrypt, JWE_GENERAL, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, NULL, 0), RHN_ERROR_INVALID);
+  r_jwe_free(jwe_decrypt);
+  
+  r_jwe_free(jwe);
+  ck_assert_int_eq(r_jwe_set_recipients_threads(1), RHN_OK);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_json_flattened_all_algs_cbc)
 {
   test_rhonabwy_json_flattened_all_algs(R_JWA_ENC_A128CBC);
@@ -713,6 +771,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_json_decrypt_general_without_kid_ok);
   tcase_add_test(tc_core, test_rhonabwy_json_flattened_flood);
   tcase_add_test(tc_core, test_rhonabwy_json_general_flood);
+  tcase_add_test(tc_core, test_rhonabwy_json_general_threads);
   tcase_add_test(tc_core, test_rhonabwy_json_flattened_all_algs_cbc);
   tcase_add_test(tc_core, test_rhonabwy_json_general_all_algs_cbc);
   tcase_add_test(tc_core, test_rhonabwy_json_flattened_all_algs_gcm);
@@ -69,6 +69,29 @@ START_TEST(test_rhonabwy_parse_token_invalid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_parse_token_policy)
+{
+  jwe_t * jwe_decrypt;
+  r_policy_t policy;
+  
+  ck_assert_int_eq(r_policy_init(&policy), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_policy(jwe_decrypt, &policy), RHN_OK);
+  
+  policy.max_p2c = 4095;
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, TOKEN, 0), RHN_ERROR_PARAM);
+  policy.max_p2c = 4096;
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, TOKEN, 0), RHN_OK);
+  policy.max_token_len = o_strlen(TOKEN)-1;
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, TOKEN, 0), RHN_ERROR_PARAM);
+  policy.max_token_len = 0;
+  policy.max_header_len = 16;
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, TOKEN, 0), RHN_ERROR_PARAM);
+  
+  r_jwe_free(jwe_decrypt);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_decrypt_token_invalid)
 {
   jwe_t * jwe_decrypt;
@@ -367,6 +390,7 @@ static Suite *rhonabwy_suite(void)
   tc_core = tcase_create("test_rhonabwy_pbes");
 #if GNUTLS_VERSION_NUMBER >= 0x03060e
   tcase_add_test(tc_core, test_rhonabwy_parse_token_invalid);
+  tcase_add_test(tc_core, test_rhonabwy_parse_token_policy);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_token_invalid);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_invalid_privkey);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_pbes2_hs256_ok);
@@ -231,6 +231,24 @@ int callback_jwks_redirect (const struct _u_request * request, struct _u_respons
   return U_CALLBACK_CONTINUE;
 }
 
+int callback_jwks_max_age (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  (*(int *)user_data)++;
+  u_map_put(response->map_header, "Cache-Control", "max-age=60");
+  return callback_jwks_ok(request, response, NULL);
+}
+
+int callback_jwks_etag (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  if (0 == o_strcmp("\"v1\"", u_map_get_case(request->map_header, "If-None-Match"))) {
+    (*(int *)user_data)++;
+    response->status = 304;
+    return U_CALLBACK_CONTINUE;
+  } else {
+    u_map_put(response->map_header, "ETag", "\"v1\"");
+    u_map_put(response->map_header, "Cache-Control", "no-cache");
+    return callback_jwks_ok(request, response, NULL);
+  }
+}
+
 int callback_x5u_rsa_crt (const struct _u_request * request, struct _u_response * response, void * user_data) {
   ulfius_set_string_body_response(response, 200, (const char *)rsa_crt);
   return U_CALLBACK_CONTINUE;
@@ -597,6 +615,103 @@ START_TEST(test_rhonabwy_jwks_import_uri)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_jwks_import_uri_cache)
+{
+  struct _u_instance instance;
+  int nb_max_age = 0, nb_etag = 0;
+#ifdef R_WITH_CURL
+  jwks_t * jwks = NULL;
+#endif
+  
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_max_age", NULL, 0, &callback_jwks_max_age, &nb_max_age), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_etag", NULL, 0, &callback_jwks_etag, &nb_etag), U_OK);
+  
+#ifdef R_WITH_CURL
+  ck_assert_int_eq(r_remote_cache_set_ttl(10, 5), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_remote_cache_set_size(4), RHN_OK);
+  ck_assert_int_eq(r_remote_cache_get_size(), 4);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+  
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 4);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 4);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(nb_max_age, 1);
+  
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_etag", 0), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(nb_etag, 0);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_etag", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 4);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(nb_etag, 1);
+  
+  r_remote_cache_flush();
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(nb_max_age, 2);
+  
+  ck_assert_int_eq(r_remote_cache_set_size(0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(nb_max_age, 4);
+  ck_assert_int_eq(r_remote_cache_set_size(16), RHN_OK);
+  
+  ulfius_stop_framework(&instance);
+#endif
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_import_uri_limits)
+{
+  struct _u_instance instance;
+#ifdef R_WITH_CURL
+  jwks_t * jwks = NULL;
+  int i;
+#endif
+  
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_ok", NULL, 0, &callback_jwks_ok, NULL), U_OK);
+  
+#ifdef R_WITH_CURL
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+  
+  ck_assert_int_eq(r_remote_set_timeout(5000), RHN_OK);
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+    ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_OK);
+    ck_assert_int_eq(r_jwks_size(jwks), 4);
+    r_jwks_free(jwks);
+  }
+  
+  ck_assert_int_eq(r_remote_set_max_response_size(16), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_ERROR);
+  r_jwks_free(jwks);
+  
+  ck_assert_int_eq(r_remote_set_max_response_size(0), RHN_OK);
+  ck_assert_int_eq(r_remote_set_timeout(0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_OK);
+  r_jwks_free(jwks);
+  
+  ulfius_stop_framework(&instance);
+#endif
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwks_get_by_kid)
 {
   char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str);
@@ -620,6 +735,104 @@ START_TEST(test_rhonabwy_jwks_get_by_kid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_jwks_get_by_kid_borrowed)
+{
+  char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str), * out;
+  jwks_t * jwks, * jwks_copy;
+  jwk_t * jwk;
+  json_t * j_out;
+  
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_json_str(jwks, jwks_str), RHN_OK);
+  
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, ""), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, NULL), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(NULL, "1"), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "error"), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "1"), r_jwks_get_at_borrowed(jwks, 0));
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "1b94c"), r_jwks_get_at_borrowed(jwks, 3));
+  ck_assert_ptr_eq(r_jwks_get_at_borrowed(jwks, 4), NULL);
+  
+  ck_assert_int_eq(r_jwks_remove_at(jwks, 1), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "2011-04-29"), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "1b94c"), r_jwks_get_at_borrowed(jwks, 2));
+  
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwks_set_at(jwks, 0, jwk), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "1"), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "2011-04-29"), r_jwks_get_at_borrowed(jwks, 0));
+  ck_assert_int_eq(r_jwks_append_jwk(jwks, jwk), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "2011-04-29"), r_jwks_get_at_borrowed(jwks, 0));
+  r_jwk_free(jwk);
+  
+  ck_assert_ptr_ne((jwks_copy = r_jwks_copy(jwks)), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks_copy, "1b94c"), r_jwks_get_at_borrowed(jwks_copy, 2));
+  ck_assert_int_ne(r_jwks_equal(jwks, jwks_copy), 0);
+  r_jwks_free(jwks_copy);
+  
+  ck_assert_ptr_ne((out = r_jwks_export_to_json_str(jwks, 0)), NULL);
+  ck_assert_ptr_eq(o_strstr(out, "rhn_kid_index"), NULL);
+  o_free(out);
+  ck_assert_ptr_ne((j_out = r_jwks_export_to_json_t(jwks)), NULL);
+  ck_assert_int_eq(json_object_size(j_out), 1);
+  json_decref(j_out);
+  
+  ck_assert_int_eq(r_jwks_empty(jwks), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "1b94c"), NULL);
+  
+  r_jwks_free(jwks);
+  o_free(jwks_str);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_get_by_kid_indexed)
+{
+  jwks_t * jwks;
+  jwk_t * jwk;
+  json_t * j_expected;
+  char kid[16];
+  int i;
+  
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  for (i=0; i<16; i++) {
+    ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+    ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_rsa_str), RHN_OK);
+    snprintf(kid, sizeof(kid), "kid-%d", i);
+    ck_assert_int_eq(r_jwk_set_property_str(jwk, "kid", kid), RHN_OK);
+    ck_assert_int_eq(r_jwks_append_jwk(jwks, jwk), RHN_OK);
+    r_jwk_free(jwk);
+  }
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "kid-3"), r_jwks_get_at_borrowed(jwks, 3));
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "kid-15"), r_jwks_get_at_borrowed(jwks, 15));
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "error"), NULL);
+  
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk, "kid", "replaced"), RHN_OK);
+  ck_assert_int_eq(r_jwks_set_at(jwks, 5, jwk), RHN_OK);
+  r_jwk_free(jwk);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "replaced"), r_jwks_get_at_borrowed(jwks, 5));
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "kid-5"), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "kid-6"), r_jwks_get_at_borrowed(jwks, 6));
+  
+  ck_assert_int_eq(r_jwks_remove_at(jwks, 2), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "kid-2"), NULL);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "kid-3"), r_jwks_get_at_borrowed(jwks, 2));
+  
+  ck_assert_int_eq(r_jwks_append_jwk(jwks, r_jwks_get_at_borrowed(jwks, 0)), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_get_by_kid_borrowed(jwks, "kid-0"), r_jwks_get_at_borrowed(jwks, 0));
+  
+  // The index isn't stored in the jwks content
+  ck_assert_int_eq(json_object_size(jwks), 1);
+  ck_assert_ptr_ne((j_expected = json_pack("{sO}", "keys", json_object_get(jwks, "keys"))), NULL);
+  ck_assert_int_eq(json_equal(jwks, j_expected), 1);
+  json_decref(j_expected);
+  
+  r_jwks_free(jwks);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwks_equal)
 {
   char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str),
@@ -953,7 +1166,11 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_jwks_export_pem);
   tcase_add_test(tc_core, test_rhonabwy_jwks_import);
   tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri_cache);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri_limits);
   tcase_add_test(tc_core, test_rhonabwy_jwks_get_by_kid);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_get_by_kid_borrowed);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_get_by_kid_indexed);
   tcase_add_test(tc_core, test_rhonabwy_jwks_equal);
   tcase_add_test(tc_core, test_rhonabwy_jwks_empty);
   tcase_add_test(tc_core, test_rhonabwy_jwks_copy);
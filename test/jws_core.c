@@ -932,6 +932,60 @@ START_TEST(test_rhonabwy_set_properties)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_parse_verify)
+{
+  jws_t * jws, * jws_parse;
+  jwk_t * jwk_key_symmetric, * jwk_key_symmetric_2;
+  char * token = NULL, * token_def = NULL;
+  const unsigned char * payload;
+  size_t payload_len = 0;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric_2), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk_key_symmetric_2, (const unsigned char *)"error", 5), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_ptr_ne((token = r_jws_serialize(jws, jwk_key_symmetric, 0)), NULL);
+  ck_assert_int_eq(r_jws_set_header_str_value(jws, "zip", "DEF"), RHN_OK);
+  ck_assert_ptr_ne((token_def = r_jws_serialize(jws, jwk_key_symmetric, 0)), NULL);
+
+  ck_assert_int_eq(r_jws_init(&jws_parse), RHN_OK);
+  ck_assert_int_eq(r_jws_compact_parse_verify(NULL, token, R_PARSE_NONE, jwk_key_symmetric, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_compact_parse_verify(jws_parse, NULL, R_PARSE_NONE, jwk_key_symmetric, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_compact_parse_verify(jws_parse, HS256_TOKEN_INVALID_HEADER_B64, R_PARSE_NONE, jwk_key_symmetric, 0), RHN_ERROR_PARAM);
+
+  ck_assert_int_eq(r_jws_compact_parse_verify(jws_parse, token, R_PARSE_NONE, jwk_key_symmetric_2, 0), RHN_ERROR_INVALID);
+  ck_assert_ptr_eq(NULL, r_jws_get_payload(jws_parse, &payload_len));
+  ck_assert_int_eq(r_jws_compact_parse_verify(jws_parse, token, R_PARSE_NONE, jwk_key_symmetric, 0), RHN_OK);
+  ck_assert_ptr_ne(NULL, payload = r_jws_get_payload(jws_parse, &payload_len));
+  ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+  ck_assert_int_eq(0, memcmp(payload, PAYLOAD, payload_len));
+  ck_assert_int_eq(r_jws_verify_signature(jws_parse, jwk_key_symmetric, 0), RHN_OK);
+
+  ck_assert_int_eq(r_jws_compact_parse_verify(jws_parse, token_def, R_PARSE_ZERO_COPY, jwk_key_symmetric, 0), RHN_OK);
+  ck_assert_ptr_ne(NULL, payload = r_jws_get_payload(jws_parse, &payload_len));
+  ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+  ck_assert_int_eq(0, memcmp(payload, PAYLOAD, payload_len));
+  ck_assert_int_eq(r_jws_verify_signature(jws_parse, jwk_key_symmetric, 0), RHN_OK);
+  r_jws_free(jws_parse);
+
+  ck_assert_int_eq(r_jws_init(&jws_parse), RHN_OK);
+  ck_assert_int_eq(r_jws_add_keys(jws_parse, NULL, jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jws_compact_parse_verify(jws_parse, token_def, R_PARSE_NONE, NULL, 0), RHN_OK);
+  ck_assert_ptr_ne(NULL, r_jws_get_payload(jws_parse, &payload_len));
+  ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+  r_jws_free(jws_parse);
+
+  o_free(token);
+  o_free(token_def);
+  r_jws_free(jws);
+  r_jwk_free(jwk_key_symmetric);
+  r_jwk_free(jwk_key_symmetric_2);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_zip_payload)
 {
   jws_t * jws, * jws_parse, * jws_parse_def;
@@ -978,6 +1032,46 @@ START_TEST(test_rhonabwy_zip_payload)
 END_TEST
 
 #if GNUTLS_VERSION_NUMBER >= 0x030600
+START_TEST(test_rhonabwy_reset)
+{
+  jws_t * jws;
+  jwk_t * jwk_key_symmetric;
+  char * token;
+  size_t payload_len = 0;
+  
+  ck_assert_int_eq(r_jws_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_add_keys(jws, jwk_key_symmetric, jwk_key_symmetric), RHN_OK);
+  
+  // The key imported from the header is removed, the attached key is kept
+  ck_assert_int_eq(r_jws_parse(jws, TOKEN_WITH_JWK_IN_HEADER, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 2);
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 1);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_privkey), 1);
+  ck_assert_int_eq(r_jws_get_alg(jws), R_JWA_ALG_UNKNOWN);
+  ck_assert_ptr_eq(r_jws_get_payload(jws, &payload_len), NULL);
+  ck_assert_ptr_eq(r_jws_get_header_str_value(jws, "typ"), NULL);
+  
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_ptr_ne((token = r_jws_serialize(jws, NULL, 0)), NULL);
+  
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 1);
+  
+  o_free(token);
+  r_jws_free(jws);
+  r_jwk_free(jwk_key_symmetric);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwk_in_header)
 {
   jws_t * jws;
@@ -1379,9 +1473,11 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_token_parse_unsecure);
   tcase_add_test(tc_core, test_rhonabwy_token_serialize_unsecure);
   tcase_add_test(tc_core, test_rhonabwy_copy);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
   tcase_add_test(tc_core, test_rhonabwy_set_properties_error);
   tcase_add_test(tc_core, test_rhonabwy_set_properties);
   tcase_add_test(tc_core, test_rhonabwy_zip_payload);
+  tcase_add_test(tc_core, test_rhonabwy_parse_verify);
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   tcase_add_test(tc_core, test_rhonabwy_jwk_in_header);
   tcase_add_test(tc_core, test_rhonabwy_jwk_in_header_invalid);
@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <check.h>
 #include <yder.h>
@@ -15,6 +16,8 @@
 #define HS256_TOKEN_INVALID_PAYLOAD_B64 "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.;error;.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5o"
 #define HS256_TOKEN_INVALID_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-5X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5o"
 #define HS256_TOKEN_INVALID_DOTS "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQVGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5o"
+#define HS256_TOKEN_TRUNCATED_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5"
+#define HS256_TOKEN_OVERSIZED_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5oGKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5oGKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5o"
 #define HS256_TOKEN_EMPTY_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u."
 
 const char jwk_key_symmetric_str[] = "{\"kty\":\"oct\",\"alg\":\"HS256\",\"k\":\"c2VjcmV0\",\"kid\":\"1\"}";
@@ -243,6 +246,110 @@ START_TEST(test_rhonabwy_verify_token_valid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_verify_token_zero_copy)
+{
+  jws_t * jws, * jws_copy;
+  jwk_t * jwk_key_symmetric;
+  char * token = o_strdup(HS256_TOKEN), * token_serialized;
+  const unsigned char * payload;
+  size_t payload_len = 0;
+  
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+  ck_assert_int_eq(r_jws_advanced_parse(jws, HS256_TOKEN_EMPTY_SIGNATURE, R_PARSE_ZERO_COPY, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_advanced_parse(jws, HS256_TOKEN_INVALID_DOTS, R_PARSE_ZERO_COPY, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_advanced_parse(jws, token, R_PARSE_ZERO_COPY, 0), RHN_OK);
+  ck_assert_ptr_eq(jws->header_b64url, NULL);
+  ck_assert_ptr_eq(jws->signature_b64url, NULL);
+  ck_assert_ptr_ne((payload = r_jws_get_payload(jws, &payload_len)), NULL);
+  ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+  ck_assert_int_eq(0, memcmp(payload, PAYLOAD, payload_len));
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  
+  ck_assert_ptr_ne((jws_copy = r_jws_copy(jws)), NULL);
+  ck_assert_ptr_eq(jws_copy->token_signing_input, NULL);
+  
+  // The token is changed, the jws now holds an invalid signature
+  token[o_strlen(token)-2] = token[o_strlen(token)-2]=='A'?'B':'A';
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jws_verify_signature(jws_copy, jwk_key_symmetric, 0), RHN_OK);
+  
+  // Modifying the jws releases the token
+  ck_assert_int_eq(r_jws_set_header_str_value(jws, "typ", "JOSE"), RHN_OK);
+  ck_assert_ptr_eq(jws->token_signing_input, NULL);
+  ck_assert_ptr_ne((token_serialized = r_jws_serialize(jws, jwk_key_symmetric, 0)), NULL);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  
+  o_free(token_serialized);
+  o_free(token);
+  r_jws_free(jws);
+  r_jws_free(jws_copy);
+  r_jwk_free(jwk_key_symmetric);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_serialize_unsecure_zero_copy)
+{
+  jws_t * jws;
+  jwk_t * jwk_key_symmetric;
+  char * token = o_strdup(HS256_TOKEN), * token_serialized;
+  
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+  ck_assert_int_eq(r_jws_advanced_parse(jws, token, R_PARSE_ZERO_COPY, 0), RHN_OK);
+  // The signature copied from the token is replaced by the new signature, run with MEMCHECK=1 to check for leaks
+  ck_assert_ptr_ne((token_serialized = r_jws_serialize_unsecure(jws, jwk_key_symmetric, 0)), NULL);
+  ck_assert_ptr_eq(jws->token_signing_input, NULL);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  o_free(token_serialized);
+  ck_assert_ptr_ne((token_serialized = r_jws_serialize_unsecure(jws, jwk_key_symmetric, 0)), NULL);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  
+  o_free(token_serialized);
+  o_free(token);
+  r_jws_free(jws);
+  r_jwk_free(jwk_key_symmetric);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_verify_token_hmac_key_cache)
+{
+  jws_t * jws;
+  jwk_t * jwk_key_symmetric, * jwk_key_symmetric_2;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric_2), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric_2, jwk_key_symmetric_str_2), RHN_OK);
+  
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, HS256_TOKEN, 0), RHN_OK);
+  // The second verification reuses the cached HMAC context
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric_2, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  r_jwk_cache_flush();
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  r_jws_free(jws);
+  
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, HS256_TOKEN_TRUNCATED_SIGNATURE, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_ERROR_INVALID);
+  r_jws_free(jws);
+  
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, HS256_TOKEN_OVERSIZED_SIGNATURE, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_ERROR_INVALID);
+  r_jws_free(jws);
+  
+  r_jwk_free(jwk_key_symmetric);
+  r_jwk_free(jwk_key_symmetric_2);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_verify_token_multiple_keys_valid)
 {
   jws_t * jws;
@@ -323,6 +430,9 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid_key_type);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid_kid);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_valid);
+  tcase_add_test(tc_core, test_rhonabwy_verify_token_zero_copy);
+  tcase_add_test(tc_core, test_rhonabwy_serialize_unsecure_zero_copy);
+  tcase_add_test(tc_core, test_rhonabwy_verify_token_hmac_key_cache);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_multiple_keys_valid);
   tcase_add_test(tc_core, test_rhonabwy_set_alg_serialize_verify_ok);
   tcase_set_timeout(tc_core, 30);
@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <pthread.h>
 
 #include <check.h>
 #include <yder.h>
@@ -340,6 +341,42 @@ START_TEST(test_rhonabwy_verify_token_valid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_verify_token_policy)
+{
+  jws_t * jws;
+  jwk_t * jwk_pubkey;
+  r_policy_t policy;
+  unsigned int bits = 0;
+  
+  ck_assert_int_eq(r_policy_init(&policy), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_no_alg_str), RHN_OK);
+  r_jwk_key_type(jwk_pubkey, &bits, 0);
+  ck_assert_int_eq(r_jws_set_policy(jws, &policy), RHN_OK);
+  
+  policy.max_token_len = o_strlen(RS256_TOKEN)-1;
+  ck_assert_int_eq(r_jws_parse(jws, RS256_TOKEN, 0), RHN_ERROR_PARAM);
+  policy.max_token_len = o_strlen(RS256_TOKEN);
+  policy.max_header_len = (size_t)(o_strchr(RS256_TOKEN, '.')-RS256_TOKEN)-1;
+  ck_assert_int_eq(r_jws_parse(jws, RS256_TOKEN, 0), RHN_ERROR_PARAM);
+  policy.max_header_len++;
+  ck_assert_int_eq(r_jws_parse(jws, RS256_TOKEN, 0), RHN_OK);
+  
+  policy.min_rsa_bits = bits+1;
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_ERROR_INVALID);
+  policy.min_rsa_bits = 0;
+  policy.max_rsa_bits = bits-1;
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_ERROR_INVALID);
+  policy.min_rsa_bits = bits;
+  policy.max_rsa_bits = bits;
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_OK);
+  
+  r_jws_free(jws);
+  r_jwk_free(jwk_pubkey);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_verify_token_multiple_keys_valid)
 {
   jws_t * jws;
@@ -405,6 +442,88 @@ START_TEST(test_rhonabwy_set_alg_serialize_verify_ok)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_verify_token_key_cache)
+{
+  jws_t * jws;
+  jwk_t * jwk_pubkey, * jwk_pubkey_2;
+  char * n;
+  
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey_2), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_no_alg_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey_2, jwk_pubkey_rsa_str_2), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, RS256_TOKEN, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_OK);
+  ck_assert_ptr_ne((n = o_strdup(r_jwk_get_property_str(jwk_pubkey_2, "n"))), NULL);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk_pubkey, "n", n), RHN_OK);
+  ck_assert_int_ne(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey_2, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jwk_cache_set_size(0), RHN_OK);
+  ck_assert_int_eq(r_jwk_cache_get_size(), 0);
+  r_jwk_free(jwk_pubkey);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_no_alg_str), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_OK);
+  ck_assert_int_eq(r_jwk_cache_set_size(64), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_pubkey, 0), RHN_OK);
+  o_free(n);
+  r_jws_free(jws);
+  r_jwk_free(jwk_pubkey);
+  r_jwk_free(jwk_pubkey_2);
+}
+END_TEST
+
+struct cache_resize_thread {
+  jwk_t * jwk_pubkey;
+  int     result;
+};
+
+static void * cache_resize_verify(void * args) {
+  struct cache_resize_thread * thread = (struct cache_resize_thread *)args;
+  jws_t * jws;
+  int i;
+
+  thread->result = RHN_OK;
+  for (i=0; i<50 && thread->result == RHN_OK; i++) {
+    if (r_jws_init(&jws) == RHN_OK) {
+      if (r_jws_parse(jws, RS256_TOKEN, 0) != RHN_OK || r_jws_verify_signature(jws, thread->jwk_pubkey, 0) != RHN_OK) {
+        thread->result = RHN_ERROR;
+      }
+      r_jws_free(jws);
+    } else {
+      thread->result = RHN_ERROR_MEMORY;
+    }
+  }
+  return NULL;
+}
+
+START_TEST(test_rhonabwy_verify_token_key_cache_resize)
+{
+  struct cache_resize_thread threads[4];
+  pthread_t thread_ids[4];
+  size_t i, sizes[] = {1, 64, 2, 0, 16};
+  int j;
+
+  for (j=0; j<4; j++) {
+    ck_assert_int_eq(r_jwk_init(&threads[j].jwk_pubkey), RHN_OK);
+    ck_assert_int_eq(r_jwk_import_from_json_str(threads[j].jwk_pubkey, jwk_pubkey_rsa_no_alg_str), RHN_OK);
+    ck_assert_int_eq(pthread_create(&thread_ids[j], NULL, cache_resize_verify, &threads[j]), 0);
+  }
+  // Resize the cache while the threads acquire and release keys
+  for (i=0; i<100; i++) {
+    ck_assert_int_eq(r_jwk_cache_set_size(sizes[i%5]), RHN_OK);
+  }
+  for (j=0; j<4; j++) {
+    pthread_join(thread_ids[j], NULL);
+    ck_assert_int_eq(threads[j].result, RHN_OK);
+    r_jwk_free(threads[j].jwk_pubkey);
+  }
+  ck_assert_int_eq(r_jwk_cache_set_size(64), RHN_OK);
+}
+END_TEST
+
 static Suite *rhonabwy_suite(void)
 {
   Suite *s;
@@ -423,8 +542,11 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid_key_type);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid_kid);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_valid);
+  tcase_add_test(tc_core, test_rhonabwy_verify_token_policy);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_multiple_keys_valid);
   tcase_add_test(tc_core, test_rhonabwy_set_alg_serialize_verify_ok);
+  tcase_add_test(tc_core, test_rhonabwy_verify_token_key_cache);
+  tcase_add_test(tc_core, test_rhonabwy_verify_token_key_cache_resize);
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
 
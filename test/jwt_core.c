@@ -291,6 +291,12 @@ const char advanced_jku_4[] = "{\"keys\":[{\"kty\":\"EC\",\"x\":\"rXNalVG5Ylar4c
 #define TOKEN_INVALID_CLAIMS_B64 "eyJ0eXAiOiJKV1QiLCJhbGciOiJSUzI1NiIsImtpZCI6IjMifQ.;error;.SgopnfP3vEE7HbuvfyYqZQZZsbu49GBR5w2YCesW7J0i_s5pVYPMIjl6xU4vOs-nV1lEwn7Z_OaQiyEhVftlOUkM5n7w57YViBZkus5C64S6LuQli150oXWNnis4La6qpg_12EocKffvmG940gL2dWg3dnQYenC-fgtX-CNcaIDZUL-NKq3iaQrwvdbuzNADlSBQUfHh80b7uyKgqcT4tboRyAnJXhcjZ-0NWxCIEusnbskmQEqdxEiq28xL8b_F2hDYe5ZuuHw8tmXcXNHUplswEefTCm0phbvi5D490nVBav6ri6zLTkC9IEOR0hA-1f5AYmvsE5NUepLfpjqCsg"
 #define TOKEN_INVALID_DOTS "eyJ0eXAiOiJKV1QiLCJhbGciOiJSUzI1NiIsImtpZCI6IjMifQeyJzdHIiOiJncnV0IiwiaW50Ijo0Miwib2JqIjp0cnVlfQ.SgopnfP3vEE7HbuvfyYqZQZZsbu49GBR5w2YCesW7J0i_s5pVYPMIjl6xU4vOs-nV1lEwn7Z_OaQiyEhVftlOUkM5n7w57YViBZkus5C64S6LuQli150oXWNnis4La6qpg_12EocKffvmG940gL2dWg3dnQYenC-fgtX-CNcaIDZUL-NKq3iaQrwvdbuzNADlSBQUfHh80b7uyKgqcT4tboRyAnJXhcjZ-0NWxCIEusnbskmQEqdxEiq28xL8b_F2hDYe5ZuuHw8tmXcXNHUplswEefTCm0phbvi5D490nVBav6ri6zLTkC9IEOR0hA-1f5AYmvsE5NUepLfpjqCsg"
 #define TOKEN_UNSECURE "eyJhbGciOiJub25lIn0.eyJzdHIiOiJncnV0IiwiaW50Ijo0Miwib2JqIjp0cnVlfQ."
+#define TOKEN_UNSECURE_LAZY "eyJhbGciOiJub25lIn0.eyAiYXVkIiA6IFsiYSIsImIiXSwgIngiOnsieSI6In0sXCIifSAsICJuIjogMSAsICJuIjoyfQ."
+#define TOKEN_UNSECURE_ESCAPED_KEY "eyJhbGciOiJub25lIn0.eyJhXHUwMDYyIjoxfQ."
+#define TOKEN_UNSECURE_ARRAY "eyJhbGciOiJub25lIn0.WzEsMiwzXQ."
+#define TOKEN_UNSECURE_MALFORMED_LITERAL "eyJhbGciOiJub25lIn0.eyJleHAiOnRydSwic3ViIjoieCJ9."
+#define TOKEN_UNSECURE_MALFORMED_ARRAY "eyJhbGciOiJub25lIn0.eyJleHAiOjEsImF1ZCI6W3RydV19."
+#define TOKEN_UNSECURE_NESTED "eyJhbGciOiJub25lIn0.eyJleHAiOjEsInN1YiI6IngiLCJhdWQiOlsiYSIseyJiIjpudWxsfV19."
 
 #define TOKEN_ENC "eyJ0eXAiOiJKV1QiLCJhbGciOiJSU0ExXzUiLCJlbmMiOiJBMTI4Q0JDLUhTMjU2In0.TGaK3fCgsGxLNuGbWR2j4Fi_hetyBLSRyadtdG0MAsXTnXlXsFb_wwFahZQASsLxwEEekZQ5EEkJb9gwu3uWaf3Oq58lOETa4Fb_Z1-WN1jvzF4DBEQLVl0azU62LbPsFHl8vWuuE7NF5oFX2V3CboQnFoWB1yyqWBJXkdEvFyIrHnNmQw9goPs2kjACnYdsNzMnP6SOYsYvguIJcvKnoBAbQYp0DA8OHXI6fW4P_zgZ7TQVCJLwpB0QoD_4Raaya3OABxQ7LJqhpYvk7iHGHnC-Ws23dmLCdv5WG_w6NEQwQLkuED8SXhUbirLeq4LRVxXdf8I1XTKesS6_NVJBNg.GMeHp_DOIg9h8sfGYE8fYg.XcRXOh492A8SPw8EEQ6mRe1kt7BNFqOgG8GqHR2g6CI4a_RI3JA2taxi3wc4eRWJ.94p-hjUgcWGiJsQ8TnnKtQ"
 #define TOKEN_ENC_INVALID_HEADER_B64 ";error;.TGaK3fCgsGxLNuGbWR2j4Fi_hetyBLSRyadtdG0MAsXTnXlXsFb_wwFahZQASsLxwEEekZQ5EEkJb9gwu3uWaf3Oq58lOETa4Fb_Z1-WN1jvzF4DBEQLVl0azU62LbPsFHl8vWuuE7NF5oFX2V3CboQnFoWB1yyqWBJXkdEvFyIrHnNmQw9goPs2kjACnYdsNzMnP6SOYsYvguIJcvKnoBAbQYp0DA8OHXI6fW4P_zgZ7TQVCJLwpB0QoD_4Raaya3OABxQ7LJqhpYvk7iHGHnC-Ws23dmLCdv5WG_w6NEQwQLkuED8SXhUbirLeq4LRVxXdf8I1XTKesS6_NVJBNg.GMeHp_DOIg9h8sfGYE8fYg.XcRXOh492A8SPw8EEQ6mRe1kt7BNFqOgG8GqHR2g6CI4a_RI3JA2taxi3wc4eRWJ.94p-hjUgcWGiJsQ8TnnKtQ"
@@ -1196,6 +1202,76 @@ START_TEST(test_rhonabwy_validate_claims)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_validate_claims_policy)
+{
+  jwt_t * jwt;
+  r_claims_policy_t * policy;
+  time_t now;
+  json_t * j_aud = json_pack("[ss]", "other", JWT_CLAIM_AUD);
+
+  time(&now);
+  ck_assert_int_eq(r_claims_policy_init(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_claims_policy_init(&policy), RHN_OK);
+  ck_assert_int_eq(r_claims_policy_add_value(NULL, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_claims_policy_add_value(policy, R_JWT_CLAIM_JTI, JWT_CLAIM_JTI), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_claims_policy_add_value(policy, R_JWT_CLAIM_ISS, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_claims_policy_set_required(policy, R_JWT_CLAIM_STR), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_claims_policy_add_value(policy, R_JWT_CLAIM_ISS, "https://other.tld"), RHN_OK);
+  ck_assert_int_eq(r_claims_policy_add_value(policy, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS), RHN_OK);
+  ck_assert_int_eq(r_claims_policy_add_value(policy, R_JWT_CLAIM_AUD, JWT_CLAIM_AUD), RHN_OK);
+  ck_assert_int_eq(r_claims_policy_set_required(policy, R_JWT_CLAIM_EXP), RHN_OK);
+  ck_assert_int_eq(r_claims_policy_set_leeway(policy, 60), RHN_OK);
+  ck_assert_int_eq(r_claims_policy_set_typ(policy, JWT_CLAIM_TYP), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(NULL, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS,
+                                         R_JWT_CLAIM_AUD, JWT_CLAIM_AUD,
+                                         R_JWT_CLAIM_EXP, now+JWT_CLAIM_EXP,
+                                         R_JWT_CLAIM_TYP, JWT_CLAIM_TYP,
+                                         R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_set_claim_json_t_value(jwt, "aud", j_aud), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "aud", "other"), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "aud", JWT_CLAIM_AUD), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://error.tld"), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://other.tld"), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "exp", now-30), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "exp", now-120), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "exp", now+JWT_CLAIM_EXP), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "nbf", now+30), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "nbf", now+120), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "nbf", now), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_set_header_str_value(jwt, "typ", "error"), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_claims_policy_set_typ(policy, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_OK);
+
+  ck_assert_int_eq(r_claims_policy_set_required(policy, R_JWT_CLAIM_JTI), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "jti", JWT_CLAIM_JTI), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims_policy(jwt, policy), RHN_OK);
+
+  json_decref(j_aud);
+  r_jwt_free(jwt);
+  r_claims_policy_free(policy);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_set_properties_error)
 {
   jwt_t * jwt;
@@ -1309,6 +1385,109 @@ START_TEST(test_rhonabwy_copy)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_reset)
+{
+  jwt_t * jwt;
+  char * token = NULL;
+  time_t now;
+  
+  time(&now);
+  ck_assert_int_eq(r_jwt_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_enc_keys_json_str(jwt, jwk_privkey_rsa_str, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_key_symmetric(jwt, (const unsigned char *)symmetric_key, sizeof(symmetric_key)), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", JWT_CLAIM_ISS), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "exp", (now+JWT_CLAIM_EXP)), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc_alg(jwt, R_JWA_ALG_RSA1_5), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc(jwt, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwt_serialize_nested(jwt, R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT, NULL, 0, NULL, 0)), NULL);
+  
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "iss"), NULL);
+  ck_assert_int_eq(r_jwt_get_sign_alg(jwt), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_jwt_get_enc_alg(jwt), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_jwt_get_enc(jwt), R_JWA_ENC_UNKNOWN);
+  ck_assert_int_eq(r_jwks_size(jwt->jwks_privkey_enc), 1);
+  ck_assert_int_eq(r_jwks_size(jwt->jwks_pubkey_sign), 1);
+  
+  // The inner jws and jwe are reused by the following parses
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_decrypt_verify_signature_nested(jwt, NULL, 0, NULL, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_ptr_ne(jwt->jws, NULL);
+  ck_assert_ptr_ne(jwt->jwe, NULL);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_decrypt_verify_signature_nested(jwt, NULL, 0, NULL, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwt->jwks_pubkey_sign), 1);
+  
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+  // The key imported from the header is removed, the attached key is kept
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, ADVANCED_TOKEN_SIGNED_WITH_ROOT_KEY, R_PARSE_HEADER_JWK, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwt->jwks_pubkey_sign), 2);
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwt->jwks_pubkey_sign), 1);
+#endif
+  
+  o_free(token);
+  r_jwt_free(jwt);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_arena)
+{
+  jwt_t * jwt;
+  r_arena_t * arena;
+  char * token = NULL;
+  size_t arena_size;
+  time_t now;
+  
+  time(&now);
+  ck_assert_int_eq(r_arena_init(NULL, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_arena_init(&arena, 0), RHN_OK);
+  ck_assert_int_eq(r_arena_get_size(arena), 0);
+  ck_assert_int_eq(r_jwt_set_arena(NULL, arena), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_enc_keys_json_str(jwt, jwk_privkey_rsa_str, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_key_symmetric(jwt, (const unsigned char *)symmetric_key, sizeof(symmetric_key)), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", JWT_CLAIM_ISS), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "exp", (now+JWT_CLAIM_EXP)), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc_alg(jwt, R_JWA_ALG_RSA1_5), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc(jwt, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwt_serialize_nested(jwt, R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT, NULL, 0, NULL, 0)), NULL);
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  
+  ck_assert_int_eq(r_jwt_set_arena(jwt, arena), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_decrypt_verify_signature_nested(jwt, NULL, 0, NULL, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_int_gt((arena_size = r_arena_get_size(arena)), 0);
+  
+  // The arena blocks are reused by the next token
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_decrypt_verify_signature_nested(jwt, NULL, 0, NULL, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_int_eq(r_arena_get_size(arena), arena_size);
+  
+  ck_assert_int_eq(r_arena_reset(arena), RHN_OK);
+  ck_assert_int_eq(r_arena_get_size(arena), 0);
+  ck_assert_int_eq(r_jwt_set_arena(jwt, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_decrypt_verify_signature_nested(jwt, NULL, 0, NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_arena_get_size(arena), 0);
+  
+  o_free(token);
+  r_jwt_free(jwt);
+  r_arena_free(arena);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_set_enc_cypher_key_iv)
 {
   jwt_t * jwt;
@@ -1373,6 +1552,137 @@ int callback_jku_ecdsa_crt (const struct _u_request * request, struct _u_respons
   return U_CALLBACK_CONTINUE;
 }
 
+START_TEST(test_rhonabwy_parse_verify)
+{
+  jwt_t * jwt;
+  jwk_t * jwk_priv, * jwk_pub, * jwk_pub_ecdsa;
+  char * token;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_priv), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pub_ecdsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_priv, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pub, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pub_ecdsa, jwk_pubkey_ecdsa_str), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", JWT_CLAIM_ISS), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, jwk_priv, 0));
+  r_jwt_free(jwt);
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse_verify(NULL, token, R_PARSE_NONE, jwk_pub, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_parse_verify(jwt, NULL, R_PARSE_NONE, jwk_pub, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_parse_verify(jwt, TOKEN_ENC, R_PARSE_NONE, jwk_pub, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_parse_verify(jwt, token, R_PARSE_NONE, jwk_pub_ecdsa, 0), RHN_ERROR_INVALID);
+  ck_assert_ptr_eq(NULL, r_jwt_get_claim_str_value(jwt, "iss"));
+  ck_assert_int_eq(r_jwt_parse_verify(jwt, token, R_PARSE_NONE, jwk_pub, 0), RHN_OK);
+  ck_assert_str_eq(JWT_CLAIM_ISS, r_jwt_get_claim_str_value(jwt, "iss"));
+  ck_assert_int_eq(r_jwt_verify_signature(jwt, jwk_pub, 0), RHN_OK);
+  r_jwt_free(jwt);
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_keys(jwt, NULL, jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse_verify(jwt, token, R_PARSE_ZERO_COPY|R_PARSE_LAZY_CLAIMS, NULL, 0), RHN_OK);
+  ck_assert_str_eq(JWT_CLAIM_ISS, r_jwt_get_claim_str_value(jwt, "iss"));
+  ck_assert_int_eq(r_jwks_size(jwt->jwks_pubkey_sign), 1);
+  r_jwt_free(jwt);
+
+  o_free(token);
+  r_jwk_free(jwk_priv);
+  r_jwk_free(jwk_pub);
+  r_jwk_free(jwk_pub_ecdsa);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_lazy_claims)
+{
+  jwt_t * jwt;
+  json_t * j_claims, * j_expected = json_pack("{sssiso}", "str", "grut", "int", 42, "obj", json_true());
+  const char * str_value;
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN, R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_int_eq(jwt->claims_index_size, 3);
+  ck_assert_int_eq(json_object_size(jwt->j_claims), 0);
+  ck_assert_ptr_ne(NULL, str_value = r_jwt_get_claim_str_value(jwt, "str"));
+  ck_assert_str_eq(str_value, "grut");
+  ck_assert_int_eq(json_object_size(jwt->j_claims), 1);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "int"), 42);
+  ck_assert_ptr_eq(NULL, r_jwt_get_claim_str_value(jwt, "error"));
+  ck_assert_int_eq(json_object_size(jwt->j_claims), 2);
+  ck_assert_ptr_ne(NULL, j_claims = r_jwt_get_full_claims_json_t(jwt));
+  ck_assert_int_eq(json_equal(j_claims, j_expected), 1);
+  ck_assert_ptr_eq(NULL, jwt->claims_lazy);
+  ck_assert_str_eq(str_value, "grut");
+  json_decref(j_claims);
+
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN, R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "str", NULL), RHN_OK);
+  ck_assert_ptr_eq(NULL, r_jwt_get_claim_str_value(jwt, "str"));
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "int"), 42);
+  ck_assert_int_ne(r_jwt_advanced_parse(jwt, TOKEN_INVALID_CLAIMS, R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  r_jwt_free(jwt);
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN_UNSECURE_LAZY, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_int_eq(jwt->claims_index_size, 4);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "n"), 2);
+  ck_assert_str_eq(json_string_value(json_object_get(r_jwt_get_claim_json_t_value(jwt, "x"), "y")), "},\"");
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_INT, "n", 2, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN_UNSECURE_ESCAPED_KEY, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_ptr_eq(NULL, jwt->claims_lazy);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "ab"), 1);
+  r_jwt_free(jwt);
+  json_decref(j_expected);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_parse_claims_not_object)
+{
+  jwt_t * jwt;
+  json_t * j_claims, * j_expected = json_pack("[iii]", 1, 2, 3);
+  uint32_t parse_flags[] = {R_PARSE_UNSIGNED, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS};
+  size_t i;
+
+  // The payload may be any JSON value
+  for (i=0; i<sizeof(parse_flags)/sizeof(uint32_t); i++) {
+    ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+    ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN_UNSECURE_ARRAY, parse_flags[i], 0), RHN_OK);
+    ck_assert_ptr_ne(NULL, j_claims = r_jwt_get_full_claims_json_t(jwt));
+    ck_assert_int_eq(json_equal(j_claims, j_expected), 1);
+    ck_assert_ptr_eq(NULL, r_jwt_get_claim_str_value(jwt, "str"));
+    json_decref(j_claims);
+    r_jwt_free(jwt);
+  }
+  json_decref(j_expected);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_parse_lazy_claims_malformed)
+{
+  jwt_t * jwt;
+  json_t * j_aud;
+  uint32_t parse_flags[] = {R_PARSE_UNSIGNED, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS};
+  size_t i;
+
+  // A malformed claim value is rejected by the parse, with or without lazy claims
+  for (i=0; i<sizeof(parse_flags)/sizeof(uint32_t); i++) {
+    ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+    ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN_UNSECURE_MALFORMED_LITERAL, parse_flags[i], 0), RHN_ERROR);
+    ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN_UNSECURE_MALFORMED_ARRAY, parse_flags[i], 0), RHN_ERROR);
+    ck_assert_int_eq(r_jwt_advanced_parse(jwt, TOKEN_UNSECURE_NESTED, parse_flags[i], 0), RHN_OK);
+    ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "sub"), "x");
+    ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "exp"), 1);
+    ck_assert_ptr_ne(NULL, j_aud = r_jwt_get_claim_json_t_value(jwt, "aud"));
+    ck_assert_int_eq(json_array_size(j_aud), 2);
+    json_decref(j_aud);
+    r_jwt_free(jwt);
+  }
+}
+END_TEST
+
 START_TEST(test_rhonabwy_advanced_parse)
 {
   jwk_t * jwk_pub, * jwk_priv, * jwk_pubkey_1;
@@ -1779,12 +2089,19 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_add_enc_keys_by_content);
   tcase_add_test(tc_core, test_rhonabwy_set_claims);
   tcase_add_test(tc_core, test_rhonabwy_validate_claims);
+  tcase_add_test(tc_core, test_rhonabwy_validate_claims_policy);
   tcase_add_test(tc_core, test_rhonabwy_set_properties_error);
   tcase_add_test(tc_core, test_rhonabwy_set_properties);
   tcase_add_test(tc_core, test_rhonabwy_copy);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
+  tcase_add_test(tc_core, test_rhonabwy_arena);
   tcase_add_test(tc_core, test_rhonabwy_set_enc_cypher_key_iv);
   tcase_add_test(tc_core, test_rhonabwy_token_type);
 #if GNUTLS_VERSION_NUMBER >= 0x030600 && defined(R_WITH_CURL)
+  tcase_add_test(tc_core, test_rhonabwy_lazy_claims);
+  tcase_add_test(tc_core, test_rhonabwy_parse_claims_not_object);
+  tcase_add_test(tc_core, test_rhonabwy_parse_lazy_claims_malformed);
+  tcase_add_test(tc_core, test_rhonabwy_parse_verify);
   tcase_add_test(tc_core, test_rhonabwy_advanced_parse);
   tcase_add_test(tc_core, test_rhonabwy_quick_parse);
   tcase_add_test(tc_core, test_rhonabwy_jwk_in_header_invalid);
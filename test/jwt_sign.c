@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <poll.h>
 
 #include <check.h>
 #include <yder.h>
@@ -391,6 +392,227 @@ START_TEST(test_rhonabwy_jwt_unsecure)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_verify_batch)
+{
+  const char * tokens[] = {TOKEN, TOKEN_INVALID_SIGNATURE, TOKEN_INVALID_HEADER_B64, TOKEN, TOKEN};
+  int status[5];
+  json_t * claims[5];
+  jwks_t * jwks;
+  size_t i;
+  
+  ck_assert_ptr_ne((jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_sign_str_2, R_IMPORT_JSON_STR, jwk_pubkey_sign_str, R_IMPORT_NONE)), NULL);
+  
+  ck_assert_int_eq(r_jwt_verify_batch(NULL, 5, jwks, 0, 2, status, claims), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verify_batch(tokens, 0, jwks, 0, 2, status, claims), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verify_batch(tokens, 5, NULL, 0, 2, status, claims), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verify_batch(tokens, 5, jwks, 0, 2, NULL, claims), RHN_ERROR_PARAM);
+  
+  ck_assert_int_eq(r_jwt_verify_batch(tokens, 5, jwks, 0, 3, status, claims), RHN_OK);
+  ck_assert_int_eq(status[0], RHN_OK);
+  ck_assert_int_eq(status[1], RHN_ERROR_INVALID);
+  ck_assert_int_eq(status[2], RHN_ERROR_PARAM);
+  ck_assert_int_eq(status[3], RHN_OK);
+  ck_assert_int_eq(status[4], RHN_OK);
+  ck_assert_str_eq(json_string_value(json_object_get(claims[0], "str")), "grut");
+  ck_assert_ptr_eq(claims[1], NULL);
+  ck_assert_ptr_eq(claims[2], NULL);
+  ck_assert_str_eq(json_string_value(json_object_get(claims[4], "str")), "grut");
+  for (i=0; i<5; i++) {
+    json_decref(claims[i]);
+  }
+  
+  ck_assert_int_eq(r_jwt_verify_batch(tokens, 5, jwks, 0, 0, status, NULL), RHN_OK);
+  ck_assert_int_eq(status[0], RHN_OK);
+  ck_assert_int_eq(status[1], RHN_ERROR_INVALID);
+  
+  r_jwks_free(jwks);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_template)
+{
+  jwt_t * jwt, * jwt_verify;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  r_jwt_template_t * jwt_template;
+  json_t * j_claims = json_pack("{sssi}", "sub", "device1", "int", 42);
+  char * token;
+  const char claims_str[] = " { \"sub\" : \"device2\" } ";
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_sign_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_sign_str), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_template_init(&jwt_template, jwt, NULL, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://rhonabwy.tld"), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "str", "grut"), RHN_OK);
+  ck_assert_int_eq(r_jwt_template_init(&jwt_template, jwt, jwk_privkey, 0), RHN_OK);
+  r_jwt_free(jwt);
+
+  ck_assert_ptr_ne(NULL, token = r_jwt_template_mint(jwt_template, j_claims));
+  ck_assert_int_eq(r_jwt_init(&jwt_verify), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_verify, jwk_pubkey, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_header_str_value(jwt_verify, "typ"), "JWT");
+  ck_assert_ptr_ne(NULL, r_jwt_get_header_str_value(jwt_verify, "kid"));
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "iss"), "https://rhonabwy.tld");
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "str"), "grut");
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "sub"), "device1");
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt_verify, "int"), 42);
+  r_jwt_free(jwt_verify);
+  r_free(token);
+
+  // A variable claim replaces the skeleton value
+  json_object_set_new(j_claims, "str", json_string("plop"));
+  ck_assert_ptr_ne(NULL, token = r_jwt_template_mint(jwt_template, j_claims));
+  ck_assert_int_eq(r_jwt_init(&jwt_verify), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_verify, jwk_pubkey, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "str"), "plop");
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "iss"), "https://rhonabwy.tld");
+  r_jwt_free(jwt_verify);
+  r_free(token);
+
+  ck_assert_ptr_ne(NULL, token = r_jwt_template_mint_str(jwt_template, claims_str, o_strlen(claims_str)));
+  ck_assert_int_eq(r_jwt_init(&jwt_verify), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_verify, jwk_pubkey, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "sub"), "device2");
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "str"), "grut");
+  r_jwt_free(jwt_verify);
+  r_free(token);
+
+  ck_assert_ptr_ne(NULL, token = r_jwt_template_mint(jwt_template, NULL));
+  ck_assert_int_eq(r_jwt_init(&jwt_verify), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_verify, jwk_pubkey, 0), RHN_OK);
+  ck_assert_ptr_eq(NULL, r_jwt_get_claim_str_value(jwt_verify, "sub"));
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "str"), "grut");
+  r_jwt_free(jwt_verify);
+  r_free(token);
+
+  ck_assert_ptr_eq(NULL, r_jwt_template_mint_str(jwt_template, "[1]", 3));
+  ck_assert_ptr_eq(NULL, r_jwt_template_mint_str(jwt_template, "{", 1));
+  ck_assert_ptr_eq(NULL, r_jwt_template_mint(jwt_template, json_true()));
+
+  r_jwt_template_free(jwt_template);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  json_decref(j_claims);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_sign_batch)
+{
+  jwt_t * jwt, * jwt_verify;
+  jwk_t * jwk_privkey;
+  jwks_t * jwks;
+  json_t * claims[4] = {json_pack("{ss}", "sub", "device0"), json_pack("{ss}", "sub", "device1"), json_pack("{ss}", "sub", "device2"), json_pack("{ss}", "sub", "device3")}, * claims_verify[4];
+  const char * claims_str[] = {"{\"sub\":\"device4\"}", "{\"sub\":\"device5\"}", "[1]"};
+  char * tokens[4], sub[8];
+  int status[4];
+  size_t i;
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_sign_str), RHN_OK);
+  ck_assert_ptr_ne((jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_sign_str, R_IMPORT_NONE)), NULL);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://rhonabwy.tld"), RHN_OK);
+
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(NULL, jwk_privkey, 0, claims, NULL, 4, 2, tokens), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(jwt, jwk_privkey, 0, NULL, NULL, 4, 2, tokens), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(jwt, jwk_privkey, 0, claims, claims_str, 3, 2, tokens), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(jwt, jwk_privkey, 0, claims, NULL, 0, 2, tokens), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(jwt, jwk_privkey, 0, claims, NULL, 4, 2, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(jwt, NULL, 0, claims, NULL, 4, 2, tokens), RHN_ERROR_PARAM);
+
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(jwt, jwk_privkey, 0, claims, NULL, 4, 3, tokens), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_batch((const char **)tokens, 4, jwks, 0, 2, status, claims_verify), RHN_OK);
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(status[i], RHN_OK);
+    snprintf(sub, 8, "device%zu", i);
+    ck_assert_str_eq(json_string_value(json_object_get(claims_verify[i], "sub")), sub);
+    ck_assert_str_eq(json_string_value(json_object_get(claims_verify[i], "iss")), "https://rhonabwy.tld");
+    json_decref(claims_verify[i]);
+    r_free(tokens[i]);
+  }
+
+  ck_assert_int_eq(r_jwt_serialize_signed_batch(jwt, jwk_privkey, 0, NULL, claims_str, 3, 0, tokens), RHN_OK);
+  ck_assert_ptr_ne(tokens[0], NULL);
+  ck_assert_ptr_ne(tokens[1], NULL);
+  ck_assert_ptr_eq(tokens[2], NULL);
+  ck_assert_int_eq(r_jwt_init(&jwt_verify), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_verify, tokens[1], 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_jwks(jwt_verify, NULL, jwks), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_verify, NULL, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_verify, "sub"), "device5");
+  r_jwt_free(jwt_verify);
+  r_free(tokens[0]);
+  r_free(tokens[1]);
+
+  for (i=0; i<4; i++) {
+    json_decref(claims[i]);
+  }
+  r_jwt_free(jwt);
+  r_jwk_free(jwk_privkey);
+  r_jwks_free(jwks);
+}
+END_TEST
+
+static void verifier_callback(void * user_data, int status, jwt_t * jwt) {
+  int * result = (int *)user_data;
+
+  if (status == RHN_OK && 0 != o_strcmp("grut", r_jwt_get_claim_str_value(jwt, "str"))) {
+    status = RHN_ERROR;
+  }
+  *result = status;
+}
+
+START_TEST(test_rhonabwy_verifier)
+{
+  const char * tokens[] = {TOKEN, TOKEN_INVALID_SIGNATURE, TOKEN_INVALID_HEADER_B64, TOKEN};
+  int status[4] = {-1, -1, -1, -1}, cancelled = -1;
+  r_jwt_verifier_t * verifier;
+  jwks_t * jwks;
+  struct pollfd pfd;
+  size_t i, nb_done = 0;
+
+  ck_assert_ptr_ne((jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_sign_str_2, R_IMPORT_JSON_STR, jwk_pubkey_sign_str, R_IMPORT_NONE)), NULL);
+
+  ck_assert_int_eq(r_jwt_verifier_init(NULL, jwks, R_PARSE_NONE, 0, 2), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verifier_get_fd(NULL), -1);
+  ck_assert_int_eq(r_jwt_verifier_init(&verifier, jwks, R_PARSE_NONE, 0, 2), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_ge(r_jwt_verifier_get_fd(verifier), 0);
+  ck_assert_int_eq(r_jwt_verifier_submit(verifier, NULL, 4, &verifier_callback, &status[0]), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verifier_submit(verifier, TOKEN, 0, &verifier_callback, &status[0]), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verifier_submit(verifier, TOKEN, o_strlen(TOKEN), NULL, &status[0]), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verifier_dispatch(verifier), 0);
+
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(r_jwt_verifier_submit(verifier, tokens[i], o_strlen(tokens[i]), &verifier_callback, &status[i]), RHN_OK);
+  }
+  pfd.fd = r_jwt_verifier_get_fd(verifier);
+  pfd.events = POLLIN;
+  while (nb_done < 4) {
+    ck_assert_int_eq(poll(&pfd, 1, 10000), 1);
+    nb_done += r_jwt_verifier_dispatch(verifier);
+  }
+  ck_assert_int_eq(status[0], RHN_OK);
+  ck_assert_int_eq(status[1], RHN_ERROR_INVALID);
+  ck_assert_int_ne(status[2], RHN_OK);
+  ck_assert_int_eq(status[3], RHN_OK);
+
+  // The callbacks are called when the verifier is freed
+  ck_assert_int_eq(r_jwt_verifier_submit(verifier, TOKEN, o_strlen(TOKEN), &verifier_callback, &cancelled), RHN_OK);
+  r_jwt_verifier_free(verifier);
+  ck_assert_int_ne(cancelled, -1);
+}
+END_TEST
+
 static Suite *rhonabwy_suite(void)
 {
   Suite *s;
@@ -411,6 +633,10 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_verify_signature_with_add_keys_ok);
   tcase_add_test(tc_core, test_rhonabwy_verify_vulnerabilty_ok);
   tcase_add_test(tc_core, test_rhonabwy_jwt_unsecure);
+  tcase_add_test(tc_core, test_rhonabwy_verify_batch);
+  tcase_add_test(tc_core, test_rhonabwy_template);
+  tcase_add_test(tc_core, test_rhonabwy_sign_batch);
+  tcase_add_test(tc_core, test_rhonabwy_verifier);
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
 
@@ -302,6 +302,54 @@ START_TEST(test_rhonabwy_invalid_deflate_payload)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_base64url)
+{
+  unsigned char in[] = HUGE_PAYLOAD, enc[2*sizeof(in)], dec[sizeof(in)];
+  struct _o_datum dat_enc = {0, NULL}, dat_dec = {0, NULL};
+  size_t len, enc_len, dec_len, o_len;
+
+  // Every length covers the SIMD blocks and all the scalar tails
+  for (len=1; len<sizeof(in); len+=7) {
+    ck_assert_int_eq(o_base64url_encode(in, len, enc, &o_len), 1);
+    ck_assert_int_eq(_r_base64url_encode(in, len, NULL, &enc_len), 1);
+    ck_assert_int_eq(enc_len, o_len);
+    ck_assert_int_eq(_r_base64url_encode_alloc(in, len, &dat_enc), 1);
+    ck_assert_int_eq(dat_enc.size, o_len);
+    ck_assert_int_eq(0, memcmp(dat_enc.data, enc, o_len));
+    ck_assert_int_eq(_r_base64url_decode(dat_enc.data, dat_enc.size, NULL, &dec_len), 1);
+    ck_assert_int_eq(dec_len, len);
+    ck_assert_int_eq(_r_base64url_decode(dat_enc.data, dat_enc.size, dec, &dec_len), 1);
+    ck_assert_int_eq(dec_len, len);
+    ck_assert_int_eq(0, memcmp(dec, in, len));
+    ck_assert_int_eq(_r_base64url_decode_alloc(dat_enc.data, dat_enc.size, &dat_dec), 1);
+    ck_assert_int_eq(dat_dec.size, len);
+    ck_assert_int_eq(0, memcmp(dat_dec.data, in, len));
+    o_free(dat_dec.data);
+    dat_dec.data = NULL;
+    // Invalid character in the SIMD part or in the tail
+    dat_enc.data[dat_enc.size/2] = '+';
+    ck_assert_int_eq(_r_base64url_decode(dat_enc.data, dat_enc.size, dec, &dec_len), 0);
+    ck_assert_int_eq(_r_base64url_decode(dat_enc.data, dat_enc.size, NULL, &dec_len), 0);
+    ck_assert_int_eq(_r_base64url_decode_alloc(dat_enc.data, dat_enc.size, &dat_dec), 0);
+    o_free(dat_enc.data);
+    dat_enc.data = NULL;
+  }
+
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"VGhlIHRydWU=", 12, dec, &dec_len), 1);
+  ck_assert_int_eq(dec_len, 8);
+  ck_assert_int_eq(0, memcmp(dec, "The true", 8));
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"VGhlIHRydWU", 11, dec, &dec_len), 1);
+  ck_assert_int_eq(dec_len, 8);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"VGhlIHRydW", 10, dec, &dec_len), 1);
+  ck_assert_int_eq(dec_len, 7);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"VGhlI", 5, dec, &dec_len), 0);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"VG===", 5, dec, &dec_len), 0);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"VGhl", 0, dec, &dec_len), 0);
+  ck_assert_int_eq(_r_base64url_decode(NULL, 4, dec, &dec_len), 0);
+  ck_assert_int_eq(_r_base64url_encode((const unsigned char *)"The", 0, enc, &enc_len), 0);
+}
+END_TEST
+
 static Suite *rhonabwy_suite(void)
 {
   Suite *s;
@@ -315,6 +363,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_enc_conversion);
   tcase_add_test(tc_core, test_rhonabwy_inflate);
   tcase_add_test(tc_core, test_rhonabwy_invalid_deflate_payload);
+  tcase_add_test(tc_core, test_rhonabwy_base64url);
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
 
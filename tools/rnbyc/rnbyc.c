@@ -39,6 +39,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -57,6 +62,10 @@
 #define R_ACTION_JWKS_OUT        1
 #define R_ACTION_PARSE_TOKEN     2
 #define R_ACTION_SERIALIZE_TOKEN 3
+#define R_ACTION_SERIALIZE_BATCH 4
+#define R_ACTION_PARSE_BATCH     5
+
+#define RNBYC_BATCH_CHUNK_SIZE 4096
 
 #define RNBYC_FORMAT_JWK 0
 #define RNBYC_FORMAT_PEM 1
@@ -111,8 +120,19 @@ static void print_help(FILE * output) {
   fprintf(output, "\tSplit JWKS output in public and private keys\n");
   fprintf(output, "-t --parse-token\n");
   fprintf(output, "\tAction: Parse token\n");
+  fprintf(output, "-B --parse-batch\n");
+  fprintf(output, "\tAction: parse, verify and decrypt the tokens of a file, one token per line, - to read from stdin\n");
+  fprintf(output, "\tOne NDJSON result per token is printed with its line number, status, header and claims, the claims only if the token is valid\n");
+  fprintf(output, "\tThe status is valid, invalid, unverified if no key is available, or error if the token can't be parsed\n");
+  fprintf(output, "-U --unordered\n");
+  fprintf(output, "\tPrint the results of a parse batch as soon as they are available instead of in the order of the tokens\n");
   fprintf(output, "-s --serialize-token\n");
   fprintf(output, "\tAction: serialize given claims in a token\n");
+  fprintf(output, "-b --serialize-batch\n");
+  fprintf(output, "\tAction: serialize in signed tokens the claims of a NDJSON file, one JSON object per line, - to read from stdin\n");
+  fprintf(output, "\tOne token per line is printed in the same order as the claims, empty lines are ignored\n");
+  fprintf(output, "-T --threads\n");
+  fprintf(output, "\tNumber of threads to sign or parse the tokens of a batch, default is the number of online processors\n");
   fprintf(output, "-H --header\n");
   fprintf(output, "\tDisplay header of a parsed token\n");
   fprintf(output, "-C --claims\n");
@@ -852,6 +872,457 @@ static int serialize_token(const char * claims, int x5u_flags, const char * str_
   return ret;
 }
 
+/**
+ * A token of a parse batch, token points to the input, not NULL terminated
+ */
+struct batch_token {
+  const char * token;
+  size_t       token_len;
+  size_t       line;
+  char       * result;
+};
+
+/**
+ * Shared state of a parse batch
+ * The workers pick the next token of the current chunk under lock
+ */
+struct batch_state {
+  struct batch_token * tokens;
+  size_t               nb_tokens;
+  size_t               next;
+  pthread_mutex_t      lock;
+  pthread_mutex_t      output_lock;
+  int                  unordered;
+  int                  x5u_flags;
+  int                  self_signed;
+  int                  show_header;
+  int                  show_claims;
+  size_t               nb_valid;
+  size_t               nb_invalid;
+  size_t               nb_unverified;
+  size_t               nb_error;
+};
+
+struct batch_worker {
+  struct batch_state * state;
+  jwks_t             * jwks_pubkey;
+  jwks_t             * jwks_privkey;
+  pthread_t            thread;
+};
+
+static jwks_t * import_batch_jwks(const char * str_jwks, const char * password) {
+  jwks_t * jwks = NULL;
+  jwk_t * jwk_password;
+  char * content;
+
+  if (r_jwks_init(&jwks) == RHN_OK) {
+    if (o_strlen(str_jwks) && str_jwks[0] == '{') {
+      if (r_jwks_import_from_json_str(jwks, str_jwks) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks\n");
+      }
+    } else if (o_strlen(str_jwks)) {
+      content = get_file_content(str_jwks);
+      if (r_jwks_import_from_json_str(jwks, content) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks path or content\n");
+      }
+      o_free(content);
+    } else if (o_strlen(password)) {
+      r_jwk_init(&jwk_password);
+      if (r_jwk_import_from_password(jwk_password, password) != RHN_OK || r_jwks_append_jwk(jwks, jwk_password) != RHN_OK) {
+        fprintf(stderr, "Error importing password\n");
+      }
+      r_jwk_free(jwk_password);
+    }
+  }
+  return jwks;
+}
+
+static const char * batch_type_str(int type) {
+  switch (type) {
+    case R_JWT_TYPE_SIGN:
+      return "JWS";
+    case R_JWT_TYPE_ENCRYPT:
+      return "JWE";
+    case R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT:
+      return "nested sign then encrypt";
+    case R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN:
+      return "nested encrypt then sign";
+    default:
+      return "unknown";
+  }
+}
+
+static char * parse_batch_token(struct batch_worker * worker, struct batch_token * token) {
+  struct batch_state * state = worker->state;
+  jwt_t * jwt = NULL;
+  json_t * j_result = json_pack("{sI}", "line", (json_int_t)token->line);
+  const char * status = "error";
+  char * result;
+  int type, is_signed, is_encrypted, checked = 0, valid = 1, decrypted = 0;
+
+  if (r_jwt_init(&jwt) == RHN_OK && r_jwt_advanced_parsen(jwt, token->token, token->token_len, state->self_signed?R_PARSE_HEADER_ALL:R_PARSE_NONE, state->x5u_flags) == RHN_OK) {
+    type = r_jwt_get_type(jwt);
+    is_signed = (type == R_JWT_TYPE_SIGN || type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN || type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT);
+    is_encrypted = (type == R_JWT_TYPE_ENCRYPT || type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN || type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT);
+    json_object_set_new(j_result, "type", json_string(batch_type_str(type)));
+    if (is_encrypted && r_jwks_size(worker->jwks_privkey)) {
+      checked = 1;
+      if (r_jwt_add_enc_jwks(jwt, worker->jwks_privkey, NULL) != RHN_OK) {
+        valid = 0;
+      } else if (type == R_JWT_TYPE_ENCRYPT) {
+        valid = (r_jwt_decrypt(jwt, NULL, state->x5u_flags) == RHN_OK);
+      } else {
+        valid = (r_jwt_decrypt_nested(jwt, NULL, state->x5u_flags) == RHN_OK);
+      }
+      decrypted = valid;
+    }
+    // The signature of a token signed then encrypted can be verified only once it's decrypted
+    if (valid && is_signed && (type != R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT || decrypted) && (state->self_signed || r_jwks_size(worker->jwks_pubkey))) {
+      checked = 1;
+      if (r_jwks_size(worker->jwks_pubkey) && r_jwt_add_sign_jwks(jwt, NULL, worker->jwks_pubkey) != RHN_OK) {
+        valid = 0;
+      } else {
+        valid = (r_jwt_verify_signature(jwt, NULL, state->x5u_flags) == RHN_OK);
+      }
+    }
+    status = !valid?"invalid":(checked?"valid":"unverified");
+    if (state->show_header) {
+      json_object_set_new(j_result, "header", r_jwt_get_full_header_json_t(jwt));
+    }
+    // The claims of a token whose signature or encryption wasn't checked are not trusted
+    if (state->show_claims && checked && valid) {
+      json_object_set_new(j_result, "claims", r_jwt_get_full_claims_json_t(jwt));
+    }
+  }
+  r_jwt_free(jwt);
+  json_object_set_new(j_result, "status", json_string(status));
+  result = json_dumps(j_result, JSON_COMPACT);
+  json_decref(j_result);
+
+  pthread_mutex_lock(&state->lock);
+  if (0 == o_strcmp("valid", status)) {
+    state->nb_valid++;
+  } else if (0 == o_strcmp("invalid", status)) {
+    state->nb_invalid++;
+  } else if (0 == o_strcmp("unverified", status)) {
+    state->nb_unverified++;
+  } else {
+    state->nb_error++;
+  }
+  pthread_mutex_unlock(&state->lock);
+  return result;
+}
+
+static void * parse_batch_worker(void * args) {
+  struct batch_worker * worker = (struct batch_worker *)args;
+  struct batch_state * state = worker->state;
+  size_t index;
+
+  while (1) {
+    pthread_mutex_lock(&state->lock);
+    index = state->next;
+    if (state->next < state->nb_tokens) {
+      state->next++;
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (index >= state->nb_tokens) {
+      break;
+    }
+    state->tokens[index].result = parse_batch_token(worker, &state->tokens[index]);
+    if (state->unordered) {
+      pthread_mutex_lock(&state->output_lock);
+      printf("%s\n", state->tokens[index].result);
+      pthread_mutex_unlock(&state->output_lock);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Parses the tokens of the current chunk with all the workers,
+ * the calling thread is the first worker
+ */
+static void parse_batch_chunk(struct batch_state * state, struct batch_worker * workers, unsigned int nb_threads) {
+  unsigned int i, nb_started = 1;
+  size_t j;
+
+  state->next = 0;
+  for (i=1; i<nb_threads && i<state->nb_tokens; i++) {
+    if (pthread_create(&workers[i].thread, NULL, parse_batch_worker, &workers[i])) {
+      break;
+    }
+    nb_started++;
+  }
+  parse_batch_worker(&workers[0]);
+  for (i=1; i<nb_started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  for (j=0; j<state->nb_tokens; j++) {
+    if (!state->unordered) {
+      printf("%s\n", state->tokens[j].result);
+    }
+    o_free(state->tokens[j].result);
+    state->tokens[j].result = NULL;
+  }
+}
+
+/**
+ * Adds a line to the current chunk if it's not empty, the trailing spaces are removed
+ */
+static int parse_batch_add_line(struct batch_state * state, const char * line, size_t line_len, size_t line_number) {
+  while (line_len && (line[0] == ' ' || line[0] == '\t')) {
+    line++;
+    line_len--;
+  }
+  while (line_len && (line[line_len-1] == ' ' || line[line_len-1] == '\t' || line[line_len-1] == '\r' || line[line_len-1] == '\n')) {
+    line_len--;
+  }
+  if (line_len) {
+    state->tokens[state->nb_tokens].token = line;
+    state->tokens[state->nb_tokens].token_len = line_len;
+    state->tokens[state->nb_tokens].line = line_number;
+    state->tokens[state->nb_tokens].result = NULL;
+    state->nb_tokens++;
+    return 1;
+  }
+  return 0;
+}
+
+static int parse_batch(const char * path, int x5u_flags, const char * str_jwks_pubkey, const char * str_jwks_privkey, const char * password, int self_signed, int show_header, int show_claims, int unordered, unsigned int nb_threads) {
+  struct batch_state state;
+  struct batch_worker * workers = NULL;
+  jwks_t * jwks_pubkey = NULL, * jwks_privkey = NULL;
+  struct timespec start, end;
+  struct stat st;
+  char * map = NULL, * lines[RNBYC_BATCH_CHUNK_SIZE] = {NULL}, * line = NULL;
+  const char * cur, * map_end, * line_end;
+  size_t line_size = 0, line_number = 0, nb_tokens = 0, i;
+  ssize_t line_len;
+  unsigned int t;
+  long nb_cpu;
+  double duration;
+  int fd = -1, ret = 0;
+
+  memset(&state, 0, sizeof(struct batch_state));
+  state.x5u_flags = x5u_flags;
+  state.self_signed = self_signed;
+  state.show_header = show_header;
+  state.show_claims = show_claims;
+  state.unordered = unordered;
+  if (!nb_threads) {
+    nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nb_threads = nb_cpu>0?(unsigned int)nb_cpu:1;
+  }
+  jwks_pubkey = import_batch_jwks(str_jwks_pubkey, password);
+  jwks_privkey = import_batch_jwks(str_jwks_privkey, password);
+  if ((state.tokens = o_malloc(RNBYC_BATCH_CHUNK_SIZE*sizeof(struct batch_token))) == NULL || (workers = o_malloc(nb_threads*sizeof(struct batch_worker))) == NULL) {
+    fprintf(stderr, "Error allocating resources for batch\n");
+    ret = ENOMEM;
+  } else {
+    // Each worker uses its own copy of the keys, so jansson objects are never shared between threads
+    for (t=0; t<nb_threads; t++) {
+      workers[t].state = &state;
+      workers[t].jwks_pubkey = r_jwks_copy(jwks_pubkey);
+      workers[t].jwks_privkey = r_jwks_copy(jwks_privkey);
+    }
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_mutex_init(&state.output_lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (0 == o_strcmp("-", path)) {
+      // Read stdin one chunk of lines at a time
+      do {
+        state.nb_tokens = 0;
+        while (state.nb_tokens < RNBYC_BATCH_CHUNK_SIZE && (line_len = getline(&line, &line_size, stdin)) >= 0) {
+          line_number++;
+          if (parse_batch_add_line(&state, line, (size_t)line_len, line_number)) {
+            // getline reuses its buffer, so the line is kept until the chunk is parsed
+            lines[state.nb_tokens-1] = line;
+            line = NULL;
+            line_size = 0;
+          }
+        }
+        if (state.nb_tokens) {
+          parse_batch_chunk(&state, workers, nb_threads);
+          nb_tokens += state.nb_tokens;
+          for (i=0; i<state.nb_tokens; i++) {
+            free(lines[i]);
+            lines[i] = NULL;
+          }
+        }
+      } while (state.nb_tokens == RNBYC_BATCH_CHUNK_SIZE);
+      free(line);
+    } else if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+      fprintf(stderr, "error opening file %s\n", path);
+      ret = EINVAL;
+    } else if (st.st_size > 0) {
+      // Memory-map the file, the tokens are parsed in place
+      if ((map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "error mapping file %s\n", path);
+        map = NULL;
+        ret = EINVAL;
+      } else {
+        madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+        cur = map;
+        map_end = map+st.st_size;
+        while (cur < map_end) {
+          state.nb_tokens = 0;
+          while (state.nb_tokens < RNBYC_BATCH_CHUNK_SIZE && cur < map_end) {
+            if ((line_end = memchr(cur, '\n', (size_t)(map_end-cur))) == NULL) {
+              line_end = map_end;
+            }
+            line_number++;
+            parse_batch_add_line(&state, cur, (size_t)(line_end-cur), line_number);
+            cur = line_end+1;
+          }
+          if (state.nb_tokens) {
+            parse_batch_chunk(&state, workers, nb_threads);
+            nb_tokens += state.nb_tokens;
+          }
+        }
+        munmap(map, (size_t)st.st_size);
+      }
+    }
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    duration = (double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec)/1e9;
+    if (!ret) {
+      fprintf(stderr, "%zu tokens in %.3f s, %.0f tokens/s: %zu valid, %zu invalid, %zu unverified, %zu error\n", nb_tokens, duration, duration>0?(double)nb_tokens/duration:0.0, state.nb_valid, state.nb_invalid, state.nb_unverified, state.nb_error);
+      if (state.nb_invalid || state.nb_error) {
+        ret = EINVAL;
+      }
+    }
+    for (t=0; t<nb_threads; t++) {
+      r_jwks_free(workers[t].jwks_pubkey);
+      r_jwks_free(workers[t].jwks_privkey);
+    }
+    pthread_mutex_destroy(&state.lock);
+    pthread_mutex_destroy(&state.output_lock);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  o_free(workers);
+  o_free(state.tokens);
+  r_jwks_free(jwks_pubkey);
+  r_jwks_free(jwks_privkey);
+  return ret;
+}
+
+static int serialize_batch(const char * path, int x5u_flags, const char * str_jwks_privkey, const char * password, const char * alg, unsigned int nb_threads) {
+  jwt_t * jwt = NULL;
+  jwks_t * jwks_privkey = NULL;
+  jwk_t * jwk_password;
+  json_t ** claims = NULL, ** claims_realloc, * j_claims;
+  char * content = NULL, * line, * line_end, ** tokens = NULL;
+  size_t nb_claims = 0, nb_lines = 0, i;
+  int ret = 0;
+
+  if (0 == o_strcmp("-", path)) {
+    content = get_stdin_content();
+  } else {
+    content = get_file_content(path);
+  }
+  if (content == NULL) {
+    fprintf(stderr, "Error reading claims\n");
+    ret = EINVAL;
+  } else {
+    // One JSON object per line, empty lines are ignored
+    line = content;
+    while (line != NULL && *line != '\0' && !ret) {
+      if ((line_end = strchr(line, '\n')) != NULL) {
+        *line_end = '\0';
+      }
+      nb_lines++;
+      if (strspn(line, " \t\r") != o_strlen(line)) {
+        j_claims = json_loads(line, JSON_DECODE_ANY, NULL);
+        if (!json_is_object(j_claims)) {
+          fprintf(stderr, "Invalid JSON claims at line %zu\n", nb_lines);
+          json_decref(j_claims);
+          ret = EINVAL;
+        } else if ((claims_realloc = o_realloc(claims, (nb_claims+1)*sizeof(json_t *))) != NULL) {
+          claims = claims_realloc;
+          claims[nb_claims++] = j_claims;
+        } else {
+          fprintf(stderr, "Error allocating claims\n");
+          json_decref(j_claims);
+          ret = ENOMEM;
+        }
+      }
+      line = line_end!=NULL?line_end+1:NULL;
+    }
+  }
+  if (!ret && !nb_claims) {
+    fprintf(stderr, "No claims to serialize\n");
+    ret = EINVAL;
+  }
+
+  if (!ret && (r_jwt_init(&jwt) != RHN_OK || r_jwks_init(&jwks_privkey) != RHN_OK)) {
+    fprintf(stderr, "Error allocating resources\n");
+    ret = ENOMEM;
+  }
+  if (!ret) {
+    if (o_strlen(str_jwks_privkey) && str_jwks_privkey[0] == '{') {
+      if (r_jwks_import_from_json_str(jwks_privkey, str_jwks_privkey) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks_privkey\n");
+        ret = EINVAL;
+      }
+    } else if (o_strlen(str_jwks_privkey)) {
+      o_free(content);
+      content = get_file_content(str_jwks_privkey);
+      if (r_jwks_import_from_json_str(jwks_privkey, content) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks_privkey path or content\n");
+        ret = EAGAIN;
+      }
+    } else if (o_strlen(password) && o_strlen(alg)) {
+      r_jwk_init(&jwk_password);
+      if (r_jwk_import_from_password(jwk_password, password) != RHN_OK || r_jwks_append_jwk(jwks_privkey, jwk_password) != RHN_OK) {
+        fprintf(stderr, "Error importing password\n");
+        ret = EINVAL;
+      }
+      r_jwk_free(jwk_password);
+    } else {
+      fprintf(stderr, "--serialize-batch: a private key or a password is required\n");
+      ret = EINVAL;
+    }
+    if (!ret && r_jwt_add_sign_jwks(jwt, jwks_privkey, NULL) != RHN_OK) {
+      fprintf(stderr, "Error setting private key\n");
+      ret = ENOMEM;
+    }
+    if (!ret && alg != NULL && r_jwt_set_sign_alg(jwt, r_str_to_jwa_alg(alg)) != RHN_OK) {
+      fprintf(stderr, "Invalid alg value\n");
+      ret = EINVAL;
+    }
+    if (!ret) {
+      if ((tokens = o_malloc(nb_claims*sizeof(char *))) == NULL) {
+        fprintf(stderr, "Error allocating tokens\n");
+        ret = ENOMEM;
+      } else if (r_jwt_serialize_signed_batch(jwt, NULL, x5u_flags, claims, NULL, nb_claims, nb_threads, tokens) != RHN_OK) {
+        fprintf(stderr, "Error serializing tokens\n");
+        ret = EINVAL;
+      } else {
+        for (i=0; i<nb_claims; i++) {
+          if (tokens[i] == NULL) {
+            fprintf(stderr, "Error serializing token %zu\n", i+1);
+            ret = EINVAL;
+          }
+          printf("%s\n", tokens[i]!=NULL?tokens[i]:"");
+          r_free(tokens[i]);
+        }
+      }
+    }
+  }
+
+  for (i=0; i<nb_claims; i++) {
+    json_decref(claims[i]);
+  }
+  o_free(claims);
+  o_free(tokens);
+  o_free(content);
+  r_jwt_free(jwt);
+  r_jwks_free(jwks_privkey);
+  return ret;
+}
+
 int main (int argc, char ** argv) {
   int next_option,
       action = R_ACTION_NONE,
@@ -860,11 +1331,13 @@ int main (int argc, char ** argv) {
       split_keys = 0,
       show_header = 0,
       show_claims = 1,
+      unordered = 0,
       self_signed = 0,
       x5u_flags = 0,
       debug_mode = 0,
       format = RNBYC_FORMAT_JWK;
-  const char * short_options = "j::g:i::f:k:a:e:l:o:p:n:F:x::t:s:H::C:K:P:S::W:u:v::h::d::";
+  unsigned int nb_threads = 0;
+  const char * short_options = "j::g:i::f:k:a:e:l:o:p:n:F:x::t:B:U::s:b:T:H::C:K:P:S::W:u:v::h::d::";
   char * out_file = NULL,
        * out_file_public = NULL,
        * parsed_token = NULL,
@@ -890,7 +1363,11 @@ int main (int argc, char ** argv) {
     {"format", no_argument, NULL, 'F'},
     {"split", no_argument, NULL, 'x'},
     {"parse-token", required_argument, NULL, 't'},
+    {"parse-batch", required_argument, NULL, 'B'},
+    {"unordered", no_argument, NULL, 'U'},
     {"serialize-token", required_argument, NULL, 's'},
+    {"serialize-batch", required_argument, NULL, 'b'},
+    {"threads", required_argument, NULL, 'T'},
     {"header", no_argument, NULL, 'H'},
     {"claims", required_argument, NULL, 'C'},
     {"public-key", required_argument, NULL, 'P'},
@@ -1027,10 +1504,26 @@ int main (int argc, char ** argv) {
         action = R_ACTION_PARSE_TOKEN;
         parsed_token = o_strdup(optarg);
         break;
+      case 'B':
+        action = R_ACTION_PARSE_BATCH;
+        o_free(parsed_token);
+        parsed_token = o_strdup(optarg);
+        break;
+      case 'U':
+        unordered = 1;
+        break;
       case 's':
         action = R_ACTION_SERIALIZE_TOKEN;
         claims = o_strdup(optarg);
         break;
+      case 'b':
+        action = R_ACTION_SERIALIZE_BATCH;
+        o_free(claims);
+        claims = o_strdup(optarg);
+        break;
+      case 'T':
+        nb_threads = (unsigned int)strtoul(optarg, NULL, 10);
+        break;
       case 'H':
         show_header = 1;
         break;
@@ -1089,8 +1582,17 @@ int main (int argc, char ** argv) {
       get_jwks_out(j_arguments, split_keys, x5u_flags, indent, format, out_file, out_file_public);
     } else if (action == R_ACTION_PARSE_TOKEN) {
       ret = parse_token(parsed_token, indent, x5u_flags, str_token_public_key, str_token_private_key, password, show_header, show_claims, self_signed);
+    } else if (action == R_ACTION_PARSE_BATCH) {
+      ret = parse_batch(parsed_token, x5u_flags, str_token_public_key, str_token_private_key, password, self_signed, show_header, show_claims, unordered, nb_threads);
     } else if (action == R_ACTION_SERIALIZE_TOKEN) {
       ret = serialize_token(claims, x5u_flags, str_token_public_key, str_token_private_key, password, alg, enc, enc_alg);
+    } else if (action == R_ACTION_SERIALIZE_BATCH) {
+      if (str_token_public_key != NULL) {
+        fprintf(stderr, "--serialize-batch: encrypted tokens are not supported\n");
+        ret = EINVAL;
+      } else {
+        ret = serialize_batch(claims, x5u_flags, str_token_private_key, password, alg, nb_threads);
+      }
     } else {
       ret = EINVAL;
       fprintf(stderr, "Please epecify an action\n");